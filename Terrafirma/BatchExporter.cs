@@ -0,0 +1,243 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Diagnostics;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Exports many worlds in one go.  Worlds are loaded and lit on several
+    /// threads while the one before them is rendered and compressed, which
+    /// already uses every core.  tiles.xml and the textures are loaded once
+    /// and shared, and the worlds' tile grids are reused, so memory depends
+    /// on Jobs rather than on how many worlds there are.
+    /// </summary>
+    class BatchExporter
+    {
+        //worlds loading at once.  one more is held while it's rendered.
+        public int Jobs = 2;
+        public double Zoom = 1.0;
+        public int Light = 0;
+        public bool UseTextures = false;
+        public bool Indexed = false;
+        public int Compression = PngWriter.DefaultLevel;
+        public long MemoryBudget = 0;
+
+        WorldInfo info;
+        Textures textures;
+
+        public class Result
+        {
+            public string Path, Output, Error;
+            public string Problems;
+            public TimeSpan Load, Light, Render;
+        }
+
+        class Loaded
+        {
+            public Result result;
+            public World world;
+        }
+
+        //the loaders run side by side, their row by row status would be noise
+        class Quiet : ILoadProgress
+        {
+            public void Status(string text)
+            {
+            }
+        }
+
+        public BatchExporter(WorldInfo info, Textures textures)
+        {
+            this.info = info;
+            this.textures = textures;
+        }
+
+        /// <summary>
+        /// Writes dir/name.png for each world.  A world that fails is reported
+        /// in its result and the rest carry on.  done is called as each world
+        /// finishes, from this thread.
+        /// </summary>
+        public List<Result> Export(IList<string> paths, string dir, Action<Result> done)
+        {
+            if (UseTextures && (textures == null || !textures.Valid))
+                throw new Exception("Couldn't find the terraria textures");
+            Directory.CreateDirectory(dir);
+
+            int jobs = Math.Max(1, Math.Min(Jobs, paths.Count));
+            //a world is a 8400x2400 grid before it has any tiles, so keep the
+            //ones we've made and load into them again
+            BlockingCollection<World> free = new BlockingCollection<World>();
+            for (int i = 0; i < jobs + 1; i++)
+                free.Add(new World(info));
+            BlockingCollection<Loaded> ready = new BlockingCollection<Loaded>(1);
+            int next = -1;
+
+            ThreadStart loadThread = delegate()
+            {
+                Quiet quiet = new Quiet();
+                int index;
+                while ((index = Interlocked.Increment(ref next)) < paths.Count)
+                {
+                    Loaded loaded = new Loaded();
+                    loaded.result = new Result();
+                    loaded.result.Path = paths[index];
+                    loaded.world = free.Take();
+                    try
+                    {
+                        Stopwatch watch = Stopwatch.StartNew();
+                        string invalid;
+                        if (!loaded.world.Load(paths[index], quiet, out invalid))
+                            loaded.result.Problems = invalid;
+                        loaded.result.Load = watch.Elapsed;
+                        if (Light != 0)
+                        {
+                            watch.Restart();
+                            loaded.world.CalculateLight(quiet);
+                            loaded.result.Light = watch.Elapsed;
+                        }
+                    }
+                    catch (Exception e)
+                    {
+                        loaded.result.Error = e.Message;
+                    }
+                    ready.Add(loaded);
+                }
+            };
+            Thread[] loaders = new Thread[jobs];
+            for (int i = 0; i < jobs; i++)
+            {
+                loaders[i] = new Thread(loadThread);
+                loaders[i].IsBackground = true;
+                loaders[i].Start();
+            }
+            Thread closer = new Thread(delegate()
+            {
+                foreach (Thread loader in loaders)
+                    loader.Join();
+                ready.CompleteAdding();
+            });
+            closer.IsBackground = true;
+            closer.Start();
+
+            //one world renders at a time, not for the textures' sake (their
+            //caches lock), but because each band's render already uses every
+            //core, and each export holds up to MemoryBudget while it runs
+            Render render = new Render(info.tileInfos, info.wallInfo, info.skyColor, info.earthColor, info.rockColor,
+                info.hellColor, info.waterColor, info.lavaColor, info.honeyColor);
+            render.Textures = textures;
+            HashSet<string> names = new HashSet<string>(StringComparer.OrdinalIgnoreCase);
+            List<Result> results = new List<Result>();
+            foreach (Loaded loaded in ready.GetConsumingEnumerable())
+            {
+                Result result = loaded.result;
+                World world = loaded.world;
+                if (result.Error == null)
+                {
+                    try
+                    {
+                        result.Output = Path.Combine(dir, outputName(result.Path, names));
+                        Stopwatch watch = Stopwatch.StartNew();
+                        render.SetWorld(world.tilesWide, world.tilesHigh, world.groundLevel, world.rockLevel,
+                            world.styles, world.treeX, world.treeStyle, world.caveBackX, world.caveBackStyle,
+                            world.jungleBackStyle, world.hellBackStyle, world.npcs, world.worldID);
+                        MapExporter exporter = new MapExporter(render);
+                        exporter.Light = Light;
+                        exporter.UseTextures = UseTextures;
+                        exporter.Indexed = Indexed;
+                        exporter.Compression = Compression;
+                        if (MemoryBudget > 0)
+                            exporter.MemoryBudget = MemoryBudget;
+                        using (FileStream stream = new FileStream(result.Output, FileMode.Create))
+                            exporter.Export(stream, world.tiles, (int)(world.tilesWide * Zoom),
+                                (int)(world.tilesHigh * Zoom), 0.0, 0.0, Zoom, null);
+                        result.Render = watch.Elapsed;
+                    }
+                    catch (Exception e)
+                    {
+                        result.Error = e.Message;
+                    }
+                }
+                free.Add(world);
+                results.Add(result);
+                if (done != null)
+                    done(result);
+            }
+            closer.Join();
+            return results;
+        }
+
+        /// <summary>
+        /// The png name for a world, made unique when two worlds in different
+        /// folders share a file name.
+        /// </summary>
+        private static string outputName(string path, HashSet<string> names)
+        {
+            string name = Path.GetFileNameWithoutExtension(path);
+            string unique = name;
+            for (int i = 2; !names.Add(unique); i++)
+                unique = String.Format("{0}-{1}", name, i);
+            return unique + ".png";
+        }
+
+        /// <summary>
+        /// Expands world arguments: files as they are, every .wld in a folder,
+        /// and * and ? in the file name, since the windows shell won't.
+        /// </summary>
+        public static List<string> FindWorlds(IEnumerable<string> args)
+        {
+            List<string> paths = new List<string>();
+            foreach (string arg in args)
+            {
+                if (Directory.Exists(arg))
+                    paths.AddRange(Directory.GetFiles(arg, "*.wld").OrderBy(p => p));
+                else if (arg.IndexOfAny(new char[] { '*', '?' }) >= 0)
+                {
+                    string folder = Path.GetDirectoryName(arg);
+                    if (String.IsNullOrEmpty(folder))
+                        folder = ".";
+                    if (!Directory.Exists(folder))
+                        throw new Exception(String.Format("No such folder: {0}", folder));
+                    paths.AddRange(Directory.GetFiles(folder, Path.GetFileName(arg)).OrderBy(p => p));
+                }
+                else if (File.Exists(arg))
+                    paths.Add(arg);
+                else
+                    throw new Exception(String.Format("No such world: {0}", arg));
+            }
+            return paths;
+        }
+    }
+}
@@ -0,0 +1,640 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// A deflate compressor that compresses a stream in separate pieces, so
+    /// the pieces can be compressed on different threads and joined, the way
+    /// pigz does it.  Each piece ends on a byte boundary with an empty stored
+    /// block, and Finish holds the bytes that end the stream.
+    /// Level 0 only stores, 1 only packs runs of a repeated byte, and 2 to 9
+    /// search harder and harder for matches.
+    /// </summary>
+    static class Deflater
+    {
+        public const int Window = 32768;
+        public static readonly byte[] Finish = { 0x03, 0x00 }; //final empty fixed block
+
+        const int MinMatch = 3;
+        const int MaxMatch = 258;
+        const int HashBits = 15;
+        const int BlockSymbols = 16384;
+        const int MaxStored = 65535;
+
+        static readonly int[] chainLengths = { 0, 0, 4, 8, 16, 32, 128, 256, 1024, 4096 };
+        //stop looking once a match is this long, and from level 5 on don't
+        //look for a better one at the next byte either
+        static readonly int[] niceLengths = { 0, MaxMatch, 8, 16, 32, 32, 128, 258, 258, 258 };
+
+        static readonly int[] lengthBase = {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static readonly int[] lengthExtra = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        static readonly int[] distBase = {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+        static readonly int[] distExtra = {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+        static readonly int[] codeLengthOrder = {
+            16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+        //length-3 to length code, and distance-1 to distance code
+        static readonly byte[] lengthCodes = makeCodes(lengthBase, MaxMatch - MinMatch + 1, MinMatch);
+        static readonly byte[] distCodes = makeCodes(distBase, Window, 1);
+
+        static readonly byte[] fixedLitLengths = makeFixedLengths();
+        static readonly byte[] fixedDistLengths = Enumerable.Repeat((byte)5, 30).ToArray();
+
+        /// <summary>
+        /// Compresses length bytes at offset as one piece of a deflate stream.
+        /// Whatever is in data before offset, back to dictStart, is taken to be
+        /// what came just before, and matches can reach back into it.
+        /// </summary>
+        public static byte[] Compress(byte[] data, int dictStart, int offset, int length, int level)
+        {
+            BitWriter output = new BitWriter(length / 2 + 64);
+            if (length > 0)
+            {
+                if (level <= 0)
+                    store(output, data, offset, length);
+                else
+                    compress(output, data, Math.Max(dictStart, offset - Window), offset, length, Math.Min(level, 9));
+            }
+            //sync, an empty stored block to get back to a byte boundary
+            output.Write(0, 3);
+            output.Align();
+            output.Write(0x0000, 16);
+            output.Write(0xffff, 16);
+            return output.ToArray();
+        }
+
+        private static void store(BitWriter output, byte[] data, int offset, int length)
+        {
+            while (length > 0)
+            {
+                int n = Math.Min(length, MaxStored);
+                writeStored(output, data, offset, n);
+                offset += n;
+                length -= n;
+            }
+        }
+
+        private static void writeStored(BitWriter output, byte[] data, int offset, int n)
+        {
+            output.Write(0, 3);
+            output.Align();
+            output.Write((UInt32)n, 16);
+            output.Write((UInt32)(~n & 0xffff), 16);
+            output.WriteBytes(data, offset, n);
+        }
+
+        private static void compress(BitWriter output, byte[] data, int dictStart, int offset, int length, int level)
+        {
+            int end = offset + length;
+            int[] head = null, prev = null;
+            //everything before inserted is in the hash chains
+            int inserted = dictStart;
+            if (level > 1)
+            {
+                head = new int[1 << HashBits];
+                for (int i = 0; i < head.Length; i++)
+                    head[i] = -1;
+                prev = new int[Window];
+                insertUpTo(data, ref inserted, offset, offset, head, prev);
+            }
+
+            //a literal is its byte, a match is 256 + its length
+            UInt16[] syms = new UInt16[BlockSymbols];
+            UInt16[] dists = new UInt16[BlockSymbols];
+            int count = 0, blockStart = offset;
+            int pos = offset;
+            int len = 0, dist = 0;
+            bool found = false; //len and dist already hold the match at pos
+            while (pos < end)
+            {
+                if (!found)
+                    findMatch(data, dictStart, pos, end, level, head, prev, ref inserted, out len, out dist);
+                found = false;
+                //lazy matching, like zlib: if the next byte starts a longer
+                //match, this one goes out as a literal
+                if (len > 0 && level >= 5 && len < niceLengths[level] && pos + 1 < end)
+                {
+                    int nextLen, nextDist;
+                    findMatch(data, dictStart, pos + 1, end, level, head, prev, ref inserted, out nextLen, out nextDist);
+                    if (nextLen > len)
+                    {
+                        len = 0;
+                        found = true;
+                    }
+                    if (found)
+                    {
+                        syms[count] = data[pos];
+                        dists[count++] = 0;
+                        pos++;
+                        len = nextLen;
+                        dist = nextDist;
+                        if (count == BlockSymbols)
+                        {
+                            writeBlock(output, syms, dists, count, data, blockStart, pos - blockStart);
+                            count = 0;
+                            blockStart = pos;
+                        }
+                        continue;
+                    }
+                }
+
+                int step;
+                if (len > 0)
+                {
+                    syms[count] = (UInt16)(256 + len);
+                    dists[count++] = (UInt16)dist;
+                    step = len;
+                }
+                else
+                {
+                    syms[count] = data[pos];
+                    dists[count++] = 0;
+                    step = 1;
+                }
+                if (head != null)
+                {
+                    //hashing every byte of a long match costs more than it finds,
+                    //except at the top levels
+                    if (step > 32 && level < 8)
+                        inserted = Math.Max(inserted, pos + step - MinMatch);
+                    insertUpTo(data, ref inserted, pos + step, end, head, prev);
+                }
+                pos += step;
+                if (count == BlockSymbols)
+                {
+                    writeBlock(output, syms, dists, count, data, blockStart, pos - blockStart);
+                    count = 0;
+                    blockStart = pos;
+                }
+            }
+            if (count > 0)
+                writeBlock(output, syms, dists, count, data, blockStart, pos - blockStart);
+        }
+
+        /// <summary>
+        /// The longest match for the bytes at pos, or a len of 0.  Level 1
+        /// only looks for runs, a match one byte back.
+        /// </summary>
+        private static void findMatch(byte[] data, int dictStart, int pos, int end, int level,
+            int[] head, int[] prev, ref int inserted, out int len, out int dist)
+        {
+            len = dist = 0;
+            int most = Math.Min(MaxMatch, end - pos);
+            if (most < MinMatch)
+                return;
+            if (level == 1)
+            {
+                if (pos > dictStart)
+                {
+                    byte b = data[pos - 1];
+                    int n = 0;
+                    while (n < most && data[pos + n] == b)
+                        n++;
+                    if (n >= MinMatch)
+                    {
+                        len = n;
+                        dist = 1;
+                    }
+                }
+                return;
+            }
+            //everything before pos has to be searchable
+            insertUpTo(data, ref inserted, pos, end, head, prev);
+            int nice = niceLengths[level];
+            int limit = Math.Max(dictStart, pos - Window);
+            int candidate = head[hash(data, pos)];
+            int chain = chainLengths[level];
+            int best = MinMatch - 1;
+            while (candidate >= limit && chain-- > 0)
+            {
+                //check the byte that would make it longer first
+                if (data[candidate + best] == data[pos + best])
+                {
+                    int n = 0;
+                    while (n < most && data[candidate + n] == data[pos + n])
+                        n++;
+                    if (n > best)
+                    {
+                        best = n;
+                        dist = pos - candidate;
+                        if (n >= nice || n == most)
+                            break;
+                    }
+                }
+                int next = prev[candidate & (Window - 1)];
+                if (next >= candidate)
+                    break;
+                candidate = next;
+            }
+            if (best >= MinMatch)
+                len = best;
+            else
+                dist = 0;
+        }
+
+        private static void insertUpTo(byte[] data, ref int inserted, int upTo, int end, int[] head, int[] prev)
+        {
+            for (; inserted < upTo && inserted + MinMatch <= end; inserted++)
+                insert(data, inserted, head, prev);
+            if (inserted < upTo)
+                inserted = upTo;
+        }
+
+        private static int hash(byte[] data, int p)
+        {
+            UInt32 v = (UInt32)(data[p] | (data[p + 1] << 8) | (data[p + 2] << 16));
+            return (int)((v * 2654435761) >> (32 - HashBits));
+        }
+
+        private static void insert(byte[] data, int p, int[] head, int[] prev)
+        {
+            int h = hash(data, p);
+            prev[p & (Window - 1)] = head[h];
+            head[h] = p;
+        }
+
+        /// <summary>
+        /// Writes the symbols as whichever of a dynamic, fixed or stored block
+        /// comes out smallest.
+        /// </summary>
+        private static void writeBlock(BitWriter output, UInt16[] syms, UInt16[] dists, int count,
+            byte[] data, int rawStart, int rawLength)
+        {
+            int[] litFreq = new int[286];
+            int[] distFreq = new int[30];
+            for (int i = 0; i < count; i++)
+            {
+                if (syms[i] < 256)
+                    litFreq[syms[i]]++;
+                else
+                {
+                    litFreq[257 + lengthCodes[syms[i] - 256 - MinMatch]]++;
+                    distFreq[distCodes[dists[i] - 1]]++;
+                }
+            }
+            litFreq[256] = 1; //end of block
+
+            byte[] litLengths = buildLengths(litFreq, 15);
+            byte[] distLengths = buildLengths(distFreq, 15);
+
+            int numLit = 286, numDist = 30;
+            while (numLit > 257 && litLengths[numLit - 1] == 0)
+                numLit--;
+            while (numDist > 1 && distLengths[numDist - 1] == 0)
+                numDist--;
+            byte[] lengths = new byte[numLit + numDist];
+            Array.Copy(litLengths, 0, lengths, 0, numLit);
+            Array.Copy(distLengths, 0, lengths, numLit, numDist);
+            List<int> clSyms = runLengths(lengths);
+            int[] clFreq = new int[19];
+            foreach (int s in clSyms)
+                clFreq[s & 0xff]++;
+            byte[] clLengths = buildLengths(clFreq, 7);
+            int numCl = 19;
+            while (numCl > 4 && clLengths[codeLengthOrder[numCl - 1]] == 0)
+                numCl--;
+
+            long dynamicBits = 3 + 5 + 5 + 4 + numCl * 3;
+            foreach (int s in clSyms)
+                dynamicBits += clLengths[s & 0xff] + clExtraBits(s & 0xff);
+            dynamicBits += dataBits(litFreq, distFreq, litLengths, distLengths);
+            long fixedBits = 3 + dataBits(litFreq, distFreq, fixedLitLengths, fixedDistLengths);
+            long storedBits = ((long)rawLength + 5 * ((rawLength + MaxStored - 1) / MaxStored)) * 8 + 7;
+
+            if (storedBits <= fixedBits && storedBits <= dynamicBits)
+            {
+                store(output, data, rawStart, rawLength);
+                return;
+            }
+            if (fixedBits <= dynamicBits)
+            {
+                output.Write(2, 3); //not final, fixed codes
+                writeSymbols(output, syms, dists, count, fixedLitLengths, fixedDistLengths);
+                return;
+            }
+            output.Write(4, 3); //not final, dynamic codes
+            output.Write((UInt32)(numLit - 257), 5);
+            output.Write((UInt32)(numDist - 1), 5);
+            output.Write((UInt32)(numCl - 4), 4);
+            for (int i = 0; i < numCl; i++)
+                output.Write(clLengths[codeLengthOrder[i]], 3);
+            UInt16[] clCodes = makeCodes(clLengths);
+            foreach (int s in clSyms)
+            {
+                int sym = s & 0xff;
+                output.Write(clCodes[sym], clLengths[sym]);
+                if (sym == 16)
+                    output.Write((UInt32)(s >> 8), 2);
+                else if (sym == 17)
+                    output.Write((UInt32)(s >> 8), 3);
+                else if (sym == 18)
+                    output.Write((UInt32)(s >> 8), 7);
+            }
+            writeSymbols(output, syms, dists, count, litLengths, distLengths);
+        }
+
+        private static void writeSymbols(BitWriter output, UInt16[] syms, UInt16[] dists, int count,
+            byte[] litLengths, byte[] distLengths)
+        {
+            UInt16[] litCodes = makeCodes(litLengths);
+            UInt16[] distCodesOut = makeCodes(distLengths);
+            for (int i = 0; i < count; i++)
+            {
+                int sym = syms[i];
+                if (sym < 256)
+                {
+                    output.Write(litCodes[sym], litLengths[sym]);
+                    continue;
+                }
+                int len = sym - 256;
+                int lc = lengthCodes[len - MinMatch];
+                output.Write(litCodes[257 + lc], litLengths[257 + lc]);
+                if (lengthExtra[lc] > 0)
+                    output.Write((UInt32)(len - lengthBase[lc]), lengthExtra[lc]);
+                int dist = dists[i];
+                int dc = distCodes[dist - 1];
+                output.Write(distCodesOut[dc], distLengths[dc]);
+                if (distExtra[dc] > 0)
+                    output.Write((UInt32)(dist - distBase[dc]), distExtra[dc]);
+            }
+            output.Write(litCodes[256], litLengths[256]);
+        }
+
+        private static long dataBits(int[] litFreq, int[] distFreq, byte[] litLengths, byte[] distLengths)
+        {
+            long bits = 0;
+            for (int i = 0; i < 286; i++)
+                bits += (long)litFreq[i] * (litLengths[i] + (i > 256 ? lengthExtra[i - 257] : 0));
+            for (int i = 0; i < 30; i++)
+                bits += (long)distFreq[i] * (distLengths[i] + distExtra[i]);
+            return bits;
+        }
+
+        private static int clExtraBits(int sym)
+        {
+            return sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0;
+        }
+
+        /// <summary>
+        /// Packs code lengths with the repeat codes.  Each entry is the code
+        /// with its repeat count minus the minimum above the low byte.
+        /// </summary>
+        private static List<int> runLengths(byte[] lengths)
+        {
+            List<int> syms = new List<int>();
+            int i = 0;
+            while (i < lengths.Length)
+            {
+                int len = lengths[i];
+                int run = 1;
+                while (i + run < lengths.Length && lengths[i + run] == len)
+                    run++;
+                if (len == 0 && run >= 3)
+                {
+                    run = Math.Min(run, 138);
+                    if (run >= 11)
+                        syms.Add(18 | ((run - 11) << 8));
+                    else
+                        syms.Add(17 | ((run - 3) << 8));
+                }
+                else if (len != 0 && run >= 4)
+                {
+                    //the length once, then repeats of it
+                    syms.Add(len);
+                    run = Math.Min(run - 1, 6) + 1;
+                    syms.Add(16 | ((run - 1 - 3) << 8));
+                }
+                else
+                {
+                    syms.Add(len);
+                    run = 1;
+                }
+                i += run;
+            }
+            return syms;
+        }
+
+        /// <summary>
+        /// Huffman code lengths for the frequencies, none longer than limit.
+        /// If the tree comes out too deep the frequencies are flattened and
+        /// it's built again.
+        /// </summary>
+        private static byte[] buildLengths(int[] freq, int limit)
+        {
+            int n = freq.Length;
+            int[] f = (int[])freq.Clone();
+            //every tree needs two codes, even if only one symbol is used
+            int used = f.Count(v => v > 0);
+            for (int i = 0; used < 2 && i < n; i++)
+                if (f[i] == 0)
+                {
+                    f[i] = 1;
+                    used++;
+                }
+            while (true)
+            {
+                byte[] lengths = huffman(f);
+                if (lengths.Max() <= limit)
+                    return lengths;
+                for (int i = 0; i < n; i++)
+                    if (f[i] > 0)
+                        f[i] = (f[i] >> 1) | 1;
+            }
+        }
+
+        private static byte[] huffman(int[] freq)
+        {
+            int n = freq.Length;
+            //leaves are 0..n-1, joined nodes come after
+            long[] weight = new long[n * 2];
+            int[] parent = new int[n * 2];
+            List<int> leaves = new List<int>();
+            for (int i = 0; i < n; i++)
+                if (freq[i] > 0)
+                {
+                    weight[i] = freq[i];
+                    leaves.Add(i);
+                }
+            leaves.Sort(delegate(int a, int b)
+            {
+                return weight[a] != weight[b] ? weight[a].CompareTo(weight[b]) : a.CompareTo(b);
+            });
+            //two queues, the sorted leaves and the joined nodes, which come
+            //out in order on their own
+            Queue<int> nodes = new Queue<int>();
+            int li = 0, next = n;
+            while (leaves.Count - li + nodes.Count > 1)
+            {
+                int a = pickLightest(leaves, ref li, nodes, weight);
+                int b = pickLightest(leaves, ref li, nodes, weight);
+                weight[next] = weight[a] + weight[b];
+                parent[a] = parent[b] = next;
+                nodes.Enqueue(next++);
+            }
+            int root = next - 1;
+            byte[] lengths = new byte[n];
+            int[] depth = new int[n * 2];
+            for (int i = root - 1; i >= n; i--)
+                depth[i] = depth[parent[i]] + 1;
+            foreach (int i in leaves)
+                lengths[i] = (byte)(depth[parent[i]] + 1);
+            return lengths;
+        }
+
+        private static int pickLightest(List<int> leaves, ref int li, Queue<int> nodes, long[] weight)
+        {
+            if (li < leaves.Count && (nodes.Count == 0 || weight[leaves[li]] <= weight[nodes.Peek()]))
+                return leaves[li++];
+            return nodes.Dequeue();
+        }
+
+        /// <summary>
+        /// Canonical codes for the lengths, bit reversed since deflate writes
+        /// codes from the top bit down into a stream read from the bottom up.
+        /// </summary>
+        private static UInt16[] makeCodes(byte[] lengths)
+        {
+            int[] count = new int[16];
+            foreach (byte l in lengths)
+                count[l]++;
+            count[0] = 0;
+            int[] next = new int[16];
+            int code = 0;
+            for (int bits = 1; bits < 16; bits++)
+            {
+                code = (code + count[bits - 1]) << 1;
+                next[bits] = code;
+            }
+            UInt16[] codes = new UInt16[lengths.Length];
+            for (int i = 0; i < lengths.Length; i++)
+            {
+                int len = lengths[i];
+                if (len == 0)
+                    continue;
+                int c = next[len]++, r = 0;
+                for (int b = 0; b < len; b++)
+                {
+                    r = (r << 1) | (c & 1);
+                    c >>= 1;
+                }
+                codes[i] = (UInt16)r;
+            }
+            return codes;
+        }
+
+        private static byte[] makeCodes(int[] bases, int size, int first)
+        {
+            byte[] codes = new byte[size];
+            int code = 0;
+            for (int v = 0; v < size; v++)
+            {
+                while (code + 1 < bases.Length && bases[code + 1] <= v + first)
+                    code++;
+                codes[v] = (byte)code;
+            }
+            return codes;
+        }
+
+        private static byte[] makeFixedLengths()
+        {
+            byte[] lengths = new byte[288];
+            for (int i = 0; i < 288; i++)
+                lengths[i] = (byte)(i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+            return lengths;
+        }
+
+        private class BitWriter
+        {
+            byte[] buffer;
+            int length;
+            UInt64 bits;
+            int count;
+
+            public BitWriter(int capacity)
+            {
+                buffer = new byte[Math.Max(capacity, 16)];
+            }
+
+            public void Write(UInt32 value, int n)
+            {
+                bits |= (UInt64)value << count;
+                count += n;
+                while (count >= 8)
+                {
+                    put((byte)bits);
+                    bits >>= 8;
+                    count -= 8;
+                }
+            }
+
+            public void Align()
+            {
+                if (count > 0)
+                    put((byte)bits);
+                bits = 0;
+                count = 0;
+            }
+
+            public void WriteBytes(byte[] data, int offset, int n)
+            {
+                if (length + n > buffer.Length)
+                    Array.Resize(ref buffer, Math.Max(buffer.Length * 2, length + n));
+                Buffer.BlockCopy(data, offset, buffer, length, n);
+                length += n;
+            }
+
+            public byte[] ToArray()
+            {
+                byte[] result = new byte[length];
+                Buffer.BlockCopy(buffer, 0, result, 0, length);
+                return result;
+            }
+
+            private void put(byte b)
+            {
+                if (length == buffer.Length)
+                    Array.Resize(ref buffer, buffer.Length * 2);
+                buffer[length++] = b;
+            }
+        }
+    }
+}
@@ -0,0 +1,493 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Diagnostics;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Net;
+using System.Net.Sockets;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// A stand-in terraria server for a loaded world, on this machine.  It
+    /// speaks just what our client uses: login (0x01, 0x03, 0x25), world info
+    /// (0x07), sections (0x0a, 0x0b), npcs (0x17) and spawning (0x31).  Replies
+    /// can be delayed and throttled, so downloads can be timed as if over a
+    /// real network, and section requests dropped or coalesced like a busy
+    /// server would.
+    /// </summary>
+    class LocalServer : IDisposable
+    {
+        //milliseconds added before every reply
+        public int Latency = 0;
+        //bytes per second to each client, 0 for no limit
+        public long Bandwidth = 0;
+        public string Password = null;
+        //ignore every nth section request, as a busy server can.  0 answers all.
+        public int DropEvery = 0;
+        //answer only the last of the section requests that arrive together,
+        //as a real server does for a player that moved several times
+        public bool Coalesce = false;
+        //told when clients come and go
+        public Action<string> Log = null;
+
+        World world;
+        TileRowCodec rows;
+        TcpListener listener;
+        Thread acceptThread;
+        List<Connection> connections = new List<Connection>();
+        int nextId = 0;
+        volatile bool stopping;
+
+        public LocalServer(World world, WorldInfo info)
+        {
+            this.world = world;
+            rows = new TileRowCodec(info.tileInfos);
+        }
+
+        public int Port { get; private set; }
+
+        /// <summary>
+        /// Listens on the loopback address.  port 0 picks a free one.
+        /// </summary>
+        public void Start(int port)
+        {
+            listener = new TcpListener(IPAddress.Loopback, port);
+            listener.Start();
+            Port = ((IPEndPoint)listener.LocalEndpoint).Port;
+            acceptThread = new Thread(accept);
+            acceptThread.IsBackground = true;
+            acceptThread.Start();
+        }
+
+        public void Stop()
+        {
+            stopping = true;
+            if (listener != null)
+                listener.Stop();
+            lock (connections)
+            {
+                foreach (Connection c in connections)
+                    c.Close();
+                connections.Clear();
+            }
+        }
+
+        public void Dispose()
+        {
+            Stop();
+        }
+
+        private void accept()
+        {
+            while (!stopping)
+            {
+                Socket socket;
+                try
+                {
+                    socket = listener.AcceptSocket();
+                }
+                catch (SocketException)
+                {
+                    break; //stopped
+                }
+                socket.NoDelay = true;
+                Connection c = new Connection(this, socket, Interlocked.Increment(ref nextId));
+                lock (connections)
+                    connections.Add(c);
+                c.Start();
+            }
+        }
+
+        private void log(string format, params object[] args)
+        {
+            if (Log != null)
+                Log(String.Format(format, args));
+        }
+
+        /// <summary>
+        /// One client.  A thread reads and answers its requests, another sends
+        /// the answers once they're due.
+        /// </summary>
+        class Connection
+        {
+            const int Slot = 1;
+
+            struct Outgoing
+            {
+                public byte[] data;
+                public long due;
+            }
+
+            LocalServer server;
+            World world;
+            Socket socket;
+            int id;
+            BlockingCollection<Outgoing> outgoing = new BlockingCollection<Outgoing>();
+            Stopwatch clock = Stopwatch.StartNew();
+            bool[,] sent;
+            bool approved;
+            long bytesSent;
+            int sectionsSent;
+            int requests;
+            //where the player last moved to, when coalescing
+            bool moved;
+            int movedX, movedY;
+
+            public Connection(LocalServer server, Socket socket, int id)
+            {
+                this.server = server;
+                this.world = server.world;
+                this.socket = socket;
+                this.id = id;
+                sent = new bool[world.tilesWide / SectionScheduler.SectionWidth,
+                    world.tilesHigh / SectionScheduler.SectionHeight];
+            }
+
+            public void Start()
+            {
+                Thread reader = new Thread(read);
+                reader.IsBackground = true;
+                reader.Start();
+                Thread writer = new Thread(write);
+                writer.IsBackground = true;
+                writer.Start();
+                server.log("client {0} connected", id);
+            }
+
+            public void Close()
+            {
+                outgoing.CompleteAdding();
+                try
+                {
+                    socket.Close();
+                }
+                catch (ObjectDisposedException)
+                {
+                }
+            }
+
+            private void read()
+            {
+                using (MessageBuffer buffer = new MessageBuffer())
+                {
+                    try
+                    {
+                        int n;
+                        while ((n = socket.Receive(buffer.Data, buffer.ReceiveOffset, buffer.ReceiveCount,
+                            SocketFlags.None)) > 0)
+                        {
+                            buffer.Received(n);
+                            int start, len;
+                            while (buffer.Next(out start, out len))
+                                handle(buffer.Data, start, len);
+                            if (moved)
+                            {
+                                moved = false;
+                                sendSectionsAround(movedX, movedY);
+                            }
+                        }
+                    }
+                    catch (Exception e)
+                    {
+                        if (!server.stopping)
+                            server.log("client {0}: {1}", id, e.Message);
+                    }
+                }
+                //let what's queued go out before hanging up
+                outgoing.CompleteAdding();
+                double seconds = clock.Elapsed.TotalSeconds;
+                server.log("client {0} left after {1:0.0}s, sent {2} sections, {3:0.0} MB", id, seconds,
+                    sectionsSent, bytesSent / (1024.0 * 1024.0));
+            }
+
+            private void write()
+            {
+                try
+                {
+                    foreach (Outgoing o in outgoing.GetConsumingEnumerable())
+                    {
+                        long wait = o.due - clock.ElapsedMilliseconds;
+                        if (wait > 0)
+                            Thread.Sleep((int)wait);
+                        socket.Send(o.data);
+                        Interlocked.Add(ref bytesSent, o.data.Length);
+                        if (server.Bandwidth > 0)
+                        {
+                            long ahead = bytesSent * 1000 / server.Bandwidth - clock.ElapsedMilliseconds;
+                            if (ahead > 0)
+                                Thread.Sleep((int)ahead);
+                        }
+                    }
+                    socket.Shutdown(SocketShutdown.Send);
+                }
+                catch (Exception)
+                {
+                    //the client hung up
+                }
+                finally
+                {
+                    socket.Close();
+                    lock (server.connections)
+                        server.connections.Remove(this);
+                }
+            }
+
+            private void send(byte[] message)
+            {
+                Outgoing o;
+                o.data = message;
+                o.due = clock.ElapsedMilliseconds + server.Latency;
+                if (!outgoing.IsAddingCompleted)
+                    outgoing.Add(o);
+            }
+
+            private void handle(byte[] data, int start, int len)
+            {
+                int messageid = data[start];
+                int payload = start + 1;
+                len--;
+                switch (messageid)
+                {
+                    case 0x01: //greeting
+                        {
+                            string version = Encoding.ASCII.GetString(data, payload, len);
+                            if (version != "Terraria" + World.MapVersion)
+                            {
+                                send(text(0x02, "You are not using the same version as this server."));
+                                break;
+                            }
+                            if (server.Password != null)
+                                send(message(0x25, null)); //ask for the password
+                            else
+                                approve();
+                        }
+                        break;
+                    case 0x26: //password
+                        if (Encoding.ASCII.GetString(data, payload, len) == server.Password)
+                            approve();
+                        else
+                            send(text(0x02, "Incorrect password."));
+                        break;
+                    case 0x06: //request world info
+                        if (approved)
+                            send(worldInfo());
+                        break;
+                    case 0x08: //request initial tile data
+                        if (approved)
+                        {
+                            int x = BitConverter.ToInt32(data, payload);
+                            int y = BitConverter.ToInt32(data, payload + 4);
+                            if (x < 0 || y < 0)
+                            {
+                                x = world.spawnX;
+                                y = world.spawnY;
+                            }
+                            sendSectionsAround(x, y);
+                            for (int i = 0; i < world.npcs.Count; i++)
+                                send(npc(i, world.npcs[i]));
+                            send(message(0x31, null)); //okay to spawn
+                        }
+                        break;
+                    case 0x0d: //player control, we send what's around the player
+                        if (approved)
+                        {
+                            float x = BitConverter.ToSingle(data, payload + 3);
+                            float y = BitConverter.ToSingle(data, payload + 7);
+                            requests++;
+                            if (server.DropEvery > 0 && requests % server.DropEvery == 0)
+                                break;
+                            if (server.Coalesce)
+                            {
+                                moved = true;
+                                movedX = (int)(x / 16);
+                                movedY = (int)(y / 16);
+                                break;
+                            }
+                            sendSectionsAround((int)(x / 16), (int)(y / 16));
+                        }
+                        break;
+                    default: //player info, life, mana, spawning and so on don't matter
+                        break;
+                }
+            }
+
+            private void approve()
+            {
+                approved = true;
+                send(message(0x03, delegate(BinaryWriter w)
+                {
+                    w.Write((byte)Slot);
+                }));
+            }
+
+            /// <summary>
+            /// Sends the sections next to the one x,y is in that haven't been
+            /// sent yet, then the 0x0b that tells the client they're done.
+            /// </summary>
+            private void sendSectionsAround(int x, int y)
+            {
+                int wide = sent.GetLength(0), high = sent.GetLength(1);
+                int sx = Math.Max(0, Math.Min(wide - 1, x / SectionScheduler.SectionWidth));
+                int sy = Math.Max(0, Math.Min(high - 1, y / SectionScheduler.SectionHeight));
+                int x0 = Math.Max(0, sx - 1), x1 = Math.Min(wide - 1, sx + 1);
+                int y0 = Math.Max(0, sy - 1), y1 = Math.Min(high - 1, sy + 1);
+                bool any = false;
+                for (int j = y0; j <= y1; j++)
+                    for (int i = x0; i <= x1; i++)
+                    {
+                        if (sent[i, j])
+                            continue;
+                        sent[i, j] = true;
+                        any = true;
+                        sectionsSent++;
+                        for (int row = 0; row < SectionScheduler.SectionHeight; row++)
+                            send(tileRow(i * SectionScheduler.SectionWidth,
+                                j * SectionScheduler.SectionHeight + row, SectionScheduler.SectionWidth));
+                    }
+                if (!any)
+                    return;
+                send(message(0x0b, delegate(BinaryWriter w)
+                {
+                    w.Write(x0);
+                    w.Write(y0);
+                    w.Write((Int16)x1);
+                    w.Write((Int16)y1);
+                }));
+            }
+
+            private byte[] worldInfo()
+            {
+                return message(0x07, delegate(BinaryWriter w)
+                {
+                    w.Write((Int32)world.gameTime);
+                    w.Write((byte)(world.dayNight ? 1 : 0));
+                    w.Write((byte)world.moonPhase);
+                    w.Write((byte)(world.bloodMoon ? 1 : 0));
+                    w.Write((byte)(world.eclipse ? 1 : 0));
+                    w.Write(world.tilesWide);
+                    w.Write(world.tilesHigh);
+                    w.Write(world.spawnX);
+                    w.Write(world.spawnY);
+                    w.Write(world.groundLevel);
+                    w.Write(world.rockLevel);
+                    w.Write(world.worldID);
+                    w.Write(world.moonType);
+                    for (int i = 0; i < 3; i++)
+                        w.Write(world.treeX[i]);
+                    for (int i = 0; i < 4; i++)
+                        w.Write((byte)world.treeStyle[i]);
+                    for (int i = 0; i < 3; i++)
+                        w.Write(world.caveBackX[i]);
+                    for (int i = 0; i < 4; i++)
+                        w.Write((byte)world.caveBackStyle[i]);
+                    w.Write(world.styles, 0, 8);
+                    w.Write((byte)world.iceBackStyle);
+                    w.Write((byte)world.jungleBackStyle);
+                    w.Write((byte)world.hellBackStyle);
+                    w.Write(0.0f); //wind speed
+                    w.Write((byte)0); //clouds
+                    byte flags = 0, flags2 = 0;
+                    if (world.smashedOrb) flags |= 1;
+                    if (world.killedBoss1) flags |= 2;
+                    if (world.killedBoss2) flags |= 4;
+                    if (world.killedBoss3) flags |= 8;
+                    if (world.hardMode) flags |= 16;
+                    if (world.killedClown) flags |= 32;
+                    if (world.killedPlantBoss) flags |= 128;
+                    if (world.killedMechBoss1) flags2 |= 1;
+                    if (world.killedMechBoss2) flags2 |= 2;
+                    if (world.killedMechBoss3) flags2 |= 4;
+                    if (world.killedMechBossAny) flags2 |= 8;
+                    if (world.crimson) flags2 |= 32;
+                    w.Write(flags);
+                    w.Write(flags2);
+                    w.Write(world.maxRain);
+                    w.Write(Encoding.ASCII.GetBytes(world.name ?? ""));
+                });
+            }
+
+            private byte[] npc(int slot, NPC npc)
+            {
+                return message(0x17, delegate(BinaryWriter w)
+                {
+                    w.Write((Int16)slot);
+                    w.Write(npc.x);
+                    w.Write(npc.y);
+                    w.Write(0.0f); //velocity
+                    w.Write(0.0f);
+                    w.Write((byte)0); //target
+                    w.Write((byte)0); //flags, no ai
+                    w.Write(250); //life
+                    w.Write((Int16)npc.sprite);
+                });
+            }
+
+            private byte[] tileRow(int startx, int y, int width)
+            {
+                return message(0x0a, delegate(BinaryWriter w)
+                {
+                    server.rows.WriteRow(w, world.tiles, startx, y, width);
+                });
+            }
+
+            private static byte[] text(int messageid, string text)
+            {
+                return message(messageid, delegate(BinaryWriter w)
+                {
+                    w.Write(Encoding.ASCII.GetBytes(text));
+                });
+            }
+
+            /// <summary>
+            /// Builds a message: its length, its id and whatever write adds.
+            /// </summary>
+            private static byte[] message(int messageid, Action<BinaryWriter> write)
+            {
+                using (MemoryStream stream = new MemoryStream())
+                using (BinaryWriter w = new BinaryWriter(stream))
+                {
+                    w.Write(0); //length, filled in below
+                    w.Write((byte)messageid);
+                    if (write != null)
+                        write(w);
+                    w.Flush();
+                    byte[] data = stream.ToArray();
+                    Buffer.BlockCopy(BitConverter.GetBytes(data.Length - 4), 0, data, 0, 4);
+                    return data;
+                }
+            }
+        }
+    }
+}
@@ -43,405 +43,18 @@ using System.Windows.Navigation;
 using System.Windows.Threading;
 using System.Windows.Interop;
 using System.Collections;
+using System.Collections.Concurrent;
 using System.Threading;
 using System.Net.Sockets;
 using System.Security.Cryptography;
 
 namespace Terrafirma
 {
-    public class TileInfo
-    {
-        public string name;
-        public UInt32 color;
-        public bool hasExtra;
-        public double light;
-        public double lightR, lightG, lightB;
-        public bool transparent, solid;
-        public bool isStone, isGrass;
-		public bool canMerge;
-        public Int16 blend;
-        public int u, v, minu, maxu, minv, maxv;
-        public bool isHilighting;
-        public List<TileInfo> variants;
-    }
-    class TileInfos
-    {
-        public TileInfos(XmlNodeList nodes)
-        {
-            info = new TileInfo[nodes.Count];
-            for (int i = 0; i < nodes.Count; i++)
-            {
-                int id = Convert.ToInt32(nodes[i].Attributes["num"].Value);
-                info[id] = new TileInfo();
-                loadInfo(info[id], nodes[i]);
-            }
-        }
-        public TileInfo this[int id] //no variantions
-        {
-            get { return info[id]; }
-        }
-        public TileInfo this[int id, Int16 u, Int16 v]
-        {
-            get { return find(info[id], u, v); }
-        }
-        public ArrayList Items()
-        {
-            ArrayList items = new ArrayList();
-            for (int i = 0; i < info.Length; i++)
-                items.Add(info[i]);
-            return items;
-        }
-
-        private TileInfo find(TileInfo info, Int16 u, Int16 v)
-        {
-            foreach (TileInfo vars in info.variants)
-            {
-                // must match *all* restrictions... and we take the first match we find.
-                if ((vars.u < 0 || vars.u == u) &&
-                    (vars.v < 0 || vars.v == v) &&
-                    (vars.minu < 0 || vars.minu <= u) &&
-                    (vars.minv < 0 || vars.minv <= v) &&
-                    (vars.maxu < 0 || vars.maxu > u) &&
-                    (vars.maxv < 0 || vars.maxv > v))
-                    return find(vars, u, v); //check for sub-variants
-            }
-            // if we get here, there are no variants that match
-            return info;
-        }
-        private double parseDouble(string value)
-        {
-            return Double.Parse(value, System.Globalization.CultureInfo.InvariantCulture);
-        }
-        private Int16 parseInt(string value)
-        {
-            return Int16.Parse(value, System.Globalization.CultureInfo.InvariantCulture);
-        }
-        private UInt32 parseColor(string color)
-        {
-            UInt32 c = 0;
-            for (int j = 0; j < color.Length; j++)
-            {
-                c <<= 4;
-                if (color[j] >= '0' && color[j] <= '9')
-                    c |= (byte)(color[j] - '0');
-                else if (color[j] >= 'A' && color[j] <= 'F')
-                    c |= (byte)(10 + color[j] - 'A');
-                else if (color[j] >= 'a' && color[j] <= 'f')
-                    c |= (byte)(10 + color[j] - 'a');
-            }
-            return c;
-        }
-        private void loadInfo(TileInfo info, XmlNode node)
-        {
-            info.name = node.Attributes["name"].Value;
-            info.color = parseColor(node.Attributes["color"].Value);
-            info.hasExtra = node.Attributes["hasExtra"] != null;
-            info.light = (node.Attributes["light"] == null) ? 0.0 : parseDouble(node.Attributes["light"].Value);
-            info.lightR = (node.Attributes["lightr"] == null) ? 0.0 : parseDouble(node.Attributes["lightr"].Value);
-            info.lightG = (node.Attributes["lightg"] == null) ? 0.0 : parseDouble(node.Attributes["lightg"].Value);
-            info.lightB = (node.Attributes["lightb"] == null) ? 0.0 : parseDouble(node.Attributes["lightb"].Value);
-            info.transparent = node.Attributes["letLight"] != null;
-            info.solid = node.Attributes["solid"] != null;
-            info.isStone = node.Attributes["isStone"] != null;
-            info.isGrass = node.Attributes["isGrass"] != null;
-			info.canMerge = node.Attributes["merge"] != null;
-            if (node.Attributes["blend"] != null)
-                info.blend = parseInt(node.Attributes["blend"].Value);
-            else
-                info.blend = -1;
-            info.variants = new List<TileInfo>();
-            if (node.HasChildNodes)
-                for (int i = 0; i < node.ChildNodes.Count; i++)
-                    info.variants.Add(newVariant(info, node.ChildNodes[i]));
-        }
-        private TileInfo newVariant(TileInfo parent, XmlNode node)
-        {
-            TileInfo info = new TileInfo();
-            info.name = (node.Attributes["name"] == null) ? parent.name : node.Attributes["name"].Value;
-            info.color = (node.Attributes["color"] == null) ? parent.color : parseColor(node.Attributes["color"].Value);
-            info.transparent = (node.Attributes["letLight"] == null) ? parent.transparent : true;
-            info.solid = (node.Attributes["solid"] == null) ? parent.solid : true;
-            info.light = (node.Attributes["light"] == null) ? parent.light : parseDouble(node.Attributes["light"].Value);
-            info.lightR = (node.Attributes["lightr"] == null) ? parent.lightR : parseDouble(node.Attributes["lightr"].Value);
-            info.lightG = (node.Attributes["lightg"] == null) ? parent.lightG : parseDouble(node.Attributes["lightg"].Value);
-            info.lightB = (node.Attributes["lightb"] == null) ? parent.lightB : parseDouble(node.Attributes["lightb"].Value);
-            info.u = (node.Attributes["u"] == null) ? -1 : parseInt(node.Attributes["u"].Value);
-            info.v = (node.Attributes["v"] == null) ? -1 : parseInt(node.Attributes["v"].Value);
-            info.minu = (node.Attributes["minu"] == null) ? -1 : parseInt(node.Attributes["minu"].Value);
-            info.maxu = (node.Attributes["maxu"] == null) ? -1 : parseInt(node.Attributes["maxu"].Value);
-            info.minv = (node.Attributes["minv"] == null) ? -1 : parseInt(node.Attributes["minv"].Value);
-            info.maxv = (node.Attributes["maxv"] == null) ? -1 : parseInt(node.Attributes["maxv"].Value);
-            info.variants = new List<TileInfo>();
-            if (node.HasChildNodes)
-                for (int i = 0; i < node.ChildNodes.Count; i++)
-                    info.variants.Add(newVariant(info, node.ChildNodes[i]));
-            return info;
-        }
-
-        private TileInfo[] info;
-    };
-    struct WallInfo
-    {
-        public string name;
-        public UInt32 color;
-		public Int16 blend;
-    }
-    class Tile
-    {
-        private UInt32 lite;
-        public Int16 u, v, wallu, wallv;
-        private UInt16 flags;
-        public UInt16 type;
-        public byte wall;
-        public byte liquid;
-
-        public byte color;
-        public byte wallColor;
-        public byte slope;
-
-
-        public bool isActive
-        {
-            get
-            {
-                return (flags & 0x0001) == 0x0001;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0001;
-                else
-                    flags &= 0xfffe;
-            }
-        }
-        public bool isLava
-        {
-            get
-            {
-                return (flags & 0x0002) == 0x0002;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0002;
-                else
-                    flags &= 0xfffd;
-            }
-        }
-        public bool isHoney
-        {
-            get
-            {
-                return (flags & 0x0004) == 0x0004;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0004;
-                else
-                    flags &= 0xfffb;
-            }
-        }
-        public bool seen
-        {
-            get
-            {
-                return (flags & 0x0008) == 0x0008;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0008;
-                else
-                    flags &= 0xfff7;
-            }
-        }
-
-        public bool hasRedWire
-        {
-            get
-            {
-                return (flags & 0x0010) == 0x0010;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0010;
-                else
-                    flags &= 0xffef;
-            }
-        }
-        public bool hasBlueWire
-        {
-            get
-            {
-                return (flags & 0x0020) == 0x0020;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0020;
-                else
-                    flags &= 0xffdf;
-            }
-        }
-        public bool hasGreenWire
-        {
-            get
-            {
-                return (flags & 0x0040) == 0x0040;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0040;
-                else
-                    flags &= 0xffbf;
-            }
-        }
-        public bool half
-        {
-            get
-            {
-                return (flags & 0x0080) == 0x0080;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0080;
-                else
-                    flags &= 0xff7f;
-            }
-        }
-        public bool actuator
-        {
-            get
-            {
-                return (flags & 0x0100) == 0x0100;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0100;
-                else
-                    flags &= 0xfeff;
-            }
-        }
-        public bool inactive
-        {
-            get
-            {
-                return (flags & 0x0200) == 0x0200;
-            }
-            set
-            {
-                if (value)
-                    flags |= 0x0200;
-                else
-                    flags &= 0xfdff;
-            }
-        }
-
-        public double light
-        {
-            get
-            {
-                return getRGBA(0);
-            }
-            set
-            {
-                setRGBA(0, value);
-            }
-        }
-        public double lightR
-        {
-            get
-            {
-                return getRGBA(24);
-            }
-            set
-            {
-                setRGBA(24, value);
-            }
-        }
-        public double lightG
-        {
-            get
-            {
-                return getRGBA(16);
-            }
-            set
-            {
-                setRGBA(16, value);
-            }
-        }
-        public double lightB
-        {
-            get
-            {
-                return getRGBA(8);
-            }
-            set
-            {
-                setRGBA(8, value);
-            }
-        }
-        private void setRGBA(int shift, double v)
-        {
-            int l = (int)Math.Round(v * 255.0);
-            if (l > 255) l = 255;
-            else if (l < 0) l = 0;
-            lite &= ~(UInt32)(0xff << shift);
-            lite |= (UInt32)(l << shift);
-        }
-        private double getRGBA(int shift)
-        {
-            int r = (int)(lite >> shift) & 0xff;
-            return (double)r / 255.0;
-        }
-    }
-    struct ChestItem
-    {
-        public int stack;
-        public string name;
-        public string prefix;
-    }
-    struct Chest
-    {
-        public Int32 x { get; set; }
-        public Int32 y { get; set; }
-        public String name { get; set; }
-        public ChestItem[] items;
-    }
-    struct Sign
-    {
-        public string text;
-        public Int32 x, y;
-    }
-    class NPC
-    {
-        public string title;
-        public string name;
-        public float x, y;
-        public bool isHomeless;
-        public Int32 homeX, homeY;
-        public int sprite;
-        public int num;
-        public int slot;
-        public int order;
-    }
-
     /// <summary>
     /// Interaction logic for MainWindow.xaml
     /// </summary>
-    public partial class MainWindow : Window, IDisposable
+    public partial class MainWindow : Window, IDisposable, ILoadProgress
     {
-        const int MapVersion = 94;
-        const int MaxTile = 254;
-        const int MaxWall = 125;
-        const int Widest = 8400;
-        const int Highest = 2400;
-
         const double MaxScale = 16.0;
         const double MinScale = 1.0;
 
@@ -451,112 +64,34 @@ namespace Terrafirma
         DispatcherTimer resizeTimer;
         int curWidth, curHeight, newWidth, newHeight;
         bool loaded = false;
-        Tile[,] tiles = null;
-        Int32 tilesWide = 0, tilesHigh = 0;
-        Int32 spawnX, spawnY;
-        Int32 groundLevel, rockLevel;
         string[] worlds;
         string currentWorld;
-        Int32 worldID = 0;
         string[] players;
         string player;
-        List<Chest> chests = new List<Chest>();
-        List<Sign> signs = new List<Sign>();
-        List<NPC> npcs = new List<NPC>();
-
-        byte moonType;
-        Int32[] treeX = new Int32[3];
-        Int32[] treeStyle = new Int32[4];
-        Int32[] caveBackX = new Int32[3];
-        Int32[] caveBackStyle = new Int32[4];
-        Int32 iceBackStyle, jungleBackStyle, hellBackStyle;
-        bool crimson;
-        bool killedQueenBee, killedMechBoss1, killedMechBoss2, killedMechBoss3, killedMechBossAny, killedPirates;
-        bool isRaining;
-        Int32 rainTime;
-        float maxRain;
-        Int32 oreTier1, oreTier2, oreTier3;
-
-        double gameTime;
-        bool dayNight, bloodMoon, eclipse;
-        int moonPhase;
-        Int32 dungeonX, dungeonY;
-        bool killedBoss1, killedBoss2, killedBoss3, killedGoblins, killedClown, killedFrost;
-        bool killedPlantBoss, killedGolemBoss;
-        bool savedTinkerer, savedWizard, savedMechanic;
-        bool smashedOrb, meteorSpawned;
-        byte shadowOrbCount;
-        Int32 altarsSmashed;
-        bool hardMode;
-        Int32 goblinsDelay, goblinsSize, goblinsType;
-        double goblinsX;
-        byte[] styles = {   0, //tree
-                            0, //corruption
-                            0, //jungle
-                            0, //snow
-                            0, //hallow
-                            0, //crimson
-                            0, //desert
-                            0 }; //ocean
+        World world;
+        WorldInfo worldInfo;
 
         Render render;
 
         TileInfos tileInfos;
         WallInfo[] wallInfo;
-        UInt32 skyColor, earthColor, rockColor, hellColor, lavaColor, waterColor, honeyColor;
         bool isHilight = false;
+        bool saving = false;
 
-        Socket socket = null;
-        byte[] readBuffer, writeBuffer;
-        int pendingSize;
-        byte[] messages;
-        byte playerSlot;
-        string status;
-        int statusTotal, statusCount;
-        int loginLevel;
-        bool[,] sentSections;
-        int sectionsWide, sectionsHigh;
+        MapSession session;
         bool busy;
-
-        struct FriendlyNPC
-        {
-            public FriendlyNPC(string title, int id, int num, int order)
-            {
-                this.title = title;
-                this.id = id;
-                this.num = num;
-                this.order = order;
-            }
-            public string title;
-            public int id; //sprite
-            public int num; // number for npc heads
-            public int order; //order in name list
-        };
-
-        FriendlyNPC[] friendlyNPCs ={
-                                        new FriendlyNPC("Merchant", 17, 2, 0),
-                                        new FriendlyNPC("Nurse", 18, 3, 1),
-                                        new FriendlyNPC("Arms Dealer", 19, 6, 2),
-                                        new FriendlyNPC("Dryad", 20, 5, 3),
-                                        new FriendlyNPC("Guide", 22, 1, 4),
-                                        new FriendlyNPC("Old Man",37, 0, -1),
-                                        new FriendlyNPC("Demolitionist", 38, 4, 6),
-                                        new FriendlyNPC("Clothier", 54, 7, 5),
-                                        new FriendlyNPC("Goblin Tinkerer", 107, 9, 7),
-                                        new FriendlyNPC("Wizard", 108, 10, 8),
-                                        new FriendlyNPC("Mechanic", 124, 8, 9),
-                                        new FriendlyNPC("Santa Claus", 142, 11, -1),
-										new FriendlyNPC("Truffle", 160, 12, 10),
-										new FriendlyNPC("Steampunker", 178, 13, 11),
-										new FriendlyNPC("Dye Trader", 207, 14, 12),
-										new FriendlyNPC("Party Girl", 208, 15, 13),
-										new FriendlyNPC("Cyborg", 209, 16, 14),
-										new FriendlyNPC("Painter", 227, 17, 15),
-										new FriendlyNPC("Witch Doctor", 228, 18, 16),
-										new FriendlyNPC("Pirate", 229, 19, 17),
-                                        new FriendlyNPC("Stylist", 353, 20, 18)
-                                   };
-
+        //where to record the next connection
+        string capturePath;
+        //tiles changed by the server since the last redraw
+        object changedLock = new object();
+        bool changesPending;
+        int changedX0, changedY0, changedX1, changedY1;
+        //the network thread never waits on the ui.  it queues what should
+        //change, and uiTimer applies it every UIInterval
+        const int UIInterval = 50;
+        ConcurrentQueue<Action> uiUpdates = new ConcurrentQueue<Action>();
+        string serverStatus;
+        DispatcherTimer uiTimer;
 
         public MainWindow()
         {
@@ -566,86 +101,13 @@ namespace Terrafirma
 
 
 
-            XmlDocument xml = new XmlDocument();
-            string xmlData = string.Empty;
-
-            using (Stream stream = this.GetType().Assembly.GetManifestResourceStream("Terrafirma.tiles.xml"))
-            {
-                xml.Load(stream);
-            }
-            tileInfos = new TileInfos(xml.GetElementsByTagName("tile"));
-            XmlNodeList wallList = xml.GetElementsByTagName("wall");
-            wallInfo = new WallInfo[wallList.Count + 1];
-            for (int i = 0; i < wallList.Count; i++)
-            {
-                int id = Convert.ToInt32(wallList[i].Attributes["num"].Value);
-                wallInfo[id].name = wallList[i].Attributes["name"].Value;
-                wallInfo[id].color = parseColor(wallList[i].Attributes["color"].Value);
-                if (wallList[i].Attributes["blend"] != null)
-                    wallInfo[id].blend = Convert.ToInt16(wallList[i].Attributes["blend"].Value);
-                else
-                    wallInfo[id].blend = (Int16)id;
-            }
-            XmlNodeList globalList = xml.GetElementsByTagName("global");
-            for (int i = 0; i < globalList.Count; i++)
-            {
-                string kind = globalList[i].Attributes["id"].Value;
-                UInt32 color = parseColor(globalList[i].Attributes["color"].Value);
-                switch (kind)
-                {
-                    case "sky":
-                        skyColor = color;
-                        break;
-                    case "earth":
-                        earthColor = color;
-                        break;
-                    case "rock":
-                        rockColor = color;
-                        break;
-                    case "hell":
-                        hellColor = color;
-                        break;
-                    case "water":
-                        waterColor = color;
-                        break;
-                    case "lava":
-                        lavaColor = color;
-                        break;
-                    case "honey":
-                        honeyColor = color;
-                        break;
-                }
-            }
-            XmlNodeList prefixList = xml.GetElementsByTagName("prefix");
-            prefixes = new string[prefixList.Count + 1];
-            for (int i = 0; i < prefixList.Count; i++)
-            {
-                int id = Convert.ToInt32(prefixList[i].Attributes["num"].Value);
-                prefixes[id] = prefixList[i].Attributes["name"].Value;
-            }
-            XmlNodeList itemList = xml.GetElementsByTagName("item");
-            //find min/max
-            Int32 minItemId = 0, maxItemId = 0;
-            for (int i = 0; i < itemList.Count; i++)
-            {
-                Int32 id = Convert.ToInt32(itemList[i].Attributes["num"].Value);
-                if (id < minItemId)
-                    minItemId = id;
-                if (id > maxItemId)
-                    maxItemId = id;
-            }
-            itemNames2 = new string[(-minItemId) + 1];
-            itemNames = new string[maxItemId + 1];
-            for (int i = 0; i < itemList.Count; i++)
-            {
-                int id = Convert.ToInt32(itemList[i].Attributes["num"].Value);
-                if (id < 0)
-                    itemNames2[-id] = itemList[i].Attributes["name"].Value;
-                else
-                    itemNames[id] = itemList[i].Attributes["name"].Value;
-            }
+            worldInfo = WorldInfo.Load();
+            tileInfos = worldInfo.tileInfos;
+            wallInfo = worldInfo.wallInfo;
+            world = new World(worldInfo);
 
-            render = new Render(tileInfos, wallInfo, skyColor, earthColor, rockColor, hellColor, waterColor, lavaColor, honeyColor);
+            render = new Render(worldInfo.tileInfos, worldInfo.wallInfo, worldInfo.skyColor, worldInfo.earthColor, worldInfo.rockColor,
+                worldInfo.hellColor, worldInfo.waterColor, worldInfo.lavaColor, worldInfo.honeyColor);
             //this resize timer is used so we don't get killed on the resize
             resizeTimer = new DispatcherTimer(
                 TimeSpan.FromMilliseconds(20), DispatcherPriority.Normal,
@@ -670,6 +132,8 @@ namespace Terrafirma
                     }
                 },
                 Dispatcher) { IsEnabled = false };
+            uiTimer = new DispatcherTimer(TimeSpan.FromMilliseconds(UIInterval), DispatcherPriority.Normal,
+                applyUIUpdates, Dispatcher);
             curWidth = 496;
             curHeight = 400;
             newWidth = 496;
@@ -680,8 +144,7 @@ namespace Terrafirma
             curX = curY = 0;
             curScale = 1.0;
 
-            tiles = new Tile[Widest, Highest];
-
+            
             //setup quick hilight menu
             ArrayList quickItems = new ArrayList();
             foreach (TileInfo info in tileInfos.Items())
@@ -811,810 +274,109 @@ namespace Terrafirma
                 }
             }
         }
-        private UInt32 parseColor(string color)
+        delegate void Del();
+
+        private void Load(string path, Del done)
         {
-            UInt32 c = 0;
-            for (int j = 0; j < color.Length; j++)
+            ThreadStart loadThread = delegate()
             {
-                c <<= 4;
-                if (color[j] >= '0' && color[j] <= '9')
-                    c |= (byte)(color[j] - '0');
-                else if (color[j] >= 'A' && color[j] <= 'F')
-                    c |= (byte)(10 + color[j] - 'A');
-                else if (color[j] >= 'a' && color[j] <= 'f')
-                    c |= (byte)(10 + color[j] - 'a');
-            }
-            return c;
-        }
+                try
+                {
+                    currentWorld = path;
 
-        delegate void Del();
+                    string invalid;
+                    if (!world.Load(path, this, out invalid))
+                    {
+                        Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                        {
+                            MessageBox.Show("Found problems with the map: " + invalid + "\nIt may not display properly.", "Warning");
+                        }));
+                    }
+                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                    {
+                        Title = world.name;
+                        NPCs.Items.Clear();
+                        serverText.Text = "Loading Fog of War...";
+                        //FogOfWar.IsChecked = false;
+                    }));
+                    foreach (NPC npc in world.npcs)
+                        addNPCToMenu(npc);
+                    
+                    //load player's map
+                    loadPlayerMap();
 
-        private bool LoadNewMap(BinaryReader b, int version, out string invalid)
-        {
-            Int16 numSections = b.ReadInt16();
-            int[] sections = new int[numSections];
-            for (int i = 0; i < numSections; i++)
-                sections[i] = b.ReadInt32();
-            Int16 numTiles = b.ReadInt16();
-            byte mask = 0x80;
-            byte bits = 0;
-            bool[] extra = new bool[numTiles];
-            for (int i = 0; i < numTiles; i++)
-            {
-                if (mask == 0x80)
+                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                        {
+                            render.SetWorld(world.tilesWide, world.tilesHigh, world.groundLevel, world.rockLevel, world.styles, world.treeX, world.treeStyle, world.caveBackX, world.caveBackStyle, world.jungleBackStyle, world.hellBackStyle, world.npcs, world.worldID);
+                        }));
+
+                    //work out every tile's frame now, instead of while drawing
+                    if (Properties.Settings.Default.ResolveFrames)
+                        render.ResolveFrames(world.tiles, delegate(int percent)
+                        {
+                            Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                            {
+                                serverText.Text = percent + "% - Resolving tiles";
+                            }));
+                        });
+
+                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                        {
+                            QuickHiliteToggle.IsEnabled = true;
+                            loaded = true;
+                            done();
+                        }));
+                    world.CalculateLight(this);
+                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                        {
+                            serverText.Text = "";
+                        }));
+                }
+                catch (Exception e)
                 {
-                    bits = b.ReadByte();
-                    mask = 1;
+                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                        {
+                            MessageBox.Show(e.Message);
+                            loaded = false;
+                            serverText.Text = "";
+                            done();
+                        }));
                 }
-                else
-                    mask <<= 1;
-                extra[i] = (bits & mask) == mask;
-            }
-            b.BaseStream.Position = sections[0]; //skip any unknown data in world file header
-            LoadHeader(b, version);
-            b.BaseStream.Position = sections[1]; //skip to tiles
-            if (!LoadTiles(b, version, extra, out invalid))
-                return true;
-            b.BaseStream.Position = sections[2]; //skip to chests
-            LoadChests(b, version);
-            b.BaseStream.Position = sections[3]; //skip to signs
-            LoadSigns(b);
-            b.BaseStream.Position = sections[4]; //skip to npcs
-            LoadNPCs(b, version);
-            return false;
-        }
-
-        private bool LoadOldMap(BinaryReader b, int version, out string invalid)
-        {
-            LoadHeader(b, version);
-            if (!LoadOldTiles(b, version, out invalid))
-                return true;
-            LoadOldChests(b, version);
-            LoadOldSigns(b);
-            LoadNPCs(b, version);
-            return false;
-        }
-
-        private void LoadHeader(BinaryReader b, int version)
-        {
-            string title = b.ReadString();
+            };
+            new Thread(loadThread).Start();
+        }
+
+        void ILoadProgress.Status(string text)
+        {
             Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
             {
-                Title = title;
+                serverText.Text = text;
             }));
-            worldID = b.ReadInt32();
-            b.BaseStream.Seek(16, SeekOrigin.Current); //skip bounds
-            tilesHigh = b.ReadInt32();
-            tilesWide = b.ReadInt32();
-            moonType = 0;
-            if (version >= 63)
-                moonType = b.ReadByte();
-            treeX[0] = treeX[1] = treeX[2] = 0;
-            treeStyle[0] = treeStyle[1] = treeStyle[2] = treeStyle[3] = 0;
-            if (version >= 44)
-            {
-                treeX[0] = b.ReadInt32();
-                treeX[1] = b.ReadInt32();
-                treeX[2] = b.ReadInt32();
-                treeStyle[0] = b.ReadInt32();
-                treeStyle[1] = b.ReadInt32();
-                treeStyle[2] = b.ReadInt32();
-                treeStyle[3] = b.ReadInt32();
-            }
-            caveBackX[0] = caveBackX[1] = caveBackX[2] = 0;
-            caveBackStyle[0] = caveBackStyle[1] = caveBackStyle[2] = caveBackStyle[3] = 0;
-            iceBackStyle = jungleBackStyle = hellBackStyle = 0;
-            if (version >= 60)
-            {
-                caveBackX[0] = b.ReadInt32();
-                caveBackX[1] = b.ReadInt32();
-                caveBackX[2] = b.ReadInt32();
-                caveBackStyle[0] = b.ReadInt32();
-                caveBackStyle[1] = b.ReadInt32();
-                caveBackStyle[2] = b.ReadInt32();
-                caveBackStyle[3] = b.ReadInt32();
-                iceBackStyle = b.ReadInt32();
-                if (version >= 61)
-                {
-                    jungleBackStyle = b.ReadInt32();
-                    hellBackStyle = b.ReadInt32();
-                }
-            }
-            spawnX = b.ReadInt32();
-            spawnY = b.ReadInt32();
-            groundLevel = (int)b.ReadDouble();
-            rockLevel = (int)b.ReadDouble();
-            gameTime = b.ReadDouble();
-            dayNight = b.ReadBoolean();
-            moonPhase = b.ReadInt32();
-            bloodMoon = b.ReadBoolean();
-            eclipse = false;
-            if (version >= 70)
-                eclipse = b.ReadBoolean();
-            dungeonX = b.ReadInt32();
-            dungeonY = b.ReadInt32();
-            crimson = false;
-            if (version >= 56)
-                crimson = b.ReadBoolean();
-            killedBoss1 = b.ReadBoolean();
-            killedBoss2 = b.ReadBoolean();
-            killedBoss3 = b.ReadBoolean();
-            killedQueenBee = false;
-            if (version >= 66)
-                killedQueenBee = b.ReadBoolean();
-            killedMechBoss1 = killedMechBoss2 = killedMechBoss3 = killedMechBossAny = false;
-            if (version >= 44)
-            {
-                killedMechBoss1 = b.ReadBoolean();
-                killedMechBoss2 = b.ReadBoolean();
-                killedMechBoss3 = b.ReadBoolean();
-                killedMechBossAny = b.ReadBoolean();
-            }
-            killedPlantBoss = killedGolemBoss = false;
-            if (version >= 64)
-            {
-                killedPlantBoss = b.ReadBoolean();
-                killedGolemBoss = b.ReadBoolean();
-            }
-            savedTinkerer = savedWizard = savedMechanic = killedGoblins = killedClown = killedFrost = killedPirates = false;
-            if (version >= 29)
-            {
-                savedTinkerer = b.ReadBoolean();
-                savedWizard = b.ReadBoolean();
-                if (version >= 34)
-                    savedMechanic = b.ReadBoolean();
-                killedGoblins = b.ReadBoolean();
-                if (version >= 32)
-                    killedClown = b.ReadBoolean();
-                if (version >= 37)
-                    killedFrost = b.ReadBoolean();
-                if (version >= 56)
-                    killedPirates = b.ReadBoolean();
-            }
-            smashedOrb = b.ReadBoolean();
-            meteorSpawned = b.ReadBoolean();
-            shadowOrbCount = b.ReadByte();
-            altarsSmashed = 0;
-            hardMode = false;
-            if (version >= 23)
+        }
+
+        private void noFogOfWar()
+        {
+            post(delegate()
             {
-                altarsSmashed = b.ReadInt32();
-                hardMode = b.ReadBoolean();
-            }
-            goblinsDelay = b.ReadInt32();
-            goblinsSize = b.ReadInt32();
-            goblinsType = b.ReadInt32();
-            goblinsX = b.ReadDouble();
-
-            isRaining = false;
-            rainTime = 0;
-            maxRain = 0.0F;
-            oreTier1 = 107;
-            oreTier2 = 108;
-            oreTier3 = 111;
-            if (version >= 23 && altarsSmashed == 0)
-                oreTier1 = oreTier2 = oreTier3 = -1;
-            if (version >= 53)
+                FogOfWar.IsChecked = false;
+            });
+        }
+
+        //never waits on the ui thread, so it's safe with a session's world locked
+        private void loadPlayerMap()
+        {
+            try
             {
-                isRaining = b.ReadBoolean();
-                rainTime = b.ReadInt32();
-                maxRain = b.ReadSingle();
-                if (version >= 54)
-                {
-                    oreTier1 = b.ReadInt32();
-                    oreTier2 = b.ReadInt32();
-                    oreTier3 = b.ReadInt32();
-                }
+                if (!world.LoadFogOfWar(player))
+                    noFogOfWar();
             }
-            if (version >= 55)
+            catch (Exception e)
             {
-                int numstyles = 3;
-                if (version >= 60)
-                    numstyles = 8;
-                for (int i = 0; i < numstyles; i++)
-                    styles[i] = b.ReadByte();
-                //skip clouds
-                if (version >= 60)
+                post(delegate()
                 {
-                    b.BaseStream.Seek(4, SeekOrigin.Current);
-                    if (version >= 62) //skip wind
-                        b.BaseStream.Seek(6, SeekOrigin.Current);
-                }
-            }
-
-            ResizeMap();
-        }
-
-        private bool LoadOldTiles(BinaryReader b, int version, out string invalid)
-        {
-            invalid = "";
-            for (int x = 0; x < tilesWide; x++)
-            {
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                {
-                    serverText.Text = ((int)((float)x * 100.0 / (float)tilesWide)) + "% - Reading tiles";
-                }));
-                for (int y = 0; y < tilesHigh; y++)
-                {
-                    tiles[x, y].isActive = b.ReadBoolean();
-                    if (tiles[x, y].isActive)
-                    {
-                        if (version <= 77)
-                            tiles[x, y].type = b.ReadByte();
-                        else
-                            tiles[x, y].type = b.ReadUInt16();
-                        if (tiles[x, y].type > MaxTile) // something screwy in the map
-                        {
-                            tiles[x, y].isActive = false;
-                            invalid = String.Format("{0} is not a valid tile type", tiles[x, y].type);
-                            return false;
-                        }
-                        else if (tileInfos[tiles[x, y].type].hasExtra || (version < 72 && tiles[x, y].type == 170))
-                        {
-                            // torches and platforms didn't have extra in older versions.
-                            if ((version < 28 && tiles[x, y].type == 4) ||
-                                (version < 40 && tiles[x, y].type == 19))
-                            {
-                                tiles[x, y].u = -1;
-                                tiles[x, y].v = -1;
-                            }
-                            else
-                            {
-                                tiles[x, y].u = b.ReadInt16();
-                                tiles[x, y].v = b.ReadInt16();
-                                if (tiles[x, y].type == 144) //timer
-                                    tiles[x, y].v = 0;
-                            }
-                        }
-                        else
-                        {
-                            tiles[x, y].u = -1;
-                            tiles[x, y].v = -1;
-                        }
-
-                        if (version >= 48 && b.ReadBoolean())
-                        {
-                            tiles[x, y].color = b.ReadByte();
-                        }
-                    }
-                    if (version <= 25)
-                        b.ReadBoolean(); //skip obsolete hasLight
-                    if (b.ReadBoolean())
-                    {
-                        tiles[x, y].wall = b.ReadByte();
-                        if (tiles[x, y].wall > MaxWall)  // bad wall
-                        {
-                            invalid = String.Format("{0} is not a valid wall type", tiles[x, y].wall);
-                            tiles[x, y].wall = 0;
-                            return false;
-                        }
-                        if (version >= 48 && b.ReadBoolean())
-                            tiles[x, y].wallColor = b.ReadByte();
-                        tiles[x, y].wallu = -1;
-                        tiles[x, y].wallv = -1;
-                    }
-                    else
-                        tiles[x, y].wall = 0;
-                    if (b.ReadBoolean())
-                    {
-                        tiles[x, y].liquid = b.ReadByte();
-                        tiles[x, y].isLava = b.ReadBoolean();
-                        if (version >= 51)
-                            tiles[x, y].isHoney = b.ReadBoolean();
-                    }
-                    else
-                        tiles[x, y].liquid = 0;
-                    tiles[x, y].hasRedWire = false;
-                    tiles[x, y].hasGreenWire = false;
-                    tiles[x, y].hasBlueWire = false;
-                    tiles[x, y].half = false;
-                    tiles[x, y].actuator = false;
-                    tiles[x, y].inactive = false;
-                    tiles[x, y].slope = 0;
-                    if (version >= 33)
-                    {
-                        tiles[x, y].hasRedWire = b.ReadBoolean();
-                        if (version >= 43)
-                        {
-                            tiles[x, y].hasGreenWire = b.ReadBoolean();
-                            tiles[x, y].hasBlueWire = b.ReadBoolean();
-                        }
-                        if (version >= 41)
-                        {
-                            tiles[x, y].half = b.ReadBoolean();
-                            if (version >= 49)
-                                tiles[x, y].slope = b.ReadByte();
-                            if (!tileInfos[tiles[x, y].type].solid)
-                            {
-                                tiles[x, y].half = false;
-                                tiles[x, y].slope = 0;
-                            }
-                            if (version >= 42)
-                            {
-                                tiles[x, y].actuator = b.ReadBoolean();
-                                tiles[x, y].inactive = b.ReadBoolean();
-                            }
-                        }
-                    }
-                    if (version >= 25) //RLE
-                    {
-                        int rle = b.ReadInt16();
-                        for (int r = y + 1; r < y + 1 + rle; r++)
-                        {
-                            tiles[x, r].isActive = tiles[x, y].isActive;
-                            tiles[x, r].type = tiles[x, y].type;
-                            tiles[x, r].u = tiles[x, y].u;
-                            tiles[x, r].v = tiles[x, y].v;
-                            tiles[x, r].wall = tiles[x, y].wall;
-                            tiles[x, r].wallu = -1;
-                            tiles[x, r].wallv = -1;
-                            tiles[x, r].liquid = tiles[x, y].liquid;
-                            tiles[x, r].isLava = tiles[x, y].isLava;
-                            tiles[x, r].isHoney = tiles[x, y].isHoney;
-                            tiles[x, r].hasRedWire = tiles[x, y].hasRedWire;
-                            tiles[x, r].hasGreenWire = tiles[x, y].hasGreenWire;
-                            tiles[x, r].hasBlueWire = tiles[x, y].hasBlueWire;
-                            tiles[x, r].half = tiles[x, y].half;
-                            tiles[x, r].slope = tiles[x, y].slope;
-                            tiles[x, r].actuator = tiles[x, y].actuator;
-                            tiles[x, r].inactive = tiles[x, y].inactive;
-                            tiles[x, r].color = tiles[x, y].color;
-                            tiles[x, r].wallColor = tiles[x, y].wallColor;
-                        }
-                        y += rle;
-                    }
-                }
-            }
-            return true;
-        }
-
-        private bool LoadTiles(BinaryReader b, int version, bool[] extra, out string invalid)
-        {
-            invalid = "";
-            for (int x = 0; x < tilesWide; x++)
-            {
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                {
-                    serverText.Text = ((int)((float)x * 100.0 / (float)tilesWide)) + "% - Reading tiles";
-                }));
-                for (int y = 0; y < tilesHigh; y++)
-                {
-                    byte flags1 = b.ReadByte();
-                    byte flags2 = 0;
-                    byte flags3 = 0;
-                    if ((flags1 & 1) == 1) //has flags2
-                    {
-                        flags2 = b.ReadByte();
-                        if ((flags2 & 1) == 1) //has flags3
-                            flags3 = b.ReadByte();
-                    }
-                    tiles[x, y].isActive = (flags1 & 2) == 2;
-                    if (tiles[x, y].isActive)
-                    {
-                        tiles[x, y].type = b.ReadByte();
-                        if ((flags1 & 0x20) == 0x20) //2-byte type
-                            tiles[x, y].type |= (UInt16)(b.ReadByte() << 8);
-
-                        if (extra[tiles[x, y].type])
-                        {
-                            tiles[x, y].u = b.ReadInt16();
-                            tiles[x, y].v = b.ReadInt16();
-                        }
-                        else
-                        {
-                            tiles[x, y].u = -1;
-                            tiles[x, y].v = -1;
-                        }
-                        if ((flags3 & 0x8) == 0x8)
-                            tiles[x, y].color = b.ReadByte();
-                    }
-                    if ((flags1 & 4) == 4) //wall
-                    {
-                        tiles[x, y].wall = b.ReadByte();
-                        if ((flags3 & 0x10) == 0x10)
-                            tiles[x, y].wallColor = b.ReadByte();
-                        tiles[x, y].wallu = -1;
-                        tiles[x, y].wallv = -1;
-                    }
-                    else
-                        tiles[x, y].wall = 0;
-                    if ((flags1 & 0x18) != 0)
-                    {
-                        tiles[x, y].liquid = b.ReadByte();
-                        tiles[x, y].isLava = (flags1 & 0x18) == 0x10;
-                        tiles[x, y].isHoney = (flags1 & 0x18) == 0x18;
-                    }
-                    else
-                        tiles[x, y].liquid = 0;
-                    tiles[x, y].hasRedWire = (flags2 & 2) == 2;
-                    tiles[x, y].hasGreenWire = (flags2 & 4) == 4;
-                    tiles[x, y].hasBlueWire = (flags2 & 8) == 8;
-                    int slope = (flags2 >> 4) & 7;
-                    tiles[x, y].half = slope == 1;
-                    tiles[x, y].slope = (byte)(slope > 1 ? slope - 1 : 0);
-                    if (!tileInfos[tiles[x, y].type].solid)
-                    {
-                        tiles[x, y].half = false;
-                        tiles[x, y].slope = 0;
-                    }
-                    tiles[x, y].actuator = (flags3 & 2) == 2;
-                    tiles[x, y].inactive = (flags3 & 4) == 4;
-
-                    int rle = 0;
-                    switch (flags1 >> 6)
-                    {
-                        case 1: // 1 byte
-                            rle = b.ReadByte();
-                            break;
-                        case 2: // 2 bytes
-                            rle = b.ReadInt16();
-                            break;
-                    }
-                    for (int r = y + 1; r < y + 1 + rle; r++)
-                    {
-                        tiles[x, r].isActive = tiles[x, y].isActive;
-                        tiles[x, r].type = tiles[x, y].type;
-                        tiles[x, r].u = tiles[x, y].u;
-                        tiles[x, r].v = tiles[x, y].v;
-                        tiles[x, r].wall = tiles[x, y].wall;
-                        tiles[x, r].wallu = -1;
-                        tiles[x, r].wallv = -1;
-                        tiles[x, r].liquid = tiles[x, y].liquid;
-                        tiles[x, r].isLava = tiles[x, y].isLava;
-                        tiles[x, r].isHoney = tiles[x, y].isHoney;
-                        tiles[x, r].hasRedWire = tiles[x, y].hasRedWire;
-                        tiles[x, r].hasGreenWire = tiles[x, y].hasGreenWire;
-                        tiles[x, r].hasBlueWire = tiles[x, y].hasBlueWire;
-                        tiles[x, r].half = tiles[x, y].half;
-                        tiles[x, r].slope = tiles[x, y].slope;
-                        tiles[x, r].actuator = tiles[x, y].actuator;
-                        tiles[x, r].inactive = tiles[x, y].inactive;
-                        tiles[x, r].color = tiles[x, y].color;
-                        tiles[x, r].wallColor = tiles[x, y].wallColor;
-                    }
-                    y += rle;
-                }
-            }
-            return true;
-        }
-
-        private void LoadOldChests(BinaryReader b, int version)
-        {
-            int itemsPerChest = 40;
-            if (version < 58)
-                itemsPerChest = 20;
-            chests.Clear();
-            for (int i = 0; i < 1000; i++)
-            {
-                if (b.ReadBoolean())
-                {
-                    Chest chest = new Chest();
-                    chest.items = new ChestItem[itemsPerChest];
-                    chest.x = b.ReadInt32();
-                    chest.y = b.ReadInt32();
-                    if (version >= 85)
-                        chest.name = b.ReadString();
-                    for (int ii = 0; ii < itemsPerChest; ii++)
-                    {
-                        if (version < 59)
-                            chest.items[ii].stack = b.ReadByte();
-                        else
-                            chest.items[ii].stack = b.ReadInt16();
-                        if (chest.items[ii].stack > 0)
-                        {
-                            string name = "Unknown";
-                            if (version >= 38) //item names not stored
-                            {
-                                Int32 itemid = b.ReadInt32();
-                                if (itemid < 0)
-                                {
-                                    itemid = -itemid;
-                                    if (itemid < itemNames2.Length)
-                                        name = itemNames2[itemid];
-                                }
-                                else if (itemid < itemNames.Length)
-                                    name = itemNames[itemid];
-                            }
-                            else
-                                name = b.ReadString();
-                            string prefix = "";
-                            if (version >= 36) //item prefixes
-                            {
-                                int pfx = b.ReadByte();
-                                if (pfx < prefixes.Length)
-                                    prefix = prefixes[pfx];
-                            }
-                            chest.items[ii].name = name;
-                            chest.items[ii].prefix = prefix;
-                        }
-                    }
-                    chests.Add(chest);
-                }
-            }
-        }
-        private void LoadChests(BinaryReader b, int version)
-        {
-            int numChests = b.ReadInt16();
-            int itemsPerChest = b.ReadInt16();
-            chests.Clear();
-            for (int i = 0; i < numChests; i++)
-            {
-                Chest chest = new Chest();
-                chest.items = new ChestItem[itemsPerChest];
-                chest.x = b.ReadInt32();
-                chest.y = b.ReadInt32();
-                chest.name = b.ReadString();
-                for (int ii = 0; ii < itemsPerChest; ii++)
-                {
-                    chest.items[ii].stack = b.ReadInt16();
-                    if (chest.items[ii].stack > 0)
-                    {
-                        string name = "Unknown";
-                        Int32 itemid = b.ReadInt32();
-                        if (itemid < 0)
-                        {
-                            itemid = -itemid;
-                            if (itemid < itemNames2.Length)
-                                name = itemNames2[itemid];
-                        }
-                        else if (itemid < itemNames.Length)
-                            name = itemNames[itemid];
-                        string prefix = "";
-
-                        int pfx = b.ReadByte();
-                        if (pfx < prefixes.Length)
-                            prefix = prefixes[pfx];
-
-                        chest.items[ii].name = name;
-                        chest.items[ii].prefix = prefix;
-                    }
-                }
-                chests.Add(chest);
-            }
-        }
-
-        private void LoadOldSigns(BinaryReader b)
-        {
-            signs.Clear();
-            for (int i = 0; i < 1000; i++)
-            {
-                if (b.ReadBoolean())
-                {
-                    Sign sign = new Sign();
-                    sign.text = b.ReadString();
-                    sign.x = b.ReadInt32();
-                    sign.y = b.ReadInt32();
-                    signs.Add(sign);
-                }
-            }
-        }
-        private void LoadSigns(BinaryReader b)
-        {
-            int numSigns = b.ReadInt16();
-            signs.Clear();
-            for (int i = 0; i < numSigns; i++)
-            {
-                Sign sign = new Sign();
-                sign.text = b.ReadString();
-                sign.x = b.ReadInt32();
-                sign.y = b.ReadInt32();
-                signs.Add(sign);
-            }
-        }
-
-        private void LoadNPCs(BinaryReader b, int version)
-        {
-            npcs.Clear();
-            Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-            {
-                NPCs.Items.Clear();
-                serverText.Text = "Loading NPCs...";
-            }));
-            while (b.ReadBoolean())
-            {
-                NPC npc = new NPC();
-                npc.title = b.ReadString();
-                npc.name = "";
-                if (version >= 83)
-                    npc.name = b.ReadString();
-                npc.x = b.ReadSingle();
-                npc.y = b.ReadSingle();
-                npc.isHomeless = b.ReadBoolean();
-                npc.homeX = b.ReadInt32();
-                npc.homeY = b.ReadInt32();
-
-                npc.order = -1;
-                npc.num = 0;
-                npc.sprite = 0;
-                for (int i = 0; i < friendlyNPCs.Length; i++)
-                    if (friendlyNPCs[i].title == npc.title)
-                    {
-                        npc.sprite = friendlyNPCs[i].id;
-                        npc.num = friendlyNPCs[i].num;
-                        npc.order = friendlyNPCs[i].order;
-                    }
-
-                npcs.Add(npc);
-                addNPCToMenu(npc);
-            }
-            if (version >= 31 && version <= 83) //read npcs
-            {
-                int numNames = 9;
-                if (version >= 34)
-                    numNames++;
-                if (version >= 65)
-                    numNames += 8;
-                if (version >= 79)
-                    numNames++;
-                for (int i = 0; i < numNames; i++)
-                {
-                    string name = b.ReadString();
-                    for (int j = 0; j < npcs.Count; j++)
-                    {
-                        if (npcs[j].order == i)
-                        {
-                            npcs[j].name = name;
-                            addNPCToMenu(npcs[j]);
-                        }
-                    }
-                }
-            }
-        }
-
-        private void Load(string world, Del done)
-        {
-            ThreadStart loadThread = delegate()
-            {
-                try
-                {
-                    currentWorld = world;
-                    bool foundInvalid = false;
-
-                    string invalid = "";
-                    using (BinaryReader b = new BinaryReader(File.Open(world, FileMode.Open, FileAccess.Read, FileShare.ReadWrite)))
-                    {
-                        int version = b.ReadInt32(); //now we care about the version
-                        if (version > MapVersion)
-                            throw new Exception("Unsupported map version: " + version);
-                        if (version > 87) //new map format
-                            foundInvalid = LoadNewMap(b, version, out invalid);
-                        else
-                            foundInvalid = LoadOldMap(b, version, out invalid);
-                    }
-                    if (foundInvalid)
-                    {
-                        Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                        {
-                            MessageBox.Show("Found problems with the map: " + invalid + "\nIt may not display properly.", "Warning");
-                        }));
-                    }
-                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                    {
-                        serverText.Text = "Loading Fog of War...";
-                        //FogOfWar.IsChecked = false;
-                    }));
-                    
-                    //load player's map
-                    loadPlayerMap();
-
-                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                        {
-                            QuickHiliteToggle.IsEnabled = true;
-                            render.SetWorld(tilesWide, tilesHigh, groundLevel, rockLevel, styles, treeX, treeStyle, caveBackX, caveBackStyle, jungleBackStyle, hellBackStyle, npcs);
-                            loaded = true;
-                            done();
-                        }));
-                    calculateLight();
-                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                        {
-                            serverText.Text = "";
-                        }));
-                }
-                catch (Exception e)
-                {
-                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                        {
-                            MessageBox.Show(e.Message);
-                            loaded = false;
-                            serverText.Text = "";
-                            done();
-                        }));
-                }
-            };
-            new Thread(loadThread).Start();
-        }
-
-        private void noFogOfWar()
-        {
-            Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-            {
-                FogOfWar.IsChecked = false;
-            }));
-        }
-
-        private void loadPlayerMap()
-        {
-            for (int x = 0; x < tilesWide; x++)
-                for (int y = 0; y < tilesHigh; y++)
-                    tiles[x, y].seen = false;
-            if (player == null)
-            {
-                noFogOfWar();
-                return;
-            }
-            try
-            {
-                string path = Path.Combine(player.Substring(0, player.Length - 4), string.Concat(worldID, ".map"));
-                if (!File.Exists(path))
-                {
-                    noFogOfWar();
-                    return;
-                }
-                using (BinaryReader b = new BinaryReader(File.Open(path, FileMode.Open, FileAccess.Read, FileShare.ReadWrite)))
-                {
-                    int version = b.ReadInt32();
-                    if (version > MapVersion) //new map format
-                        throw new Exception("Unsupported fog of war version: " + version);
-                    string title = b.ReadString();
-                    b.BaseStream.Seek(4, SeekOrigin.Current); //skip worldid
-                    Int32 mapTilesHigh = b.ReadInt32();
-                    Int32 mapTilesWide = b.ReadInt32();
-                    if (version <= 91)
-                    {
-                        for (int x = 0; x < mapTilesWide; x++)
-                        {
-                            for (int y = 0; y < mapTilesHigh; y++)
-                            {
-                                if (b.ReadBoolean())
-                                {
-                                    if (y < tilesHigh && x < tilesWide)
-                                        tiles[x, y].seen = true;
-                                    UInt16 type = (version <= 77) ? b.ReadByte() : b.ReadUInt16();
-                                    byte light = b.ReadByte();
-                                    byte misc = b.ReadByte();
-                                    byte misc2 = 0;
-                                    if (version >= 50) misc2 = b.ReadByte();
-                                    int rle = b.ReadInt16();
-                                    if (light == 255)
-                                    {
-                                        for (int r = y + 1; r < y + 1 + rle; r++)
-                                        {
-                                            if (r < tilesHigh && x < tilesWide)
-                                                tiles[x, r].seen = true;
-                                        }
-                                    }
-                                    else
-                                    {
-                                        for (int r = y + 1; r < y + 1 + rle; r++)
-                                        {
-                                            light = b.ReadByte();
-                                            if (r < tilesHigh && x < tilesWide)
-                                                tiles[x, r].seen = true;
-                                        }
-                                    }
-                                    y += rle;
-                                }
-                                else
-                                    y += b.ReadInt16(); //skip
-                            }
-                        }
-                    }
-                    else //version 2
-                    {
-                        //disabled
-                        for (int y = 0; y < mapTilesHigh; y++)
-                            for (int x = 0; x < mapTilesWide; x++)
-                                tiles[x, y].seen = true;
-                    }
-                }
-            }
-            catch (Exception e)
-            {
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                    {
-                        FogOfWar.IsChecked = false;
-                        MessageBox.Show(e.Message);
-                    }));
+                    FogOfWar.IsChecked = false;
+                    MessageBox.Show(e.Message);
+                });
             }
         }
         private void addNPCToMenu(NPC npc)
@@ -1626,7 +388,7 @@ namespace Terrafirma
                 name = npc.name + " the " + npc.title;
             if (!npc.isHomeless)
             {
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                post(delegate()
                 {
                     MenuItem item;
                     for (int i = 0; i < NPCs.Items.Count; i++)
@@ -1644,11 +406,11 @@ namespace Terrafirma
                     item.Tag = npc;
                     NPCs.Items.Add(item);
                     NPCs.IsEnabled = true;
-                }));
+                });
             }
             else
             {
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                post(delegate()
                 {
                     MenuItem item;
                     for (int i = 0; i < NPCs.Items.Count; i++)
@@ -1666,14 +428,10 @@ namespace Terrafirma
                     item.Tag = npc;
                     NPCs.Items.Add(item);
                     NPCs.IsEnabled = true;
-                }));
+                });
             }
         }
 
-        private string[] prefixes;
-        private string[] itemNames2;
-        private string[] itemNames;
-
         void jumpNPC(object sender, RoutedEventArgs e)
         {
             MenuItem item = sender as MenuItem;
@@ -1693,16 +451,21 @@ namespace Terrafirma
 
         private void RenderMap()
         {
+            if (saving) //the exporter has the renderer
+                return;
             var rect = new Int32Rect(0, 0, curWidth, curHeight);
 
             double startx = curX - (curWidth / (2 * curScale));
             double starty = curY - (curHeight / (2 * curScale));
+            //fetch what's being looked at first
+            if (session != null)
+                session.Recenter(curX, curY);
             try
             {
                 render.Draw(curWidth, curHeight, startx, starty, curScale, ref bits,
                     isHilight, Lighting1.IsChecked ? 1 : Lighting2.IsChecked ? 2 : 0,
                     UseTextures.IsChecked && curScale > 2.0, ShowHouses.IsChecked, ShowWires.IsChecked,
-                    FogOfWar.IsChecked, ref tiles);
+                    FogOfWar.IsChecked, ref world.tiles);
             }
             catch (System.Exception e)
             {
@@ -1750,8 +513,8 @@ namespace Terrafirma
                 curY += v.Y / curScale;
                 if (curX < 0) curX = 0;
                 if (curY < 0) curY = 0;
-                if (curX > tilesWide) curX = tilesWide;
-                if (curY > tilesHigh) curY = tilesHigh;
+                if (curX > world.tilesWide) curX = world.tilesWide;
+                if (curY > world.tilesHigh) curY = world.tilesHigh;
                 start = curPos;
                 if (loaded)
                     RenderMap();
@@ -1765,19 +528,19 @@ namespace Terrafirma
 
                 int sx, sy;
                 getMapXY(curPos, out sx, out sy);
-                if (sx >= 0 && sx < tilesWide && sy >= 0 && sy < tilesHigh && loaded)
+                if (sx >= 0 && sx < world.tilesWide && sy >= 0 && sy < world.tilesHigh && loaded)
                 {
                     string label = "Nothing";
-                    if (tiles[sx, sy].wall > 0)
-                        label = wallInfo[tiles[sx, sy].wall].name;
-                    if (tiles[sx, sy].liquid > 0)
-                        label = tiles[sx, sy].isLava ? "Lava" : tiles[sx, sy].isHoney ? "Honey" : "Water";
-                    if (tiles[sx, sy].isActive)
+                    if (world.tiles[sx, sy].wall > 0)
+                        label = wallInfo[world.tiles[sx, sy].wall].name;
+                    if (world.tiles[sx, sy].liquid > 0)
+                        label = world.tiles[sx, sy].isLava ? "Lava" : world.tiles[sx, sy].isHoney ? "Honey" : "Water";
+                    if (world.tiles[sx, sy].isActive)
                     {
-                        label = tileInfos[tiles[sx, sy].type, tiles[sx, sy].u, tiles[sx, sy].v].name;
-                        if (tiles[sx, sy].type == 21) //chest, let's find its name
+                        label = tileInfos[world.tiles[sx, sy].type, world.tiles[sx, sy].u, world.tiles[sx, sy].v].name;
+                        if (world.tiles[sx, sy].type == 21) //chest, let's find its name
                         {
-                            foreach (Chest c in chests)
+                            foreach (Chest c in world.chests)
                             {
                                 if ((c.x == sx || c.x + 1 == sx) && (c.y == sy || c.y + 1 == sy))
                                 {
@@ -1788,7 +551,7 @@ namespace Terrafirma
                             }
                         }
                     }
-                    if (FogOfWar.IsChecked && !tiles[sx, sy].seen)
+                    if (FogOfWar.IsChecked && !world.tiles[sx, sy].seen)
                         label = "Murky blackness";
                     statusText.Text = String.Format("{0},{1} {2}", sx, sy, label);
                 }
@@ -1858,7 +621,7 @@ namespace Terrafirma
             start = curPos;
             int sx, sy;
             getMapXY(curPos, out sx, out sy);
-            foreach (Chest c in chests)
+            foreach (Chest c in world.chests)
             {
                 //chests are 2x2, and their x/y is upper left corner
                 if ((c.x == sx || c.x + 1 == sx) && (c.y == sy || c.y + 1 == sy))
@@ -1878,7 +641,7 @@ namespace Terrafirma
                     chestPop.IsOpen = true;
                 }
             }
-            foreach (Sign s in signs)
+            foreach (Sign s in world.signs)
             {
                 //signs are 2x2, and their x/y is upper left corner
                 if ((s.x == sx || s.x + 1 == sx) && (s.y == sy || s.y + 1 == sy))
@@ -1944,8 +707,8 @@ namespace Terrafirma
 
                 if (curX < 0) curX = 0;
                 if (curY < 0) curY = 0;
-                if (curX > tilesWide) curX = tilesWide;
-                if (curY > tilesHigh) curY = tilesHigh;
+                if (curX > world.tilesWide) curX = world.tilesWide;
+                if (curY > world.tilesHigh) curY = world.tilesHigh;
                 changed = true;
             }
             if (changed)
@@ -1992,8 +755,8 @@ namespace Terrafirma
                     busy = false;
                     if (!loaded)
                         return;
-                    curX = spawnX;
-                    curY = spawnY;
+                    curX = world.spawnX;
+                    curY = world.spawnY;
                     if (render.Textures != null && render.Textures.Valid)
                     {
                         UseTextures.IsChecked = true;
@@ -2014,8 +777,8 @@ namespace Terrafirma
                 busy = false;
                 if (!loaded)
                     return;
-                curX = spawnX;
-                curY = spawnY;
+                curX = world.spawnX;
+                curY = world.spawnY;
                 if (render.Textures != null && render.Textures.Valid)
                 {
                     UseTextures.IsChecked = true;
@@ -2082,14 +845,21 @@ namespace Terrafirma
             if (loaded)
                 RenderMap();
         }
+        private void ResolveFrames_Toggle(object sender, ExecutedRoutedEventArgs e)
+        {
+            if (ResolveFrames.IsChecked)
+                ResolveFrames.IsChecked = false;
+            else
+                ResolveFrames.IsChecked = true;
+        }
         private void FogOfWar_CanExecute(object sender, CanExecuteRoutedEventArgs e)
         {
             e.CanExecute = Players.IsEnabled;
         }
         private void JumpToSpawn_Executed(object sender, ExecutedRoutedEventArgs e)
         {
-            curX = spawnX;
-            curY = spawnY;
+            curX = world.spawnX;
+            curY = world.spawnY;
             RenderMap();
         }
         private void Lighting_Executed(object sender, ExecutedRoutedEventArgs e)
@@ -2133,12 +903,6 @@ namespace Terrafirma
 
         private void ConnectToServer_Executed(object sender, ExecutedRoutedEventArgs e)
         {
-            MessageBox.Show("Network support temporarily disabled.. sorry.");
-            return;
-
-
-            //we should disconnect if connected.
-
             ConnectToServer c = new ConnectToServer();
             if (c.ShowDialog() == true)
             {
@@ -2155,803 +919,322 @@ namespace Terrafirma
                     return;
                 }
 
-                socket = new Socket(AddressFamily.InterNetwork, SocketType.Stream, ProtocolType.Tcp);
+                if (session != null)
+                    disconnect(null);
                 _disposed = false;
-                System.Net.IPAddress[] ips;
+                session = newSession();
+                session.Connected = connected;
+                session.CapturePath = capturePath;
+                capturePath = null;
+                busy = true;
+                serverText.Text = "Connecting...";
                 try
                 {
-                    ips = System.Net.Dns.GetHostAddresses(serverip);
-                }
-                catch (Exception)
-                {
-                    MessageBox.Show("Invalid server address");
-                    return;
+                    session.Connect(serverip, port);
                 }
-                foreach (System.Net.IPAddress addr in ips)
+                catch (Exception ex)
                 {
-                    try
-                    {
-                        System.Net.IPEndPoint remoteEP = new System.Net.IPEndPoint(addr, port);
-
-                        socket.BeginConnect(remoteEP, new AsyncCallback(connected), null);
-                        break;
-                    }
-                    catch
-                    {
-                    }
+                    busy = false;
+                    MessageBox.Show(ex.Message);
+                    serverText.Text = "Connection failed.";
                 }
-                busy = true;
-                serverText.Text = "Connecting...";
             }
         }
         private void Disconnect_Executed(object sender, ExecutedRoutedEventArgs e)
         {
-            socket.Close();
-            Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-            {
-                serverText.Text = "Connection cancelled.";
-            }));
+            disconnect("Connection cancelled.");
         }
         private void Disconnect_CanExecute(object sender, CanExecuteRoutedEventArgs e)
         {
-            e.CanExecute = socket != null && socket.Connected;
+            e.CanExecute = session != null && session.IsConnected;
         }
-        private void connected(IAsyncResult ar)
+
+        /// <summary>
+        /// A session mapping into our world.  It tells us what changed from
+        /// the network thread, so everything here goes through post.
+        /// </summary>
+        private MapSession newSession()
         {
-            try
-            {
-                socket.EndConnect(ar);
-                //we connected, huzzah!
-                readBuffer = new byte[1024];
-                writeBuffer = new byte[1024];
-                messages = new byte[8192];
-                pendingSize = 0;
-                loginLevel = 1;
-                SendMessage(1); //greetings server!
-                socket.BeginReceive(readBuffer, 0, readBuffer.Length, SocketFlags.None,
-                    new AsyncCallback(ReceivedData), null);
-            }
-            catch (Exception e)
+            MapSession s = new MapSession(world, worldInfo);
+            s.FetchWindow = Properties.Settings.Default.FetchWindow;
+            s.FollowLive = Properties.Settings.Default.FollowLive;
+            s.Status = showStatus;
+            s.Failed = delegate(string why)
             {
-                socket.Close();
                 busy = false;
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                post(delegate()
                 {
-                    MessageBox.Show(e.Message);
-                    serverText.Text = "Connection failed.";
-                }));
-            }
-        }
-
-        private void ReceivedData(IAsyncResult ar)
-        {
-            try
+                    MessageBox.Show(why);
+                });
+            };
+            s.WorldReceived = delegate()
             {
-                int bytesRead = socket.EndReceive(ar);
-                if (bytesRead > 0)
+                string title = world.name;
+                post(delegate()
                 {
-                    Buffer.BlockCopy(readBuffer, 0, messages, pendingSize, bytesRead);
-                    pendingSize += bytesRead;
-                    messagePump();
-                    if (socket.Connected)
-                        socket.BeginReceive(readBuffer, 0, readBuffer.Length, SocketFlags.None,
-                            new AsyncCallback(ReceivedData), null); //restart receive
-                }
-                else
+                    Title = title;
+                });
+                //not on the socket's thread, the player's map is a file to read
+                Thread loader = new Thread(delegate()
                 {
-                    busy = false;
-                    socket.Close();
-                    // socket was closed?
-                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                    s.LockWorld(loadPlayerMap);
+                    post(delegate()
                     {
-                        serverText.Text = "Connection lost.";
-                    }));
-                }
-            }
-            catch (Exception e)
-            {
-                MessageBox.Show(e.Message);
-                socket.Close();
-                busy = false;
-            }
-        }
-
-        private void messagePump()
-        {
-            if (pendingSize < 5) //haven't received enough data for even a message header
-                return;
-            int msgLen = BitConverter.ToInt32(messages, 0);
-            int ofs = 0;
-            while (ofs + 4 + msgLen <= pendingSize)
-            {
-                HandleMessage(ofs + 4, msgLen);
-                ofs += msgLen + 4;
-                if (ofs + 4 <= pendingSize)
-                    msgLen = BitConverter.ToInt32(messages, ofs);
-                else
-                    break;
-            }
-            if (ofs == pendingSize)
-                pendingSize = 0;
-            else if (ofs > 0)
-            {
-                Buffer.BlockCopy(messages, ofs, messages, 0, pendingSize - ofs);
-                pendingSize -= ofs;
-            }
-        }
-
-        private void HandleMessage(int start, int len)
-        {
-            if (statusTotal > 0)
+                        if (loaded)
+                            RenderMap();
+                    });
+                });
+                loader.IsBackground = true;
+                loader.Start();
+            };
+            s.NpcChanged = addNPCToMenu;
+            s.PasswordNeeded = delegate()
             {
-                statusCount++;
-                if (statusCount == statusTotal)
-                    statusTotal = 0;
-                else
-                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                    {
-                        serverText.Text = ((int)((float)statusCount * 100.0 / (float)statusTotal)) + "% - " + status;
-                    }));
-            }
-            int messageid = messages[start++];
-            len--;
-            int payload = start;
-            switch (messageid)
+                post(delegate()
+                {
+                    ServerPassword p = new ServerPassword();
+                    if (p.ShowDialog() == true)
+                        s.SendPassword(p.Password);
+                    else
+                        disconnect("Login cancelled.");
+                });
+            };
+            s.Spawned = delegate()
             {
-                case 0x01: // connect request - c2s only
-                    break;
-                case 0x02: //error
-                    {
-                        string error = Encoding.ASCII.GetString(messages, payload, len);
-                        Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                            {
-                                MessageBox.Show(error);
-                            }));
-                        socket.Close();
-                        busy = false;
-                    }
-                    break;
-                case 0x03: //connection approved
-                    {
-                        if (loginLevel == 1) loginLevel = 2;
-                        playerSlot = messages[payload];
-                        SendMessage(4);
-                        SendMessage(0x10);
-                        SendMessage(0x2a);
-                        //send buffs
-                        //send inventory
-                        //send dyes
-                        SendMessage(6);
-                        if (loginLevel == 2) loginLevel = 3;
-                    }
-                    break;
-                case 0x04: //player appearance
-                    //ignore other players
-                    break;
-                case 0x05: //inventory items
-                    //ignore player inventory
-                    break;
-                case 0x06: //request world info - c2s only
-                    break;
-                case 0x07: //world info
-                    {
-                        gameTime = BitConverter.ToInt32(messages, payload); payload += 4;
-                        dayNight = messages[payload++] == 1;
-                        moonPhase = messages[payload++];
-                        bloodMoon = messages[payload++] == 1;
-                        payload++; //eclipse
-                        tilesWide = BitConverter.ToInt32(messages, payload); payload += 4;
-                        tilesHigh = BitConverter.ToInt32(messages, payload); payload += 4;
-                        spawnX = BitConverter.ToInt32(messages, payload); payload += 4;
-                        spawnY = BitConverter.ToInt32(messages, payload); payload += 4;
-                        groundLevel = BitConverter.ToInt32(messages, payload); payload += 4;
-                        rockLevel = BitConverter.ToInt32(messages, payload); payload += 4;
-                        worldID = BitConverter.ToInt32(messages, payload); payload += 4;
-                        payload++; //moon type
-                        for (int i = 0; i < 3; i++)
-                        {
-                            treeX[i] = BitConverter.ToInt32(messages, payload); payload += 4;
-                        }
-                        for (int i = 0; i < 4; i++)
-                            treeStyle[i] = messages[payload++];
-                        for (int i = 0; i < 3; i++)
-                        {
-                            caveBackX[i] = BitConverter.ToInt32(messages, payload); payload += 4;
-                        }
-                        for (int i = 0; i < 4; i++)
-                            caveBackStyle[i] = messages[payload++];
-                        for (int i = 0; i < 8; i++)
-                            styles[i] = messages[payload++];
-                        iceBackStyle = messages[payload++];
-                        jungleBackStyle = messages[payload++];
-                        hellBackStyle = messages[payload++];
-                        payload += 4; //wind speed
-                        payload++; //number of clouds
-                        byte flags = messages[payload++];
-                        byte flags2 = messages[payload++];
-                        payload += 4; //max rain
-                        string title = Encoding.ASCII.GetString(messages, payload, start + len - payload);
-                        Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                        {
-                            Title = title;
-                        }));
-                        smashedOrb = (flags & 1) == 1;
-                        killedBoss1 = (flags & 2) == 2;
-                        killedBoss2 = (flags & 4) == 4;
-                        killedBoss3 = (flags & 8) == 8;
-                        hardMode = (flags & 16) == 16;
-                        killedClown = (flags & 32) == 32;
-                        killedPlantBoss = (flags & 128) == 128;
-                        killedMechBoss1 = (flags2 & 1) == 1;
-                        killedMechBoss2 = (flags2 & 2) == 2;
-                        killedMechBoss3 = (flags2 & 4) == 4;
-                        killedMechBossAny = (flags2 & 8) == 8;
-                        crimson = (flags2 & 32) == 32;
-                        meteorSpawned = false;
-                        killedFrost = false;
-                        killedGoblins = false;
-                        killedPirates = false;
-                        killedQueenBee = false;
-                        savedMechanic = false;
-                        savedTinkerer = false;
-                        savedWizard = false;
-                        goblinsDelay = 0;
-                        altarsSmashed = 0;
-                        ResizeMap();
-                        if (loginLevel == 3)
-                        {
-                            sectionsWide = (tilesWide / 200);
-                            sectionsHigh = (tilesHigh / 150);
-                            sentSections = new bool[sectionsWide, sectionsHigh];
-                            loginLevel = 4;
-                            for (int y = 0; y < tilesHigh; y++) //set all tiles to blank
-                                for (int x = 0; x < tilesWide; x++)
-                                {
-                                    tiles[x, y].isActive = false;
-                                    tiles[x, y].wall = 0;
-                                    tiles[x, y].liquid = 0;
-                                    tiles[x, y].hasRedWire = false;
-                                    tiles[x, y].hasGreenWire = false;
-                                    tiles[x, y].hasBlueWire = false;
-                                    tiles[x, y].half = false;
-                                    tiles[x, y].actuator = false;
-                                    tiles[x, y].inactive = false;
-                                    tiles[x, y].color = 0;
-                                    tiles[x, y].wallColor = 0;
-                                }
-                            SendMessage(8); //request initial tile data
-                        }
-                        chests.Clear();
-                        signs.Clear();
-                        npcs.Clear();
-                        loadPlayerMap();
-                    }
-                    break;
-                case 0x08: //request initial tile data - c2s only
-                    break;
-                case 0x09: //status text
-                    {
-                        statusTotal = BitConverter.ToInt32(messages, payload); payload += 4;
-                        statusCount = 0;
-                        status = Encoding.ASCII.GetString(messages, payload, start + len - payload);
-                        Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                        {
-                            serverText.Text = status;
-                        }));
-                    }
-                    break;
-                case 0x0a: //tile row data
-                    {
-                        int width = BitConverter.ToInt16(messages, payload); payload += 2;
-                        int startx = BitConverter.ToInt32(messages, payload); payload += 4;
-                        int y = BitConverter.ToInt32(messages, payload); payload += 4;
-                        for (int x = startx; x < startx + width; x++)
-                        {
-                            Tile tile = tiles[x, y];
-                            byte flags = messages[payload++];
-                            byte flags2 = messages[payload++];
-                            tile.isActive = (flags & 1) == 1;
-                            tile.hasRedWire = (flags & 16) == 16;
-                            tile.half = (flags & 32) == 32;
-                            tile.actuator = (flags & 64) == 64;
-                            tile.inactive = (flags & 128) == 128;
-                            tile.hasGreenWire = (flags2 & 1) == 1;
-                            tile.hasBlueWire = (flags2 & 2) == 2;
-                            tile.slope = (byte)((flags2 & 0x30) >> 4);
-                            if ((flags2 & 4) == 4)
-                                tile.color = messages[payload++];
-                            else
-                                tile.color = 0;
-                            if ((flags2 & 8) == 8)
-                                tile.wallColor = messages[payload++];
-                            else
-                                tile.wallColor = 0;
-                            if (tile.isActive)
-                            {
-                                tile.type = messages[payload++];
-                                if (tileInfos[tile.type].hasExtra)
-                                {
-                                    tile.u = BitConverter.ToInt16(messages, payload); payload += 2;
-                                    tile.v = BitConverter.ToInt16(messages, payload); payload += 2;
-                                }
-                                else
-                                {
-                                    tile.u = -1;
-                                    tile.v = -1;
-                                }
-                            }
-                            if ((flags & 4) == 4)
-                            {
-                                tile.wall = messages[payload++];
-                                tile.wallu = -1;
-                                tile.wallv = -1;
-                            }
-                            else
-                                tile.wall = 0;
-                            if ((flags & 8) == 8)
-                            {
-                                tile.liquid = messages[payload++];
-                                tile.isLava = messages[payload] == 1;
-                                tile.isHoney = messages[payload] == 2;
-                                payload++;
-                            }
-                            else
-                                tile.liquid = 0;
-                            int rle = BitConverter.ToInt16(messages, payload); payload += 2;
-                            for (int r = x + 1; r < x + 1 + rle; r++)
-                            {
-                                tiles[r, y].isActive = tiles[x, y].isActive;
-                                tiles[r, y].type = tiles[x, y].type;
-                                tiles[r, y].u = tiles[x, y].u;
-                                tiles[r, y].v = tiles[x, y].v;
-                                tiles[r, y].wall = tiles[x, y].wall;
-                                tiles[r, y].wallu = -1;
-                                tiles[r, y].wallv = -1;
-                                tiles[r, y].liquid = tiles[x, y].liquid;
-                                tiles[r, y].isLava = tiles[x, y].isLava;
-                                tiles[r, y].isHoney = tiles[x, y].isHoney;
-                                tiles[r, y].hasRedWire = tiles[x, y].hasRedWire;
-                                tiles[r, y].hasGreenWire = tiles[x, y].hasGreenWire;
-                                tiles[r, y].hasBlueWire = tiles[x, y].hasBlueWire;
-                                tiles[r, y].half = tiles[x, y].half;
-                                tiles[r, y].actuator = tiles[x, y].actuator;
-                                tiles[r, y].inactive = tiles[x, y].inactive;
-                                tiles[r, y].slope = tiles[x, y].slope;
-                                tiles[r, y].color = tiles[x, y].color;
-                                tiles[r, y].wallColor = tiles[x, y].wallColor;
-                            }
-                            x += rle;
-                        }
-                    }
-                    break;
-                case 0x0b: //recalculate u/v
-                    {
-                        int startx = BitConverter.ToInt16(messages, payload); payload += 4;
-                        int starty = BitConverter.ToInt16(messages, payload); payload += 4;
-                        int endx = BitConverter.ToInt16(messages, payload); payload += 2;
-                        int endy = BitConverter.ToInt16(messages, payload);
-
-                        for (int y = starty; y <= endy; y++)
-                            for (int x = startx; x <= endx; x++)
-                                sentSections[x, y] = true;
-
-                        startx *= 200;
-                        starty *= 150;
-                        endx = (endx + 1) * 200;
-                        endy = (endy + 1) * 150;
-
-
-                        for (int y = starty; y < endy; y++)
-                            for (int x = startx; x < endx; x++)
-                            {
-                                Tile tile = tiles[x, y];
-                                if (tile.isActive && !tileInfos[tile.type].hasExtra)
-                                {
-                                    tile.u = -1;
-                                    tile.v = -1;
-                                }
-                                if (tile.wall > 0)
-                                {
-                                    tile.wallu = -1;
-                                    tile.wallv = -1;
-                                }
-                            }
-                        if (loginLevel == 5)
-                            fetchNextSection();
-                    }
-                    break;
-                case 0x0c: //player spawned
-                    break;
-                case 0x0d: //player control
-                    break;
-                case 0x0e: //set active players
-                    break;
-                case 0x10: //player life
-                    break;
-                case 0x11: //modify tile
-                    break;
-                case 0x12: //set time
-                    break;
-                case 0x13: //open/close door
-                    break;
-                case 0x14: //update tile block
-                    break;
-                case 0x15: //update item
-                    break;
-                case 0x16: //set item owner
-                    break;
-                case 0x17: //update NPC
-                    {
-                        int slot = BitConverter.ToInt16(messages, payload); payload += 2;
-                        float posx = BitConverter.ToSingle(messages, payload); payload += 4;
-                        float posy = BitConverter.ToSingle(messages, payload); payload += 4;
-                        payload += 9; //skip velocity and target
-                        byte flags = messages[payload++];
-                        payload += 4; //skip life
-                        //skip any applicable AI
-                        if ((flags & 32) == 32) payload += 4;
-                        if ((flags & 16) == 16) payload += 4;
-                        if ((flags & 8) == 8) payload += 4;
-                        if ((flags & 4) == 4) payload += 4;
-                        int id = BitConverter.ToInt16(messages, payload);
-                        bool found = false;
-                        for (int i = 0; i < npcs.Count; i++)
-                        {
-                            if (npcs[i].slot == slot)
-                            {
-                                npcs[i].x = posx;
-                                npcs[i].y = posy;
-                                npcs[i].sprite = id;
-                                found = true;
-                                addNPCToMenu(npcs[i]);
-                            }
-                        }
-                        if (!found)
-                        {
-                            for (int i = 0; i < friendlyNPCs.Length; i++)
-                                if (friendlyNPCs[i].id == id) //we found a friendly npc
-                                {
-                                    NPC npc = new NPC();
-                                    npc.isHomeless = true; //homeless for now
-                                    npc.title = friendlyNPCs[i].title;
-                                    npc.name = "";
-                                    npc.num = friendlyNPCs[i].num;
-                                    npc.sprite = id;
-                                    npc.x = posx;
-                                    npc.y = posy;
-                                    npc.slot = slot;
-                                    npcs.Add(npc);
-                                    addNPCToMenu(npc);
-                                }
-                        }
-                    }
-                    break;
-                case 0x18: //strike npc
-                    break;
-                case 0x19: //chat
-                    break;
-                case 0x1a: //damage player
-                    break;
-                case 0x1b: //update projectile
-                    break;
-                case 0x1c: //damage npc
-                    break;
-                case 0x1d: //destroy projectile
-                    break;
-                case 0x1e: //pvp toggled
-                    break;
-                case 0x1f: //request open chest - c2s only
-                    break;
-                case 0x20: //set chest item
-                    break;
-                case 0x21: //open chest
-                    break;
-                case 0x22: //destroy chest
-                    break;
-                case 0x23: //heal player
-                    break;
-                case 0x24: //set zones
-                    break;
-                case 0x25: //request password.
-                    {
-                        Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                        {
-                            ServerPassword s = new ServerPassword();
-                            if (s.ShowDialog() == true)
-                                SendMessage(0x26, s.Password);
-                            else
-                            {
-                                socket.Close();
-                                serverText.Text = "Login cancelled.";
-                                busy = false;
-                            }
-                        }));
-                    }
-                    break;
-                case 0x26: //login - c2s only
-                    break;
-                case 0x27: //unassign item
-                    break;
-                case 0x28: //talk to npc
-                    break;
-                case 0x29: //animate flail
-                    break;
-                case 0x2a: //set mana
-                    break;
-                case 0x2b: //replenish mana
-                    break;
-                case 0x2c: //kill player
-                    break;
-                case 0x2d: //change party
-                    break;
-                case 0x2e: //read sign - c2s only
-                    break;
-                case 0x2f: //edit sign
-                    break;
-                case 0x30: //adjust liquids
-                    break;
-                case 0x31: //okay to spawn
-                    if (loginLevel == 4)
+                post(delegate()
                     {
-                        loginLevel = 5;
-                        Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                            {
-                                serverText.Text = "";
-                                render.SetWorld(tilesWide, tilesHigh, groundLevel, rockLevel, styles, treeX, treeStyle, caveBackX, caveBackStyle, jungleBackStyle, hellBackStyle, npcs);
-                                loaded = true;
-                                curX = spawnX;
-                                curY = spawnY;
-                                if (render.Textures != null && render.Textures.Valid)
-                                {
-                                    UseTextures.IsChecked = true;
-                                    curScale = 16.0;
-                                }
-                                RenderMap();
-                            }));
-                        SendMessage(0x0c); //spawn
-                        if (tilesWide == 8400) //large world
+                        serverText.Text = "";
+                        render.SetWorld(world.tilesWide, world.tilesHigh, world.groundLevel, world.rockLevel, world.styles, world.treeX, world.treeStyle, world.caveBackX, world.caveBackStyle, world.jungleBackStyle, world.hellBackStyle, world.npcs, world.worldID);
+                        loaded = true;
+                        curX = world.spawnX;
+                        curY = world.spawnY;
+                        if (render.Textures != null && render.Textures.Valid)
                         {
-                            //give the user a choice to map a remote large world
-                            Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                            {
-                                if (MessageBox.Show(this, "Mapping remote large worlds is not recommend.\nContinue to map the rest of the world?", "Map Whole World",
-                                MessageBoxButton.YesNo, MessageBoxImage.Question) == MessageBoxResult.Yes)
-                                {
-                                    fetchNextSection(); //start fetching the world
-                                }
-                                else
-                                {
-                                    socket.Close();
-                                    busy = false;
-                                }
-                            }));
+                            UseTextures.IsChecked = true;
+                            curScale = 16.0;
                         }
-                        else
-                            fetchNextSection(); //start fetching the world
-                    }
-                    break;
-                case 0x32: //set buffs
-                    break;
-                case 0x33: //old man answer
-                    break;
-                case 0x34: //unlock chest
-                    break;
-                case 0x35: //add npc buff
-                    break;
-                case 0x36: //set npc buffs
-                    break;
-                case 0x37: //add player buff
-                    break;
-                case 0x38: //set npc names
+                        RenderMap();
+                    });
+            };
+            s.LargeWorld = delegate()
+            {
+                //give the user a choice to map a remote large world
+                post(delegate()
+                {
+                    if (MessageBox.Show(this, "Mapping remote large worlds is not recommend.\nContinue to map the rest of the world?", "Map Whole World",
+                    MessageBoxButton.YesNo, MessageBoxImage.Question) == MessageBoxResult.Yes)
                     {
-                        int id = BitConverter.ToInt16(messages, payload); payload += 2;
-                        string name = Encoding.ASCII.GetString(messages, payload, start + len - payload);
-                        for (int i = 0; i < npcs.Count; i++)
-                        {
-                            if (npcs[i].sprite == id)
-                            {
-                                npcs[i].name = name;
-                                addNPCToMenu(npcs[i]);
-                            }
-                        }
+                        s.Fetch(); //start fetching the world
                     }
-                    break;
-                case 0x39: //set balance stats
-                    break;
-                case 0x3a: //play harp
-                    break;
-                case 0x3b: //flip switch
-                    break;
-                case 0x3c: //move npc home
+                    else
+                        disconnect("Disconnected.");
+                });
+            };
+            s.TilesChanged = tilesChanged;
+            s.Complete = delegate()
+            {
+                busy = false;
+            };
+            s.Lost = delegate(Exception error)
+            {
+                busy = false;
+                if (error != null)
+                {
+                    post(delegate()
                     {
-                        int slot = BitConverter.ToInt16(messages, payload); payload += 2;
-                        int x = BitConverter.ToInt16(messages, payload); payload += 2;
-                        int y = BitConverter.ToInt16(messages, payload); payload += 2;
-                        byte homeless = messages[payload];
-                        for (int i = 0; i < npcs.Count; i++)
-                        {
-                            if (npcs[i].slot == slot)
-                            {
-                                npcs[i].isHomeless = homeless == 1;
-                                npcs[i].homeX = x;
-                                npcs[i].homeY = y;
-                                addNPCToMenu(npcs[i]);
-                                break;
-                            }
-                        }
-                    }
-                    break;
-                case 0x3d: //summon boss
-                    break;
-                case 0x3e: //ninja dodge
-                    break;
-                case 0x3f: //paint tile
-                    break;
-                case 0x40: //paint wall
-                    break;
-                case 0x41: //teleport npc
-                    break;
-                case 0x42: //heal player
-                    break;
-                case 0x44: //unknown
-                    break;
-                default: // ignore unknown messages
-                    break;
-            }
+                        MessageBox.Show(error.Message);
+                    });
+                }
+                showStatus("Connection lost.");
+            };
+            return s;
         }
 
-        private void SendMessage(int messageid, string text = null, int x = 0, int y = 0)
+        private void connected(Exception error)
         {
-            int payload = 5;
-            int payloadLen = 0;
-            switch (messageid)
+            if (error != null)
             {
-                case 1: //send greeting
-                    byte[] greeting = Encoding.ASCII.GetBytes("Terraria" + MapVersion);
-                    payloadLen = greeting.Length;
-                    Buffer.BlockCopy(greeting, 0, writeBuffer, payload, payloadLen);
-                    break;
-                case 4: //send player info
-                    writeBuffer[payload++] = playerSlot;
-                    writeBuffer[payload++] = 0; //hair
-                    writeBuffer[payload++] = 1; //male
-                    writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; //hair color
-                    writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; //skin color
-                    writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; //eye color
-                    writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; //shirt color
-                    writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; //undershirt color
-                    writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; //pants color
-                    writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; writeBuffer[payload++] = 0; //shoe color
-                    writeBuffer[payload++] = 0; //soft core
-                    byte[] name = Encoding.ASCII.GetBytes("Terrafirma");
-                    Buffer.BlockCopy(name, 0, writeBuffer, payload, name.Length);
-                    payloadLen += 25 + name.Length;
-                    break;
-                case 6: //request world info
-                    //no payload
-                    break;
-                case 8: //request initial tile data
-                    Buffer.BlockCopy(BitConverter.GetBytes(spawnX), 0, writeBuffer, payload, 4); payload += 4;
-                    Buffer.BlockCopy(BitConverter.GetBytes(spawnY), 0, writeBuffer, payload, 4);
-                    payloadLen += 8;
-                    break;
-                case 0x0c: //spawn
-                    writeBuffer[payload++] = playerSlot;
-                    Buffer.BlockCopy(BitConverter.GetBytes(spawnX), 0, writeBuffer, payload, 4); payload += 4;
-                    Buffer.BlockCopy(BitConverter.GetBytes(spawnY), 0, writeBuffer, payload, 4);
-                    payloadLen += 9;
-                    break;
-                case 0x0d: //player control
-                    writeBuffer[payload++] = playerSlot;
-                    writeBuffer[payload++] = 0; //no buttons
-                    writeBuffer[payload++] = 0; //selected item 0
-                    Buffer.BlockCopy(BitConverter.GetBytes((float)(x * 16.0)), 0, writeBuffer, payload, 4); payload += 4;
-                    Buffer.BlockCopy(BitConverter.GetBytes((float)(y * 16.0)), 0, writeBuffer, payload, 4); payload += 4;
-                    byte[] velocity = BitConverter.GetBytes((float)0);
-                    Buffer.BlockCopy(velocity, 0, writeBuffer, payload, 4); payload += 4;
-                    Buffer.BlockCopy(velocity, 0, writeBuffer, payload, 4); payload += 4;
-                    writeBuffer[payload] = 0; //not on a rope
-                    payloadLen += 20;
-                    break;
-                case 0x10: //set player life
-                    writeBuffer[payload++] = playerSlot;
-                    byte[] health = BitConverter.GetBytes((Int16)400);
-                    Buffer.BlockCopy(health, 0, writeBuffer, payload, 2); payload += 2;
-                    Buffer.BlockCopy(health, 0, writeBuffer, payload, 2);
-                    payloadLen += 5;
-                    break;
-                case 0x26: //send password
-                    byte[] password = Encoding.ASCII.GetBytes(text);
-                    payloadLen = password.Length;
-                    Buffer.BlockCopy(password, 0, writeBuffer, payload, payloadLen);
-                    break;
-                case 0x2a: //set mana
-                    writeBuffer[payload++] = playerSlot;
-                    byte[] mana = BitConverter.GetBytes((Int16)0);
-                    Buffer.BlockCopy(mana, 0, writeBuffer, payload, 2); payload += 2;
-                    Buffer.BlockCopy(mana, 0, writeBuffer, payload, 2);
-                    payloadLen += 5;
-                    break;
-                case 0x2d: //set team
-                    writeBuffer[payload++] = playerSlot;
-                    writeBuffer[payload++] = (byte)x;
-                    payloadLen += 2;
-                    break;
-                default:
-                    throw new Exception(String.Format("Unknown messageid: {0}", messageid));
+                busy = false;
+                post(delegate()
+                {
+                    MessageBox.Show(error.Message);
+                    serverText.Text = "Connection failed.";
+                });
             }
+        }
 
-            byte[] msgLen = BitConverter.GetBytes(payloadLen + 1);
-            Buffer.BlockCopy(msgLen, 0, writeBuffer, 0, 4);
-            writeBuffer[4] = (byte)messageid;
-            if (socket.Connected)
-                socket.BeginSend(writeBuffer, 0, payloadLen + 5, SocketFlags.None,
-                    new AsyncCallback(SentMessage), null);
+        /// <summary>
+        /// Hangs up on the server ourselves, showing why
+        /// </summary>
+        private void disconnect(string why)
+        {
+            busy = false;
+            if (why != null)
+                showStatus(why);
+            session.Close();
         }
-        private void SentMessage(IAsyncResult ar)
+
+        private void CaptureSession_Executed(object sender, ExecutedRoutedEventArgs e)
         {
-            try
-            {
-                if (socket.Connected)
-                    socket.EndSend(ar);
-            }
-            catch (Exception e)
+            var dlg = new Microsoft.Win32.SaveFileDialog();
+            dlg.DefaultExt = ".tfcap";
+            dlg.Filter = "Session Capture|*.tfcap";
+            dlg.Title = "Capture Next Connection";
+            if (dlg.ShowDialog() == true)
             {
-                MessageBox.Show(e.Message);
+                capturePath = dlg.FileName;
+                serverText.Text = "The next connection will be captured.";
             }
         }
 
-        private void fetchNextSection()
+        /// <summary>
+        /// Feeds a capture through a session as if its server was sending it,
+        /// then shows how long that took.
+        /// </summary>
+        private void ReplayCapture_Executed(object sender, ExecutedRoutedEventArgs e)
         {
-            bool foundOne = false;
-            for (int y = 0; y < sectionsHigh && !foundOne; y++)
-                for (int x = 0; x < sectionsWide && !foundOne; x++)
+            var dlg = new Microsoft.Win32.OpenFileDialog();
+            dlg.Filter = "Session Capture|*.tfcap";
+            if (dlg.ShowDialog() != true)
+                return;
+            string path = dlg.FileName;
+            bool originalPace = MessageBox.Show(this,
+                "Replay at the pace it was captured?\nNo replays it as fast as possible.", "Replay Capture",
+                MessageBoxButton.YesNo, MessageBoxImage.Question) == MessageBoxResult.Yes;
+
+            if (session != null)
+                disconnect(null);
+            MapSession replay = newSession();
+            session = replay;
+            busy = true;
+            serverText.Text = "Replaying...";
+            ThreadStart replayThread = delegate()
+            {
+                System.Diagnostics.Stopwatch clock = System.Diagnostics.Stopwatch.StartNew();
+                try
+                {
+                    long bytes = replay.Replay(path, originalPace);
+                    showStatus(String.Format("Replayed {0:0.0} MB in {1:0.00}s", bytes / (1024.0 * 1024.0),
+                        clock.Elapsed.TotalSeconds));
+                }
+                catch (Exception ex)
                 {
-                    if (!sentSections[x, y])
+                    post(delegate()
                     {
-                        //System.Console.WriteLine("Fetching {0}x{1}", x, y);
-                        sentSections[x, y] = true;
-                        SendMessage(0x0d, "", x * 200, y * 150);
-                        foundOne = true;
-                    }
+                        MessageBox.Show(ex.Message);
+                    });
                 }
-            if (!foundOne)
-            {
-                socket.Close();
-                loginLevel = 0;
                 busy = false;
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                {
-                    serverText.Text = "Map Load Complete. Disconnected.";
-                }));
-            }
+            };
+            new Thread(replayThread).Start();
+        }
+
+        /// <summary>
+        /// Queues a change to the ui from the network thread
+        /// </summary>
+        private void post(Action update)
+        {
+            uiUpdates.Enqueue(update);
+        }
+
+        /// <summary>
+        /// Sets the status text from the network thread.  Only the latest is
+        /// shown, however many were set since the last tick.
+        /// </summary>
+        private void showStatus(string text)
+        {
+            Interlocked.Exchange(ref serverStatus, text);
+        }
+
+        private void applyUIUpdates(object sender, EventArgs e)
+        {
+            //a dialog shown by an update runs the dispatcher, don't tick under it
+            uiTimer.Stop();
+            Action update;
+            while (uiUpdates.TryDequeue(out update))
+                update();
+            string text = Interlocked.Exchange(ref serverStatus, null);
+            if (text != null)
+                serverText.Text = text;
+            MapSession s = session;
+            string progress = s != null ? s.Progress() : null;
+            if (progress != null)
+                serverText.Text = progress;
+            uiTimer.Start();
+        }
+
+        private void FollowLive_Toggle(object sender, ExecutedRoutedEventArgs e)
+        {
+            if (FollowLive.IsChecked)
+                FollowLive.IsChecked = false;
+            else
+                FollowLive.IsChecked = true;
+            if (session != null)
+                session.FollowLive = FollowLive.IsChecked;
+            //done following a finished map
+            if (!FollowLive.IsChecked && session != null && session.MapComplete)
+                disconnect("Map Load Complete. Disconnected.");
         }
 
-        private void ResizeMap()
+        /// <summary>
+        /// Notes tiles the server changed.  However many changes arrive, only
+        /// one redraw is queued until it's been done.
+        /// </summary>
+        private void tilesChanged(int x0, int y0, int x1, int y1)
         {
-            for (int y = 0; y < tilesHigh; y++)
+            lock (changedLock)
             {
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                {
-                    serverText.Text = ((int)((float)y * 100.0 / (float)tilesHigh)) + "% - Allocating tiles";
-                }));
-                for (int x = 0; x < tilesWide; x++)
+                if (changesPending)
                 {
-                    if (tiles[x, y] == null)
-                        tiles[x, y] = new Tile();
+                    changedX0 = Math.Min(changedX0, x0);
+                    changedY0 = Math.Min(changedY0, y0);
+                    changedX1 = Math.Max(changedX1, x1);
+                    changedY1 = Math.Max(changedY1, y1);
+                    return;
                 }
+                changesPending = true;
+                changedX0 = x0;
+                changedY0 = y0;
+                changedX1 = x1;
+                changedY1 = y1;
             }
-            if (tilesWide < Widest || tilesHigh < Highest) //free unused tiles
+            Dispatcher.BeginInvoke(DispatcherPriority.Render, new Action(redrawChanges));
+        }
+
+        /// <summary>
+        /// Relights and redraws just the part of the view the server changed.
+        /// </summary>
+        private void redrawChanges()
+        {
+            int x0, y0, x1, y1;
+            lock (changedLock)
             {
-                for (int y = 0; y < Highest; y++)
-                {
-                    int start = tilesWide;
-                    if (y >= tilesHigh)
-                        start = 0;
-                    for (int x = start; x < Widest; x++)
-                        tiles[x, y] = null;
-                }
+                changesPending = false;
+                x0 = changedX0 - 1;
+                y0 = changedY0 - 1;
+                x1 = changedX1 + 1;
+                y1 = changedY1 + 1;
+            }
+            if (!loaded || saving)
+                return;
+            int light = Lighting1.IsChecked ? 1 : Lighting2.IsChecked ? 2 : 0;
+            if (light != 0)
+            {
+                world.CalculateLight(x0, y0, x1, y1);
+                //the light changed further out than the tiles did
+                x0 -= World.LightReach;
+                y0 -= World.LightReach;
+                x1 += World.LightReach;
+                y1 += World.LightReach;
             }
+            double startx = curX - (curWidth / (2 * curScale));
+            double starty = curY - (curHeight / (2 * curScale));
+            int left, top, right, bottom;
+            if (render.DrawTiles(curWidth, curHeight, startx, starty, curScale, bits, x0, y0, x1, y1,
+                isHilight, light, UseTextures.IsChecked && curScale > 2.0, ShowHouses.IsChecked,
+                ShowWires.IsChecked, FogOfWar.IsChecked, world.tiles, out left, out top, out right, out bottom))
+                mapbits.WritePixels(new Int32Rect(left, top, right - left, bottom - top), bits, curWidth * 4,
+                    left, top);
         }
 
         private void Hilight_Executed(object sender, ExecutedRoutedEventArgs e)
@@ -2999,16 +1282,14 @@ namespace Terrafirma
                 if (saveOpts.ShowDialog() == true)
                 {
 
-                    Saving save = new Saving();
-                    save.Show();
-                    byte[] pixels;
                     int wd, ht;
                     double sc, startx, starty;
+                    bool useTextures = saveOpts.UseTextures && curScale > 2.0 && !saveOpts.Indexed;
 
                     if (saveOpts.EntireMap)
                     {
-                        wd = tilesWide;
-                        ht = tilesHigh;
+                        wd = world.tilesWide;
+                        ht = world.tilesHigh;
                         sc = 1.0;
                         startx = 0.0;
                         starty = 0.0;
@@ -3021,34 +1302,61 @@ namespace Terrafirma
                             sc = 16.0;
                         else
                             sc = 1.0;
+                        if (useTextures) //textures are drawn a whole number of pixels per tile
+                            sc = Math.Floor(sc);
 
                         wd = (int)((curWidth / curScale) * sc);
                         ht = (int)((curHeight / curScale) * sc);
                         startx = curX - (wd / (2 * sc));
                         starty = curY - (ht / (2 * sc));
                     }
-                    pixels = new byte[wd * ht * 4];
 
-                    try
-                    {
-                        render.Draw(wd, ht, startx, starty, sc,
-                            ref pixels, false, Lighting1.IsChecked ? 1 : Lighting2.IsChecked ? 2 : 0,
-                            saveOpts.UseTextures && curScale > 2.0, ShowHouses.IsChecked, ShowWires.IsChecked,
-                            FogOfWar.IsChecked, ref tiles);
-                    }
-                    catch (Exception ex)
+                    MapExporter exporter = new MapExporter(render);
+                    //indexed images are flat, so they're saved unlit
+                    exporter.Indexed = saveOpts.Indexed;
+                    if (!exporter.Indexed)
+                        exporter.Light = Lighting1.IsChecked ? 1 : Lighting2.IsChecked ? 2 : 0;
+                    exporter.UseTextures = useTextures;
+                    exporter.Houses = ShowHouses.IsChecked;
+                    exporter.Wires = ShowWires.IsChecked;
+                    exporter.FogOfWar = FogOfWar.IsChecked;
+                    string filename = dlg.FileName;
+
+                    //the image is rendered in bands on another thread, so it can be
+                    //far bigger than memory.  the viewer can't draw until it's done.
+                    Saving save = new Saving();
+                    saving = true;
+                    ThreadStart saveThread = delegate()
                     {
-                        MessageBox.Show(ex.Message);
-                    }
-
-                    BitmapSource source = BitmapSource.Create(wd, ht, 96.0, 96.0,
-                        PixelFormats.Bgr32, null, pixels, wd * 4);
-                    FileStream stream = new FileStream(dlg.FileName, FileMode.Create);
-                    PngBitmapEncoder encoder = new PngBitmapEncoder();
-                    encoder.Frames.Add(BitmapFrame.Create(source));
-                    encoder.Save(stream);
-                    stream.Close();
-                    save.Close();
+                        string error = null;
+                        try
+                        {
+                            using (FileStream stream = new FileStream(filename, FileMode.Create))
+                            {
+                                exporter.Export(stream, world.tiles, wd, ht, startx, starty, sc, delegate(int percent)
+                                {
+                                    Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                                    {
+                                        save.textBlock1.Text = String.Format("Please Wait. Saving image... {0}%", percent);
+                                    }));
+                                });
+                            }
+                        }
+                        catch (Exception ex)
+                        {
+                            error = ex.Message;
+                        }
+                        Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
+                        {
+                            saving = false;
+                            save.Close();
+                            if (error != null)
+                                MessageBox.Show(error);
+                            RenderMap();
+                        }));
+                    };
+                    new Thread(saveThread).Start();
+                    save.ShowDialog();
                 }
             }
 
@@ -3070,45 +1378,45 @@ namespace Terrafirma
 
         private void JumpToDungeon_Executed(object sender, ExecutedRoutedEventArgs e)
         {
-            curX = dungeonX;
-            curY = dungeonY;
+            curX = world.dungeonX;
+            curY = world.dungeonY;
             RenderMap();
         }
         private void ShowStats_Executed(object sender, ExecutedRoutedEventArgs e)
         {
             WorldStats stats = new WorldStats();
-            stats.Add("Eye of Cthulhu", killedBoss1 ? "Blackened" : "Undefeated");
+            stats.Add("Eye of Cthulhu", world.killedBoss1 ? "Blackened" : "Undefeated");
             // killedBoss2 should be Brain of Cthulhu in crimson, but it isn't.
-            if (!crimson)
-                stats.Add("Eater of Worlds", killedBoss2 ? "Choked" : "Undefeated");
-            stats.Add("Skeletron", killedBoss3 ? "Boned" : "Undefeated");
-            stats.Add("Wall of Flesh", hardMode ? "Flayed" : "Undefeated");
-            stats.Add("Queen Bee", killedQueenBee ? "Swatted" : "Undefeated");
-            stats.Add("The Destroyer", killedMechBoss1 ? "Destroyed" : "Undefeated");
-            stats.Add("The Twins", killedMechBoss2 ? "Separated" : "Undefeated");
-            stats.Add("Skeletron Prime", killedMechBoss3 ? "Boned" : "Undefeated");
-            stats.Add("Plantera", killedPlantBoss ? "Weeded" : "Undefeated");
-            stats.Add("Golem", killedGolemBoss ? "Stoned" : "Undefeated");
-            stats.Add("Goblin Invasion", killedGoblins ? "Thwarted" : "Undefeated");
-            stats.Add("Clown", killedClown ? "Eviscerated" : "Undefeated");
-            stats.Add("Frost Horde", killedFrost ? "Thawed" : "Undefeated");
-            stats.Add("Pirates", killedPirates ? "Keelhauled" : "Undefeated");
-            stats.Add("Tinkerer", savedTinkerer ? "Saved" : killedGoblins ? "Bound" : "Not present yet");
-            stats.Add("Wizard", savedWizard ? "Saved" : hardMode ? "Bound" : "Not present yet");
-            stats.Add("Mechanic", savedMechanic ? "Saved" : killedBoss3 ? "Bound" : "Not present yet");
-            stats.Add("Game Mode", hardMode ? "Hard" : "Normal");
-            stats.Add("Broke a Shadow Orb", smashedOrb ? "Yes" : "Not Yet");
-            stats.Add("Orbs left til EoW", (3 - shadowOrbCount).ToString());
-            stats.Add("Altars Smashed", altarsSmashed.ToString());
+            if (!world.crimson)
+                stats.Add("Eater of Worlds", world.killedBoss2 ? "Choked" : "Undefeated");
+            stats.Add("Skeletron", world.killedBoss3 ? "Boned" : "Undefeated");
+            stats.Add("Wall of Flesh", world.hardMode ? "Flayed" : "Undefeated");
+            stats.Add("Queen Bee", world.killedQueenBee ? "Swatted" : "Undefeated");
+            stats.Add("The Destroyer", world.killedMechBoss1 ? "Destroyed" : "Undefeated");
+            stats.Add("The Twins", world.killedMechBoss2 ? "Separated" : "Undefeated");
+            stats.Add("Skeletron Prime", world.killedMechBoss3 ? "Boned" : "Undefeated");
+            stats.Add("Plantera", world.killedPlantBoss ? "Weeded" : "Undefeated");
+            stats.Add("Golem", world.killedGolemBoss ? "Stoned" : "Undefeated");
+            stats.Add("Goblin Invasion", world.killedGoblins ? "Thwarted" : "Undefeated");
+            stats.Add("Clown", world.killedClown ? "Eviscerated" : "Undefeated");
+            stats.Add("Frost Horde", world.killedFrost ? "Thawed" : "Undefeated");
+            stats.Add("Pirates", world.killedPirates ? "Keelhauled" : "Undefeated");
+            stats.Add("Tinkerer", world.savedTinkerer ? "Saved" : world.killedGoblins ? "Bound" : "Not present yet");
+            stats.Add("Wizard", world.savedWizard ? "Saved" : world.hardMode ? "Bound" : "Not present yet");
+            stats.Add("Mechanic", world.savedMechanic ? "Saved" : world.killedBoss3 ? "Bound" : "Not present yet");
+            stats.Add("Game Mode", world.hardMode ? "Hard" : "Normal");
+            stats.Add("Broke a Shadow Orb", world.smashedOrb ? "Yes" : "Not Yet");
+            stats.Add("Orbs left til EoW", (3 - world.shadowOrbCount).ToString());
+            stats.Add("Altars Smashed", world.altarsSmashed.ToString());
             stats.Show();
         }
 
         private void FindItem_Executed(object sender, ExecutedRoutedEventArgs e)
         {
             Dictionary<string, List<int>> items = new Dictionary<string, List<int>>();
-            for (int i = 0; i < chests.Count; i++)
+            for (int i = 0; i < world.chests.Count; i++)
             {
-                foreach (ChestItem c in chests[i].items)
+                foreach (ChestItem c in world.chests[i].items)
                 {
                     if (c.name == null)
                         continue;
@@ -3122,8 +1430,8 @@ namespace Terrafirma
             if (fi.ShowDialog() == true)
             {
                 int id = fi.SelectedChest;
-                curX = chests[id].x;
-                curY = chests[id].y;
+                curX = world.chests[id].x;
+                curY = world.chests[id].y;
                 RenderMap();
             }
         }
@@ -3146,129 +1454,6 @@ namespace Terrafirma
 
         }
 
-        private void calculateLight()
-        {
-            // turn off all light
-            for (int y = 0; y < tilesHigh; y++)
-            {
-                for (int x = 0; x < tilesWide; x++)
-                {
-                    Tile tile = tiles[x, y];
-                    tile.light = 0.0;
-                    tile.lightR = 0.0;
-                    tile.lightG = 0.0;
-                    tile.lightB = 0.0;
-                }
-            }
-            // light up light sources
-            for (int y = 0; y < tilesHigh; y++)
-            {
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                {
-                    serverText.Text = ((int)((float)y * 100.0 / (float)tilesHigh)) + "% - Lighting tiles";
-                }));
-                for (int x = 0; x < tilesWide; x++)
-                {
-                    Tile tile = tiles[x, y];
-                    TileInfo inf = tileInfos[tile.type, tile.u, tile.v];
-                    if ((!tile.isActive || inf.transparent) &&
-                        (tile.wall == 0 || tile.wall == 21) && tile.liquid < 255 && y < groundLevel) //sunlight
-                    {
-                        tile.light = 1.0;
-                        tile.lightR = 1.0;
-                        tile.lightG = 1.0;
-                        tile.lightB = 1.0;
-                    }
-                    if (tile.liquid > 0 && tile.isLava) //lava
-                    {
-                        tile.light = Math.Max(tile.light, (tile.liquid / 255) * 0.38 + 0.1275);
-                        // colored lava light's brightness is not affected by its level
-                        tile.lightR = Math.Max(tile.lightR, 0.66);
-                        tile.lightG = Math.Max(tile.lightG, 0.39);
-                        tile.lightB = Math.Max(tile.lightB, 0.13);
-                    }
-                    tile.light = Math.Max(tile.light, inf.light);
-                    tile.lightR = Math.Max(tile.lightR, inf.lightR);
-                    tile.lightG = Math.Max(tile.lightG, inf.lightG);
-                    tile.lightB = Math.Max(tile.lightB, inf.lightB);
-                }
-            }
-            // spread light
-            for (int y = 0; y < tilesHigh; y++)
-            {
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                {
-                    serverText.Text = ((int)((float)y * 50.0 / (float)tilesHigh)) + "% - Spreading light";
-                }));
-                for (int x = 0; x < tilesWide; x++)
-                {
-                    double delta = 0.04;
-                    Tile tile = tiles[x, y];
-                    TileInfo inf = tileInfos[tile.type, tile.u, tile.v];
-                    if (tile.isActive && !inf.transparent) delta = 0.16;
-                    if (y > 0)
-                    {
-                        if (tiles[x, y - 1].light - delta > tile.light)
-                            tile.light = tiles[x, y - 1].light - delta;
-                        if (tiles[x, y - 1].lightR - delta > tile.lightR)
-                            tile.lightR = tiles[x, y - 1].lightR - delta;
-                        if (tiles[x, y - 1].lightG - delta > tile.lightG)
-                            tile.lightG = tiles[x, y - 1].lightG - delta;
-                        if (tiles[x, y - 1].lightB - delta > tile.lightB)
-                            tile.lightB = tiles[x, y - 1].lightB - delta;
-                    }
-                    if (x > 0)
-                    {
-                        if (tiles[x - 1, y].light - delta > tile.light)
-                            tile.light = tiles[x - 1, y].light - delta;
-                        if (tiles[x - 1, y].lightR - delta > tile.lightR)
-                            tile.lightR = tiles[x - 1, y].lightR - delta;
-                        if (tiles[x - 1, y].lightG - delta > tile.lightG)
-                            tile.lightG = tiles[x - 1, y].lightG - delta;
-                        if (tiles[x - 1, y].lightB - delta > tile.lightB)
-                            tile.lightB = tiles[x - 1, y].lightB - delta;
-                    }
-                }
-            }
-            // spread light backwards
-            for (int y = tilesHigh - 1; y >= 0; y--)
-            {
-                Dispatcher.Invoke(DispatcherPriority.Normal, new Action(delegate()
-                {
-                    serverText.Text = ((int)((float)(tilesHigh - y) * 50.0 / (float)tilesHigh) + 50) + "% - Spreading light";
-                }));
-                for (int x = tilesWide - 1; x >= 0; x--)
-                {
-                    double delta = 0.04;
-                    Tile tile = tiles[x, y];
-                    TileInfo inf = tileInfos[tile.type, tile.u, tile.v];
-                    if (tile.isActive && !inf.transparent) delta = 0.16;
-                    if (y < tilesHigh - 1)
-                    {
-                        if (tiles[x, y + 1].light - delta > tile.light)
-                            tile.light = tiles[x, y + 1].light - delta;
-                        if (tiles[x, y + 1].lightR - delta > tile.lightR)
-                            tile.lightR = tiles[x, y + 1].lightR - delta;
-                        if (tiles[x, y + 1].lightG - delta > tile.lightG)
-                            tile.lightG = tiles[x, y + 1].lightG - delta;
-                        if (tiles[x, y + 1].lightB - delta > tile.lightB)
-                            tile.lightB = tiles[x, y + 1].lightB - delta;
-                    }
-                    if (x < tilesWide - 1)
-                    {
-                        if (tiles[x + 1, y].light - delta > tile.light)
-                            tile.light = tiles[x + 1, y].light - delta;
-                        if (tiles[x + 1, y].lightR - delta > tile.lightR)
-                            tile.lightR = tiles[x + 1, y].lightR - delta;
-                        if (tiles[x + 1, y].lightG - delta > tile.lightG)
-                            tile.lightG = tiles[x + 1, y].lightG - delta;
-                        if (tiles[x + 1, y].lightB - delta > tile.lightB)
-                            tile.lightB = tiles[x + 1, y].lightB - delta;
-                    }
-                }
-            }
-        }
-
         private void checkVersion()
         {
             Version newVersion = null;
@@ -3393,10 +1578,10 @@ namespace Terrafirma
             {
                 if (disposing)
                 {
-                    if (socket != null)
-                        socket.Dispose();
+                    if (session != null)
+                        session.Dispose();
                 }
-                socket = null;
+                session = null;
                 _disposed = true;
             }
         }
@@ -65,11 +65,19 @@ namespace Terrafirma
             "Show NPC Houses", "Houses", typeof(MapCommands));
         public static readonly RoutedUICommand Wires = new RoutedUICommand(
             "Show Wires", "Wires", typeof(MapCommands));
+        public static readonly RoutedUICommand ResolveFrames = new RoutedUICommand(
+            "Resolve Tiles on Load", "ResolveFrames", typeof(MapCommands));
         public static readonly RoutedUICommand ConnectToServer = new RoutedUICommand(
             "Connect to Server...", "ConnectToServer", typeof(MapCommands),
             new InputGestureCollection(new InputGesture[] { new KeyGesture(Key.K, ModifierKeys.Control) }));
         public static readonly RoutedUICommand Disconnect = new RoutedUICommand(
             "Disconnect from Server", "Disconnect", typeof(MapCommands));
+        public static readonly RoutedUICommand FollowLive = new RoutedUICommand(
+            "Follow Live Changes", "FollowLive", typeof(MapCommands));
+        public static readonly RoutedUICommand CaptureSession = new RoutedUICommand(
+            "Capture Next Connection...", "CaptureSession", typeof(MapCommands));
+        public static readonly RoutedUICommand ReplayCapture = new RoutedUICommand(
+            "Replay Capture...", "ReplayCapture", typeof(MapCommands));
         public static readonly RoutedUICommand ShowStats = new RoutedUICommand(
             "World Information...", "ShowStats", typeof(MapCommands));
         public static readonly RoutedUICommand JumpToDungeon = new RoutedUICommand(
@@ -0,0 +1,214 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Keeps maps of several servers up to date at once.  Each server gets a
+    /// MapSession and a world of its own, grown to just the size it needs.
+    /// The sessions' sockets complete on the thread pool, so no threads are
+    /// added per server.  tiles.xml and the textures are shared, and any map
+    /// can be rendered whenever it's wanted.
+    /// </summary>
+    class MapDashboard : IDisposable
+    {
+        public int FetchWindow = SectionScheduler.DefaultWindow;
+        //the most tiles any one server's world may have
+        public long MaxTilesPerSession = (long)World.Widest * World.Highest;
+        //how long to wait before connecting again to a server we lost
+        public TimeSpan RetryDelay = TimeSpan.FromSeconds(30);
+        public bool UseTextures = false;
+        public int Compression = PngWriter.DefaultLevel;
+        public long MemoryBudget = 0;
+        public Action<MapSession, string> Log;
+
+        WorldInfo info;
+        Render render;
+        List<MapSession> sessions = new List<MapSession>();
+        //pending reconnects, held so they aren't collected
+        Dictionary<MapSession, Timer> retries = new Dictionary<MapSession, Timer>();
+        bool disposed;
+
+        public MapDashboard(WorldInfo info, Textures textures)
+        {
+            this.info = info;
+            render = new Render(info.tileInfos, info.wallInfo, info.skyColor, info.earthColor, info.rockColor,
+                info.hellColor, info.waterColor, info.lavaColor, info.honeyColor);
+            render.Textures = textures;
+        }
+
+        /// <summary>
+        /// The sessions, in the order they were added
+        /// </summary>
+        public List<MapSession> Sessions
+        {
+            get
+            {
+                lock (sessions)
+                    return new List<MapSession>(sessions);
+            }
+        }
+
+        /// <summary>
+        /// Starts mapping host:port, and keeps following its changes
+        /// </summary>
+        public MapSession Add(string host, int port, string password)
+        {
+            MapSession session = new MapSession(new World(info, 0, 0), info);
+            session.FetchWindow = FetchWindow;
+            session.MaxTiles = MaxTilesPerSession;
+            session.FollowLive = true;
+            session.Password = password;
+            session.Connected = delegate(Exception error)
+            {
+                if (error == null)
+                    log(session, "Connected");
+                else
+                {
+                    log(session, String.Format("Couldn't connect: {0}", error.Message));
+                    retry(session);
+                }
+            };
+            session.WorldReceived = delegate()
+            {
+                log(session, String.Format("Mapping {0}, {1}x{2}", session.World.name,
+                    session.World.tilesWide, session.World.tilesHigh));
+            };
+            session.Complete = delegate()
+            {
+                log(session, "Map complete, following changes");
+            };
+            session.Failed = delegate(string why)
+            {
+                log(session, why);
+            };
+            session.Lost = delegate(Exception error)
+            {
+                log(session, error != null ? String.Format("Connection lost: {0}", error.Message) : "Connection lost");
+                retry(session);
+            };
+            lock (sessions)
+            {
+                if (disposed)
+                    throw new ObjectDisposedException("MapDashboard");
+                sessions.Add(session);
+            }
+            session.Connect(host, port);
+            return session;
+        }
+
+        /// <summary>
+        /// Stops mapping a server and lets its world go
+        /// </summary>
+        public void Remove(MapSession session)
+        {
+            lock (sessions)
+            {
+                sessions.Remove(session);
+                cancelRetry(session);
+            }
+            session.Close();
+        }
+
+        /// <summary>
+        /// Writes a png of a session's map as it is now, zoom pixels per tile
+        /// </summary>
+        public void Export(MapSession session, Stream output, double zoom, int light)
+        {
+            session.Export(output, render, zoom, light, UseTextures, Compression, MemoryBudget);
+        }
+
+        private void retry(MapSession session)
+        {
+            if (RetryDelay <= TimeSpan.Zero)
+                return;
+            lock (sessions)
+            {
+                if (disposed || !sessions.Contains(session) || retries.ContainsKey(session))
+                    return;
+                retries[session] = new Timer(delegate(object state)
+                {
+                    lock (sessions)
+                    {
+                        if (!sessions.Contains(session))
+                            return;
+                        cancelRetry(session);
+                    }
+                    log(session, "Reconnecting");
+                    try
+                    {
+                        session.Connect(session.Host, session.Port);
+                    }
+                    catch (Exception e)
+                    {
+                        log(session, e.Message);
+                    }
+                }, null, RetryDelay, TimeSpan.FromMilliseconds(-1));
+            }
+        }
+
+        //call with sessions locked
+        private void cancelRetry(MapSession session)
+        {
+            Timer timer;
+            if (retries.TryGetValue(session, out timer))
+            {
+                timer.Dispose();
+                retries.Remove(session);
+            }
+        }
+
+        private void log(MapSession session, string text)
+        {
+            if (Log != null)
+                Log(session, text);
+        }
+
+        public void Dispose()
+        {
+            List<MapSession> closing;
+            lock (sessions)
+            {
+                disposed = true;
+                foreach (Timer timer in retries.Values)
+                    timer.Dispose();
+                retries.Clear();
+                closing = new List<MapSession>(sessions);
+                sessions.Clear();
+            }
+            foreach (MapSession session in closing)
+                session.Close();
+        }
+    }
+}
@@ -0,0 +1,191 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Renders an image a band of rows at a time and streams it into a png,
+    /// so memory use stays the same however big the image is.  The next band
+    /// renders while the last one is being compressed.
+    /// </summary>
+    class MapExporter
+    {
+        //tiles drawn above and below each textured band, clipped to it, so
+        //trees, npcs and banners that cross a band edge aren't cut off
+        const int Overscan = 6;
+        //one band rendering, one waiting, one being compressed
+        const int BuffersInFlight = 3;
+        //the largest byte array .NET will make
+        const long MaxBandBytes = 0x7FFFFFC7;
+
+        public long MemoryBudget = 256L * 1024 * 1024;
+        public int Light = 0;
+        public bool UseTextures = false;
+        public bool Houses = false;
+        public bool Wires = false;
+        public bool FogOfWar = false;
+        //png compression level, 0 to 9
+        public int Compression = PngWriter.DefaultLevel;
+        //write a palette and a byte per pixel instead of truecolor.  only
+        //for flat, unlit maps, which use few enough colors.
+        public bool Indexed = false;
+        //the palette of the last indexed export
+        public MapPalette Palette { get; private set; }
+
+        Render render;
+
+        struct Band
+        {
+            public byte[] pixels;
+            public int rows;
+        }
+
+        public MapExporter(Render render)
+        {
+            this.render = render;
+        }
+
+        /// <summary>
+        /// Writes a width x height png of the map, with startx,starty the tile at
+        /// the top left and scale pixels per tile.  progress gets a percentage.
+        /// </summary>
+        public void Export(Stream output, Tile[,] tiles, int width, int height,
+            double startx, double starty, double scale, Action<int> progress)
+        {
+            if (UseTextures && scale != Math.Floor(scale))
+                throw new Exception("Textured exports need a whole number zoom");
+            if (Indexed && (UseTextures || Light != 0))
+                throw new Exception("Indexed exports can't use textures or lighting");
+
+            //bands start on tile boundaries when we can, so every band sees the
+            //same tiles a single render would
+            int step = scale == Math.Floor(scale) ? (int)scale : 1;
+            int margin = UseTextures ? Overscan * step : 0;
+            long rowBytes = (long)width * (Indexed ? 1 : 4);
+            //textured bands also build a list of sprites, which the renderer
+            //runs early once it reaches MaxCommands
+            long budget = MemoryBudget;
+            if (UseTextures)
+                budget -= Render.MaxCommands * Render.CommandBytes;
+            //with a tight budget, give up overlapping the rendering and
+            //compressing before giving up on it
+            int buffers = BuffersInFlight;
+            while (buffers > 1 && budget / (rowBytes * buffers) < step)
+                buffers--;
+            long budgetRows = Math.Min(budget / (rowBytes * buffers), MaxBandBytes / rowBytes) / step * step;
+            if (budgetRows < step)
+                throw new Exception(String.Format("A memory budget of {0} bytes can't hold {1} rows of a {2} pixel wide image",
+                    MemoryBudget, step, width));
+            int bandRows = (int)Math.Min(height, budgetRows);
+
+            BlockingCollection<Band> ready = new BlockingCollection<Band>(1);
+            BlockingCollection<byte[]> free = new BlockingCollection<byte[]>();
+            int allocated = 0;
+            Exception writeError = null;
+
+            Palette = null;
+            if (Indexed)
+                Palette = new MapPalette(render.CountColors(width, height, startx, starty, scale, FogOfWar, tiles));
+
+            using (PngWriter png = new PngWriter(output, width, height,
+                Palette != null ? Palette.Colors : null, Compression))
+            {
+                ThreadStart writeThread = delegate()
+                {
+                    int written = 0;
+                    foreach (Band band in ready.GetConsumingEnumerable())
+                    {
+                        if (writeError == null)
+                        {
+                            try
+                            {
+                                png.WriteRows(band.pixels, 0, band.rows);
+                            }
+                            catch (Exception e)
+                            {
+                                writeError = e;
+                            }
+                        }
+                        free.Add(band.pixels);
+                        written += band.rows;
+                        if (progress != null)
+                            progress((int)((long)written * 100 / height));
+                    }
+                };
+                Thread writer = new Thread(writeThread);
+                writer.Start();
+                try
+                {
+                    for (int top = 0; top < height && writeError == null; top += bandRows)
+                    {
+                        int rows = Math.Min(bandRows, height - top);
+                        byte[] pixels;
+                        if (!free.TryTake(out pixels))
+                        {
+                            if (allocated < buffers)
+                            {
+                                pixels = new byte[rowBytes * bandRows];
+                                allocated++;
+                            }
+                            else
+                                pixels = free.Take();
+                        }
+                        if (UseTextures) //textures don't cover anything off the map
+                            Array.Clear(pixels, 0, (int)(rowBytes * rows));
+                        if (Indexed)
+                            render.DrawIndexed(width, rows, startx, starty + top / scale,
+                                scale, pixels, Palette, FogOfWar, tiles);
+                        else
+                            render.DrawBand(width, rows, margin, startx, starty + top / scale,
+                                scale, pixels, Light, UseTextures, Houses, Wires, FogOfWar, tiles);
+
+                        Band band;
+                        band.pixels = pixels;
+                        band.rows = rows;
+                        ready.Add(band);
+                    }
+                }
+                finally
+                {
+                    ready.CompleteAdding();
+                    writer.Join();
+                }
+                if (writeError != null)
+                    throw new Exception("Couldn't write the image: " + writeError.Message, writeError);
+                png.Close();
+            }
+        }
+    }
+}
@@ -0,0 +1,103 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// The colors of an indexed export, at most 256 of them.  A world uses far
+    /// fewer flat colors than tiles.xml has, so the palette is built from the
+    /// colors the map actually draws.
+    /// </summary>
+    class MapPalette
+    {
+        public const int MaxColors = 256;
+
+        //0xRRGGBB for each index
+        public UInt32[] Colors { get; private set; }
+
+        Dictionary<UInt32, byte> indices;
+
+        /// <summary>
+        /// Builds a palette from how many times each color is drawn.  If there
+        /// are too many, the rarest ones are drawn with the closest color kept.
+        /// </summary>
+        public MapPalette(Dictionary<UInt32, long> counts)
+        {
+            UInt32[] byUse = counts.OrderByDescending(c => c.Value).ThenBy(c => c.Key)
+                .Select(c => c.Key).ToArray();
+            Colors = byUse.Take(MaxColors).ToArray();
+            if (Colors.Length == 0)
+                Colors = new UInt32[] { 0xffffff };
+            indices = new Dictionary<UInt32, byte>();
+            for (int i = 0; i < Colors.Length; i++)
+                indices[Colors[i]] = (byte)i;
+            for (int i = Colors.Length; i < byUse.Length; i++)
+                indices[byUse[i]] = closest(byUse[i]);
+        }
+
+        public int Count
+        {
+            get { return Colors.Length; }
+        }
+
+        /// <summary>
+        /// The index to draw color with.  Safe to call from many threads.
+        /// </summary>
+        public byte IndexOf(UInt32 color)
+        {
+            byte index;
+            if (indices.TryGetValue(color, out index))
+                return index;
+            return closest(color);
+        }
+
+        private byte closest(UInt32 color)
+        {
+            int r = (int)(color >> 16) & 0xff, g = (int)(color >> 8) & 0xff, b = (int)color & 0xff;
+            int best = 0, bestDist = int.MaxValue;
+            for (int i = 0; i < Colors.Length; i++)
+            {
+                int dr = r - (int)((Colors[i] >> 16) & 0xff);
+                int dg = g - (int)((Colors[i] >> 8) & 0xff);
+                int db = b - (int)(Colors[i] & 0xff);
+                int dist = dr * dr + dg * dg + db * db;
+                if (dist < bestDist)
+                {
+                    bestDist = dist;
+                    best = i;
+                }
+            }
+            return (byte)best;
+        }
+    }
+}
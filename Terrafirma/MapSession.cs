@@ -0,0 +1,1126 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// A connection to one terraria server and the world it's mapping.  It
+    /// has no UI dependencies, so the viewer drives one session and a
+    /// dashboard can drive many, each with its own world.  Messages are
+    /// handled on the socket's thread, and the callbacks are called from
+    /// there too, so they must not wait on anything.
+    /// </summary>
+    class MapSession : ILoadProgress, IDisposable
+    {
+        //the big world size, mapping it takes a long time
+        const int LargeWorldWide = 8400;
+
+        public int FetchWindow = SectionScheduler.DefaultWindow;
+        //how long a section request may go unanswered before it's sent again
+        public TimeSpan RequestTimeout = SectionScheduler.DefaultTimeout;
+        //stay connected once the map is complete, applying changes as they happen
+        public volatile bool FollowLive = false;
+        public bool UseCache = true;
+        //sent when the server asks for one, otherwise PasswordNeeded is called
+        public string Password;
+        //where to record the next connection
+        public string CapturePath;
+        //the most tiles the world may have, so memory stays bounded
+        public long MaxTiles = (long)World.Widest * World.Highest;
+
+        /// <summary>
+        /// Called once connected, with null, or with why it couldn't
+        /// </summary>
+        public Action<Exception> Connected { get; set; }
+        public Action<string> Status { get; set; }
+        /// <summary>
+        /// Called with why the session gave up.  It's closed by then.
+        /// </summary>
+        public Action<string> Failed { get; set; }
+        /// <summary>
+        /// Called when the world info arrives and the world is blanked for mapping
+        /// </summary>
+        public Action WorldReceived { get; set; }
+        public Action<NPC> NpcChanged { get; set; }
+        /// <summary>
+        /// Called when the server wants a password and none was set.  Answer
+        /// with SendPassword, or Close.
+        /// </summary>
+        public Action PasswordNeeded { get; set; }
+        /// <summary>
+        /// Called once we've spawned and the map can be shown
+        /// </summary>
+        public Action Spawned { get; set; }
+        /// <summary>
+        /// Called instead of fetching a large world.  Answer with Fetch, or Close.
+        /// </summary>
+        public Action LargeWorld { get; set; }
+        /// <summary>
+        /// Called with tiles x0,y0 to x1,y1 once the server changes them after
+        /// the map is complete
+        /// </summary>
+        public Action<int, int, int, int> TilesChanged { get; set; }
+        public Action Complete { get; set; }
+        /// <summary>
+        /// Called when the server ends the connection, or it fails.  Not
+        /// called when we close it.  error is null if the server hung up.
+        /// </summary>
+        public Action<Exception> Lost { get; set; }
+
+        World world;
+        TileInfos tileInfos;
+        TileRowCodec rows;
+        ServerConnection server;
+        SectionScheduler sections;
+        //sections from earlier connections to the same world
+        SectionCache sectionCache;
+        SessionCapture capture;
+        //held while a message is handled or the map is exported
+        object worldLock = new object();
+        int loginLevel;
+        bool replaying;
+        bool complete;
+        byte playerSlot;
+        string status;
+        int statusTotal, statusCount;
+        int changes;
+        //asks again for requests that timed out while nothing arrives
+        Timer retryTimer;
+
+        static readonly string Greeting = "Terraria" + World.MapVersion;
+
+        //lighting an export reports every row, nobody wants to hear it
+        class Quiet : ILoadProgress
+        {
+            public void Status(string text)
+            {
+            }
+        }
+
+        public MapSession(World world, WorldInfo info)
+        {
+            this.world = world;
+            tileInfos = info.tileInfos;
+            rows = new TileRowCodec(tileInfos);
+        }
+
+        public World World
+        {
+            get { return world; }
+        }
+
+        public string Host { get; private set; }
+        public int Port { get; private set; }
+
+        public bool IsConnected
+        {
+            get { return server != null && server.IsConnected; }
+        }
+
+        /// <summary>
+        /// Spawned, and fetching sections or following changes
+        /// </summary>
+        public bool Mapping
+        {
+            get { return loginLevel == 5; }
+        }
+
+        public bool MapComplete
+        {
+            get { return loginLevel == 5 && sections.Complete; }
+        }
+
+        /// <summary>
+        /// Goes up whenever tiles change, to tell whether an export is stale
+        /// </summary>
+        public int Changes
+        {
+            get { return changes; }
+        }
+
+        /// <summary>
+        /// How far the server is through what it's sending, or null if it
+        /// isn't sending anything big
+        /// </summary>
+        public string Progress()
+        {
+            int total = statusTotal;
+            if (total <= 0)
+                return null;
+            return ((int)((float)statusCount * 100.0 / (float)total)) + "% - " + status;
+        }
+
+        /// <summary>
+        /// Connects and maps the world, hanging up on any earlier connection.
+        /// A session can connect again once it's lost, into the same world.
+        /// </summary>
+        public void Connect(string host, int port)
+        {
+            Close();
+            Host = host;
+            Port = port;
+            if (CapturePath != null)
+            {
+                capture = new SessionCapture(CapturePath);
+                CapturePath = null;
+            }
+            server = newConnection();
+            server.Connected = connected;
+            server.Capture = delegate(byte[] data, int offset, int count)
+            {
+                SessionCapture c = capture;
+                if (c != null)
+                    c.Write(data, offset, count);
+            };
+            server.Connect(host, port);
+        }
+
+        /// <summary>
+        /// Feeds a capture through the session as if its server was sending it.
+        /// Nothing is sent, the cache isn't used, and nobody is asked anything.
+        /// Returns how many bytes were replayed.
+        /// </summary>
+        public long Replay(string path, bool originalPace)
+        {
+            //never connected, so whatever we'd send goes nowhere
+            ServerConnection replay = newConnection();
+            server = replay;
+            replaying = true;
+            loginLevel = 1;
+            long bytes = 0;
+            try
+            {
+                SessionCapture.Replay(path, originalPace, delegate(byte[] data, int offset, int count)
+                {
+                    bytes += count;
+                    replay.Feed(data, offset, count);
+                });
+            }
+            finally
+            {
+                Close();
+                replaying = false;
+            }
+            return bytes;
+        }
+
+        private ServerConnection newConnection()
+        {
+            ServerConnection conn = new ServerConnection();
+            conn.Received = handleMessage;
+            conn.Closed = closed;
+            return conn;
+        }
+
+        private void connected(Exception error)
+        {
+            if (error != null)
+                stopCapture();
+            else
+            {
+                //we connected, huzzah!
+                loginLevel = 1;
+                send(1); //greetings server!
+            }
+            if (Connected != null)
+                Connected(error);
+        }
+
+        /// <summary>
+        /// Hangs up on the server ourselves
+        /// </summary>
+        public void Close()
+        {
+            loginLevel = 0;
+            ServerConnection conn = server;
+            if (conn != null)
+                conn.Close();
+        }
+
+        public void Dispose()
+        {
+            Close();
+        }
+
+        private void closed(Exception error)
+        {
+            stopRetries();
+            stopCapture();
+            //Close can come from any thread, and the socket thread may be
+            //writing tiles or storing sections
+            lock (worldLock)
+                closeCache();
+            //we didn't hang up, the server did
+            if (loginLevel != 0)
+            {
+                loginLevel = 0;
+                if (Lost != null)
+                    Lost(error);
+            }
+        }
+
+        private void fail(string why)
+        {
+            Close();
+            if (Failed != null)
+                Failed(why);
+        }
+
+        private void stopCapture()
+        {
+            SessionCapture c = capture;
+            capture = null;
+            if (c != null)
+                c.Dispose();
+        }
+
+        /// <summary>
+        /// Stores what changed since the sections were cached and closes the cache.
+        /// Call with worldLock held.
+        /// </summary>
+        private void closeCache()
+        {
+            SectionCache cache = sectionCache;
+            sectionCache = null;
+            if (cache != null)
+            {
+                try
+                {
+                    cache.Flush();
+                }
+                finally
+                {
+                    cache.Dispose();
+                }
+            }
+        }
+
+        public void SendPassword(string password)
+        {
+            send(0x26, password);
+        }
+
+        /// <summary>
+        /// Fetches a large world after all
+        /// </summary>
+        public void Fetch()
+        {
+            lock (worldLock)
+            {
+                if (loginLevel == 5)
+                    fetchSections();
+            }
+        }
+
+        /// <summary>
+        /// Fetches what's around x,y first
+        /// </summary>
+        public void Recenter(double x, double y)
+        {
+            if (loginLevel == 5)
+                sections.Recenter(x, y);
+        }
+
+        /// <summary>
+        /// Runs change with messages held off, for changing the world from
+        /// another thread.  change mustn't wait on the ui.
+        /// </summary>
+        public void LockWorld(Action change)
+        {
+            lock (worldLock)
+                change();
+        }
+
+        void ILoadProgress.Status(string text)
+        {
+            showStatus(text);
+        }
+
+        private void showStatus(string text)
+        {
+            if (Status != null)
+                Status(text);
+        }
+
+        /// <summary>
+        /// Writes a png of the whole map as it is now, zoom pixels per tile.
+        /// Messages wait while it's drawn, so the image is of one moment.
+        /// render is copied, so sessions can share one.
+        /// </summary>
+        public void Export(Stream output, Render render, double zoom, int light, bool useTextures, int compression,
+            long memoryBudget)
+        {
+            lock (worldLock)
+            {
+                if (sections == null || world.tilesWide == 0)
+                    throw new Exception("Nothing has been mapped yet");
+                Render r = new Render(render);
+                r.SetWorld(world.tilesWide, world.tilesHigh, world.groundLevel, world.rockLevel, world.styles,
+                    world.treeX, world.treeStyle, world.caveBackX, world.caveBackStyle, world.jungleBackStyle,
+                    world.hellBackStyle, world.npcs, world.worldID);
+                if (light != 0)
+                    world.CalculateLight(new Quiet());
+                MapExporter exporter = new MapExporter(r);
+                exporter.Light = light;
+                exporter.UseTextures = useTextures;
+                exporter.Compression = compression;
+                if (memoryBudget > 0)
+                    exporter.MemoryBudget = memoryBudget;
+                exporter.Export(output, world.tiles, (int)(world.tilesWide * zoom), (int)(world.tilesHigh * zoom),
+                    0.0, 0.0, zoom, null);
+            }
+        }
+
+        private void handleMessage(byte[] messages, int start, int len)
+        {
+            lock (worldLock)
+                handle(messages, start, len);
+        }
+
+        private void handle(byte[] messages, int start, int len)
+        {
+            if (statusTotal > 0)
+            {
+                statusCount++;
+                if (statusCount == statusTotal)
+                    statusTotal = 0;
+            }
+            int messageid = messages[start++];
+            len--;
+            int payload = start;
+            switch (messageid)
+            {
+                case 0x01: // connect request - c2s only
+                    break;
+                case 0x02: //error
+                    fail(Encoding.ASCII.GetString(messages, payload, len));
+                    break;
+                case 0x03: //connection approved
+                    {
+                        if (loginLevel == 1) loginLevel = 2;
+                        playerSlot = messages[payload];
+                        send(4);
+                        send(0x10);
+                        send(0x2a);
+                        //send buffs
+                        //send inventory
+                        //send dyes
+                        send(6);
+                        if (loginLevel == 2) loginLevel = 3;
+                    }
+                    break;
+                case 0x04: //player appearance
+                    //ignore other players
+                    break;
+                case 0x05: //inventory items
+                    //ignore player inventory
+                    break;
+                case 0x06: //request world info - c2s only
+                    break;
+                case 0x07: //world info
+                    {
+                        world.gameTime = BitConverter.ToInt32(messages, payload); payload += 4;
+                        world.dayNight = messages[payload++] == 1;
+                        world.moonPhase = messages[payload++];
+                        world.bloodMoon = messages[payload++] == 1;
+                        payload++; //eclipse
+                        int wide = BitConverter.ToInt32(messages, payload); payload += 4;
+                        int high = BitConverter.ToInt32(messages, payload); payload += 4;
+                        if ((long)wide * high > MaxTiles)
+                        {
+                            fail(String.Format("The world is {0}x{1}, bigger than a session may map", wide, high));
+                            break;
+                        }
+                        world.tilesWide = wide;
+                        world.tilesHigh = high;
+                        world.spawnX = BitConverter.ToInt32(messages, payload); payload += 4;
+                        world.spawnY = BitConverter.ToInt32(messages, payload); payload += 4;
+                        world.groundLevel = BitConverter.ToInt32(messages, payload); payload += 4;
+                        world.rockLevel = BitConverter.ToInt32(messages, payload); payload += 4;
+                        world.worldID = BitConverter.ToInt32(messages, payload); payload += 4;
+                        payload++; //moon type
+                        for (int i = 0; i < 3; i++)
+                        {
+                            world.treeX[i] = BitConverter.ToInt32(messages, payload); payload += 4;
+                        }
+                        for (int i = 0; i < 4; i++)
+                            world.treeStyle[i] = messages[payload++];
+                        for (int i = 0; i < 3; i++)
+                        {
+                            world.caveBackX[i] = BitConverter.ToInt32(messages, payload); payload += 4;
+                        }
+                        for (int i = 0; i < 4; i++)
+                            world.caveBackStyle[i] = messages[payload++];
+                        for (int i = 0; i < 8; i++)
+                            world.styles[i] = messages[payload++];
+                        world.iceBackStyle = messages[payload++];
+                        world.jungleBackStyle = messages[payload++];
+                        world.hellBackStyle = messages[payload++];
+                        payload += 4; //wind speed
+                        payload++; //number of clouds
+                        byte flags = messages[payload++];
+                        byte flags2 = messages[payload++];
+                        payload += 4; //max rain
+                        world.name = Encoding.ASCII.GetString(messages, payload, start + len - payload);
+                        world.smashedOrb = (flags & 1) == 1;
+                        world.killedBoss1 = (flags & 2) == 2;
+                        world.killedBoss2 = (flags & 4) == 4;
+                        world.killedBoss3 = (flags & 8) == 8;
+                        world.hardMode = (flags & 16) == 16;
+                        world.killedClown = (flags & 32) == 32;
+                        world.killedPlantBoss = (flags & 128) == 128;
+                        world.killedMechBoss1 = (flags2 & 1) == 1;
+                        world.killedMechBoss2 = (flags2 & 2) == 2;
+                        world.killedMechBoss3 = (flags2 & 4) == 4;
+                        world.killedMechBossAny = (flags2 & 8) == 8;
+                        world.crimson = (flags2 & 32) == 32;
+                        world.meteorSpawned = false;
+                        world.killedFrost = false;
+                        world.killedGoblins = false;
+                        world.killedPirates = false;
+                        world.killedQueenBee = false;
+                        world.savedMechanic = false;
+                        world.savedTinkerer = false;
+                        world.savedWizard = false;
+                        world.goblinsDelay = 0;
+                        world.altarsSmashed = 0;
+                        world.ResizeMap(this);
+                        if (loginLevel == 3)
+                        {
+                            sections = new SectionScheduler(world.tilesWide / SectionScheduler.SectionWidth,
+                                world.tilesHigh / SectionScheduler.SectionHeight, FetchWindow);
+                            sections.Timeout = RequestTimeout;
+                            complete = false;
+                            loginLevel = 4;
+                            for (int y = 0; y < world.tilesHigh; y++) //set all tiles to blank
+                                for (int x = 0; x < world.tilesWide; x++)
+                                {
+                                    world.tiles[x, y].isActive = false;
+                                    world.tiles[x, y].wall = 0;
+                                    world.tiles[x, y].liquid = 0;
+                                    world.tiles[x, y].hasRedWire = false;
+                                    world.tiles[x, y].hasGreenWire = false;
+                                    world.tiles[x, y].hasBlueWire = false;
+                                    world.tiles[x, y].half = false;
+                                    world.tiles[x, y].actuator = false;
+                                    world.tiles[x, y].inactive = false;
+                                    world.tiles[x, y].color = 0;
+                                    world.tiles[x, y].wallColor = 0;
+                                }
+                            //only what the cache doesn't have gets fetched
+                            closeCache();
+                            if (UseCache && !replaying)
+                            {
+                                try
+                                {
+                                    sectionCache = new SectionCache(world, rows);
+                                    int cached = sectionCache.Load(sections);
+                                    if (cached > 0)
+                                        showStatus(String.Format("{0} sections from the cache", cached));
+                                }
+                                catch (Exception)
+                                {
+                                    //fetch everything
+                                    closeCache();
+                                }
+                            }
+                            send(8); //request initial tile data
+                        }
+                        world.chests.Clear();
+                        world.signs.Clear();
+                        world.npcs.Clear();
+                        if (WorldReceived != null)
+                            WorldReceived();
+                    }
+                    break;
+                case 0x08: //request initial tile data - c2s only
+                    break;
+                case 0x09: //status text
+                    {
+                        statusTotal = BitConverter.ToInt32(messages, payload); payload += 4;
+                        statusCount = 0;
+                        status = Encoding.ASCII.GetString(messages, payload, start + len - payload);
+                        showStatus(status);
+                    }
+                    break;
+                case 0x0a: //tile row data
+                    {
+                        int startx, y, width;
+                        rows.DecodeRow(messages, payload, world, out startx, out y, out width);
+                        //rows sent once the map is complete are live changes
+                        if (loginLevel == 5 && sections.Complete)
+                            tilesChanged(startx, y, startx + width - 1, y);
+                    }
+                    break;
+                case 0x0b: //recalculate u/v
+                    {
+                        int startx = BitConverter.ToInt16(messages, payload); payload += 4;
+                        int starty = BitConverter.ToInt16(messages, payload); payload += 4;
+                        int endx = BitConverter.ToInt16(messages, payload); payload += 2;
+                        int endy = BitConverter.ToInt16(messages, payload);
+
+                        sections.Received(startx, starty, endx, endy);
+
+                        resetFrames(startx * 200, starty * 150, (endx + 1) * 200 - 1, (endy + 1) * 150 - 1);
+                        SectionCache cache = sectionCache;
+                        if (cache != null)
+                            cache.Store(startx, starty, endx, endy);
+                        changes++;
+                        if (loginLevel == 5)
+                            fetchSections();
+                    }
+                    break;
+                case 0x0c: //player spawned
+                    break;
+                case 0x0d: //player control
+                    break;
+                case 0x0e: //set active players
+                    break;
+                case 0x10: //player life
+                    break;
+                case 0x11: //modify tile
+                    {
+                        byte action = messages[payload++];
+                        int x = BitConverter.ToInt32(messages, payload); payload += 4;
+                        int y = BitConverter.ToInt32(messages, payload); payload += 4;
+                        byte type = messages[payload++];
+                        byte style = messages[payload++];
+                        if (!onMap(x, y))
+                            break;
+                        Tile tile = world.tiles[x, y];
+                        switch (action)
+                        {
+                            case 0: //kill tile, type is 1 if it only got hit
+                            case 4: //kill tile without dropping it
+                                if (type == 0)
+                                {
+                                    tile.isActive = false;
+                                    tile.half = false;
+                                    tile.slope = 0;
+                                    tile.color = 0;
+                                }
+                                break;
+                            case 1: //place tile, multi-tile frames come after in a 0x14
+                                tile.isActive = true;
+                                tile.type = type;
+                                tile.half = false;
+                                tile.slope = 0;
+                                tile.u = -1;
+                                tile.v = -1;
+                                break;
+                            case 2: //kill wall, type is 1 if it only got hit
+                                if (type == 0)
+                                {
+                                    tile.wall = 0;
+                                    tile.wallColor = 0;
+                                }
+                                break;
+                            case 3: //place wall
+                                tile.wall = type;
+                                break;
+                            case 5: tile.hasRedWire = true; break;
+                            case 6: tile.hasRedWire = false; break;
+                            case 7: //hammer
+                                tile.half = !tile.half;
+                                tile.slope = 0;
+                                break;
+                            case 8: tile.actuator = true; break;
+                            case 9: tile.actuator = false; break;
+                            case 10: tile.hasGreenWire = true; break;
+                            case 11: tile.hasGreenWire = false; break;
+                            case 12: tile.hasBlueWire = true; break;
+                            case 13: tile.hasBlueWire = false; break;
+                            case 14: //slope
+                                tile.slope = type;
+                                tile.half = false;
+                                break;
+                        }
+                        tilesChanged(x, y, x, y);
+                    }
+                    break;
+                case 0x12: //set time
+                    break;
+                case 0x13: //open/close door
+                    {
+                        bool close = messages[payload++] == 1;
+                        int x = BitConverter.ToInt32(messages, payload); payload += 4;
+                        int y = BitConverter.ToInt32(messages, payload); payload += 4;
+                        int direction = messages[payload] == 1 ? 1 : -1;
+                        if (onMap(x, y) && onMap(x - 1, y) && onMap(x + 1, y + 2) && world.tiles[x, y].isActive)
+                            swingDoor(x, y, close, direction);
+                    }
+                    break;
+                case 0x14: //update tile block
+                    {
+                        int size = BitConverter.ToInt16(messages, payload); payload += 2;
+                        int startx = BitConverter.ToInt32(messages, payload); payload += 4;
+                        int starty = BitConverter.ToInt32(messages, payload); payload += 4;
+                        if (!onMap(startx, starty) || !onMap(startx + size - 1, starty + size - 1))
+                            break;
+                        //columns, not rows
+                        for (int x = startx; x < startx + size; x++)
+                            for (int y = starty; y < starty + size; y++)
+                                payload = rows.ReadTile(messages, payload, world.tiles[x, y]);
+                        tilesChanged(startx, starty, startx + size - 1, starty + size - 1);
+                    }
+                    break;
+                case 0x15: //update item
+                    break;
+                case 0x16: //set item owner
+                    break;
+                case 0x17: //update NPC
+                    {
+                        int slot = BitConverter.ToInt16(messages, payload); payload += 2;
+                        float posx = BitConverter.ToSingle(messages, payload); payload += 4;
+                        float posy = BitConverter.ToSingle(messages, payload); payload += 4;
+                        payload += 9; //skip velocity and target
+                        byte flags = messages[payload++];
+                        payload += 4; //skip life
+                        //skip any applicable AI
+                        if ((flags & 32) == 32) payload += 4;
+                        if ((flags & 16) == 16) payload += 4;
+                        if ((flags & 8) == 8) payload += 4;
+                        if ((flags & 4) == 4) payload += 4;
+                        int id = BitConverter.ToInt16(messages, payload);
+                        bool found = false;
+                        for (int i = 0; i < world.npcs.Count; i++)
+                        {
+                            if (world.npcs[i].slot == slot)
+                            {
+                                world.npcs[i].x = posx;
+                                world.npcs[i].y = posy;
+                                world.npcs[i].sprite = id;
+                                found = true; //moving doesn't change the menu
+                            }
+                        }
+                        if (!found)
+                        {
+                            for (int i = 0; i < World.friendlyNPCs.Length; i++)
+                                if (World.friendlyNPCs[i].id == id) //we found a friendly npc
+                                {
+                                    NPC npc = new NPC();
+                                    npc.isHomeless = true; //homeless for now
+                                    npc.title = World.friendlyNPCs[i].title;
+                                    npc.name = "";
+                                    npc.num = World.friendlyNPCs[i].num;
+                                    npc.sprite = id;
+                                    npc.x = posx;
+                                    npc.y = posy;
+                                    npc.slot = slot;
+                                    world.npcs.Add(npc);
+                                    npcChanged(npc);
+                                }
+                        }
+                    }
+                    break;
+                case 0x18: //strike npc
+                    break;
+                case 0x19: //chat
+                    break;
+                case 0x1a: //damage player
+                    break;
+                case 0x1b: //update projectile
+                    break;
+                case 0x1c: //damage npc
+                    break;
+                case 0x1d: //destroy projectile
+                    break;
+                case 0x1e: //pvp toggled
+                    break;
+                case 0x1f: //request open chest - c2s only
+                    break;
+                case 0x20: //set chest item
+                    break;
+                case 0x21: //open chest
+                    break;
+                case 0x22: //destroy chest
+                    break;
+                case 0x23: //heal player
+                    break;
+                case 0x24: //set zones
+                    break;
+                case 0x25: //request password.
+                    if (replaying)
+                        break;
+                    if (Password != null)
+                        send(0x26, Password);
+                    else if (PasswordNeeded != null)
+                        PasswordNeeded();
+                    else
+                        fail("The server wants a password");
+                    break;
+                case 0x26: //login - c2s only
+                    break;
+                case 0x27: //unassign item
+                    break;
+                case 0x28: //talk to npc
+                    break;
+                case 0x29: //animate flail
+                    break;
+                case 0x2a: //set mana
+                    break;
+                case 0x2b: //replenish mana
+                    break;
+                case 0x2c: //kill player
+                    break;
+                case 0x2d: //change party
+                    break;
+                case 0x2e: //read sign - c2s only
+                    break;
+                case 0x2f: //edit sign
+                    break;
+                case 0x30: //adjust liquids
+                    {
+                        int x = BitConverter.ToInt32(messages, payload); payload += 4;
+                        int y = BitConverter.ToInt32(messages, payload); payload += 4;
+                        if (!onMap(x, y))
+                            break;
+                        Tile tile = world.tiles[x, y];
+                        tile.liquid = messages[payload++];
+                        tile.isLava = messages[payload] == 1;
+                        tile.isHoney = messages[payload] == 2;
+                        tilesChanged(x, y, x, y);
+                    }
+                    break;
+                case 0x31: //okay to spawn
+                    if (loginLevel == 4)
+                    {
+                        loginLevel = 5;
+                        if (Spawned != null)
+                            Spawned();
+                        send(0x0c); //spawn
+                        sections.Recenter(world.spawnX, world.spawnY);
+                        //let the owner decide whether a remote large world is worth mapping
+                        if (world.tilesWide == LargeWorldWide && !replaying && LargeWorld != null)
+                            LargeWorld();
+                        else
+                            fetchSections(); //start fetching the world
+                    }
+                    break;
+                case 0x32: //set buffs
+                    break;
+                case 0x33: //old man answer
+                    break;
+                case 0x34: //unlock chest
+                    break;
+                case 0x35: //add npc buff
+                    break;
+                case 0x36: //set npc buffs
+                    break;
+                case 0x37: //add player buff
+                    break;
+                case 0x38: //set npc names
+                    {
+                        int id = BitConverter.ToInt16(messages, payload); payload += 2;
+                        string name = Encoding.ASCII.GetString(messages, payload, start + len - payload);
+                        for (int i = 0; i < world.npcs.Count; i++)
+                        {
+                            if (world.npcs[i].sprite == id)
+                            {
+                                world.npcs[i].name = name;
+                                npcChanged(world.npcs[i]);
+                            }
+                        }
+                    }
+                    break;
+                case 0x39: //set balance stats
+                    break;
+                case 0x3a: //play harp
+                    break;
+                case 0x3b: //flip switch
+                    break;
+                case 0x3c: //move npc home
+                    {
+                        int slot = BitConverter.ToInt16(messages, payload); payload += 2;
+                        int x = BitConverter.ToInt16(messages, payload); payload += 2;
+                        int y = BitConverter.ToInt16(messages, payload); payload += 2;
+                        byte homeless = messages[payload];
+                        for (int i = 0; i < world.npcs.Count; i++)
+                        {
+                            if (world.npcs[i].slot == slot)
+                            {
+                                world.npcs[i].isHomeless = homeless == 1;
+                                world.npcs[i].homeX = x;
+                                world.npcs[i].homeY = y;
+                                npcChanged(world.npcs[i]);
+                                break;
+                            }
+                        }
+                    }
+                    break;
+                case 0x3d: //summon boss
+                    break;
+                case 0x3e: //ninja dodge
+                    break;
+                case 0x3f: //paint tile
+                case 0x40: //paint wall
+                    {
+                        int x = BitConverter.ToInt32(messages, payload); payload += 4;
+                        int y = BitConverter.ToInt32(messages, payload); payload += 4;
+                        if (!onMap(x, y))
+                            break;
+                        if (messageid == 0x3f)
+                            world.tiles[x, y].color = messages[payload];
+                        else
+                            world.tiles[x, y].wallColor = messages[payload];
+                        tilesChanged(x, y, x, y);
+                    }
+                    break;
+                case 0x41: //teleport npc
+                    break;
+                case 0x42: //heal player
+                    break;
+                case 0x44: //unknown
+                    break;
+                default: // ignore unknown messages
+                    break;
+            }
+        }
+
+        private void npcChanged(NPC npc)
+        {
+            if (NpcChanged != null)
+                NpcChanged(npc);
+        }
+
+        private void send(int messageid, string text = null, int x = 0, int y = 0)
+        {
+            //safe from any thread, the connection queues it
+            ServerConnection conn = server;
+            if (conn == null || !conn.IsConnected)
+                return;
+            byte[] msg = conn.NewMessage();
+            int pos = ServerConnection.PayloadStart;
+            switch (messageid)
+            {
+                case 1: //send greeting
+                    ServerConnection.PutText(msg, ref pos, Greeting);
+                    break;
+                case 4: //send player info
+                    ServerConnection.PutByte(msg, ref pos, playerSlot);
+                    ServerConnection.PutByte(msg, ref pos, 0); //hair
+                    ServerConnection.PutByte(msg, ref pos, 1); //male
+                    //hair, skin, eye, shirt, undershirt, pants and shoe colors
+                    Array.Clear(msg, pos, 21);
+                    pos += 21;
+                    ServerConnection.PutByte(msg, ref pos, 0); //soft core
+                    ServerConnection.PutText(msg, ref pos, "Terrafirma");
+                    break;
+                case 6: //request world info
+                    //no payload
+                    break;
+                case 8: //request initial tile data
+                    ServerConnection.PutInt32(msg, ref pos, world.spawnX);
+                    ServerConnection.PutInt32(msg, ref pos, world.spawnY);
+                    break;
+                case 0x0c: //spawn
+                    ServerConnection.PutByte(msg, ref pos, playerSlot);
+                    ServerConnection.PutInt32(msg, ref pos, world.spawnX);
+                    ServerConnection.PutInt32(msg, ref pos, world.spawnY);
+                    break;
+                case 0x0d: //player control
+                    ServerConnection.PutByte(msg, ref pos, playerSlot);
+                    ServerConnection.PutByte(msg, ref pos, 0); //no buttons
+                    ServerConnection.PutByte(msg, ref pos, 0); //selected item 0
+                    ServerConnection.PutSingle(msg, ref pos, (float)(x * 16.0));
+                    ServerConnection.PutSingle(msg, ref pos, (float)(y * 16.0));
+                    ServerConnection.PutSingle(msg, ref pos, 0); //velocity
+                    ServerConnection.PutSingle(msg, ref pos, 0);
+                    ServerConnection.PutByte(msg, ref pos, 0); //not on a rope
+                    break;
+                case 0x10: //set player life
+                    ServerConnection.PutByte(msg, ref pos, playerSlot);
+                    ServerConnection.PutInt16(msg, ref pos, 400);
+                    ServerConnection.PutInt16(msg, ref pos, 400);
+                    break;
+                case 0x26: //send password
+                    ServerConnection.PutText(msg, ref pos, text);
+                    break;
+                case 0x2a: //set mana
+                    ServerConnection.PutByte(msg, ref pos, playerSlot);
+                    ServerConnection.PutInt16(msg, ref pos, 0);
+                    ServerConnection.PutInt16(msg, ref pos, 0);
+                    break;
+                case 0x2d: //set team
+                    ServerConnection.PutByte(msg, ref pos, playerSlot);
+                    ServerConnection.PutByte(msg, ref pos, (byte)x);
+                    break;
+                default:
+                    throw new Exception(String.Format("Unknown messageid: {0}", messageid));
+            }
+            conn.Send(msg, messageid, pos);
+        }
+
+        /// <summary>
+        /// Asks for sections until the scheduler's window is full, by moving
+        /// our player to each of them.
+        /// </summary>
+        private void fetchSections()
+        {
+            int x, y;
+            while (sections.Next(out x, out y))
+                send(0x0d, null, x, y);
+            if (retryTimer == null && !replaying && !sections.Complete)
+            {
+                int interval = (int)Math.Max(50, Math.Min(1000, RequestTimeout.TotalMilliseconds / 2));
+                retryTimer = new Timer(retry, null, interval, interval);
+            }
+            if (sections.Complete && !complete)
+            {
+                stopRetries();
+                complete = true;
+                if (Complete != null)
+                    Complete();
+                if (FollowLive)
+                {
+                    showStatus("Map Load Complete. Following changes.");
+                    return;
+                }
+                Close();
+                showStatus("Map Load Complete. Disconnected.");
+            }
+        }
+
+        private void retry(object state)
+        {
+            lock (worldLock)
+            {
+                if (loginLevel == 5 && !complete && retryTimer != null)
+                    fetchSections();
+            }
+        }
+
+        private void stopRetries()
+        {
+            Timer timer = Interlocked.Exchange(ref retryTimer, null);
+            if (timer != null)
+                timer.Dispose();
+        }
+
+        private bool onMap(int x, int y)
+        {
+            return world.tiles != null && x >= 0 && y >= 0 && x < world.tilesWide && y < world.tilesHigh;
+        }
+
+        /// <summary>
+        /// Makes the renderer work out the frames of tiles x0,y0 to x1,y1 again,
+        /// from their new neighbours.
+        /// </summary>
+        private void resetFrames(int x0, int y0, int x1, int y1)
+        {
+            x0 = Math.Max(0, x0);
+            y0 = Math.Max(0, y0);
+            x1 = Math.Min(world.tilesWide - 1, x1);
+            y1 = Math.Min(world.tilesHigh - 1, y1);
+            for (int y = y0; y <= y1; y++)
+                for (int x = x0; x <= x1; x++)
+                {
+                    Tile tile = world.tiles[x, y];
+                    if (tile.isActive && !tileInfos[tile.type].hasExtra)
+                    {
+                        tile.u = -1;
+                        tile.v = -1;
+                    }
+                    if (tile.wall > 0)
+                    {
+                        tile.wallu = -1;
+                        tile.wallv = -1;
+                    }
+                }
+        }
+
+        /// <summary>
+        /// Opens or closes the door at x,y like the game does.  A closed door
+        /// is a tile wide, an open one is two, swung towards direction.
+        /// </summary>
+        private void swingDoor(int x, int y, bool close, int direction)
+        {
+            Tile door = world.tiles[x, y];
+            if (door.u < 0 || door.v < 0)
+                return;
+            int top = y - (door.v % 54) / 18;
+            int style = door.v / 54 * 54;
+            if (top < 0)
+                return;
+            int x0;
+            if (close)
+            {
+                //the open door's frame says which side it hangs from
+                int frame = door.u % 72;
+                int hinge = frame == 18 ? x - 1 : frame == 36 ? x + 1 : x;
+                x0 = frame < 36 ? hinge : hinge - 1;
+                if (!onMap(x0, top) || !onMap(x0 + 1, top + 2))
+                    return;
+                for (int i = x0; i <= x0 + 1; i++)
+                    for (int j = top; j <= top + 2; j++)
+                    {
+                        Tile tile = world.tiles[i, j];
+                        tile.isActive = i == hinge;
+                        tile.type = 10;
+                        tile.u = 0;
+                        tile.v = (Int16)(style + (j - top) * 18);
+                    }
+            }
+            else
+            {
+                x0 = direction == 1 ? x : x - 1;
+                for (int i = x0; i <= x0 + 1; i++)
+                    for (int j = top; j <= top + 2; j++)
+                    {
+                        Tile tile = world.tiles[i, j];
+                        tile.isActive = true;
+                        tile.type = 11;
+                        tile.u = (Int16)((direction == 1 ? 0 : 36) + (i - x0) * 18);
+                        tile.v = (Int16)(style + (j - top) * 18);
+                    }
+            }
+            tilesChanged(x0, top, x0 + 1, top + 2);
+        }
+
+        /// <summary>
+        /// Notes tiles the server changed, for the renderer, the cache and the owner
+        /// </summary>
+        private void tilesChanged(int x0, int y0, int x1, int y1)
+        {
+            //neighbours frame against the changed tiles
+            resetFrames(x0 - 1, y0 - 1, x1 + 1, y1 + 1);
+            SectionCache cache = sectionCache;
+            if (cache != null)
+                cache.Changed(x0, y0, x1, y1);
+            changes++;
+            if (TilesChanged != null)
+                TilesChanged(x0, y0, x1, y1);
+        }
+    }
+}
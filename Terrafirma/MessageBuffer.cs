@@ -0,0 +1,174 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Frames the server's length-prefixed messages.  The socket receives
+    /// straight into a large buffer and messages are handed out where they
+    /// lie, so nothing is copied per receive.  When the room left at the end
+    /// gets short, the one partial message left over is moved to the front.
+    /// A message bigger than the buffer grows it.
+    /// </summary>
+    class MessageBuffer : IDisposable
+    {
+        public const int DefaultSize = 256 * 1024;
+        //always leave room for a decent sized receive
+        const int MinReceive = 16 * 1024;
+        //no message from a terraria server comes anywhere near this
+        const int MaxMessage = 16 * 1024 * 1024;
+
+        //buffers of DefaultSize, shared by every connection
+        static readonly ConcurrentBag<byte[]> pool = new ConcurrentBag<byte[]>();
+
+        byte[] data;
+        int head, tail;
+
+        public MessageBuffer()
+        {
+            if (!pool.TryTake(out data))
+                data = new byte[DefaultSize];
+            head = tail = 0;
+        }
+
+        /// <summary>
+        /// The buffer to receive into, from ReceiveOffset for ReceiveCount bytes.
+        /// Messages returned by Next are in it too.  It changes when it grows.
+        /// </summary>
+        public byte[] Data
+        {
+            get { return data; }
+        }
+
+        public int ReceiveOffset
+        {
+            get { return tail; }
+        }
+
+        public int ReceiveCount
+        {
+            get { return data.Length - tail; }
+        }
+
+        /// <summary>
+        /// Bytes received that aren't a whole message yet
+        /// </summary>
+        public int Pending
+        {
+            get { return tail - head; }
+        }
+
+        /// <summary>
+        /// Adds count bytes just received at ReceiveOffset
+        /// </summary>
+        public void Received(int count)
+        {
+            if (count < 0 || count > ReceiveCount)
+                throw new Exception("Received more than the buffer holds");
+            tail += count;
+        }
+
+        /// <summary>
+        /// Finds the next whole message.  start is where its id is in Data,
+        /// and len counts the id and payload.  Once it returns false, the
+        /// buffer has made room for the next receive.
+        /// </summary>
+        public bool Next(out int start, out int len)
+        {
+            start = len = 0;
+            if (tail - head >= 4)
+            {
+                int msgLen = BitConverter.ToInt32(data, head);
+                if (msgLen < 1 || msgLen > MaxMessage)
+                    throw new Exception(String.Format("Bad message length: {0}", msgLen));
+                if (tail - head - 4 >= msgLen)
+                {
+                    start = head + 4;
+                    len = msgLen;
+                    head += 4 + msgLen;
+                    return true;
+                }
+                makeRoom(4 + msgLen);
+            }
+            else
+                makeRoom(4);
+            return false;
+        }
+
+        /// <summary>
+        /// Makes sure the partial message at head, needing need bytes in all,
+        /// will fit, and that there's room to receive more of it.
+        /// </summary>
+        private void makeRoom(int need)
+        {
+            int pending = tail - head;
+            if (pending == 0)
+            {
+                head = tail = 0;
+                return;
+            }
+            int room = data.Length - tail;
+            //it can finish where it is
+            if (data.Length - head >= need && (room >= MinReceive || room >= need - pending))
+                return;
+            if (need > data.Length)
+            {
+                int size = data.Length;
+                while (size < need)
+                    size *= 2;
+                byte[] bigger = new byte[size];
+                Buffer.BlockCopy(data, head, bigger, 0, pending);
+                release();
+                data = bigger;
+            }
+            else
+                Buffer.BlockCopy(data, head, data, 0, pending);
+            head = 0;
+            tail = pending;
+        }
+
+        private void release()
+        {
+            if (data != null && data.Length == DefaultSize)
+                pool.Add(data);
+            data = null;
+        }
+
+        public void Dispose()
+        {
+            release();
+            head = tail = 0;
+        }
+    }
+}
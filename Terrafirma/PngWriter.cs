@@ -0,0 +1,461 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading.Tasks;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Writes a truecolor png from the Bgr32 pixels the renderer produces,
+    /// or an indexed png from a byte per pixel and a palette.
+    /// Rows can be added a band at a time so the compressed image never
+    /// has to sit in memory.  Rows are filtered, and the filtered data
+    /// compressed in pieces, on all the cores at once.
+    /// </summary>
+    class PngWriter : IDisposable
+    {
+        const int MaxChunk = 65536;
+        //filtered bytes compressed per thread at a time, same as pigz
+        const int PieceSize = 128 * 1024;
+        public const int DefaultLevel = 6;
+
+        static readonly byte[] signature = { 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a };
+        static readonly UInt32[] crcTable = makeCrcTable();
+
+        Stream output;
+        int width, height, rowsWritten, level;
+        //bytes per pixel given to WriteRows, and written to the png
+        int inBytes, outBytes;
+        UInt32[] palette;
+        MemoryStream idat;
+        UInt32 adler;
+        bool finished;
+        //filtered rows waiting to be compressed, after the last 32k that was
+        //compressed, which the next pieces can match against
+        byte[] pending;
+        int dictLen, pendingLen;
+        byte[] lastRow;
+
+        public PngWriter(Stream output, int width, int height)
+            : this(output, width, height, DefaultLevel)
+        {
+        }
+
+        /// <summary>
+        /// level is 0 to 9 like zlib.  0 stores the pixels as they are and 1
+        /// only packs runs, both much faster than the rest for previews.
+        /// </summary>
+        public PngWriter(Stream output, int width, int height, int level)
+            : this(output, width, height, null, level)
+        {
+        }
+
+        /// <summary>
+        /// An indexed png.  palette holds up to 256 0xRRGGBB colors, and rows
+        /// are given as a byte per pixel.  Without a palette it's truecolor.
+        /// </summary>
+        public PngWriter(Stream output, int width, int height, UInt32[] palette, int level)
+        {
+            if (level < 0 || level > 9)
+                throw new Exception(String.Format("Compression level {0} isn't between 0 and 9", level));
+            if (palette != null && (palette.Length == 0 || palette.Length > 256))
+                throw new Exception(String.Format("A palette can't have {0} colors", palette.Length));
+            this.output = output;
+            this.width = width;
+            this.height = height;
+            this.level = level;
+            this.palette = palette;
+            inBytes = palette != null ? 1 : 4;
+            outBytes = palette != null ? 1 : 3;
+            rowsWritten = 0;
+            adler = 1;
+            int rowBytes = width * outBytes + 1;
+            //small images don't need the whole batch
+            long batch = Math.Min(Math.Max(PieceSize * Environment.ProcessorCount, rowBytes), (long)rowBytes * height);
+            pending = new byte[Deflater.Window + Math.Max(batch, 1)];
+            dictLen = pendingLen = 0;
+            lastRow = new byte[width * outBytes];
+
+            output.Write(signature, 0, signature.Length);
+            byte[] ihdr = new byte[13];
+            putInt(ihdr, 0, (UInt32)width);
+            putInt(ihdr, 4, (UInt32)height);
+            ihdr[8] = 8; //bit depth
+            ihdr[9] = palette != null ? (byte)3 : (byte)2; //indexed or truecolor
+            writeChunk("IHDR", ihdr, 0, ihdr.Length);
+            if (palette != null)
+            {
+                byte[] plte = new byte[palette.Length * 3];
+                for (int i = 0; i < palette.Length; i++)
+                {
+                    plte[i * 3] = (byte)(palette[i] >> 16);
+                    plte[i * 3 + 1] = (byte)(palette[i] >> 8);
+                    plte[i * 3 + 2] = (byte)palette[i];
+                }
+                writeChunk("PLTE", plte, 0, plte.Length);
+            }
+
+            idat = new MemoryStream();
+            idat.WriteByte(0x78); //zlib header, with a hint at the level
+            idat.WriteByte(level < 2 ? (byte)0x01 : level < 6 ? (byte)0x5e : level == 6 ? (byte)0x9c : (byte)0xda);
+        }
+
+        /// <summary>
+        /// Adds rows to the image.  pixels holds Bgr32 rows, width*4 bytes each,
+        /// or width bytes of palette indices.
+        /// </summary>
+        public void WriteRows(byte[] pixels, int offset, int rows)
+        {
+            WriteRows(pixels, offset, width * inBytes, rows);
+        }
+
+        /// <summary>
+        /// Adds rows cut out of a wider image, stride bytes apart.
+        /// </summary>
+        public void WriteRows(byte[] pixels, int offset, int stride, int rows)
+        {
+            if (rowsWritten + rows > height)
+                throw new Exception(String.Format("Too many rows for a {0}x{1} image", width, height));
+            int rowBytes = width * outBytes + 1;
+            while (rows > 0)
+            {
+                int fit = Math.Min((pending.Length - pendingLen) / rowBytes, rows);
+                if (fit == 0)
+                {
+                    compressPending();
+                    continue;
+                }
+                filterRows(pixels, offset, stride, fit);
+                pendingLen += fit * rowBytes;
+                offset += fit * stride;
+                rows -= fit;
+                rowsWritten += fit;
+            }
+        }
+
+        /// <summary>
+        /// Finishes the image.  Doesn't close the underlying stream.
+        /// </summary>
+        public void Close()
+        {
+            if (finished)
+                return;
+            if (rowsWritten != height)
+                throw new Exception(String.Format("Only {0} of {1} rows were written", rowsWritten, height));
+            compressPending();
+            finished = true;
+            idat.Write(Deflater.Finish, 0, Deflater.Finish.Length);
+            byte[] a = new byte[4];
+            putInt(a, 0, adler);
+            idat.Write(a, 0, 4);
+            flushChunk();
+            writeChunk("IEND", a, 0, 0);
+            output.Flush();
+        }
+
+        public void Dispose()
+        {
+            finished = true;
+            pending = null;
+        }
+
+        /// <summary>
+        /// Saves a whole Bgr32 image in one go.
+        /// </summary>
+        public static void Save(string filename, byte[] pixels, int width, int height)
+        {
+            using (FileStream stream = new FileStream(filename, FileMode.Create))
+            using (PngWriter png = new PngWriter(stream, width, height))
+            {
+                png.WriteRows(pixels, 0, height);
+                png.Close();
+            }
+        }
+
+        /// <summary>
+        /// Filters rows into the pending buffer, a row per thread.
+        /// </summary>
+        private void filterRows(byte[] pixels, int offset, int stride, int rows)
+        {
+            int rowBytes = width * outBytes;
+            int dst = pendingLen;
+            Parallel.For<byte[][]>(0, rows,
+                delegate() { return new byte[][] { new byte[rowBytes], new byte[rowBytes], new byte[rowBytes] }; },
+                delegate(int y, ParallelLoopState state, byte[][] scratch)
+                {
+                    byte[] cur = scratch[0], prior = scratch[1];
+                    unpack(pixels, offset + y * stride, cur);
+                    if (y > 0)
+                        unpack(pixels, offset + (y - 1) * stride, prior);
+                    else
+                        Buffer.BlockCopy(lastRow, 0, prior, 0, rowBytes);
+                    filter(cur, prior, pending, dst + y * (rowBytes + 1), scratch[2]);
+                    return scratch;
+                },
+                delegate(byte[][] scratch) { });
+            unpack(pixels, offset + (rows - 1) * stride, lastRow);
+        }
+
+        private void unpack(byte[] pixels, int src, byte[] rgb)
+        {
+            if (palette != null)
+            {
+                Buffer.BlockCopy(pixels, src, rgb, 0, width);
+                return;
+            }
+            for (int x = 0, dst = 0; x < width; x++, src += 4)
+            {
+                rgb[dst++] = pixels[src + 2];
+                rgb[dst++] = pixels[src + 1];
+                rgb[dst++] = pixels[src];
+            }
+        }
+
+        /// <summary>
+        /// Writes the filter type and the filtered row to dest.  Stored images
+        /// aren't filtered, run packing wants the sub filter, which turns flat
+        /// color into zeros, and the rest pick whichever filter gives the
+        /// smallest bytes, like libpng does.  Palette indices aren't
+        /// brightnesses, so differencing them only hides runs; libpng leaves
+        /// those unfiltered too.
+        /// </summary>
+        private void filter(byte[] cur, byte[] prior, byte[] dest, int o, byte[] trial)
+        {
+            int n = cur.Length;
+            if (level == 0 || palette != null)
+            {
+                dest[o] = 0;
+                Buffer.BlockCopy(cur, 0, dest, o + 1, n);
+                return;
+            }
+            if (level == 1)
+            {
+                dest[o] = 1;
+                filterWith(1, cur, prior, dest, o + 1);
+                return;
+            }
+            long best = long.MaxValue;
+            for (int type = 0; type <= 4 && best > 0; type++)
+            {
+                long sum = filterWith(type, cur, prior, trial, 0);
+                if (sum < best)
+                {
+                    best = sum;
+                    dest[o] = (byte)type;
+                    Buffer.BlockCopy(trial, 0, dest, o + 1, n);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Filters a row with one filter type, and returns the sum of the
+        /// filtered bytes taken as signed, which is smaller the better it'll pack.
+        /// </summary>
+        private static long filterWith(int type, byte[] cur, byte[] prior, byte[] dest, int o)
+        {
+            int n = cur.Length;
+            long sum = 0;
+            byte v;
+            switch (type)
+            {
+                case 0:
+                    for (int x = 0; x < n; x++)
+                    {
+                        dest[o + x] = v = cur[x];
+                        sum += v < 128 ? v : 256 - v;
+                    }
+                    break;
+                case 1:
+                    for (int x = 0; x < n; x++)
+                    {
+                        dest[o + x] = v = (byte)(cur[x] - (x >= 3 ? cur[x - 3] : 0));
+                        sum += v < 128 ? v : 256 - v;
+                    }
+                    break;
+                case 2:
+                    for (int x = 0; x < n; x++)
+                    {
+                        dest[o + x] = v = (byte)(cur[x] - prior[x]);
+                        sum += v < 128 ? v : 256 - v;
+                    }
+                    break;
+                case 3:
+                    for (int x = 0; x < n; x++)
+                    {
+                        dest[o + x] = v = (byte)(cur[x] - (((x >= 3 ? cur[x - 3] : 0) + prior[x]) >> 1));
+                        sum += v < 128 ? v : 256 - v;
+                    }
+                    break;
+                default:
+                    for (int x = 0; x < n; x++)
+                    {
+                        int a = x >= 3 ? cur[x - 3] : 0, c = x >= 3 ? prior[x - 3] : 0;
+                        dest[o + x] = v = (byte)(cur[x] - paeth(a, prior[x], c));
+                        sum += v < 128 ? v : 256 - v;
+                    }
+                    break;
+            }
+            return sum;
+        }
+
+        private static int paeth(int a, int b, int c)
+        {
+            int p = a + b - c;
+            int pa = Math.Abs(p - a), pb = Math.Abs(p - b), pc = Math.Abs(p - c);
+            if (pa <= pb && pa <= pc)
+                return a;
+            return pb <= pc ? b : c;
+        }
+
+        /// <summary>
+        /// Compresses the pending rows in pieces on all the cores and appends
+        /// them, in order, to the image data.
+        /// </summary>
+        private void compressPending()
+        {
+            int total = pendingLen - dictLen;
+            if (total == 0)
+                return;
+            int pieces = (total + PieceSize - 1) / PieceSize;
+            byte[][] packed = new byte[pieces][];
+            UInt32[] sums = new UInt32[pieces];
+            Parallel.For(0, pieces, delegate(int i)
+            {
+                int start = dictLen + i * PieceSize;
+                int len = Math.Min(PieceSize, pendingLen - start);
+                packed[i] = Deflater.Compress(pending, 0, start, len, level);
+                sums[i] = updateAdler(1, pending, start, len);
+            });
+            for (int i = 0; i < pieces; i++)
+            {
+                int len = Math.Min(PieceSize, total - i * PieceSize);
+                adler = combineAdler(adler, sums[i], len);
+                idat.Write(packed[i], 0, packed[i].Length);
+                if (idat.Length >= MaxChunk)
+                    flushChunk();
+            }
+            //the end of what was just compressed is the next dictionary
+            int keep = Math.Min(Deflater.Window, pendingLen);
+            Array.Copy(pending, pendingLen - keep, pending, 0, keep);
+            dictLen = pendingLen = keep;
+        }
+
+        private void flushChunk()
+        {
+            if (idat.Length == 0)
+                return;
+            writeChunk("IDAT", idat.GetBuffer(), 0, (int)idat.Length);
+            idat.SetLength(0);
+        }
+
+        private void writeChunk(string type, byte[] data, int offset, int len)
+        {
+            byte[] head = new byte[8];
+            putInt(head, 0, (UInt32)len);
+            for (int i = 0; i < 4; i++)
+                head[4 + i] = (byte)type[i];
+            UInt32 crc = updateCrc(0xffffffff, head, 4, 4);
+            crc = updateCrc(crc, data, offset, len) ^ 0xffffffff;
+            output.Write(head, 0, 8);
+            output.Write(data, offset, len);
+            byte[] tail = new byte[4];
+            putInt(tail, 0, crc);
+            output.Write(tail, 0, 4);
+        }
+
+        private static void putInt(byte[] buf, int offset, UInt32 v)
+        {
+            buf[offset] = (byte)(v >> 24);
+            buf[offset + 1] = (byte)(v >> 16);
+            buf[offset + 2] = (byte)(v >> 8);
+            buf[offset + 3] = (byte)v;
+        }
+
+        private static UInt32[] makeCrcTable()
+        {
+            UInt32[] table = new UInt32[256];
+            for (UInt32 n = 0; n < 256; n++)
+            {
+                UInt32 c = n;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) != 0 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                table[n] = c;
+            }
+            return table;
+        }
+
+        private static UInt32 updateCrc(UInt32 crc, byte[] data, int offset, int len)
+        {
+            for (int i = offset; i < offset + len; i++)
+                crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+            return crc;
+        }
+
+        private static UInt32 updateAdler(UInt32 adler, byte[] data, int offset, int len)
+        {
+            UInt32 a = adler & 0xffff, b = adler >> 16;
+            while (len > 0)
+            {
+                //5552 is the most we can sum before b could overflow
+                int n = Math.Min(len, 5552);
+                len -= n;
+                while (n-- > 0)
+                {
+                    a += data[offset++];
+                    b += a;
+                }
+                a %= 65521;
+                b %= 65521;
+            }
+            return (b << 16) | a;
+        }
+
+        /// <summary>
+        /// The adler32 of two pieces joined, from the adler32 of each, as zlib
+        /// does it.
+        /// </summary>
+        private static UInt32 combineAdler(UInt32 adler1, UInt32 adler2, int len2)
+        {
+            const UInt32 Base = 65521;
+            UInt32 rem = (UInt32)(len2 % Base);
+            UInt32 sum1 = adler1 & 0xffff;
+            UInt32 sum2 = (UInt32)((UInt64)rem * sum1 % Base);
+            sum1 += (adler2 & 0xffff) + Base - 1;
+            sum2 += (adler1 >> 16) + (adler2 >> 16) + Base - rem;
+            if (sum1 >= Base) sum1 -= Base;
+            if (sum1 >= Base) sum1 -= Base;
+            if (sum2 >= Base << 1) sum2 -= Base << 1;
+            if (sum2 >= Base) sum2 -= Base;
+            return sum1 | (sum2 << 16);
+        }
+    }
+}
@@ -94,5 +94,41 @@ namespace Terrafirma.Properties {
                 this["Lighting"] = value;
             }
         }
+        
+        [global::System.Configuration.UserScopedSettingAttribute()]
+        [global::System.Diagnostics.DebuggerNonUserCodeAttribute()]
+        [global::System.Configuration.DefaultSettingValueAttribute("False")]
+        public bool ResolveFrames {
+            get {
+                return ((bool)(this["ResolveFrames"]));
+            }
+            set {
+                this["ResolveFrames"] = value;
+            }
+        }
+        
+        [global::System.Configuration.UserScopedSettingAttribute()]
+        [global::System.Diagnostics.DebuggerNonUserCodeAttribute()]
+        [global::System.Configuration.DefaultSettingValueAttribute("4")]
+        public int FetchWindow {
+            get {
+                return ((int)(this["FetchWindow"]));
+            }
+            set {
+                this["FetchWindow"] = value;
+            }
+        }
+        
+        [global::System.Configuration.UserScopedSettingAttribute()]
+        [global::System.Diagnostics.DebuggerNonUserCodeAttribute()]
+        [global::System.Configuration.DefaultSettingValueAttribute("False")]
+        public bool FollowLive {
+            get {
+                return ((bool)(this["FollowLive"]));
+            }
+            set {
+                this["FollowLive"] = value;
+            }
+        }
     }
 }
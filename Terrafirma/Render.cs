@@ -29,6 +29,8 @@ using System;
 using System.Collections.Generic;
 using System.Linq;
 using System.Text;
+using System.Threading;
+using System.Threading.Tasks;
 
 namespace Terrafirma
 {
@@ -44,8 +46,7 @@ namespace Terrafirma
         private byte[] styles;
         private Int32[] treeX,treeStyle,caveX,caveStyle;
         private Int32 jungleStyle, hellStyle;
-
-        Random rand;
+        private Int32 worldID;
 
         public Textures Textures { set; get; }
 
@@ -62,14 +63,27 @@ namespace Terrafirma
             this.waterColor = waterColor;
             this.lavaColor = lavaColor;
             this.honeyColor = honeyColor;
-            rand = new Random();
+        }
+
+        /// <summary>
+        /// A renderer for the same world and textures, so another thread can draw
+        /// </summary>
+        public Render(Render other)
+            : this(other.tileInfos, other.wallInfo, other.skyColor, other.earthColor, other.rockColor,
+                other.hellColor, other.waterColor, other.lavaColor, other.honeyColor)
+        {
+            SetWorld(other.tilesWide, other.tilesHigh, other.groundLevel, other.rockLevel, other.styles,
+                other.treeX, other.treeStyle, other.caveX, other.caveStyle, other.jungleStyle,
+                other.hellStyle, other.npcs, other.worldID);
+            Textures = other.Textures;
         }
 
         public void SetWorld(Int32 tilesWide, Int32 tilesHigh,
             int groundLevel, int rockLevel, byte[] styles, 
             Int32[] treeX, Int32[] treeStyle, Int32[] caveX, Int32[] caveStyle,
-            Int32 jungleStyle, Int32 hellStyle, List<NPC> npcs)
+            Int32 jungleStyle, Int32 hellStyle, List<NPC> npcs, Int32 worldID)
         {
+            this.worldID = worldID;
             this.tilesWide = tilesWide;
             this.tilesHigh = tilesHigh;
             this.groundLevel = groundLevel;
@@ -98,6 +112,9 @@ namespace Terrafirma
         };
 
 
+        //tiles drawn around a redrawn area and thrown away
+        const int RedrawOverscan = 6;
+
         private struct Delayed
         {
             public int px, py;
@@ -110,19 +127,135 @@ namespace Terrafirma
             bool isHilight,
             int light, bool texture, bool houses, bool wires, bool fogofwar, ref Tile[,] tiles)
         {
+            draw(width, height, startx, starty, scale, pixels, isHilight, light, texture,
+                houses, wires, fogofwar, tiles, true, 0, height);
+        }
+
+        /// <summary>
+        /// Draws with startx,starty exactly at the top left pixel.  Draw centers
+        /// the textured view for the viewer, which would shift each piece of an
+        /// image rendered in pieces differently.
+        /// </summary>
+        public void DrawRegion(int width, int height,
+            double startx, double starty,
+            double scale, byte[] pixels,
+            int light, bool texture, bool houses, bool wires, bool fogofwar, Tile[,] tiles)
+        {
+            draw(width, height, startx, starty, scale, pixels, false, light, texture,
+                houses, wires, fogofwar, tiles, false, 0, height);
+        }
+
+        /// <summary>
+        /// Draws a band of rows with startx,starty at its top left, like
+        /// DrawRegion.  Tiles up to margin pixels above and below it are drawn
+        /// too, clipped to the band, so sprites reaching across its edges aren't
+        /// cut off.  pixels only has to hold the band.
+        /// </summary>
+        public void DrawBand(int width, int rows, int margin,
+            double startx, double starty,
+            double scale, byte[] pixels,
+            int light, bool texture, bool houses, bool wires, bool fogofwar, Tile[,] tiles)
+        {
+            draw(width, rows + 2 * margin, startx, starty - margin / scale, scale, pixels, false, light, texture,
+                houses, wires, fogofwar, tiles, false, margin, rows);
+        }
+
+        /// <summary>
+        /// Redraws just the tiles x0,y0 to x1,y1 of a view Draw already drew
+        /// into pixels.  left,top,right,bottom get the pixels that changed, and
+        /// it returns false if none of those tiles are in view.
+        /// </summary>
+        public bool DrawTiles(int width, int height,
+            double startx, double starty,
+            double scale, byte[] pixels,
+            int x0, int y0, int x1, int y1,
+            bool isHilight,
+            int light, bool texture, bool houses, bool wires, bool fogofwar, Tile[,] tiles,
+            out int left, out int top, out int right, out int bottom)
+        {
+            double step = scale;
+            int margin = 0;
             if (texture)
             {
+                //the same origin Draw centers on
+                int blocksWide = (int)(width / Math.Floor(scale)) + 2;
+                int blocksHigh = (int)(height / Math.Floor(scale)) + 2;
+                startx += ((width / scale) - blocksWide) / 2;
+                starty += ((height / scale) - blocksHigh) / 2;
+                step = (int)scale;
+                //sprites from tiles nearby can reach into the changed ones
+                margin = RedrawOverscan;
+            }
+            //a pixel to spare for rounding
+            left = Math.Max(0, (int)Math.Floor((x0 - startx) * step) - 1);
+            top = Math.Max(0, (int)Math.Floor((y0 - starty) * step) - 1);
+            right = Math.Min(width, (int)Math.Ceiling((x1 + 1 - startx) * step) + 1);
+            bottom = Math.Min(height, (int)Math.Ceiling((y1 + 1 - starty) * step) + 1);
+            if (left >= right || top >= bottom)
+                return false;
+
+            //textures only line up a whole number of tiles from the view's origin
+            double tx, ty;
+            int ox, oy;
+            if (texture)
+            {
+                tx = Math.Floor(left / step) - margin;
+                ty = Math.Floor(top / step) - margin;
+                ox = (int)(tx * step);
+                oy = (int)(ty * step);
+            }
+            else
+            {
+                tx = left / scale;
+                ty = top / scale;
+                ox = left;
+                oy = top;
+            }
+            int w = right - ox + (int)(margin * step);
+            int h = bottom - oy + (int)(margin * step);
+            byte[] part = new byte[w * h * 4]; //textures don't cover anything off the map
+            draw(w, h, startx + tx, starty + ty, scale, part, isHilight, light, texture,
+                houses, wires, fogofwar, tiles, false, 0, h);
+            int rowBytes = (right - left) * 4;
+            for (int y = top; y < bottom; y++)
+                Buffer.BlockCopy(part, ((y - oy) * w + (left - ox)) * 4, pixels, (y * width + left) * 4, rowBytes);
+            return true;
+        }
+
+        private void draw(int width, int height,
+            double startx, double starty,
+            double scale, byte[] pixels,
+            bool isHilight,
+            int light, bool texture, bool houses, bool wires, bool fogofwar, Tile[,] tiles, bool centered,
+            int bandTop, int bandRows)
+        {
+            //pixels holds rows bandTop to bandTop+bandRows of the height drawn
+            if (texture)
+            {
+                commands.Clear();
+                target = pixels;
+                targetWidth = width;
+                targetFirst = bandTop;
+                targetRows = bandRows;
+
                 int blocksWide = (int)(width / Math.Floor(scale)) + 2; //scale=1.0 to 16.0
                 int blocksHigh = (int)(height / Math.Floor(scale)) + 2;
 
-                double adjustx = ((width / scale) - blocksWide) / 2;
-                double adjusty = ((height / scale) - blocksHigh) / 2;
-                startx += adjustx;
-                starty += adjusty;
+                if (centered)
+                {
+                    double adjustx = ((width / scale) - blocksWide) / 2;
+                    double adjusty = ((height / scale) - blocksHigh) / 2;
+                    startx += adjustx;
+                    starty += adjusty;
+                }
 
                 int skipx = 0, skipy = 0;
                 if (startx < 0) skipx = (int)-startx;
                 if (starty < 0) skipy = (int)-starty;
+                // clamp the visible rectangle to the world once, so none of
+                // the passes below have to test for tiles off the map.
+                int endx = Math.Min(blocksWide, (int)Math.Ceiling(tilesWide - startx));
+                int endy = Math.Min(blocksHigh, (int)Math.Ceiling(tilesHigh - starty));
 
                 double shiftx = (startx - Math.Floor(startx)) * scale;
                 double shifty = (starty - Math.Floor(starty)) * scale;
@@ -136,7 +269,7 @@ namespace Terrafirma
                 hellLevel = hellLevel * 6 + groundLevel - 5;
 
                 py = skipy * (int)scale;
-                for (int y = skipy; y < blocksHigh; y++)
+                for (int y = skipy; y < endy; y++)
                 {
                     int sy = (int)(y + starty);
                     px = skipx * (int)scale;
@@ -183,11 +316,9 @@ namespace Terrafirma
                         v = sy - hellLevel;
                     }
 
-                    for (int x = skipx; x < blocksWide; x++)
+                    for (int x = skipx; x < endx; x++)
                     {
                         int sx = (int)(x + startx);
-                        if (sx < 0 || sx >= tilesWide || sy < 0 || sy >= tilesHigh)
-                            continue;
 
                         int bgtile=0;
                         if (bg >= 0)
@@ -229,7 +360,7 @@ namespace Terrafirma
                         if (bg == -1) //sky
                             vv = sy * (tex.height-16) / groundLevel;
                         drawTexture(tex, 16, 16, vv * tex.width * 4 + u * 4,
-                            pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0);
+                            (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0);
 
                         px += (int)scale;
                     }
@@ -241,18 +372,15 @@ namespace Terrafirma
                 Texture wallOutline = Textures.GetWallOutline(0);
 
                 py = skipy * (int)scale - (int)(scale / 2);
-                for (int y = skipy; y < blocksHigh; y++)
+                for (int y = skipy; y < endy; y++)
                 {
                     int sy = (int)(y + starty);
 
                     px = skipx * (int)scale - (int)(scale / 2);
-                    for (int x = skipx; x < blocksWide; x++)
+                    for (int x = skipx; x < endx; x++)
                     {
                         int sx = (int)(x + startx);
 
-                        if (sx < 0 || sx >= tilesWide || sy < 0 || sy >= tilesHigh)
-                            continue;
-
                         Tile tile = tiles[sx, sy];
 
                         if (tile.wall > 0)
@@ -281,25 +409,25 @@ namespace Terrafirma
                                 lightR = lightG = lightB = 0.0;
 
                             drawTexture(tex, 32, 32, tile.wallv * tex.width * 4 * 2 + tile.wallu * 4 * 2,
-                                pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.wallColor);
+                                (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.wallColor);
                             Int16 blend = wallInfo[tile.wall].blend;
                             if (sx > 0 && tiles[sx - 1, sy].wall > 0 &&
                                 wallInfo[tiles[sx - 1, sy].wall].blend != blend)
                                 drawTexture(wallOutline, 2, 16, 0,
-                                    pixels, (int)(px + (scale / 2) - shiftx), (int)(py + (scale / 2) - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0);
+                                    (int)(px + (scale / 2) - shiftx), (int)(py + (scale / 2) - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0);
                             double pad = 14.0 * scale / 16.0;
                             if (sx < tilesWide - 2 && tiles[sx + 1, sy].wall > 0 &&
                                 wallInfo[tiles[sx + 1, sy].wall].blend != blend)
                                 drawTexture(wallOutline, 2, 16, 14 * 4 * 2,
-                                    pixels, (int)(px + pad + (scale / 2) - shiftx), (int)(py + (scale / 2) - shifty), width, height, scale / 16.0, lightR, lightG, lightB,0);
+                                    (int)(px + pad + (scale / 2) - shiftx), (int)(py + (scale / 2) - shifty), width, height, scale / 16.0, lightR, lightG, lightB,0);
                             if (sy > 0 && tiles[sx, sy - 1].wall > 0 &&
                                 wallInfo[tiles[sx, sy - 1].wall].blend != blend)
                                 drawTexture(wallOutline, 16, 2, 0,
-                                    pixels, (int)(px + (scale / 2) - shiftx), (int)(py + (scale / 2) - shifty), width, height, scale / 16.0, lightR, lightG, lightB,0);
+                                    (int)(px + (scale / 2) - shiftx), (int)(py + (scale / 2) - shifty), width, height, scale / 16.0, lightR, lightG, lightB,0);
                             if (sy < tilesHigh - 2 && tiles[sx, sy + 1].wall > 0 &&
                                 wallInfo[tiles[sx, sy + 1].wall].blend != blend)
                                 drawTexture(wallOutline, 16, 2, 14 * tex.width * 4 * 2,
-                                    pixels, (int)(px + (scale / 2) - shiftx), (int)(py + pad + (scale / 2) - shifty), width, height, scale / 16.0, lightR, lightG, lightB,0);
+                                    (int)(px + (scale / 2) - shiftx), (int)(py + pad + (scale / 2) - shifty), width, height, scale / 16.0, lightR, lightG, lightB,0);
                         }
 
                         px += (int)scale;
@@ -311,17 +439,14 @@ namespace Terrafirma
 
                 //draw tiles
                 py = skipy * (int)scale;
-                for (int y = skipy; y < blocksHigh; y++)
+                for (int y = skipy; y < endy; y++)
                 {
                     int sy = (int)(y + starty);
                     px = skipx * (int)scale;
-                    for (int x = skipx; x < blocksWide; x++)
+                    for (int x = skipx; x < endx; x++)
                     {
                         int sx = (int)(x + startx);
 
-                        if (sx < 0 || sx >= tilesWide || sy < 0 || sy >= tilesHigh)
-                            continue;
-
                         Tile tile = tiles[sx, sy];
 
                         if (light == 1)
@@ -367,11 +492,11 @@ namespace Terrafirma
                             int texw = 16;
                             int texh = 16;
                             int toppad = 0;
-                            if (tile.type == 4 && tileInfos[tiles[sx,sy-1].type].solid) //torch
+                            if (tile.type == 4 && tileInfos[tileAt(tiles, sx, sy - 1).type].solid) //torch
                             {
                                 toppad = 2;
-                                if (tileInfos[tiles[sx - 1, sy + 1].type].solid ||
-                                    tileInfos[tiles[sx + 1, sy + 1].type].solid)
+                                if (tileInfos[tileAt(tiles, sx - 1, sy + 1).type].solid ||
+                                    tileInfos[tileAt(tiles, sx + 1, sy + 1).type].solid)
                                     toppad = 4;
                             }
                             if (tile.type == 78 || tile.type == 85 || tile.type == 105 || tile.type==132 ||
@@ -435,15 +560,15 @@ namespace Terrafirma
 
                             if (tile.type == 72 && tile.u>=36) //mushroom
                                 drawMushroom(tile.u, tile.v,
-                                    pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB);
+                                    (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB);
 
                             if (tile.type == 103) //bowl
                                 if (tile.u == 18) texw = 14;
 
                             //solid tile adjacent to water
-                            if (tileInfos[tile.type].solid && (tiles[sx - 1, sy].liquid > 0 ||
-                                tiles[sx + 1, sy].liquid > 0 || tiles[sx, sy - 1].liquid > 0 ||
-                                tiles[sx, sy + 1].liquid > 0))
+                            if (tileInfos[tile.type].solid && (tileAt(tiles, sx - 1, sy).liquid > 0 ||
+                                tileAt(tiles, sx + 1, sy).liquid > 0 || tileAt(tiles, sx, sy - 1).liquid > 0 ||
+                                tileAt(tiles, sx, sy + 1).liquid > 0))
                             {
                                 byte waterMask = 0;
                                 double sideLevel = 0.0;
@@ -455,7 +580,7 @@ namespace Terrafirma
                                 //lrtb
                                 int mask = 0;
                                 Tile edge;
-                                if ((edge = tiles[sx - 1, sy]).liquid > 0)
+                                if ((edge = tileAt(tiles, sx - 1, sy)).liquid > 0)
                                 {
                                     sideLevel = edge.liquid;
                                     mask |= 8; //left
@@ -466,7 +591,7 @@ namespace Terrafirma
                                     else
                                         waterMask |= 1;
                                 }
-                                if ((edge = tiles[sx + 1, sy]).liquid > 0)
+                                if ((edge = tileAt(tiles, sx + 1, sy)).liquid > 0)
                                 {
                                     sideLevel = edge.liquid;
                                     mask |= 4; //right
@@ -477,7 +602,7 @@ namespace Terrafirma
                                     else
                                         waterMask |= 1;
                                 }
-                                if ((edge = tiles[sx, sy - 1]).liquid > 0)
+                                if ((edge = tileAt(tiles, sx, sy - 1)).liquid > 0)
                                 {
                                     mask |= 2; //top
                                     if (edge.isLava)
@@ -489,7 +614,7 @@ namespace Terrafirma
                                 }
                                 else if (!edge.isActive || !tileInfos[edge.type].solid)
                                     v = 0; // water has a ripple
-                                if ((edge = tiles[sx, sy + 1]).liquid > 0)
+                                if ((edge = tileAt(tiles, sx, sy + 1)).liquid > 0)
                                 {
                                     if (edge.liquid > 240)
                                         mask |= 1; //bottom is high enough
@@ -536,7 +661,7 @@ namespace Terrafirma
                                     double alpha = waterid == 0 ? 0.5 : 0.85;
                                     Texture tex = Textures.GetLiquid(waterid);
                                     drawTextureAlpha(tex, waterw, waterh, v * tex.width * 4,
-                                        pixels, (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0, alpha);
+                                        (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0, alpha);
                                 }
                             }
 
@@ -555,7 +680,7 @@ namespace Terrafirma
                                 //draw armor stand
                                 Texture tex = Textures.GetTile(tile.type);
                                 drawTexture(tex, texw, texh, tile.v * tex.width * 4 + au * 4,
-                                    pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB,tile.color);
+                                    (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB,tile.color);
                                 //draw armor
                                 int armor = tile.u / 100;
                                 if (armor > 0)
@@ -621,7 +746,7 @@ namespace Terrafirma
                                 else
                                     tex = Textures.GetWood(wood);
                                 drawTexture(tex, texw, texh, tile.v * tex.width * 4 + tile.u * 4,
-                                    pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB,tile.color);
+                                    (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB,tile.color);
                             }
                             else if (tile.type == 80) //cactus
                             {
@@ -660,7 +785,7 @@ namespace Terrafirma
                                 else
                                     tex = Textures.GetCactus(cactus);
                                 drawTexture(tex, texw, texh, tile.v * tex.width * 4 + tile.u * 4,
-                                    pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                    (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                             }
                             else if (tile.type == 171) //christmas tree
                             {
@@ -671,31 +796,31 @@ namespace Terrafirma
 
                                 Texture tex = Textures.GetTile(tile.type); //base tree
                                 drawTexture(tex, 64, 128, 0,
-                                    pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                    (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
 
                                 if (topper > 0)
                                 {
                                     tex = Textures.GetXmasTree(3);
                                     drawTexture(tex, 64, 128, 66 * (topper - 1) * 4,
-                                        pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                        (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                 }
                                 if (garland > 0)
                                 {
                                     tex = Textures.GetXmasTree(1);
                                     drawTexture(tex, 64, 128, 66 * (garland - 1) * 4,
-                                        pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                        (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                 }
                                 if (ornaments > 0)
                                 {
                                     tex = Textures.GetXmasTree(2);
                                     drawTexture(tex, 64, 128, 66 * (ornaments - 1) * 4,
-                                        pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                        (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                 }
                                 if (lights > 0)
                                 {
                                     tex = Textures.GetXmasTree(4);
                                     drawTexture(tex, 64, 128, 66 * (lights - 1) * 4,
-                                        pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                        (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                 }
                             }
                             else
@@ -713,7 +838,7 @@ namespace Terrafirma
                                             double xpad = ((double)i * 2.0) * scale / 16.0;
                                             ypad = ((double)toppad + (double)i * 2.0) * scale / 16.0;
                                             drawTexture(tex, 2, 14 - i * 2, tile.v * tex.width * 4 + (tile.u + i * 2) * 4,
-                                                pixels, (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                         }
                                     }
                                     else if (tile.slope == 2)
@@ -723,7 +848,7 @@ namespace Terrafirma
                                             double xpad = (14 - (double)i * 2.0) * scale / 16.0;
                                             ypad = ((double)toppad + (double)i * 2.0) * scale / 16.0;
                                             drawTexture(tex, 2, 14 - i * 2, tile.v * tex.width * 4 + (tile.u + 14 - i * 2) * 4,
-                                                pixels, (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                         }
                                     }
                                     else if (tile.slope == 3)
@@ -733,7 +858,7 @@ namespace Terrafirma
                                             double xpad = ((double)i * 2.0) * scale / 16.0;
                                             ypad = (double)toppad * scale / 16.0;
                                             drawTexture(tex, 2, 16 - i * 2, (tile.v + i * 2) * tex.width * 4 + (tile.u + i * 2) * 4,
-                                                pixels, (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                         }
                                     }
                                     else
@@ -743,20 +868,20 @@ namespace Terrafirma
                                             double xpad = (14 - (double)i * 2.0) * scale / 16.0;
                                             ypad = (double)toppad * scale / 16.0;
                                             drawTexture(tex, 2, 16 - i * 2, (tile.v + i * 2) * tex.width * 4 + (tile.u + 14 - i * 2) * 4,
-                                                pixels, (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                         }
                                     }
                                     if (tile.slope < 3)
                                     {
                                         ypad = ((double)toppad + 14.0) * scale / 16.0;
                                         drawTexture(tex, 16, 2, (tile.v + 14) * tex.width * 4 + tile.u * 4,
-                                            pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                            (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                     }
                                     else
                                     {
                                         ypad = (double)toppad * scale / 16.0;
                                         drawTexture(tex, 16, 2, tile.v * tex.width * 4 + tile.u * 4,
-                                            pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                            (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                     }
                                 }
                                 else
@@ -769,55 +894,55 @@ namespace Terrafirma
                                         {
                                             ypad = ((double)toppad + 8.0) * scale / 16.0;
                                             drawTexture(tex, texw, 8, (tile.v + 8) * tex.width * 4 + tile.u * 4,
-                                                pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                             ypad = (double)toppad * scale / 16.0;
                                             drawTexture(tex, 16, 8, 126 * 4,
-                                                pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                         }
                                         else
                                         {
                                             ypad = ((double)toppad + 8.0) * scale / 16.0;
                                             drawTexture(tex, texw, 8, (tile.v + 8) * tex.width * 4 + tile.u * 4,
-                                                pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                             if (tiles[sx - 1, sy].half) //left side
                                             {
                                                 double xpad = 4 * scale / 16.0;
                                                 ypad = (double)toppad * scale / 16.0;
                                                 drawTexture(tex, texw - 4, texh, tile.v * tex.width * 4 + (tile.u + 4) * 4,
-                                                    pixels, (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                    (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                                 drawTexture(tex, 4, 8, 126 * 4,
-                                                    pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                    (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                             }
                                             else //right side
                                             {
                                                 ypad = (double)toppad * scale / 16.0;
                                                 drawTexture(tex, texw - 4, texh, tile.v * tex.width * 4 + tile.u * 4,
-                                                    pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                    (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                                 double xpad = 12 * scale / 16.0;
                                                 drawTexture(tex, 4, 8, 138 * 4,
-                                                    pixels, (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                    (int)(px + xpad - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                             }
                                         }
                                     }
                                     else
                                     {
                                         //half block on top of an empty space
-                                        if (tile.half && (!tiles[sx, sy + 1].isActive || !tileInfos[tiles[sx, sy + 1].type].solid ||
-                                            tiles[sx, sy + 1].half))
+                                        if (tile.half && (!tileAt(tiles, sx, sy + 1).isActive || !tileInfos[tileAt(tiles, sx, sy + 1).type].solid ||
+                                            tileAt(tiles, sx, sy + 1).half))
                                         {
                                             ypad = ((double)toppad + 8.0) * scale / 16.0;
                                             if (tile.type == 19) //platform
                                             {
                                                 drawTexture(tex, texw, texh, tile.v * tex.width * 4 + tile.u * 4,
-                                                    pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                    (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                             }
                                             else
                                             {
                                                 drawTexture(tex, texw, texh - 12, tile.v * tex.width * 4 + tile.u * 4,
-                                                    pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                    (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                                 ypad = ((double)toppad + 12.0) * scale / 16.0;
                                                 drawTexture(tex, texw, 4, 66 * tex.width * 4 + 144 * 4,
-                                                    pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
+                                                    (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, tile.color);
                                             }
                                         }
                                         else
@@ -831,10 +956,10 @@ namespace Terrafirma
                                             ypad = ((double)toppad + (tile.half ? 8.0 : 0.0)) * scale / 16.0;
                                             if (flip)
                                                 drawTextureFlip(tex, texw - 1, texh, tile.v * tex.width * 4 + tile.u * 4,
-            pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, col);
+            (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, col);
                                             else
                                                 drawTexture(tex, texw, texh - (tile.half ? 8 : 0), tile.v * tex.width * 4 + tile.u * 4,
-                                                pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, col);
+                                                (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, col);
                                         }
                                     }
                                 }
@@ -852,28 +977,28 @@ namespace Terrafirma
                             int v = 0;
                             double ypad = waterLevel * scale / 16.0;
                             //water above, no ripple
-                            if (tiles[sx, sy - 1].liquid > 32 || (tiles[sx,sy-1].isActive && tileInfos[tiles[sx,sy-1].type].solid))
+                            if (tileAt(tiles, sx, sy - 1).liquid > 32 || (tileAt(tiles, sx, sy - 1).isActive && tileInfos[tileAt(tiles, sx, sy - 1).type].solid))
                                 v = 4;
 
                             Texture tex = Textures.GetLiquid(waterid);
                             drawTextureAlpha(tex, 16, waterh, v * tex.width * 4,
-                                pixels, (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0, alpha);
+                                (int)(px - shiftx), (int)(py + ypad - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0, alpha);
                         }
                         if (wires && tile.actuator)
                         {
                             Texture tex = Textures.GetActuator(0);
                             drawTexture(tex, 16, 16, 0,
-                                pixels, (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0);
+                                (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, 0);
                         }
                         // draw wires if necessary
                         if (wires && tile.hasRedWire)
-                            drawRedWire(sx, sy, pixels,
+                            drawRedWire(sx, sy,
                                 (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, ref tiles);
                         if (wires && tile.hasGreenWire)
-                            drawGreenWire(sx, sy, pixels,
+                            drawGreenWire(sx, sy,
                                 (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, ref tiles);
                         if (wires && tile.hasBlueWire)
-                            drawBlueWire(sx, sy, pixels,
+                            drawBlueWire(sx, sy,
                                 (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB, ref tiles);
                         
                         px += (int)scale;
@@ -939,21 +1064,21 @@ namespace Terrafirma
                         }
                         if (au >= 36) //reverse
                             drawTexture(tex, texw, texh, 0,
-                                pixels, (int)(delay.px - 4.0 * scale / 16.0), (int)(delay.py - dy), width, height, scale / 16.0, lightR, lightG, lightB, 0);
+                                (int)(delay.px - 4.0 * scale / 16.0), (int)(delay.py - dy), width, height, scale / 16.0, lightR, lightG, lightB, 0);
                         else
                             drawTextureFlip(tex, texw, texh, 0,
-                                pixels, (int)(delay.px - 4 * scale / 16.0), (int)(delay.py - dy), width, height, scale / 16.0, lightR, lightG, lightB, 0);
+                                (int)(delay.px - 4 * scale / 16.0), (int)(delay.py - dy), width, height, scale / 16.0, lightR, lightG, lightB, 0);
                     }
                     else if (tile.type == 5) //tree leaves
                     {
                         drawLeaves(tile.u, tile.v, delay.sx, delay.sy,
-                                   pixels, delay.px, delay.py, width, height, scale / 16.0, lightR, lightG, lightB, ref tiles);
+                                   delay.px, delay.py, width, height, scale / 16.0, lightR, lightG, lightB, ref tiles);
                     }
                     else if (tile.type == 237) //lihzahrd altar
                     {
                         tex = Textures.GetTile(tile.type);
                         drawTexture(tex, texw, texh, 0,
-                            pixels, delay.px, delay.py, width, height, scale / 16.0, lightR, lightG, lightB, 0);
+                            delay.px, delay.py, width, height, scale / 16.0, lightR, lightG, lightB, 0);
                     }
                 }
 
@@ -987,7 +1112,7 @@ namespace Terrafirma
                         Texture tex = Textures.GetNPC(npc.sprite);
                         px = (int)(skipx + npc.x / 16 - (int)startx) * (int)scale - (int)(scale / 4);
                         py = (int)(skipy + npc.y / 16 - (int)starty) * (int)scale - (int)(scale / 4);
-                        drawTexture(tex, tex.width, 56, 0, pixels,
+                        drawTexture(tex, tex.width, 56, 0,
                             (int)(px - shiftx), (int)(py - shifty), width, height, scale / 16.0, lightR, lightG, lightB,0);
                     }
                     if (houses && npc.num != 0)
@@ -1029,22 +1154,27 @@ namespace Terrafirma
                             Texture tex = Textures.GetBanner(1); //house banner
                             int npx = (int)(px - tex.width * scale / 32.0);
                             int npy = (int)(py - tex.height * scale / 32.0);
-                            drawTexture(tex, 32, 40, 0, pixels,
+                            drawTexture(tex, 32, 40, 0,
                                 (int)(npx - shiftx), (int)(npy - shifty), width, height, scale / 16.0, lightR, lightG, lightB,0);
                             tex = Textures.GetNPCHead(npc.num);
                             npx = (int)(px - tex.width * scale / 32.0);
                             npy = (int)(py - tex.height * scale / 32.0);
-                            drawTexture(tex, tex.width, tex.height, 0, pixels,
+                            drawTexture(tex, tex.width, tex.height, 0,
                                 (int)(npx - shiftx), (int)(npy - shifty), width, height, scale / 16.0, lightR, lightG, lightB,0);
                         }
                     }
                 }
+
+                execute(pixels, width, bandTop, bandRows);
+                commands.Clear();
+                target = null;
             }
             else
             {
-                for (int y = 0; y < height; y++)
+                //every row is independent, so spread them over the cores
+                Parallel.For(bandTop, bandTop + bandRows, delegate(int y)
                 {
-                    int bofs = y * width * 4;
+                    int bofs = (y - bandTop) * width * 4;
                     int sy = (int)(y / scale + starty);
                     for (int x = 0; x < width; x++)
                     {
@@ -1053,30 +1183,7 @@ namespace Terrafirma
                         if (sx >= 0 && sx < tilesWide && sy >= 0 && sy < tilesHigh)
                         {
                             Tile tile = tiles[sx, sy];
-                            if (sy < groundLevel)
-                                c = skyColor;
-                            else if (sy < rockLevel)
-                                c = earthColor;
-                            else
-                            {
-                                //fade between rockColor and hellColor...
-                                double alpha = (double)(sy - rockLevel) / (double)(tilesHigh - rockLevel);
-                                c = alphaBlend(rockColor, hellColor, alpha);
-                            }
-                            if (tile.wall > 0)
-                            {
-                                c = wallInfo[tile.wall].color;
-                            }
-                            if (tile.isActive)
-                            {
-                                c = tileInfos[tile.type, tile.u, tile.v].color;
-                                if (tile.inactive)
-                                    c = alphaBlend(c, 0x000000, 0.4);
-                                if (isHilight && tileInfos[tile.type, tile.u, tile.v].isHilighting)
-                                    c = alphaBlend(c, 0xff88ff, 0.9);
-                            }
-                            if (tile.liquid > 0)
-                                c = alphaBlend(c, tile.isLava ? lavaColor : tile.isHoney ? honeyColor : waterColor, 0.5);
+                            c = flatColor(tile, sy, isHilight, 0);
                             if (light == 1)
                                 c = alphaBlend(0, c, tile.light);
                             else if (light == 2)
@@ -1097,9 +1204,126 @@ namespace Terrafirma
                         pixels[bofs++] = (byte)((c >> 16) & 0xff);
                         pixels[bofs++] = 0xff;
                     }
-                }
+                });
             }
         }
+
+        /// <summary>
+        /// The untextured, unlit color of a tile.  shades is how many steps the
+        /// fade from rock to hell is drawn in, or 0 for a smooth fade.
+        /// </summary>
+        private UInt32 flatColor(Tile tile, int sy, bool isHilight, int shades)
+        {
+            UInt32 c;
+            if (sy < groundLevel)
+                c = skyColor;
+            else if (sy < rockLevel)
+                c = earthColor;
+            else
+            {
+                //fade between rockColor and hellColor...
+                double alpha = (double)(sy - rockLevel) / (double)(tilesHigh - rockLevel);
+                if (shades > 0)
+                    alpha = Math.Round(alpha * shades) / shades;
+                c = alphaBlend(rockColor, hellColor, alpha);
+            }
+            if (tile.wall > 0)
+            {
+                c = wallInfo[tile.wall].color;
+            }
+            if (tile.isActive)
+            {
+                c = tileInfos[tile.type, tile.u, tile.v].color;
+                if (tile.inactive)
+                    c = alphaBlend(c, 0x000000, 0.4);
+                if (isHilight && tileInfos[tile.type, tile.u, tile.v].isHilighting)
+                    c = alphaBlend(c, 0xff88ff, 0.9);
+            }
+            if (tile.liquid > 0)
+                c = alphaBlend(c, tile.isLava ? lavaColor : tile.isHoney ? honeyColor : waterColor, 0.5);
+            return c;
+        }
+
+        //the rock to hell fade alone would fill a palette, so indexed
+        //images draw it in steps
+        const int IndexedShades = 32;
+
+        private UInt32 indexedColor(Tile[,] tiles, int sx, int sy, bool fogofwar)
+        {
+            if (sx < 0 || sx >= tilesWide || sy < 0 || sy >= tilesHigh)
+                return 0xffffff;
+            Tile tile = tiles[sx, sy];
+            if (fogofwar && !tile.seen)
+                return 0;
+            return flatColor(tile, sy, false, IndexedShades);
+        }
+
+        /// <summary>
+        /// Counts how many tiles of each color DrawIndexed would draw in the
+        /// region, to build its palette from.
+        /// </summary>
+        public Dictionary<UInt32, long> CountColors(int width, int height,
+            double startx, double starty, double scale, bool fogofwar, Tile[,] tiles)
+        {
+            int x0 = (int)startx, x1 = (int)((width - 1) / scale + startx);
+            int y0 = (int)starty, y1 = (int)((height - 1) / scale + starty);
+            Dictionary<UInt32, long> counts = new Dictionary<UInt32, long>();
+            Parallel.For<Dictionary<UInt32, long>>(y0, y1 + 1,
+                delegate() { return new Dictionary<UInt32, long>(); },
+                delegate(int sy, ParallelLoopState state, Dictionary<UInt32, long> local)
+                {
+                    for (int sx = x0; sx <= x1; sx++)
+                    {
+                        UInt32 c = indexedColor(tiles, sx, sy, fogofwar);
+                        long n;
+                        local.TryGetValue(c, out n);
+                        local[c] = n + 1;
+                    }
+                    return local;
+                },
+                delegate(Dictionary<UInt32, long> local)
+                {
+                    lock (counts)
+                    {
+                        foreach (KeyValuePair<UInt32, long> kv in local)
+                        {
+                            long n;
+                            counts.TryGetValue(kv.Key, out n);
+                            counts[kv.Key] = n + kv.Value;
+                        }
+                    }
+                });
+            return counts;
+        }
+
+        /// <summary>
+        /// Draws the flat map as palette indices, a byte per pixel, with the
+        /// same startx,starty placement as DrawRegion.  Indexed maps aren't lit.
+        /// </summary>
+        public void DrawIndexed(int width, int height,
+            double startx, double starty, double scale, byte[] indices,
+            MapPalette palette, bool fogofwar, Tile[,] tiles)
+        {
+            Parallel.For(0, height, delegate(int y)
+            {
+                int ofs = y * width;
+                int sy = (int)(y / scale + starty);
+                int lastx = Int32.MinValue;
+                byte index = 0;
+                for (int x = 0; x < width; x++)
+                {
+                    int sx = (int)(x / scale + startx);
+                    //zoomed in, a tile covers several pixels in a row
+                    if (sx != lastx)
+                    {
+                        index = palette.IndexOf(indexedColor(tiles, sx, sy, fogofwar));
+                        lastx = sx;
+                    }
+                    indices[ofs++] = index;
+                }
+            });
+        }
+
         private int findCorruptGrass(int x, int y, ref Tile[,] tiles)
         {
             for (int i = 0; i < 100; i++)
@@ -1143,7 +1367,7 @@ namespace Terrafirma
             return 0;
         }
 
-        private void drawRedWire(int sx, int sy, byte[] pixels, int px, int py, int w, int h, double zoom, double lightR, double lightG, double lightB, ref Tile[,] tiles)
+        private void drawRedWire(int sx, int sy, int px, int py, int w, int h, double zoom, double lightR, double lightG, double lightB, ref Tile[,] tiles)
         {
             int mask = 0;
             //udlr
@@ -1152,10 +1376,10 @@ namespace Terrafirma
             if (sy < tilesHigh - 1 && tiles[sx, sy + 1].hasRedWire) mask |= 4; //down
             if (sy > 0 && tiles[sx, sy - 1].hasRedWire) mask |= 8; //up
             Texture tex = Textures.GetWire(0);
-            drawTexture(tex, 16, 16, uvWires[mask * 2 + 1] * tex.width * 4 + uvWires[mask * 2] * 4, pixels,
+            drawTexture(tex, 16, 16, uvWires[mask * 2 + 1] * tex.width * 4 + uvWires[mask * 2] * 4,
                 px, py, w, h, zoom, lightR, lightG, lightB,0);
         }
-        private void drawGreenWire(int sx, int sy, byte[] pixels, int px, int py, int w, int h, double zoom, double lightR, double lightG, double lightB, ref Tile[,] tiles)
+        private void drawGreenWire(int sx, int sy, int px, int py, int w, int h, double zoom, double lightR, double lightG, double lightB, ref Tile[,] tiles)
         {
             int mask = 0;
             //udlr
@@ -1164,10 +1388,10 @@ namespace Terrafirma
             if (sy < tilesHigh - 1 && tiles[sx, sy + 1].hasGreenWire) mask |= 4; //down
             if (sy > 0 && tiles[sx, sy - 1].hasGreenWire) mask |= 8; //up
             Texture tex = Textures.GetWire(1);
-            drawTexture(tex, 16, 16, uvWires[mask * 2 + 1] * tex.width * 4 + uvWires[mask * 2] * 4, pixels,
+            drawTexture(tex, 16, 16, uvWires[mask * 2 + 1] * tex.width * 4 + uvWires[mask * 2] * 4,
                 px, py, w, h, zoom, lightR, lightG, lightB,0);
         }
-        private void drawBlueWire(int sx, int sy, byte[] pixels, int px, int py, int w, int h, double zoom, double lightR, double lightG, double lightB, ref Tile[,] tiles)
+        private void drawBlueWire(int sx, int sy, int px, int py, int w, int h, double zoom, double lightR, double lightG, double lightB, ref Tile[,] tiles)
         {
             int mask = 0;
             //udlr
@@ -1176,12 +1400,12 @@ namespace Terrafirma
             if (sy < tilesHigh - 1 && tiles[sx, sy + 1].hasBlueWire) mask |= 4; //down
             if (sy > 0 && tiles[sx, sy - 1].hasBlueWire) mask |= 8; //up
             Texture tex = Textures.GetWire(2);
-            drawTexture(tex, 16, 16, uvWires[mask * 2 + 1] * tex.width * 4 + uvWires[mask * 2] * 4, pixels,
+            drawTexture(tex, 16, 16, uvWires[mask * 2 + 1] * tex.width * 4 + uvWires[mask * 2] * 4,
                 px, py, w, h, zoom, lightR, lightG, lightB,0);
         }
 
         private void drawLeaves(int u, int v, int sx, int sy,
-            byte[] pixels, int px, int py,
+            int px, int py,
             int w, int h, double zoom, double lightR, double lightG, double lightB, ref Tile[,] tiles)
         {
             if (u < 22 || v < 198) return; //not a leaf
@@ -1199,14 +1423,14 @@ namespace Terrafirma
                     if (leafType == 3) //hallowed
                     {
                         variant += (sx % 3) * 3;
-                        drawTexture(tex, 80, 140, variant * 82 * 4, pixels,
+                        drawTexture(tex, 80, 140, variant * 82 * 4,
                             px - (int)(30 * zoom), py - (int)(124 * zoom), w, h, zoom, lightR, lightG, lightB,0);
                     }
                     else if (leafType == 2 || leafType==11 || leafType==13) //jungle
-                        drawTexture(tex, 114, 96, variant * 116 * 4, pixels,
+                        drawTexture(tex, 114, 96, variant * 116 * 4,
                             px - (int)(46 * zoom), py - (int)(80 * zoom), w, h, zoom, lightR, lightG, lightB,0);
                     else
-                        drawTexture(tex, 80, 80, variant * 82 * 4, pixels,
+                        drawTexture(tex, 80, 80, variant * 82 * 4,
                             px - (int)(30 * zoom), py - (int)(62 * zoom), w, h, zoom, lightR, lightG, lightB,0);
                     break;
                 case 44: //left branch
@@ -1214,7 +1438,7 @@ namespace Terrafirma
                     tex = Textures.GetTreeBranches(leafType);
                     if (leafType == 3) //hallowed
                         variant += (sx % 3) * 3;
-                    drawTexture(tex, 40, 40, variant * 42 * tex.width * 4, pixels,
+                    drawTexture(tex, 40, 40, variant * 42 * tex.width * 4,
                         px - (int)(22 * zoom), py - (int)(12 * zoom), w, h, zoom, lightR, lightG, lightB,0);
                     break;
                 case 66: //right branch
@@ -1222,13 +1446,13 @@ namespace Terrafirma
                     tex = Textures.GetTreeBranches(leafType);
                     if (leafType == 3) //hallowed
                         variant += (sx % 3) * 3;
-                    drawTexture(tex, 40, 40, variant * 42 * tex.width * 4 + 42 * 4, pixels,
+                    drawTexture(tex, 40, 40, variant * 42 * tex.width * 4 + 42 * 4,
                         px, py - (int)(12 * zoom), w, h, zoom, lightR, lightG, lightB,0);
                     break;
             }
         }
         private void drawMushroom(int u, int v,
-            byte[] pixels, int px, int py,
+            int px, int py,
             int w, int h, double zoom, double lightR, double lightG, double lightB)
         {
             int variant = 0;
@@ -1237,327 +1461,292 @@ namespace Terrafirma
             else if (v == 36)
                 variant = 2;
             Texture tex = Textures.GetShroomTop(0);
-            drawTexture(tex, 60, 42, variant * 62 * 4, pixels,
+            drawTexture(tex, 60, 42, variant * 62 * 4,
                 px - (int)(22 * zoom), py - (int)(26 * zoom), w, h, zoom, lightR, lightG, lightB,0);
         }
 
+        // the build stage: these record a sprite into the command list rather
+        // than drawing it, so every decision about what to draw is made before
+        // a single pixel is touched.
         void drawTexture(Texture tex, int bw, int bh, int tofs,
-            byte[] pixels, int px, int py,
+            int px, int py,
             int w, int h, double zoom, double lightR, double lightG, double lightB,byte paint)
         {
-            int tw = (int)(bw * zoom+0.5);
-            int th = (int)(bh * zoom+0.5);
-            int skipx = 0, skipy = 0;
-            if (px < 0) skipx = -px;
-            if (px + tw >= w) tw = w - px;
-            if (bw <= 0) return;
-            if (py < 0) skipy = -py;
-            if (py + th >= h) th = h - py;
-            if (bh <= 0) return;
+            addCommand(tex, bw, bh, tofs, px, py, w, h, zoom, lightR, lightG, lightB, paint, -1, false);
+        }
+        void drawTextureAlpha(Texture tex, int bw, int bh, int tofs,
+            int px, int py,
+            int w, int h, double zoom, double lightR, double lightG, double lightB, byte paint, double alpha)
+        {
+            addCommand(tex, bw, bh, tofs, px, py, w, h, zoom, lightR, lightG, lightB, paint,
+                (int)(alpha * 255.0 + 0.5), false);
+        }
+        void drawTextureFlip(Texture tex, int bw, int bh, int tofs,
+            int px, int py,
+            int w, int h, double zoom, double lightR, double lightG, double lightB,byte paint)
+        {
+            addCommand(tex, bw, bh, tofs, px, py, w, h, zoom, lightR, lightG, lightB, paint, -1, true);
+        }
 
-            int bofs = py * w * 4 + px * 4;
-            for (int y = 0; y < th; y++)
+        // one sprite, ready to rasterize.  commands are executed in the order
+        // they were added, which is what gives us the layering (backgrounds,
+        // walls, tiles, liquids, wires, then the delayed sprites and npcs).
+        private struct DrawCommand
+        {
+            public Texture tex;
+            public int tofs;        //texel offset of the top left of the source
+            public int bw, bh;      //source size in texels
+            public int px, py;      //destination position
+            public int tw, th;      //destination size
+            public double zoom;
+            public int lr, lg, lb;  //rows in lightTable
+            public int alpha;       //constant alpha out of 255, or -1 for the texture's own
+            public bool flip;
+        }
+
+        List<DrawCommand> commands = new List<DrawCommand>();
+        // where the commands being built go.  a list this long is run and
+        // cleared early, which draws the same since commands run in order;
+        // it keeps a big export's list from growing without bound.
+        public const int MaxCommands = 1 << 18;
+        // a DrawCommand, and its index in execute's band lists
+        public const long CommandBytes = 80;
+        byte[] target;
+        int targetWidth, targetFirst, targetRows;
+
+        void addCommand(Texture tex, int bw, int bh, int tofs, int px, int py, int w, int h,
+            double zoom, double lightR, double lightG, double lightB, byte paint, int alpha, bool flip)
+        {
+            DrawCommand cmd;
+            cmd.tw = (int)(bw * zoom + 0.5);
+            cmd.th = (int)(bh * zoom + 0.5);
+            int x0, y0, x1, y1;
+            if (!clipSprite(px, py, cmd.tw, cmd.th, 0, 0, w, h, out x0, out y0, out x1, out y1))
+                return; //entirely off screen
+            if (paint > 0)
+                tex = Textures.GetPainted(tex, paint);
+            cmd.tex = tex;
+            cmd.tofs = tofs;
+            cmd.bw = bw;
+            cmd.bh = bh;
+            cmd.px = px;
+            cmd.py = py;
+            cmd.zoom = zoom;
+            cmd.lr = lightLevel(lightR);
+            cmd.lg = lightLevel(lightG);
+            cmd.lb = lightLevel(lightB);
+            cmd.alpha = alpha;
+            cmd.flip = flip;
+            commands.Add(cmd);
+            if (commands.Count >= MaxCommands)
             {
-                if (y < skipy)
-                {
-                    bofs += w * 4;
-                    continue;
-                }
-                int t = tofs + (int)(y / zoom) * tex.width * 4;
-                //if we go off the end of the texture (like with water)
-                //we should duplicate the last line.
-                while (t >= tex.data.Length)
-                    t -= tex.width * 4;
-                int b = bofs;
-                for (int x = 0; x < tw; x++)
-                {
-                    int tx = t + (int)(x / zoom) * 4;
-                    if (x < skipx || tex.data[tx + 3] == 0)
-                    {
-                        b += 4;
-                        continue;
-                    }
-                    byte blue = tex.data[tx++];
-                    byte green = tex.data[tx++];
-                    byte red = tex.data[tx++];
-                    if (paint > 0)
-                        applyPaint(paint, ref red, ref green, ref blue);
-                    if (tex.data[tx] < 255) //alpha blend, damn
-                    {
-                        UInt32 c = (uint)(blue * lightB) | ((uint)(green * lightG) << 8) | ((uint)(red * lightR) << 16);
-                        UInt32 orig = (UInt32)(pixels[b] | (pixels[b + 1] << 8) | (pixels[b + 2] << 16));
-                        orig = alphaBlend(orig, c, tex.data[tx] / 255.0);
-                        pixels[b++] = (byte)(orig & 0xff);
-                        pixels[b++] = (byte)((orig >> 8) & 0xff);
-                        pixels[b++] = (byte)((orig >> 16) & 0xff);
-                        pixels[b++] = 0xff;
-                    }
-                    else
-                    {
-                        pixels[b++] = (byte)(blue * lightB);
-                        pixels[b++] = (byte)(green * lightG);
-                        pixels[b++] = (byte)(red * lightR);
-                        pixels[b++] = 0xff;
-                    }
-                }
-                bofs += w * 4;
+                execute(target, targetWidth, targetFirst, targetRows);
+                commands.Clear();
             }
         }
-        void drawTextureAlpha(Texture tex, int bw, int bh, int tofs,
-            byte[] pixels, int px, int py,
-            int w, int h, double zoom, double lightR, double lightG, double lightB, byte paint, double alpha)
+
+        // the execute stage.  the frame is cut into horizontal bands which are
+        // rasterized in parallel; each band runs every command that touches it,
+        // in build order, clipped to the band.  so overlapping sprites stack
+        // exactly as they would drawing the whole list on one thread.  only
+        // rows first to first+h are kept, and pixels starts at row first.
+        const int BandsPerCore = 4;
+        const int MinBandHeight = 16;
+        void execute(byte[] pixels, int w, int first, int h)
         {
-            int tw = (int)(bw * zoom + 0.5);
-            int th = (int)(bh * zoom + 0.5);
-            int skipx = 0, skipy = 0;
-            if (px < 0) skipx = -px;
-            if (px + tw >= w) tw = w - px;
-            if (bw <= 0) return;
-            if (py < 0) skipy = -py;
-            if (py + th >= h) th = h - py;
-            if (bh <= 0) return;
+            int numBands = Environment.ProcessorCount * BandsPerCore;
+            int bandHeight = Math.Max(MinBandHeight, (h + numBands - 1) / numBands);
+            numBands = (h + bandHeight - 1) / bandHeight;
+            if (numBands <= 0) return;
+
+            List<int>[] bands = new List<int>[numBands];
+            for (int i = 0; i < numBands; i++)
+                bands[i] = new List<int>();
+            for (int i = 0; i < commands.Count; i++)
+            {
+                DrawCommand cmd = commands[i];
+                int py = cmd.py - first;
+                if (py >= h || py + cmd.th <= 0)
+                    continue; //only in the rows thrown away
+                int firstBand = Math.Max(py, 0) / bandHeight;
+                int lastBand = (Math.Min(py + cmd.th, h) - 1) / bandHeight;
+                for (int b = firstBand; b <= lastBand; b++)
+                    bands[b].Add(i);
+            }
 
-            int bofs = py * w * 4 + px * 4;
-            for (int y = 0; y < th; y++)
+            Parallel.For(0, numBands, delegate(int band)
             {
-                if (y < skipy)
+                int top = first + band * bandHeight;
+                int bottom = Math.Min(top + bandHeight, first + h);
+                foreach (int i in bands[band])
+                    rasterize(commands[i], pixels, w, top, bottom, first);
+            });
+        }
+
+        void rasterize(DrawCommand cmd, byte[] pixels, int w, int top, int bottom, int first)
+        {
+            int x0, y0, x1, y1;
+            if (!clipSprite(cmd.px, cmd.py, cmd.tw, cmd.th, 0, top, w, bottom, out x0, out y0, out x1, out y1))
+                return;
+            byte[] data = cmd.tex.data;
+            int stride = cmd.tex.width * 4;
+            RowKernel kernel = cmd.alpha >= 0 ? alphaRow : pickKernel(cmd.tex);
+            int[] cols = mapColumns(cmd.bw, x1, cmd.zoom, cmd.flip);
+
+            for (int y = y0; y < y1; y++)
+            {
+                int t = cmd.tofs + (int)(y / cmd.zoom) * stride;
+                if (cmd.flip)
                 {
-                    bofs += w * 4;
-                    continue;
+                    if (t >= data.Length) continue;
                 }
-                int t = tofs + (int)(y / zoom) * tex.width * 4;
-                //if we go off the end of the texture (like with water)
-                //we should duplicate the last line.
-                while (t >= tex.data.Length)
-                    t -= tex.width * 4;
-                int b = bofs;
-                for (int x = 0; x < tw; x++)
+                else
                 {
-                    int tx = t + (int)(x / zoom) * 4;
-                    if (x < skipx || tex.data[tx + 3] == 0)
-                    {
-                        b += 4;
-                        continue;
-                    }
-                    byte blue = tex.data[tx++];
-                    byte green = tex.data[tx++];
-                    byte red = tex.data[tx++];
-                    if (paint > 0)
-                        applyPaint(paint, ref red, ref green, ref blue);
-                    UInt32 c = (uint)(blue * lightB) | ((uint)(green * lightG) << 8) | ((uint)(red * lightR) << 16);
-                    UInt32 orig = (UInt32)(pixels[b] | (pixels[b + 1] << 8) | (pixels[b + 2] << 16));
-                    orig = alphaBlend(orig, c, alpha);
-                    pixels[b++] = (byte)(orig & 0xff);
-                    pixels[b++] = (byte)((orig >> 8) & 0xff);
-                    pixels[b++] = (byte)((orig >> 16) & 0xff);
-                    pixels[b++] = 0xff;
+                    //if we go off the end of the texture (like with water)
+                    //we should duplicate the last line.
+                    while (t >= data.Length)
+                        t -= stride;
                 }
-                bofs += w * 4;
+                kernel(data, t, cols, x0, x1, pixels, (cmd.py + y - first) * w * 4 + (cmd.px + x0) * 4,
+                    cmd.lr, cmd.lg, cmd.lb, cmd.alpha);
             }
         }
-        void drawTextureFlip(Texture tex, int bw, int bh, int tofs,
-            byte[] pixels, int px, int py,
-            int w, int h, double zoom, double lightR, double lightG, double lightB,byte paint)
+
+        // a neighbour of a tile being drawn, or an empty tile past the edge of
+        // the map, so tiles along the edge can look around them.
+        static readonly Tile offMap = new Tile();
+        Tile tileAt(Tile[,] tiles, int x, int y)
         {
-            int tw = (int)(bw * zoom +0.5);
-            int th = (int)(bh * zoom +0.5);
-            int skipx = 0, skipy = 0;
-            if (px < 0) skipx = -px;
-            if (px + tw >= w) tw = w - px;
-            if (bw <= 0) return;
-            if (py < 0) skipy = -py;
-            if (py + th >= h) th = h - py;
-            if (bh <= 0) return;
+            if (x < 0 || y < 0 || x >= tilesWide || y >= tilesHigh)
+                return offMap;
+            return tiles[x, y];
+        }
 
-            int bofs = py * w * 4 + px * 4;
-            for (int y = 0; y < th; y++)
+        // clips a tw x th sprite at px,py against the clip rectangle, giving
+        // the range of sprite columns and rows that actually land inside it.
+        static bool clipSprite(int px, int py, int tw, int th,
+            int left, int top, int right, int bottom,
+            out int x0, out int y0, out int x1, out int y1)
+        {
+            x0 = px < left ? left - px : 0;
+            y0 = py < top ? top - py : 0;
+            x1 = px + tw > right ? right - px : tw;
+            y1 = py + th > bottom ? bottom - py : th;
+            return x0 < x1 && y0 < y1;
+        }
+
+        // blits one row of texels, columns x0 to x1, starting at pixel offset b.
+        // which kernel gets used is decided once per sprite from the texture's
+        // opacity, so the inner loops don't have to test for it.  the
+        // benchmarks swap in other kernels to compare them.
+        internal delegate void RowKernel(byte[] data, int t, int[] cols, int x0, int x1,
+            byte[] pixels, int b, int lr, int lg, int lb, int alpha);
+        internal static RowKernel opaqueRow = blitOpaqueRow;
+        internal static RowKernel maskedRow = blitMaskedRow;
+        internal static RowKernel blendedRow = blitBlendedRow;
+        internal static RowKernel alphaRow = blitAlphaRow;
+
+        static RowKernel pickKernel(Texture tex)
+        {
+            if (tex.opaque)
+                return opaqueRow;
+            if (tex.translucent)
+                return blendedRow;
+            return maskedRow;
+        }
+        static void blitOpaqueRow(byte[] data, int t, int[] cols, int x0, int x1,
+            byte[] pixels, int b, int lr, int lg, int lb, int alpha)
+        {
+            for (int x = x0; x < x1; x++, b += 4)
             {
-                if (y < skipy)
-                {
-                    bofs += w * 4;
+                int tx = t + cols[x];
+                pixels[b] = lightTable[lb + data[tx]];
+                pixels[b + 1] = lightTable[lg + data[tx + 1]];
+                pixels[b + 2] = lightTable[lr + data[tx + 2]];
+                pixels[b + 3] = 0xff;
+            }
+        }
+        static void blitMaskedRow(byte[] data, int t, int[] cols, int x0, int x1,
+            byte[] pixels, int b, int lr, int lg, int lb, int alpha)
+        {
+            for (int x = x0; x < x1; x++, b += 4)
+            {
+                int tx = t + cols[x];
+                if (data[tx + 3] == 0)
                     continue;
-                }
-                int t = tofs + (int)(y / zoom) * tex.width * 4;
-                if (t >= tex.data.Length) continue;
-                int b = bofs;
-                for (int x = 0; x < tw; x++)
-                {
-                    int tx = t + (int)(bw - x / zoom) * 4;
-                    if (x < skipx || tex.data[tx + 3] == 0)
-                    {
-                        b += 4;
-                        continue;
-                    }
-                    byte blue = tex.data[tx++];
-                    byte green = tex.data[tx++];
-                    byte red = tex.data[tx++];
-                    if (paint > 0)
-                        applyPaint(paint, ref red, ref green, ref blue);
-                    if (tex.data[tx] < 255) //alpha blend
-                    {
-                        UInt32 c = (uint)(blue * lightB) | ((uint)(green * lightG) << 8) | ((uint)(red * lightR) << 16);
-                        UInt32 orig = (UInt32)(pixels[b] | (pixels[b + 1] << 8) | (pixels[b + 2] << 16));
-                        orig = alphaBlend(orig, c, tex.data[tx] / 255.0);
-                        pixels[b++] = (byte)(orig & 0xff);
-                        pixels[b++] = (byte)((orig >> 8) & 0xff);
-                        pixels[b++] = (byte)((orig >> 16) & 0xff);
-                        pixels[b++] = 0xff;
-                    }
-                    else
-                    {
-                        pixels[b++] = (byte)(blue * lightB);
-                        pixels[b++] = (byte)(green * lightG);
-                        pixels[b++] = (byte)(red * lightR);
-                        pixels[b++] = 0xff;
-                    }
-                }
-                bofs += w * 4;
+                pixels[b] = lightTable[lb + data[tx]];
+                pixels[b + 1] = lightTable[lg + data[tx + 1]];
+                pixels[b + 2] = lightTable[lr + data[tx + 2]];
+                pixels[b + 3] = 0xff;
             }
         }
-        void applyPaint(byte paint, ref byte red, ref byte green, ref byte blue)
+        static void blitBlendedRow(byte[] data, int t, int[] cols, int x0, int x1,
+            byte[] pixels, int b, int lr, int lg, int lb, int alpha)
         {
-            if (paint > 27) //grass colors
+            for (int x = x0; x < x1; x++, b += 4)
             {
-                //skip nongrass part
-                if (blue * 0.5 < green && green * 0.5 < blue &&
-                    red * 0.3 < blue && red * 0.8 > blue &&
-                    red * 0.8 > green && red * 0.3 < green)
-                    return;
-                paint -= 27;
+                int tx = t + cols[x];
+                int a = data[tx + 3];
+                if (a == 0)
+                    continue;
+                pixels[b] = blend(pixels[b], lightTable[lb + data[tx]], a);
+                pixels[b + 1] = blend(pixels[b + 1], lightTable[lg + data[tx + 1]], a);
+                pixels[b + 2] = blend(pixels[b + 2], lightTable[lr + data[tx + 2]], a);
+                pixels[b + 3] = 0xff;
             }
-
-            byte max = red > green ? red : green;
-            byte min = red < green ? red : green;
-            if (blue > max) max = blue;
-            if (blue < min) min = blue;
-            switch (paint)
+        }
+        // liquids, drawn with one constant alpha over the whole sprite
+        static void blitAlphaRow(byte[] data, int t, int[] cols, int x0, int x1,
+            byte[] pixels, int b, int lr, int lg, int lb, int alpha)
+        {
+            for (int x = x0; x < x1; x++, b += 4)
             {
-                case 1: //Red
-                    red = max;
-                    green = blue = min;
-                    break;
-                case 2: //Orange
-                    red = max;
-                    green = (byte)((max + min) / 2);
-                    blue = min;
-                    break;
-                case 3: //Yellow
-                    red = green = max;
-                    blue = min;
-                    break;
-                case 4: //Lime
-                    red = (byte)((max + min) / 2);
-                    green = max;
-                    blue = min;
-                    break;
-                case 5: //Green
-                    red = blue = min;
-                    green = max;
-                    break;
-                case 6: //Teal
-                    red = min;
-                    green = max;
-                    blue = (byte)((max + min) / 2);
-                    break;
-                case 7: //Cyan
-                    red = min;
-                    green = blue = max;
-                    break;
-                case 8: //SkyBlue
-                    red = min;
-                    green = (byte)((max + min) / 2);
-                    blue = max;
-                    break;
-                case 9: //Blue
-                    red = green = min;
-                    blue = max;
-                    break;
-                case 10: //Purple
-                    red = (byte)((max + min) / 2);
-                    green = min;
-                    blue = max;
-                    break;
-                case 11: //Violet
-                    red = blue = max;
-                    green = min;
-                    break;
-                case 12: //Pink
-                    red = max;
-                    green = min;
-                    blue = (byte)((max + min) / 2);
-                    break;
-                case 13: //DeepRed
-                    red = max;
-                    green = blue = (byte)(min * 0.4);
-                    break;
-                case 14: //DeepOrange
-                    red = max;
-                    green = (byte)((max + min * 0.4) / 2);
-                    blue = (byte)(min * 0.4);
-                    break;
-                case 15: //DeepYellow
-                    red = green = max;
-                    blue = (byte)(min * 0.4);
-                    break;
-                case 16: //DeepLime
-                    red = (byte)((max + min * 0.4) / 2);
-                    green = max;
-                    blue = (byte)(min * 0.4);
-                    break;
-                case 17: //DeepGreen
-                    red = blue = (byte)(min * 0.4);
-                    green = max;
-                    break;
-                case 18: //DeepTeal
-                    red = (byte)(min * 0.4);
-                    green = max;
-                    blue = (byte)((max + min * 0.4) / 2);
-                    break;
-                case 19: //DeepCyan
-                    red = (byte)(min * 0.4);
-                    green = blue = max;
-                    break;
-                case 20: //DeepSkyBlue
-                    red = (byte)(min * 0.4);
-                    green = (byte)((max + min * 0.4) / 2);
-                    blue = max;
-                    break;
-                case 21: //DeepBlue
-                    red = green = (byte)(min * 0.4);
-                    blue = max;
-                    break;
-                case 22: //DeepPurple
-                    red = (byte)((max + min * 0.4) / 2);
-                    green = (byte)(min * 0.4);
-                    blue = max;
-                    break;
-                case 23: //DeepViolet
-                    red = blue = max;
-                    green = (byte)(min * 0.4);
-                    break;
-                case 24: //DeepPink
-                    red = max;
-                    green = (byte)(min * 0.4);
-                    blue = (byte)((max + min * 0.4) / 2);
-                    break;
-                case 25: //Black
-                    red = green = blue = (byte)((max + min) * 0.15);
-                    break;
-                case 26: //Silver
-                    {
-                        double dmax = max / 255.0;
-                        double dmin = min / 255.0;
-                        double intensity = (dmax * 0.7 + dmin * 0.3) * (2.0 - (dmax + dmin) / 2.0);
-                        if (intensity > 1.0) intensity = 1.0;
-                        if (intensity < 0.0) intensity = 0.0;
-                        red = green = blue = (byte)(intensity*255);
-                    }
-                    break;
-                case 27: //Grey
-                    red = green = blue = (byte)((max + min) / 2);
-                    break;
+                int tx = t + cols[x];
+                if (data[tx + 3] == 0)
+                    continue;
+                pixels[b] = blend(pixels[b], lightTable[lb + data[tx]], alpha);
+                pixels[b + 1] = blend(pixels[b + 1], lightTable[lg + data[tx + 1]], alpha);
+                pixels[b + 2] = blend(pixels[b + 2], lightTable[lr + data[tx + 2]], alpha);
+                pixels[b + 3] = 0xff;
             }
         }
+        // blends a channel towards c by alpha out of 255
+        static byte blend(byte from, byte c, int alpha)
+        {
+            return (byte)((c * alpha + from * (255 - alpha)) / 255);
+        }
+
+        [ThreadStatic]
+        static int[] colBuffer;
+        // texel offset of every destination column, so the kernels don't
+        // have to divide by the zoom per pixel.
+        static int[] mapColumns(int bw, int tw, double zoom, bool flip)
+        {
+            if (colBuffer == null || colBuffer.Length < tw)
+                colBuffer = new int[Math.Max(tw, 256)];
+            for (int x = 0; x < tw; x++)
+                colBuffer[x] = (flip ? (int)(bw - x / zoom) : (int)(x / zoom)) * 4;
+            return colBuffer;
+        }
+        // lightTable[level * 256 + c] is channel c lit to level / 255, so the
+        // blitters never have to touch floating point per texel.
+        static readonly byte[] lightTable = buildLightTable();
+        static byte[] buildLightTable()
+        {
+            byte[] table = new byte[256 * 256];
+            for (int level = 0; level < 256; level++)
+                for (int c = 0; c < 256; c++)
+                    table[level * 256 + c] = (byte)(c * level / 255);
+            return table;
+        }
+        // quantizes a light value to its row in lightTable
+        static int lightLevel(double light)
+        {
+            int l = (int)(light * 255.0 + 0.5);
+            if (l > 255) l = 255;
+            else if (l < 0) l = 0;
+            return l << 8;
+        }
         void drawOverlay(UInt32 color, double alpha, int amount, byte[] pixels, int px, int py, int w, int h, double zoom)
         {
             int skipx = 0, skipy = 0;
@@ -1619,7 +1808,7 @@ namespace Terrafirma
             }
         };
 
-        UVRule[][] grassRules ={
+        static UVRule[][] grassRules ={
             new UVRule[] {}, //0000
             new UVRule[] {}, //0001
             new UVRule[] {}, //0010
@@ -1709,7 +1898,7 @@ namespace Terrafirma
                 new UVRule(0xf0f00,0xf0f00, 18,18,   36,18,    54,18, 15) //all
             }
         };
-        UVRule[][] blendRules ={
+        static UVRule[][] blendRules ={
             new UVRule[] {}, //0000
             new UVRule[] {}, //0001
             new UVRule[] {}, //0010
@@ -1735,7 +1924,7 @@ namespace Terrafirma
             },
             new UVRule[] {} //1111
         };
-        UVRule[][] blendGrassRules ={
+        static UVRule[][] blendGrassRules ={
             new UVRule[] {}, //0000
             new UVRule[] { //0001
                 new UVRule(0xf1000,0x11000, 54,234,  72,234,  90,234, 1) //right
@@ -1801,7 +1990,7 @@ namespace Terrafirma
                 new UVRule(0xff001,0xf0001, 0,90,    0,126,   0,162)
             }
         };
-        UVRule[][] uvRules ={
+        static UVRule[][] uvRules ={
             new UVRule[] { //0000
                 new UVRule(0xf0000,0x00000, 162,54,  180,54,  198,54)
             },
@@ -1857,7 +2046,7 @@ namespace Terrafirma
         };
 
 
-        UVRule[] cactusRules ={
+        static UVRule[] cactusRules ={
                 new UVRule(0xbf,0x30, 90,0,   0,0, 0,0),
                 new UVRule(0xab,0x20, 72,0,   0,0, 0,0),
                 new UVRule(0x97,0x10, 18,0,   0,0, 0,0),
@@ -1914,13 +2103,123 @@ namespace Terrafirma
                         18,18       //1111
                           };
 
+        // a rule set compiled into a lookup from neighbour mask to the rule
+        // it matches, so a tile's frame costs one table read instead of a
+        // scan through the rules.  masks are 20 bits, so this is a megabyte
+        // per rule set; entries are filled in the first time each mask turns
+        // up, which means only the masks a world actually uses cost anything.
+        // two threads filling the same entry write the same byte, so it's
+        // safe to use from the parallel resolve pass.
+        class RuleTable
+        {
+            const byte Unknown = 0, NoMatch = 255;
+            UVRule[][] rules;
+            byte[] table = new byte[1 << 20];
+
+            public RuleTable(UVRule[][] rules)
+            {
+                this.rules = rules;
+            }
+            public UVRule Match(int mask)
+            {
+                UVRule[] group = rules[mask >> 16];
+                byte index = table[mask];
+                if (index == Unknown)
+                {
+                    index = NoMatch;
+                    for (int i = 0; i < group.Length; i++)
+                    {
+                        if ((mask & group[i].mask) == group[i].val)
+                        {
+                            index = (byte)(i + 1);
+                            break;
+                        }
+                    }
+                    table[mask] = index;
+                }
+                return index == NoMatch ? null : group[index - 1];
+            }
+        }
+        static readonly RuleTable grassTable = new RuleTable(grassRules);
+        static readonly RuleTable blendTable = new RuleTable(blendRules);
+        static readonly RuleTable blendGrassTable = new RuleTable(blendGrassRules);
+        static readonly RuleTable uvTable = new RuleTable(uvRules);
+
+        // cactus masks are only 8 bits, so that table is just built up front
+        static readonly UVRule[] cactusTable = buildCactusTable();
+        static UVRule[] buildCactusTable()
+        {
+            UVRule[] table = new UVRule[256];
+            for (int mask = 0; mask < 256; mask++)
+            {
+                foreach (UVRule rule in cactusRules)
+                {
+                    if ((mask & rule.mask) == rule.val)
+                    {
+                        table[mask] = rule;
+                        break;
+                    }
+                }
+            }
+            return table;
+        }
+
+        // resolves the frames of every tile and wall that wasn't stored with
+        // one, so drawing never has to stop and work them out.
+        // the world is cut into stripes of rows; the even stripes are done in
+        // parallel, then the odd ones.  fixTile reaches at most one row above
+        // or below the tile it is fixing, so stripes running at the same time
+        // never touch the same row.
+        const int StripeHeight = 16;
+        public void ResolveFrames(Tile[,] tiles, Action<int> progress)
+        {
+            int stripes = (tilesHigh + StripeHeight - 1) / StripeHeight;
+            int finished = 0;
+            for (int phase = 0; phase < 2; phase++)
+            {
+                Parallel.For(0, (stripes - phase + 1) / 2, delegate(int i)
+                {
+                    int top = (i * 2 + phase) * StripeHeight;
+                    int bottom = Math.Min(top + StripeHeight, tilesHigh);
+                    for (int y = top; y < bottom; y++)
+                    {
+                        for (int x = 0; x < tilesWide; x++)
+                        {
+                            Tile tile = tiles[x, y];
+                            if (tile.isActive && (tile.u == -1 || tile.v == -1))
+                                fixTile(x, y, ref tiles);
+                            if (tile.wall > 0 && tile.wallu == -1)
+                                fixWall(x, y, ref tiles);
+                        }
+                    }
+                    int done = Interlocked.Increment(ref finished);
+                    if (progress != null)
+                        progress(done * 100 / stripes);
+                });
+            }
+        }
+
+        // picks which of the three variants of a frame a tile or wall gets.
+        // it's a hash of the position and the world rather than a random
+        // number, so a world always renders the same way, whatever order or
+        // thread its tiles get fixed on.
+        private int frameSet(int x, int y, uint salt)
+        {
+            uint h = (uint)x * 0x9e3779b1 ^ (uint)y * 0x85ebca77 ^ (uint)worldID * 0xc2b2ae3d ^ salt;
+            h ^= h >> 15;
+            h *= 0x2c1b3c6d;
+            h ^= h >> 12;
+            h *= 0x297a2d39;
+            h ^= h >> 15;
+            return (int)(h % 3) * 2;
+        }
         private byte fixTile(int x, int y, ref Tile[,] tiles)
         {
             int t = -1, l = -1, r = -1, b = -1;
             int tl = -1, tr = -1, bl = -1, br = -1;
             UInt16 c = tiles[x, y].type;
             Int16 u;
-            int set = rand.Next(0, 3) * 2;
+            int set = frameSet(x, y, 0);
 
             if (x > 0)
             {
@@ -2064,38 +2363,32 @@ namespace Terrafirma
 
             if (tileInfos[c].isGrass) //do grasses
             {
-                foreach (UVRule rule in grassRules[mask >> 16])
+                UVRule rule = grassTable.Match(mask);
+                if (rule != null)
                 {
-                    if ((mask & rule.mask) == rule.val)
-                    {
-                        tiles[x, y].u = rule.uvs[set];
-                        tiles[x, y].v = rule.uvs[set + 1];
-                        return rule.blend;
-                    }
+                    tiles[x, y].u = rule.uvs[set];
+                    tiles[x, y].v = rule.uvs[set + 1];
+                    return rule.blend;
                 }
             }
             if (tileInfos[c].blend > -1 && !tileInfos[c].isGrass) //do blend-onlys
             {
-                foreach (UVRule rule in blendRules[mask >> 16])
+                UVRule rule = blendTable.Match(mask);
+                if (rule != null)
                 {
-                    if ((mask & rule.mask) == rule.val)
-                    {
-                        tiles[x, y].u = rule.uvs[set];
-                        tiles[x, y].v = rule.uvs[set + 1];
-                        return rule.blend;
-                    }
+                    tiles[x, y].u = rule.uvs[set];
+                    tiles[x, y].v = rule.uvs[set + 1];
+                    return rule.blend;
                 }
             }
             if (tileInfos[c].blend > -1) //do blend and unmatched grasses
             {
-                foreach (UVRule rule in blendGrassRules[mask >> 16])
+                UVRule rule = blendGrassTable.Match(mask);
+                if (rule != null)
                 {
-                    if ((mask & rule.mask) == rule.val)
-                    {
-                        tiles[x, y].u = rule.uvs[set];
-                        tiles[x, y].v = rule.uvs[set + 1];
-                        return rule.blend;
-                    }
+                    tiles[x, y].u = rule.uvs[set];
+                    tiles[x, y].v = rule.uvs[set + 1];
+                    return rule.blend;
                 }
             }
             // no match, delete blends
@@ -2105,14 +2398,12 @@ namespace Terrafirma
                 mask = ((mask & 0xf0000) ^ ((mask & 0xf000) << 4)) | ((mask & 0xf0) << 4);
 
 
-            foreach (UVRule rule in uvRules[mask >> 16])
+            UVRule match = uvTable.Match(mask);
+            if (match != null)
             {
-                if ((mask & rule.mask) == rule.val)
-                {
-                    tiles[x, y].u = rule.uvs[set];
-                    tiles[x, y].v = rule.uvs[set + 1];
-                    return rule.blend;
-                }
+                tiles[x, y].u = match.uvs[set];
+                tiles[x, y].v = match.uvs[set + 1];
+                return match.blend;
             }
             //should be impossible to get here.
             return 0;
@@ -2121,7 +2412,7 @@ namespace Terrafirma
         {
             byte t = 0, l = 0, r = 0, b = 0;
             byte c = tiles[x, y].wall;
-            int set = rand.Next(0, 3) * 2;
+            int set = frameSet(x, y, 1);
 
             if (x > 0)
                 l = tiles[x - 1, y].wall;
@@ -2144,14 +2435,12 @@ namespace Terrafirma
             else if (x % 3 == 1 && y % 3 == 2) mask |= 0xa00;
             else mask |= 0xf00;
 
-            foreach (UVRule rule in uvRules[mask >> 16])
+            UVRule rule = uvTable.Match(mask);
+            if (rule != null)
             {
-                if ((mask & rule.mask) == rule.val)
-                {
-                    tiles[x, y].wallu = rule.uvs[set];
-                    tiles[x, y].wallv = rule.uvs[set + 1];
-                    return;
-                }
+                tiles[x, y].wallu = rule.uvs[set];
+                tiles[x, y].wallv = rule.uvs[set + 1];
+                return;
             }
             //again, impossible to be here.
         }
@@ -2190,14 +2479,11 @@ namespace Terrafirma
             if (b == 80) mask |= 0x40;
             if (t == 80) mask |= 0x80;
 
-            foreach (UVRule rule in cactusRules)
+            UVRule rule = cactusTable[mask];
+            if (rule != null)
             {
-                if ((mask & rule.mask) == rule.val)
-                {
-                    tiles[x, y].u = rule.uvs[0];
-                    tiles[x, y].v = rule.uvs[1];
-                    return;
-                }
+                tiles[x, y].u = rule.uvs[0];
+                tiles[x, y].v = rule.uvs[1];
             }
         }
 
@@ -72,6 +72,11 @@ namespace Terrafirma
             get;
             set;
         }
+        public bool Indexed
+        {
+            get;
+            set;
+        }
 
         private void saveAll_Checked(object sender, RoutedEventArgs e)
         {
@@ -101,5 +106,10 @@ namespace Terrafirma
         {
             UseZoom = useZoom.IsChecked == true;
         }
+
+        private void indexed_Checked(object sender, RoutedEventArgs e)
+        {
+            Indexed = indexed.IsChecked == true;
+        }
     }
 }
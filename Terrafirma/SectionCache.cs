@@ -0,0 +1,321 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.IO.Compression;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Keeps the sections downloaded from a server on disk, a file per world,
+    /// so reconnecting only fetches what's missing.  The file is a header, an
+    /// index with the offset, length and time of each section, then the
+    /// sections themselves, each its rows as 0x0a sends them, deflated.  A
+    /// section stored again is appended and its index entry updated; the
+    /// file is compacted when it opens if most of it is stale.
+    /// </summary>
+    class SectionCache : IDisposable
+    {
+        static readonly byte[] Magic = Encoding.ASCII.GetBytes("TFSC");
+        const byte Version = 1;
+        const int HeaderSize = 5 + 5 * 4;
+        const int EntrySize = 8 + 4 + 8;
+        //servers can't tell us what changed, so after this we ask again
+        public static readonly TimeSpan MaxAge = TimeSpan.FromHours(12);
+
+        struct Entry
+        {
+            public long offset;
+            public int length;
+            public long saved; //utc ticks
+        }
+
+        World world;
+        TileRowCodec rows;
+        FileStream file;
+        int wide, high;
+        Entry[] index;
+        //sections changed since they were stored
+        bool[] changed;
+
+        /// <summary>
+        /// Opens the cache for world, which has its size and worldID but no
+        /// tiles yet, or starts a new one.
+        /// </summary>
+        public SectionCache(World world, TileRowCodec rows)
+        {
+            this.world = world;
+            this.rows = rows;
+            wide = world.tilesWide / SectionScheduler.SectionWidth;
+            high = world.tilesHigh / SectionScheduler.SectionHeight;
+            index = new Entry[wide * high];
+            changed = new bool[wide * high];
+
+            string folder = Folder();
+            Directory.CreateDirectory(folder);
+            string path = Path.Combine(folder, String.Format("{0}-{1}x{2}.tfsc", (UInt32)world.worldID,
+                world.tilesWide, world.tilesHigh));
+            file = new FileStream(path, FileMode.OpenOrCreate, FileAccess.ReadWrite, FileShare.Read);
+            if (!readIndex())
+            {
+                //new, or not something we can use
+                Array.Clear(index, 0, index.Length);
+                file.SetLength(0);
+                writeHeader();
+            }
+            else if (file.Length > 2 * (HeaderSize + index.Length * EntrySize + index.Sum(e => (long)e.length)))
+                compact();
+        }
+
+        public static string Folder()
+        {
+            return Path.Combine(Environment.GetFolderPath(Environment.SpecialFolder.LocalApplicationData),
+                "Terrafirma", "Sections");
+        }
+
+        /// <summary>
+        /// Decodes every section stored within MaxAge into the world's tiles
+        /// and tells sections it has them.  Returns how many there were.
+        /// </summary>
+        public int Load(SectionScheduler sections)
+        {
+            long oldest = DateTime.UtcNow.Ticks - MaxAge.Ticks;
+            int count = 0;
+            lock (this)
+            {
+                for (int i = 0; i < index.Length; i++)
+                {
+                    if (index[i].length == 0 || index[i].saved < oldest)
+                        continue;
+                    byte[] data = new byte[index[i].length];
+                    file.Position = index[i].offset;
+                    if (file.Read(data, 0, data.Length) != data.Length)
+                        continue;
+                    try
+                    {
+                        decode(data);
+                    }
+                    catch (Exception)
+                    {
+                        index[i].length = 0; //corrupt, fetch it
+                        continue;
+                    }
+                    int sx = i % wide, sy = i / wide;
+                    sections.Received(sx, sy, sx, sy);
+                    count++;
+                }
+            }
+            return count;
+        }
+
+        /// <summary>
+        /// Stores sections x0,y0 to x1,y1 from the world's tiles
+        /// </summary>
+        public void Store(int x0, int y0, int x1, int y1)
+        {
+            lock (this)
+            {
+                for (int sy = Math.Max(0, y0); sy <= Math.Min(high - 1, y1); sy++)
+                    for (int sx = Math.Max(0, x0); sx <= Math.Min(wide - 1, x1); sx++)
+                        store(sx, sy);
+                file.Flush();
+            }
+        }
+
+        /// <summary>
+        /// Notes tiles x0,y0 to x1,y1 changed after they were stored
+        /// </summary>
+        public void Changed(int x0, int y0, int x1, int y1)
+        {
+            lock (this)
+            {
+                for (int sy = Math.Max(0, y0 / SectionScheduler.SectionHeight);
+                    sy <= Math.Min(high - 1, y1 / SectionScheduler.SectionHeight); sy++)
+                    for (int sx = Math.Max(0, x0 / SectionScheduler.SectionWidth);
+                        sx <= Math.Min(wide - 1, x1 / SectionScheduler.SectionWidth); sx++)
+                        changed[sy * wide + sx] = true;
+            }
+        }
+
+        /// <summary>
+        /// Stores the sections that changed since they were last stored
+        /// </summary>
+        public void Flush()
+        {
+            lock (this)
+            {
+                if (file == null)
+                    return;
+                for (int i = 0; i < changed.Length; i++)
+                    if (changed[i])
+                        store(i % wide, i / wide);
+                file.Flush();
+            }
+        }
+
+        public void Dispose()
+        {
+            lock (this)
+            {
+                if (file != null)
+                    file.Dispose();
+                file = null;
+            }
+        }
+
+        private void store(int sx, int sy)
+        {
+            if (file == null)
+                return;
+            byte[] data;
+            using (MemoryStream stream = new MemoryStream())
+            {
+                using (DeflateStream deflate = new DeflateStream(stream, CompressionMode.Compress, true))
+                using (BinaryWriter w = new BinaryWriter(deflate))
+                {
+                    for (int y = 0; y < SectionScheduler.SectionHeight; y++)
+                        rows.WriteRow(w, world.tiles, sx * SectionScheduler.SectionWidth,
+                            sy * SectionScheduler.SectionHeight + y, SectionScheduler.SectionWidth);
+                }
+                data = stream.ToArray();
+            }
+            int i = sy * wide + sx;
+            index[i].offset = file.Length;
+            index[i].length = data.Length;
+            index[i].saved = DateTime.UtcNow.Ticks;
+            changed[i] = false;
+            file.Position = index[i].offset;
+            file.Write(data, 0, data.Length);
+            writeEntry(i);
+        }
+
+        private void decode(byte[] data)
+        {
+            byte[] raw;
+            using (MemoryStream output = new MemoryStream())
+            {
+                using (DeflateStream inflate = new DeflateStream(new MemoryStream(data), CompressionMode.Decompress))
+                    inflate.CopyTo(output);
+                raw = output.ToArray();
+            }
+            int offset = 0, startx, row, width;
+            for (int y = 0; y < SectionScheduler.SectionHeight; y++)
+                offset = rows.DecodeRow(raw, offset, world, out startx, out row, out width);
+        }
+
+        private bool readIndex()
+        {
+            if (file.Length < HeaderSize + index.Length * EntrySize)
+                return false;
+            BinaryReader r = new BinaryReader(file);
+            file.Position = 0;
+            if (!r.ReadBytes(Magic.Length).SequenceEqual(Magic) || r.ReadByte() != Version)
+                return false;
+            if (r.ReadInt32() != world.worldID || r.ReadInt32() != world.tilesWide ||
+                r.ReadInt32() != world.tilesHigh || r.ReadInt32() != wide || r.ReadInt32() != high)
+                return false;
+            for (int i = 0; i < index.Length; i++)
+            {
+                index[i].offset = r.ReadInt64();
+                index[i].length = r.ReadInt32();
+                index[i].saved = r.ReadInt64();
+                if (index[i].offset < 0 || index[i].length < 0 || index[i].offset + index[i].length > file.Length)
+                    index[i].length = 0;
+            }
+            return true;
+        }
+
+        private void writeHeader()
+        {
+            BinaryWriter w = new BinaryWriter(file);
+            file.Position = 0;
+            w.Write(Magic);
+            w.Write(Version);
+            w.Write(world.worldID);
+            w.Write(world.tilesWide);
+            w.Write(world.tilesHigh);
+            w.Write(wide);
+            w.Write(high);
+            w.Flush();
+            for (int i = 0; i < index.Length; i++)
+                writeEntry(i);
+        }
+
+        private void writeEntry(int i)
+        {
+            byte[] entry = new byte[EntrySize];
+            Buffer.BlockCopy(BitConverter.GetBytes(index[i].offset), 0, entry, 0, 8);
+            Buffer.BlockCopy(BitConverter.GetBytes(index[i].length), 0, entry, 8, 4);
+            Buffer.BlockCopy(BitConverter.GetBytes(index[i].saved), 0, entry, 12, 8);
+            file.Position = HeaderSize + (long)i * EntrySize;
+            file.Write(entry, 0, EntrySize);
+        }
+
+        /// <summary>
+        /// Rewrites the file with just the current sections
+        /// </summary>
+        private void compact()
+        {
+            byte[][] chunks = new byte[index.Length][];
+            for (int i = 0; i < index.Length; i++)
+            {
+                if (index[i].length == 0)
+                    continue;
+                chunks[i] = new byte[index[i].length];
+                file.Position = index[i].offset;
+                if (file.Read(chunks[i], 0, chunks[i].Length) != chunks[i].Length)
+                    chunks[i] = null;
+            }
+            file.SetLength(0);
+            long offset = HeaderSize + (long)index.Length * EntrySize;
+            for (int i = 0; i < index.Length; i++)
+            {
+                if (chunks[i] == null)
+                {
+                    index[i].length = 0;
+                    continue;
+                }
+                index[i].offset = offset;
+                offset += chunks[i].Length;
+            }
+            writeHeader();
+            for (int i = 0; i < index.Length; i++)
+            {
+                if (chunks[i] == null)
+                    continue;
+                file.Position = index[i].offset;
+                file.Write(chunks[i], 0, chunks[i].Length);
+            }
+            file.Flush();
+        }
+    }
+}
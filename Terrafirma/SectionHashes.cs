@@ -0,0 +1,201 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading.Tasks;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// A content hash of each 200x150 section of the world, the same grid the
+    /// server sends the map in.  Comparing against the hashes saved by the
+    /// last export tells which parts of the map need drawing again.
+    /// </summary>
+    class SectionHashes
+    {
+        public const int SectionWidth = 200;
+        public const int SectionHeight = 150;
+        const UInt64 FnvBasis = 14695981039346656037;
+        const UInt64 FnvPrime = 1099511628211;
+
+        public int tilesWide, tilesHigh;
+        //sections across and down, the last ones may be partial
+        public int across, down;
+        public UInt64[] hashes;
+        //npcs are kept apart since only textured images draw them
+        public UInt64[] npcHashes;
+        //sections with nothing but air, and with nothing explored
+        public bool[] air, unseen;
+
+        private SectionHashes(int tilesWide, int tilesHigh)
+        {
+            this.tilesWide = tilesWide;
+            this.tilesHigh = tilesHigh;
+            across = (tilesWide + SectionWidth - 1) / SectionWidth;
+            down = (tilesHigh + SectionHeight - 1) / SectionHeight;
+            hashes = new UInt64[across * down];
+            npcHashes = new UInt64[across * down];
+            air = new bool[across * down];
+            unseen = new bool[across * down];
+        }
+
+        /// <summary>
+        /// Hashes every section of the world, several sections at a time.
+        /// npcs are hashed into the section they're standing in, and their
+        /// home banners into the section with the home, pass null to skip them.
+        /// </summary>
+        public static SectionHashes Compute(Tile[,] tiles, int tilesWide, int tilesHigh, List<NPC> npcs)
+        {
+            SectionHashes s = new SectionHashes(tilesWide, tilesHigh);
+            Parallel.For(0, s.across * s.down, delegate(int i)
+            {
+                int x0 = (i % s.across) * SectionWidth, y0 = (i / s.across) * SectionHeight;
+                int x1 = Math.Min(x0 + SectionWidth, tilesWide), y1 = Math.Min(y0 + SectionHeight, tilesHigh);
+                UInt64 h = FnvBasis;
+                bool isAir = true, isUnseen = true;
+                //columns are contiguous in the tile array
+                for (int x = x0; x < x1; x++)
+                    for (int y = y0; y < y1; y++)
+                    {
+                        Tile tile = tiles[x, y];
+                        h = tile.Hash(h);
+                        if (isAir && (tile.isActive || tile.wall != 0 || tile.liquid != 0))
+                            isAir = false;
+                        if (isUnseen && tile.seen)
+                            isUnseen = false;
+                    }
+                s.hashes[i] = h;
+                s.air[i] = isAir;
+                s.unseen[i] = isUnseen;
+            });
+            if (npcs != null)
+                foreach (NPC npc in npcs)
+                {
+                    s.mix((int)(npc.x / 16), (int)(npc.y / 16), (UInt64)npc.sprite);
+                    if (!npc.isHomeless)
+                        s.mix(npc.homeX, npc.homeY, (UInt64)npc.sprite << 32);
+                }
+            return s;
+        }
+
+        private void mix(int x, int y, UInt64 v)
+        {
+            if (x < 0 || y < 0 || x >= tilesWide || y >= tilesHigh)
+                return;
+            int i = (y / SectionHeight) * across + x / SectionWidth;
+            npcHashes[i] = (npcHashes[i] ^ v ^ (UInt64)((x % SectionWidth) | ((y % SectionHeight) << 8))) * FnvPrime;
+        }
+
+        /// <summary>
+        /// Which sections differ from the last hashes.  Everything changed if
+        /// there are no last hashes or the world changed size.
+        /// </summary>
+        public bool[] Changed(SectionHashes last, bool withNPCs)
+        {
+            bool[] changed = new bool[hashes.Length];
+            bool all = last == null || last.tilesWide != tilesWide || last.tilesHigh != tilesHigh;
+            for (int i = 0; i < hashes.Length; i++)
+                changed[i] = all || last.hashes[i] != hashes[i] ||
+                    (withNPCs && last.npcHashes[i] != npcHashes[i]);
+            return changed;
+        }
+
+        /// <summary>
+        /// Calls f with the index of every section the tile rectangle touches.
+        /// Stops early if f returns true, and returns whether it did.
+        /// </summary>
+        public bool Any(int left, int top, int wide, int high, Func<int, bool> f)
+        {
+            int sx0 = Math.Max(left, 0) / SectionWidth, sy0 = Math.Max(top, 0) / SectionHeight;
+            int sx1 = Math.Min((left + wide - 1) / SectionWidth, across - 1);
+            int sy1 = Math.Min((top + high - 1) / SectionHeight, down - 1);
+            for (int sy = sy0; sy <= sy1; sy++)
+                for (int sx = sx0; sx <= sx1; sx++)
+                    if (f(sy * across + sx))
+                        return true;
+            return false;
+        }
+
+        public void Save(string path, string settings)
+        {
+            //written to the side and swapped in, so an interrupted export can't
+            //leave hashes for sections that were never drawn
+            string temp = path + ".tmp";
+            using (StreamWriter writer = new StreamWriter(temp))
+            {
+                writer.WriteLine(settings);
+                writer.WriteLine("{0} {1}", tilesWide, tilesHigh);
+                for (int i = 0; i < hashes.Length; i++)
+                    writer.WriteLine("{0:x16} {1:x16} {2}{3}", hashes[i], npcHashes[i],
+                        air[i] ? 'a' : '-', unseen[i] ? 'u' : '-');
+            }
+            if (File.Exists(path))
+                File.Delete(path);
+            File.Move(temp, path);
+        }
+
+        /// <summary>
+        /// Reads hashes saved with the same settings, or returns null.
+        /// </summary>
+        public static SectionHashes Load(string path, string settings)
+        {
+            if (!File.Exists(path))
+                return null;
+            string[] lines = File.ReadAllLines(path);
+            if (lines.Length < 2 || lines[0] != settings)
+                return null;
+            string[] size = lines[1].Split(' ');
+            int wide, high;
+            if (size.Length != 2 || !Int32.TryParse(size[0], out wide) || !Int32.TryParse(size[1], out high))
+                return null;
+            SectionHashes s = new SectionHashes(wide, high);
+            if (lines.Length - 2 != s.hashes.Length)
+                return null;
+            for (int i = 0; i < s.hashes.Length; i++)
+            {
+                string[] parts = lines[i + 2].Split(' ');
+                if (parts.Length != 3 || parts[2].Length != 2 ||
+                    !parseHex(parts[0], out s.hashes[i]) || !parseHex(parts[1], out s.npcHashes[i]))
+                    return null;
+                s.air[i] = parts[2][0] == 'a';
+                s.unseen[i] = parts[2][1] == 'u';
+            }
+            return s;
+        }
+
+        private static bool parseHex(string text, out UInt64 v)
+        {
+            return UInt64.TryParse(text, System.Globalization.NumberStyles.HexNumber,
+                System.Globalization.CultureInfo.InvariantCulture, out v);
+        }
+    }
+}
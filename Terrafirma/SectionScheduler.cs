@@ -0,0 +1,224 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Diagnostics;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Picks which map sections to ask a server for.  A server sends the
+    /// sections around wherever our player is, so each request moves the
+    /// player.  Several requests are kept in flight, nearest the view first,
+    /// and a bitmap of received sections means nothing is scanned twice.
+    /// A server only answers where the player is now, so it can skip requests
+    /// when the player moves quickly.  A request that goes unanswered for a
+    /// good while longer than answers have been taking is asked for again.
+    /// </summary>
+    class SectionScheduler
+    {
+        public const int SectionWidth = 200, SectionHeight = 150;
+        public const int DefaultWindow = 4;
+        public static readonly TimeSpan DefaultTimeout = TimeSpan.FromSeconds(3);
+
+        //how long a request may go unanswered before it's sent again, at
+        //least.  a slow server gets twice its slowest answer.
+        public TimeSpan Timeout = DefaultTimeout;
+
+        struct Request
+        {
+            public int section;
+            public long sent;   //milliseconds on clock
+        }
+
+        int sectionsWide, sectionsHigh, window;
+        bool[] done;
+        int remaining;
+        //every section, nearest the center first
+        int[] order;
+        int cursor;
+        int centerX = -1, centerY = -1;
+        //in the order they were sent
+        List<Request> inFlight = new List<Request>();
+        //requests to send again, before anything new
+        List<int> retry = new List<int>();
+        Stopwatch clock = Stopwatch.StartNew();
+        //milliseconds the slowest answered request took
+        long slowest;
+
+        public SectionScheduler(int sectionsWide, int sectionsHigh, int window)
+        {
+            this.sectionsWide = sectionsWide;
+            this.sectionsHigh = sectionsHigh;
+            this.window = Math.Max(1, window);
+            done = new bool[sectionsWide * sectionsHigh];
+            remaining = done.Length;
+            order = new int[done.Length];
+            for (int i = 0; i < order.Length; i++)
+                order[i] = i;
+            cursor = 0;
+        }
+
+        public int Total
+        {
+            get { return done.Length; }
+        }
+
+        public int Remaining
+        {
+            get { lock (this) return remaining; }
+        }
+
+        public bool Complete
+        {
+            get { lock (this) return remaining == 0; }
+        }
+
+        /// <summary>
+        /// Fetches outward from tile x,y from now on.  Cheap when the center
+        /// is still in the same section.
+        /// </summary>
+        public void Recenter(double x, double y)
+        {
+            int cx = Math.Max(0, Math.Min(sectionsWide - 1, (int)(x / SectionWidth)));
+            int cy = Math.Max(0, Math.Min(sectionsHigh - 1, (int)(y / SectionHeight)));
+            lock (this)
+            {
+                if (cx == centerX && cy == centerY)
+                    return;
+                centerX = cx;
+                centerY = cy;
+                //distance in tiles, sections aren't square
+                long[] dist = new long[order.Length];
+                for (int i = 0; i < order.Length; i++)
+                {
+                    long dx = (i % sectionsWide - cx) * SectionWidth;
+                    long dy = (i / sectionsWide - cy) * SectionHeight;
+                    order[i] = i;
+                    dist[i] = dx * dx + dy * dy;
+                }
+                Array.Sort(dist, order);
+                cursor = 0;
+            }
+        }
+
+        /// <summary>
+        /// The server sent sections x0,y0 to x1,y1 inclusive.
+        /// </summary>
+        public void Received(int x0, int y0, int x1, int y1)
+        {
+            lock (this)
+            {
+                x0 = Math.Max(x0, 0);
+                y0 = Math.Max(y0, 0);
+                x1 = Math.Min(x1, sectionsWide - 1);
+                y1 = Math.Min(y1, sectionsHigh - 1);
+                for (int y = y0; y <= y1; y++)
+                    for (int x = x0; x <= x1; x++)
+                    {
+                        int i = y * sectionsWide + x;
+                        if (!done[i])
+                        {
+                            done[i] = true;
+                            remaining--;
+                        }
+                    }
+                //a request is answered once its section arrives, whichever
+                //request the server was answering when it sent it
+                long now = clock.ElapsedMilliseconds;
+                for (int i = inFlight.Count - 1; i >= 0; i--)
+                    if (done[inFlight[i].section])
+                    {
+                        slowest = Math.Max(slowest, now - inFlight[i].sent);
+                        inFlight.RemoveAt(i);
+                    }
+            }
+        }
+
+        //call locked.  gives up on requests that have waited too long.
+        private void expire()
+        {
+            long now = clock.ElapsedMilliseconds;
+            long limit = Math.Max((long)Timeout.TotalMilliseconds, slowest * 2);
+            while (inFlight.Count > 0 && now - inFlight[0].sent >= limit)
+            {
+                retry.Add(inFlight[0].section);
+                inFlight.RemoveAt(0);
+            }
+        }
+
+        private bool isInFlight(int section)
+        {
+            foreach (Request r in inFlight)
+                if (r.section == section)
+                    return true;
+            return false;
+        }
+
+        /// <summary>
+        /// The next section to ask for, if there's room in the window.  x,y is
+        /// the tile to move the player to.  Call it now and then even when
+        /// nothing arrives, so requests that timed out go again.
+        /// </summary>
+        public bool Next(out int x, out int y)
+        {
+            x = y = 0;
+            lock (this)
+            {
+                expire();
+                if (inFlight.Count >= window)
+                    return false;
+                int i = -1;
+                while (i < 0 && retry.Count > 0)
+                {
+                    if (!done[retry[0]] && !isInFlight(retry[0]))
+                        i = retry[0];
+                    retry.RemoveAt(0);
+                }
+                if (i < 0)
+                {
+                    while (cursor < order.Length && (done[order[cursor]] || isInFlight(order[cursor])))
+                        cursor++;
+                    if (cursor == order.Length)
+                        return false;
+                    i = order[cursor++];
+                }
+                Request request;
+                request.section = i;
+                request.sent = clock.ElapsedMilliseconds;
+                inFlight.Add(request);
+                x = (i % sectionsWide) * SectionWidth + SectionWidth / 2;
+                y = (i / sectionsWide) * SectionHeight + SectionHeight / 2;
+                return true;
+            }
+        }
+    }
+}
@@ -0,0 +1,452 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Net;
+using System.Net.Sockets;
+using System.Runtime.InteropServices;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// A connection to a terraria server.  Whole messages from the server are
+    /// handed to Received on the socket's thread, straight out of a
+    /// MessageBuffer.  Messages to the server are built in pooled buffers and
+    /// queued, and only one send is ever in flight, so they go out whole and
+    /// in order.  Once warmed up, neither direction allocates.
+    /// </summary>
+    class ServerConnection : IDisposable
+    {
+        //where a message's payload starts, after its length and id
+        public const int PayloadStart = 5;
+        //everything we send is tiny
+        const int MessageSize = 1024;
+
+        //send buffers, shared by every connection
+        static readonly Stack<byte[]> pool = new Stack<byte[]>();
+
+        [StructLayout(LayoutKind.Explicit)]
+        struct SingleBits
+        {
+            [FieldOffset(0)]
+            public float value;
+            [FieldOffset(0)]
+            public int bits;
+        }
+
+        /// <summary>
+        /// Called once the connection is made, with null, or with why it couldn't be
+        /// </summary>
+        public Action<Exception> Connected;
+        /// <summary>
+        /// Called with each message, where it lies in data.  len counts the id and payload.
+        /// </summary>
+        public Action<byte[], int, int> Received;
+        /// <summary>
+        /// Called with everything received, before it's framed
+        /// </summary>
+        public Action<byte[], int, int> Capture;
+        /// <summary>
+        /// Called once when a connection that was made ends.  error is null if we
+        /// closed it or the server hung up.
+        /// </summary>
+        public Action<Exception> Closed;
+
+        Socket socket;
+        SocketAsyncEventArgs receiveArgs, sendArgs;
+        MessageBuffer received = new MessageBuffer();
+        bool receiving;
+        //replaying through Feed, which owns the buffer meanwhile
+        bool feeding;
+        object bufferLock = new object();
+        int closed;
+
+        object sendLock = new object();
+        Queue<byte[]> outgoing = new Queue<byte[]>();
+        bool sending;
+        //how much of the message at the head of outgoing is already sent
+        int sentBytes;
+
+        public ServerConnection()
+        {
+            receiveArgs = new SocketAsyncEventArgs();
+            receiveArgs.Completed += receiveCompleted;
+            sendArgs = new SocketAsyncEventArgs();
+            sendArgs.Completed += sendCompleted;
+        }
+
+        public bool IsConnected
+        {
+            get { return closed == 0 && socket != null && socket.Connected; }
+        }
+
+        public void Connect(string host, int port)
+        {
+            socket = new Socket(AddressFamily.InterNetwork, SocketType.Stream, ProtocolType.Tcp);
+            SocketAsyncEventArgs args = new SocketAsyncEventArgs();
+            args.RemoteEndPoint = new DnsEndPoint(host, port);
+            args.Completed += delegate(object sender, SocketAsyncEventArgs e)
+            {
+                connected(e);
+            };
+            if (!socket.ConnectAsync(args))
+                connected(args);
+        }
+
+        private void connected(SocketAsyncEventArgs args)
+        {
+            Exception error = null;
+            if (args.SocketError != SocketError.Success)
+                error = new SocketException((int)args.SocketError);
+            args.Dispose();
+            if (error != null)
+            {
+                //closed while connecting, nobody's waiting to hear about it
+                if (Interlocked.Exchange(ref closed, 1) != 0)
+                    error = null;
+                socket.Close();
+                received.Dispose();
+                if (error != null && Connected != null)
+                    Connected(error);
+                return;
+            }
+            receiving = true;
+            if (Connected != null)
+                Connected(null);
+            receive();
+        }
+
+        /// <summary>
+        /// Frames bytes as if the server had sent them.  For replaying
+        /// captures on a connection that was never made.
+        /// </summary>
+        public void Feed(byte[] data, int offset, int count)
+        {
+            lock (bufferLock)
+            {
+                if (closed != 0)
+                    return;
+                feeding = true;
+            }
+            try
+            {
+                //a message handler may close us, then the rest is dropped
+                while (count > 0 && closed == 0)
+                {
+                    int n = Math.Min(count, received.ReceiveCount);
+                    Buffer.BlockCopy(data, offset, received.Data, received.ReceiveOffset, n);
+                    received.Received(n);
+                    pump();
+                    offset += n;
+                    count -= n;
+                }
+            }
+            finally
+            {
+                lock (bufferLock)
+                {
+                    feeding = false;
+                    if (closed != 0)
+                        received.Dispose();
+                }
+            }
+        }
+
+        private void pump()
+        {
+            int start, len;
+            while (closed == 0 && received.Next(out start, out len))
+                Received(received.Data, start, len);
+        }
+
+        private void receive()
+        {
+            try
+            {
+                //loop for as long as receives finish right away
+                while (true)
+                {
+                    receiveArgs.SetBuffer(received.Data, received.ReceiveOffset, received.ReceiveCount);
+                    if (socket.ReceiveAsync(receiveArgs))
+                        return;
+                    if (!gotData())
+                        return;
+                }
+            }
+            catch (Exception e)
+            {
+                stopReceiving(e);
+            }
+        }
+
+        private void receiveCompleted(object sender, SocketAsyncEventArgs e)
+        {
+            try
+            {
+                if (!gotData())
+                    return;
+            }
+            catch (Exception ex)
+            {
+                stopReceiving(ex);
+                return;
+            }
+            receive();
+        }
+
+        /// <summary>
+        /// Handles a finished receive, returning whether to receive again
+        /// </summary>
+        private bool gotData()
+        {
+            if (receiveArgs.SocketError != SocketError.Success)
+            {
+                stopReceiving(new SocketException((int)receiveArgs.SocketError));
+                return false;
+            }
+            int count = receiveArgs.BytesTransferred;
+            if (count == 0 || closed != 0) //hung up
+            {
+                stopReceiving(null);
+                return false;
+            }
+            if (Capture != null)
+                Capture(received.Data, received.ReceiveOffset, count);
+            received.Received(count);
+            pump();
+            if (closed != 0)
+            {
+                stopReceiving(null);
+                return false;
+            }
+            return true;
+        }
+
+        private void stopReceiving(Exception error)
+        {
+            //the receive loop is the only one touching the buffer
+            received.Dispose();
+            finish(error);
+        }
+
+        /// <summary>
+        /// A buffer to build a message in, from PayloadStart on.  Give it to
+        /// Send, which puts it back.
+        /// </summary>
+        public byte[] NewMessage()
+        {
+            lock (pool)
+            {
+                if (pool.Count > 0)
+                    return pool.Pop();
+            }
+            return new byte[MessageSize];
+        }
+
+        private static void free(byte[] message)
+        {
+            lock (pool)
+                pool.Push(message);
+        }
+
+        /// <summary>
+        /// Queues a message built by NewMessage, whose payload ends at end.
+        /// Safe to call from any thread.
+        /// </summary>
+        public void Send(byte[] message, int messageid, int end)
+        {
+            int pos = 0;
+            PutInt32(message, ref pos, end - 4);
+            message[pos] = (byte)messageid;
+            lock (sendLock)
+            {
+                if (closed != 0 || socket == null || !socket.Connected)
+                {
+                    free(message);
+                    return;
+                }
+                outgoing.Enqueue(message);
+                if (sending)
+                    return;
+                sending = true;
+            }
+            sendNext();
+        }
+
+        private void sendNext()
+        {
+            try
+            {
+                while (true)
+                {
+                    byte[] message;
+                    lock (sendLock)
+                    {
+                        if (outgoing.Count == 0 || closed != 0)
+                        {
+                            dropOutgoing();
+                            return;
+                        }
+                        message = outgoing.Peek();
+                    }
+                    int total = BitConverter.ToInt32(message, 0) + 4;
+                    sendArgs.SetBuffer(message, sentBytes, total - sentBytes);
+                    if (socket.SendAsync(sendArgs))
+                        return;
+                    if (!sent())
+                        return;
+                }
+            }
+            catch (Exception e)
+            {
+                sendFailed(e);
+            }
+        }
+
+        private void sendCompleted(object sender, SocketAsyncEventArgs e)
+        {
+            if (sent())
+                sendNext();
+        }
+
+        /// <summary>
+        /// Handles a finished send, returning whether to send the next
+        /// </summary>
+        private bool sent()
+        {
+            if (sendArgs.SocketError != SocketError.Success)
+            {
+                sendFailed(new SocketException((int)sendArgs.SocketError));
+                return false;
+            }
+            lock (sendLock)
+            {
+                sentBytes += sendArgs.BytesTransferred;
+                byte[] message = outgoing.Peek();
+                if (sentBytes >= BitConverter.ToInt32(message, 0) + 4)
+                {
+                    outgoing.Dequeue();
+                    free(message);
+                    sentBytes = 0;
+                }
+            }
+            return true;
+        }
+
+        private void sendFailed(Exception error)
+        {
+            lock (sendLock)
+                dropOutgoing();
+            finish(error);
+        }
+
+        //call with sendLock held, once nothing is in flight
+        private void dropOutgoing()
+        {
+            while (outgoing.Count > 0)
+                free(outgoing.Dequeue());
+            sentBytes = 0;
+            sending = false;
+        }
+
+        private void finish(Exception error)
+        {
+            if (Interlocked.Exchange(ref closed, 1) != 0)
+                return;
+            if (socket != null)
+                socket.Close();
+            lock (sendLock)
+            {
+                //an aborted send puts its own back
+                if (!sending)
+                    dropOutgoing();
+            }
+            lock (bufferLock)
+            {
+                //otherwise whoever's using it lets it go when they see we're closed
+                if (!receiving && !feeding)
+                    received.Dispose();
+            }
+            if (Closed != null)
+                Closed(error);
+        }
+
+        /// <summary>
+        /// Hangs up.  Closed is called, here or on the socket's thread.
+        /// </summary>
+        public void Close()
+        {
+            finish(null);
+        }
+
+        public void Dispose()
+        {
+            Close();
+        }
+
+        public static void PutByte(byte[] message, ref int pos, byte value)
+        {
+            message[pos++] = value;
+        }
+
+        public static void PutInt16(byte[] message, ref int pos, Int16 value)
+        {
+            message[pos++] = (byte)value;
+            message[pos++] = (byte)(value >> 8);
+        }
+
+        public static void PutInt32(byte[] message, ref int pos, Int32 value)
+        {
+            message[pos++] = (byte)value;
+            message[pos++] = (byte)(value >> 8);
+            message[pos++] = (byte)(value >> 16);
+            message[pos++] = (byte)(value >> 24);
+        }
+
+        public static void PutSingle(byte[] message, ref int pos, float value)
+        {
+            SingleBits s = new SingleBits();
+            s.value = value;
+            PutInt32(message, ref pos, s.bits);
+        }
+
+        /// <summary>
+        /// Writes text as ascii, unprefixed.  Terraria takes the rest of the
+        /// message as the string.
+        /// </summary>
+        public static void PutText(byte[] message, ref int pos, string text)
+        {
+            if (pos + text.Length > message.Length)
+                throw new Exception(String.Format("Text too long to send: {0} characters", text.Length));
+            pos += Encoding.ASCII.GetBytes(text, 0, text.Length, message, pos);
+        }
+    }
+}
@@ -0,0 +1,125 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Records what a server sent, as it arrived, so a session can be
+    /// replayed without the server.  The file is a header, then a record per
+    /// receive: milliseconds since the start, the length and the bytes.
+    /// </summary>
+    class SessionCapture : IDisposable
+    {
+        static readonly byte[] Magic = Encoding.ASCII.GetBytes("TFCAP");
+        const byte Version = 1;
+
+        BinaryWriter writer;
+        Stopwatch clock;
+
+        public SessionCapture(string path)
+        {
+            writer = new BinaryWriter(new FileStream(path, FileMode.Create, FileAccess.Write, FileShare.Read));
+            writer.Write(Magic);
+            writer.Write(Version);
+            clock = Stopwatch.StartNew();
+        }
+
+        /// <summary>
+        /// Appends count bytes just received.  Called from the socket's thread.
+        /// </summary>
+        public void Write(byte[] data, int offset, int count)
+        {
+            lock (this)
+            {
+                if (writer == null)
+                    return;
+                writer.Write((UInt32)clock.ElapsedMilliseconds);
+                writer.Write(count);
+                writer.Write(data, offset, count);
+            }
+        }
+
+        public void Dispose()
+        {
+            lock (this)
+            {
+                if (writer != null)
+                    writer.Close();
+                writer = null;
+            }
+        }
+
+        /// <summary>
+        /// Hands each receive in the capture at path to received, as fast as
+        /// possible or with the gaps it was captured with.
+        /// </summary>
+        public static void Replay(string path, bool originalPace, Action<byte[], int, int> received)
+        {
+            using (BinaryReader reader = new BinaryReader(new FileStream(path, FileMode.Open, FileAccess.Read,
+                FileShare.ReadWrite)))
+            {
+                byte[] magic = reader.ReadBytes(Magic.Length);
+                if (!magic.SequenceEqual(Magic))
+                    throw new Exception("Not a session capture");
+                byte version = reader.ReadByte();
+                if (version > Version)
+                    throw new Exception(String.Format("Unknown capture version: {0}", version));
+
+                Stopwatch clock = Stopwatch.StartNew();
+                byte[] data = new byte[MessageBuffer.DefaultSize];
+                long end = reader.BaseStream.Length;
+                while (reader.BaseStream.Position + 8 <= end)
+                {
+                    UInt32 ms = reader.ReadUInt32();
+                    int count = reader.ReadInt32();
+                    if (count < 0 || reader.BaseStream.Position + count > end)
+                        break; //cut short while capturing
+                    if (count > data.Length)
+                        data = new byte[count];
+                    if (reader.Read(data, 0, count) != count)
+                        break;
+                    if (originalPace)
+                    {
+                        long wait = ms - clock.ElapsedMilliseconds;
+                        if (wait > 0)
+                            Thread.Sleep((int)wait);
+                    }
+                    received(data, 0, count);
+                }
+            }
+        }
+    }
+}
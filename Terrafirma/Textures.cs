@@ -39,6 +39,10 @@ namespace Terrafirma
     {
         public int width, height;
         public byte[] data;
+        // opaque: every texel has full alpha.  translucent: some texels
+        // are partially transparent and need blending.  a texture with
+        // neither set only has fully transparent holes.
+        public bool opaque, translucent;
 
         private static string GetName(string path, string xnb)
         {
@@ -105,6 +109,193 @@ namespace Terrafirma
                 else
                     ReadTexture(b.BaseStream);
             }
+            classify();
+        }
+
+        private void classify()
+        {
+            opaque = true;
+            translucent = false;
+            for (int ofs = 3; ofs < data.Length; ofs += 4)
+            {
+                byte a = data[ofs];
+                if (a != 255)
+                    opaque = false;
+                if (a != 0 && a != 255)
+                {
+                    translucent = true;
+                    break;
+                }
+            }
+        }
+
+        // builds a pre-painted copy of another texture, so painted tiles
+        // can be blitted without recoloring every texel.
+        public Texture(Texture source, byte paint)
+        {
+            width = source.width;
+            height = source.height;
+            data = new byte[source.data.Length];
+            Buffer.BlockCopy(source.data, 0, data, 0, data.Length);
+            for (int ofs = 0; ofs < data.Length; ofs += 4)
+            {
+                if (data[ofs + 3] == 0)
+                    continue;
+                byte blue = data[ofs];
+                byte green = data[ofs + 1];
+                byte red = data[ofs + 2];
+                applyPaint(paint, ref red, ref green, ref blue);
+                data[ofs] = blue;
+                data[ofs + 1] = green;
+                data[ofs + 2] = red;
+            }
+            opaque = source.opaque;
+            translucent = source.translucent;
+        }
+
+        private static void applyPaint(byte paint, ref byte red, ref byte green, ref byte blue)
+        {
+            if (paint > 27) //grass colors
+            {
+                //skip nongrass part
+                if (blue * 0.5 < green && green * 0.5 < blue &&
+                    red * 0.3 < blue && red * 0.8 > blue &&
+                    red * 0.8 > green && red * 0.3 < green)
+                    return;
+                paint -= 27;
+            }
+
+            byte max = red > green ? red : green;
+            byte min = red < green ? red : green;
+            if (blue > max) max = blue;
+            if (blue < min) min = blue;
+            switch (paint)
+            {
+                case 1: //Red
+                    red = max;
+                    green = blue = min;
+                    break;
+                case 2: //Orange
+                    red = max;
+                    green = (byte)((max + min) / 2);
+                    blue = min;
+                    break;
+                case 3: //Yellow
+                    red = green = max;
+                    blue = min;
+                    break;
+                case 4: //Lime
+                    red = (byte)((max + min) / 2);
+                    green = max;
+                    blue = min;
+                    break;
+                case 5: //Green
+                    red = blue = min;
+                    green = max;
+                    break;
+                case 6: //Teal
+                    red = min;
+                    green = max;
+                    blue = (byte)((max + min) / 2);
+                    break;
+                case 7: //Cyan
+                    red = min;
+                    green = blue = max;
+                    break;
+                case 8: //SkyBlue
+                    red = min;
+                    green = (byte)((max + min) / 2);
+                    blue = max;
+                    break;
+                case 9: //Blue
+                    red = green = min;
+                    blue = max;
+                    break;
+                case 10: //Purple
+                    red = (byte)((max + min) / 2);
+                    green = min;
+                    blue = max;
+                    break;
+                case 11: //Violet
+                    red = blue = max;
+                    green = min;
+                    break;
+                case 12: //Pink
+                    red = max;
+                    green = min;
+                    blue = (byte)((max + min) / 2);
+                    break;
+                case 13: //DeepRed
+                    red = max;
+                    green = blue = (byte)(min * 0.4);
+                    break;
+                case 14: //DeepOrange
+                    red = max;
+                    green = (byte)((max + min * 0.4) / 2);
+                    blue = (byte)(min * 0.4);
+                    break;
+                case 15: //DeepYellow
+                    red = green = max;
+                    blue = (byte)(min * 0.4);
+                    break;
+                case 16: //DeepLime
+                    red = (byte)((max + min * 0.4) / 2);
+                    green = max;
+                    blue = (byte)(min * 0.4);
+                    break;
+                case 17: //DeepGreen
+                    red = blue = (byte)(min * 0.4);
+                    green = max;
+                    break;
+                case 18: //DeepTeal
+                    red = (byte)(min * 0.4);
+                    green = max;
+                    blue = (byte)((max + min * 0.4) / 2);
+                    break;
+                case 19: //DeepCyan
+                    red = (byte)(min * 0.4);
+                    green = blue = max;
+                    break;
+                case 20: //DeepSkyBlue
+                    red = (byte)(min * 0.4);
+                    green = (byte)((max + min * 0.4) / 2);
+                    blue = max;
+                    break;
+                case 21: //DeepBlue
+                    red = green = (byte)(min * 0.4);
+                    blue = max;
+                    break;
+                case 22: //DeepPurple
+                    red = (byte)((max + min * 0.4) / 2);
+                    green = (byte)(min * 0.4);
+                    blue = max;
+                    break;
+                case 23: //DeepViolet
+                    red = blue = max;
+                    green = (byte)(min * 0.4);
+                    break;
+                case 24: //DeepPink
+                    red = max;
+                    green = (byte)(min * 0.4);
+                    blue = (byte)((max + min * 0.4) / 2);
+                    break;
+                case 25: //Black
+                    red = green = blue = (byte)((max + min) * 0.15);
+                    break;
+                case 26: //Silver
+                    {
+                        double dmax = max / 255.0;
+                        double dmin = min / 255.0;
+                        double intensity = (dmax * 0.7 + dmin * 0.3) * (2.0 - (dmax + dmin) / 2.0);
+                        if (intensity > 1.0) intensity = 1.0;
+                        if (intensity < 0.0) intensity = 0.0;
+                        red = green = blue = (byte)(intensity*255);
+                    }
+                    break;
+                case 27: //Grey
+                    red = green = blue = (byte)((max + min) / 2);
+                    break;
+            }
         }
 
         private void ReadTexture(Stream s)
@@ -221,6 +412,33 @@ namespace Terrafirma
     }
     class Textures
     {
+        // painted variants are kept around up to this many bytes, after which
+        // the least recently used ones are thrown away.
+        const long PaintCacheBudget = 64 * 1024 * 1024;
+
+        struct PaintKey : IEquatable<PaintKey>
+        {
+            public Texture tex;
+            public byte paint;
+            public bool Equals(PaintKey other)
+            {
+                return tex == other.tex && paint == other.paint;
+            }
+            public override int GetHashCode()
+            {
+                return System.Runtime.CompilerServices.RuntimeHelpers.GetHashCode(tex) * 31 + paint;
+            }
+        }
+        struct PaintEntry
+        {
+            public PaintKey key;
+            public Texture painted;
+        }
+
+        Dictionary<PaintKey, LinkedListNode<PaintEntry>> painted;
+        LinkedList<PaintEntry> paintLRU;
+        long paintCacheSize;
+
         Dictionary<int, Texture> textures;
         Dictionary<int, Texture> backgrounds;
         Dictionary<int, Texture> walls;
@@ -246,27 +464,7 @@ namespace Terrafirma
         public Textures()
         {
             rootDir = null;
-
-            textures = new Dictionary<int, Texture>();
-            backgrounds = new Dictionary<int, Texture>();
-            walls = new Dictionary<int, Texture>();
-            treeTops = new Dictionary<int, Texture>();
-            treeBranches = new Dictionary<int, Texture>();
-            shrooms = new Dictionary<int, Texture>();
-            npcs = new Dictionary<int, Texture>();
-            npcHeads = new Dictionary<int, Texture>();
-            banners = new Dictionary<int, Texture>();
-            armorHeads = new Dictionary<int, Texture>();
-            armorBodies = new Dictionary<int, Texture>();
-            femaleBodies = new Dictionary<int, Texture>();
-            armorLegs = new Dictionary<int, Texture>();
-            wires = new Dictionary<int, Texture>();
-            liquids = new Dictionary<int, Texture>();
-            woods = new Dictionary<int, Texture>();
-            wallOutlines = new Dictionary<int, Texture>();
-            actuators = new Dictionary<int, Texture>();
-            cacti = new Dictionary<int, Texture>();
-            xmasTrees = new Dictionary<int, Texture>();
+            init();
 
             // find terraria install
             SteamConfig steam = new SteamConfig();
@@ -297,204 +495,339 @@ namespace Terrafirma
             if (Directory.Exists(path))
                 rootDir=path;
         }
+        /// <summary>
+        /// Uses the terraria install at installDir instead of looking for one.
+        /// Accepts either the install itself or its Content/Images folder.
+        /// </summary>
+        public Textures(string installDir)
+        {
+            rootDir = null;
+            init();
+
+            string path = Path.Combine(Path.Combine(installDir, "Content"), "Images");
+            if (Directory.Exists(path))
+                rootDir = path;
+            else if (File.Exists(Path.Combine(installDir, "Tiles_0.xnb")))
+                rootDir = installDir;
+        }
+        private void init()
+        {
+            textures = new Dictionary<int, Texture>();
+            backgrounds = new Dictionary<int, Texture>();
+            walls = new Dictionary<int, Texture>();
+            treeTops = new Dictionary<int, Texture>();
+            treeBranches = new Dictionary<int, Texture>();
+            shrooms = new Dictionary<int, Texture>();
+            npcs = new Dictionary<int, Texture>();
+            npcHeads = new Dictionary<int, Texture>();
+            banners = new Dictionary<int, Texture>();
+            armorHeads = new Dictionary<int, Texture>();
+            armorBodies = new Dictionary<int, Texture>();
+            femaleBodies = new Dictionary<int, Texture>();
+            armorLegs = new Dictionary<int, Texture>();
+            wires = new Dictionary<int, Texture>();
+            liquids = new Dictionary<int, Texture>();
+            woods = new Dictionary<int, Texture>();
+            wallOutlines = new Dictionary<int, Texture>();
+            actuators = new Dictionary<int, Texture>();
+            cacti = new Dictionary<int, Texture>();
+            xmasTrees = new Dictionary<int, Texture>();
+
+            painted = new Dictionary<PaintKey, LinkedListNode<PaintEntry>>();
+            paintLRU = new LinkedList<PaintEntry>();
+            paintCacheSize = 0;
+        }
         public bool Valid {
             get { return rootDir!=null; }
         }
+        public Texture GetPainted(Texture tex, byte paint)
+        {
+            PaintKey key;
+            key.tex = tex;
+            key.paint = paint;
+            lock (painted)
+            {
+                LinkedListNode<PaintEntry> node;
+                if (painted.TryGetValue(key, out node))
+                {
+                    //most recently used goes to the front
+                    paintLRU.Remove(node);
+                    paintLRU.AddFirst(node);
+                    return node.Value.painted;
+                }
+                PaintEntry entry;
+                entry.key = key;
+                entry.painted = new Texture(tex, paint);
+                node = paintLRU.AddFirst(entry);
+                painted[key] = node;
+                paintCacheSize += entry.painted.data.Length;
+                while (paintCacheSize > PaintCacheBudget && paintLRU.Last != node)
+                {
+                    LinkedListNode<PaintEntry> oldest = paintLRU.Last;
+                    paintLRU.RemoveLast();
+                    painted.Remove(oldest.Value.key);
+                    paintCacheSize -= oldest.Value.painted.data.Length;
+                }
+                return entry.painted;
+            }
+        }
+        // the getters load textures on first use.  they lock so the exporters
+        // can render on several threads with one set of textures.
         public Texture GetTile(int num)
         {
-            if (!textures.ContainsKey(num))
+            lock (textures)
             {
-                string name = String.Format("Tiles_{0}", num);
-                textures[num] = new Texture(rootDir, name);
+                if (!textures.ContainsKey(num))
+                {
+                    string name = String.Format("Tiles_{0}", num);
+                    textures[num] = new Texture(rootDir, name);
+                }
+                return textures[num];
             }
-            return textures[num];
         }
         public Texture GetWood(int wood)
         {
-            if (!woods.ContainsKey(wood))
+            lock (woods)
             {
-                string name = String.Format("Tiles_5_{0}", wood);
-                woods[wood] = new Texture(rootDir, name);
+                if (!woods.ContainsKey(wood))
+                {
+                    string name = String.Format("Tiles_5_{0}", wood);
+                    woods[wood] = new Texture(rootDir, name);
+                }
+                return woods[wood];
             }
-            return woods[wood];
         }
         public Texture GetBackground(int num)
         {
-            if (!backgrounds.ContainsKey(num))
+            lock (backgrounds)
             {
-                string name = String.Format("Background_{0}", num);
-                backgrounds[num] = new Texture(rootDir, name);
+                if (!backgrounds.ContainsKey(num))
+                {
+                    string name = String.Format("Background_{0}", num);
+                    backgrounds[num] = new Texture(rootDir, name);
+                }
+                return backgrounds[num];
             }
-            return backgrounds[num];
         }
         public Texture GetWall(int num)
         {
-            if (!walls.ContainsKey(num))
+            lock (walls)
             {
-                string name = String.Format("Wall_{0}", num);
-                walls[num] = new Texture(rootDir, name);
+                if (!walls.ContainsKey(num))
+                {
+                    string name = String.Format("Wall_{0}", num);
+                    walls[num] = new Texture(rootDir, name);
+                }
+                return walls[num];
             }
-            return walls[num];
         }
         public Texture GetTreeTops(int num)
         {
-            if (!treeTops.ContainsKey(num))
+            lock (treeTops)
             {
-                string name = String.Format("Tree_Tops_{0}", num);
-                treeTops[num] = new Texture(rootDir, name);
+                if (!treeTops.ContainsKey(num))
+                {
+                    string name = String.Format("Tree_Tops_{0}", num);
+                    treeTops[num] = new Texture(rootDir, name);
+                }
+                return treeTops[num];
             }
-            return treeTops[num];
         }
         public Texture GetTreeBranches(int num)
         {
-            if (!treeBranches.ContainsKey(num))
+            lock (treeBranches)
             {
-                string name = String.Format("Tree_Branches_{0}", num);
-                treeBranches[num] = new Texture(rootDir, name);
+                if (!treeBranches.ContainsKey(num))
+                {
+                    string name = String.Format("Tree_Branches_{0}", num);
+                    treeBranches[num] = new Texture(rootDir, name);
+                }
+                return treeBranches[num];
             }
-            return treeBranches[num];
         }
         public Texture GetShroomTop(int num)
         {
-            if (!shrooms.ContainsKey(num))
+            lock (shrooms)
             {
-                string name = String.Format("Shroom_Tops");
-                shrooms[num] = new Texture(rootDir, name);
+                if (!shrooms.ContainsKey(num))
+                {
+                    string name = String.Format("Shroom_Tops");
+                    shrooms[num] = new Texture(rootDir, name);
+                }
+                return shrooms[num];
             }
-            return shrooms[num];
         }
         public Texture GetNPC(int num)
         {
-            if (!npcs.ContainsKey(num))
+            lock (npcs)
             {
-                string name = String.Format("NPC_{0}", num);
-                npcs[num] = new Texture(rootDir, name);
+                if (!npcs.ContainsKey(num))
+                {
+                    string name = String.Format("NPC_{0}", num);
+                    npcs[num] = new Texture(rootDir, name);
+                }
+                return npcs[num];
             }
-            return npcs[num];
         }
         public Texture GetNPCHead(int num)
         {
-            if (!npcHeads.ContainsKey(num))
+            lock (npcHeads)
             {
-                string name = String.Format("NPC_Head_{0}", num);
-                npcHeads[num] = new Texture(rootDir, name);
+                if (!npcHeads.ContainsKey(num))
+                {
+                    string name = String.Format("NPC_Head_{0}", num);
+                    npcHeads[num] = new Texture(rootDir, name);
+                }
+                return npcHeads[num];
             }
-            return npcHeads[num];
         }
         public Texture GetBanner(int num)
         {
-            if (!banners.ContainsKey(num))
+            lock (banners)
             {
-                string name = String.Format("House_Banner_{0}", num);
-                banners[num] = new Texture(rootDir, name);
+                if (!banners.ContainsKey(num))
+                {
+                    string name = String.Format("House_Banner_{0}", num);
+                    banners[num] = new Texture(rootDir, name);
+                }
+                return banners[num];
             }
-            return banners[num];
         }
         public Texture GetArmorHead(int num)
         {
-            if (!armorHeads.ContainsKey(num))
+            lock (armorHeads)
             {
-                string name = String.Format("Armor_Head_{0}", num);
-                armorHeads[num] = new Texture(rootDir, name);
+                if (!armorHeads.ContainsKey(num))
+                {
+                    string name = String.Format("Armor_Head_{0}", num);
+                    armorHeads[num] = new Texture(rootDir, name);
+                }
+                return armorHeads[num];
             }
-            return armorHeads[num];
         }
         public Texture GetArmorBody(int num)
         {
-            if (!armorBodies.ContainsKey(num))
+            lock (armorBodies)
             {
-                string name = String.Format("Armor_Body_{0}", num);
-                armorBodies[num] = new Texture(rootDir, name);
+                if (!armorBodies.ContainsKey(num))
+                {
+                    string name = String.Format("Armor_Body_{0}", num);
+                    armorBodies[num] = new Texture(rootDir, name);
+                }
+                return armorBodies[num];
             }
-            return armorBodies[num];
         }
         public Texture GetFemaleBody(int num)
         {
-            if (!femaleBodies.ContainsKey(num))
+            lock (femaleBodies)
             {
-                string name = String.Format("Female_Body_{0}", num);
-                femaleBodies[num] = new Texture(rootDir, name);
+                if (!femaleBodies.ContainsKey(num))
+                {
+                    string name = String.Format("Female_Body_{0}", num);
+                    femaleBodies[num] = new Texture(rootDir, name);
+                }
+                return femaleBodies[num];
             }
-            return femaleBodies[num];
         }
         public Texture GetArmorLegs(int num)
         {
-            if (!armorLegs.ContainsKey(num))
+            lock (armorLegs)
             {
-                string name = String.Format("Armor_Legs_{0}", num);
-                armorLegs[num] = new Texture(rootDir, name);
+                if (!armorLegs.ContainsKey(num))
+                {
+                    string name = String.Format("Armor_Legs_{0}", num);
+                    armorLegs[num] = new Texture(rootDir, name);
+                }
+                return armorLegs[num];
             }
-            return armorLegs[num];
         }
         public Texture GetWire(int num)
         {
-            if (!wires.ContainsKey(num))
+            lock (wires)
             {
-                string name;
-                if (num == 0)
-                    name = String.Format("Wires");
-                else
-                    name = String.Format("Wires{0}", num+1);
-                wires[num] = new Texture(rootDir, name);
+                if (!wires.ContainsKey(num))
+                {
+                    string name;
+                    if (num == 0)
+                        name = String.Format("Wires");
+                    else
+                        name = String.Format("Wires{0}", num+1);
+                    wires[num] = new Texture(rootDir, name);
+                }
+                return wires[num];
             }
-            return wires[num];
         }
         public Texture GetLiquid(int num)
         {
-            if (!liquids.ContainsKey(num))
+            lock (liquids)
             {
-                string name = String.Format("Liquid_{0}", num);
-                liquids[num] = new Texture(rootDir, name);
+                if (!liquids.ContainsKey(num))
+                {
+                    string name = String.Format("Liquid_{0}", num);
+                    liquids[num] = new Texture(rootDir, name);
+                }
+                return liquids[num];
             }
-            return liquids[num];
         }
         public Texture GetWallOutline(int num)
         {
-            if (!wallOutlines.ContainsKey(num))
+            lock (wallOutlines)
             {
-                string name = String.Format("Wall_Outline");
-                wallOutlines[num] = new Texture(rootDir, name);
+                if (!wallOutlines.ContainsKey(num))
+                {
+                    string name = String.Format("Wall_Outline");
+                    wallOutlines[num] = new Texture(rootDir, name);
+                }
+                return wallOutlines[num];
             }
-            return wallOutlines[num];
         }
         public Texture GetActuator(int num)
         {
-            if (!actuators.ContainsKey(num))
+            lock (actuators)
             {
-                string name = String.Format("Actuator");
-                actuators[num] = new Texture(rootDir, name);
+                if (!actuators.ContainsKey(num))
+                {
+                    string name = String.Format("Actuator");
+                    actuators[num] = new Texture(rootDir, name);
+                }
+                return actuators[num];
             }
-            return actuators[num];
         }
         public Texture GetXmasTree(int num)
         {
-            if (!xmasTrees.ContainsKey(num))
+            lock (xmasTrees)
             {
-                string name = String.Format("Xmas_{0}", num);
-                xmasTrees[num] = new Texture(rootDir, name);
+                if (!xmasTrees.ContainsKey(num))
+                {
+                    string name = String.Format("Xmas_{0}", num);
+                    xmasTrees[num] = new Texture(rootDir, name);
+                }
+                return xmasTrees[num];
             }
-            return xmasTrees[num];
         }
         public Texture GetCactus(int num)
         {
-            if (!cacti.ContainsKey(num))
+            lock (cacti)
             {
-                string name="Tiles_80";
-                switch (num)
+                if (!cacti.ContainsKey(num))
                 {
-                    case 1: //evil
-                        name = "Evil_Cactus";
-                        break;
-                    case 2: //good
-                        name = "Good_Cactus";
-                        break;
-                    case 3: //crimson
-                        name = "Crimson_Cactus";
-                        break;
+                    string name="Tiles_80";
+                    switch (num)
+                    {
+                        case 1: //evil
+                            name = "Evil_Cactus";
+                            break;
+                        case 2: //good
+                            name = "Good_Cactus";
+                            break;
+                        case 3: //crimson
+                            name = "Crimson_Cactus";
+                            break;
+                    }
+                    cacti[num] = new Texture(rootDir, name);
                 }
-                cacti[num] = new Texture(rootDir, name);
+                return cacti[num];
             }
-            return cacti[num];
         }
     }
 }
@@ -0,0 +1,259 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Writes the map as a zoom pyramid of png tiles laid out as z/x/y.png,
+    /// the way web map viewers expect.  Level 0 is one pixel per world tile
+    /// and each level up doubles it.  Tiles that are all air or unexplored
+    /// aren't written, and the section hashes saved with the tiles let the
+    /// next export redraw only the tiles over sections that changed.
+    /// </summary>
+    class TilePyramid
+    {
+        public const int TileSize = 256;
+        //pyramid tiles drawn in one go per side, so fewer get drawn twice
+        //at the edges
+        const int MetaTiles = 4;
+        //world tiles rendered around each textured block and thrown away,
+        //same as the exporter's bands
+        const int Overscan = 6;
+        const string ManifestName = "sections.manifest";
+        const string InfoName = "tiles.json";
+
+        public int MinLevel = 0;
+        public int MaxLevel = 4;
+        public int Light = 0;
+        public bool UseTextures = false;
+        public bool Houses = false;
+        public bool Wires = false;
+        public bool FogOfWar = false;
+        public int Compression = PngWriter.DefaultLevel;
+        //only redraw what changed since the last export
+        public bool Incremental = true;
+
+        //what the last export did
+        public int Written, Unchanged, Empty;
+
+        Render render;
+
+        struct Block
+        {
+            public int level, x, y;
+        }
+
+        public TilePyramid(Render render)
+        {
+            this.render = render;
+        }
+
+        /// <summary>
+        /// Writes the pyramid for world into dir.  The renderer needs to have
+        /// been given the world already.  progress gets a percentage.
+        /// </summary>
+        public void Export(string dir, World world, Action<int> progress)
+        {
+            if (MinLevel < 0 || MaxLevel > 4 || MinLevel > MaxLevel)
+                throw new Exception("Pyramid levels must be between 0 (1x) and 4 (16x)");
+            Directory.CreateDirectory(dir);
+
+            //frames have to be settled before several threads draw, and before
+            //hashing so the hashes don't depend on what happened to be drawn
+            render.ResolveFrames(world.tiles, null);
+
+            string settings = String.Format("levels {0}-{1} light {2} textures {3} houses {4} wires {5} fog {6}",
+                MinLevel, MaxLevel, Light, UseTextures, Houses, Wires, FogOfWar);
+            SectionHashes sections = SectionHashes.Compute(world.tiles, world.tilesWide, world.tilesHigh,
+                UseTextures ? world.npcs : null);
+            SectionHashes last = Incremental ? SectionHashes.Load(Path.Combine(dir, ManifestName), settings) : null;
+            //npcs only show on the textured levels
+            bool[] changed = sections.Changed(last, false);
+            bool[] changedTextured = sections.Changed(last, true);
+
+            List<Block> blocks = new List<Block>();
+            for (int level = MinLevel; level <= MaxLevel; level++)
+            {
+                int scale = 1 << level;
+                int size = TileSize * MetaTiles;
+                int across = (world.tilesWide * scale + size - 1) / size;
+                int down = (world.tilesHigh * scale + size - 1) / size;
+                for (int y = 0; y < down; y++)
+                    for (int x = 0; x < across; x++)
+                    {
+                        Block b = new Block();
+                        b.level = level;
+                        b.x = x;
+                        b.y = y;
+                        blocks.Add(b);
+                    }
+            }
+
+            int written = 0, unchanged = 0, empty = 0, finished = 0;
+            //the renderer keeps state while drawing, so each thread gets its own
+            Parallel.ForEach<Block, Render>(blocks,
+                delegate() { return new Render(render); },
+                delegate(Block b, ParallelLoopState state, Render r)
+                {
+                    int w, u, e;
+                    drawBlock(dir, world, b, r, sections, changed, changedTextured, out w, out u, out e);
+                    Interlocked.Add(ref written, w);
+                    Interlocked.Add(ref unchanged, u);
+                    Interlocked.Add(ref empty, e);
+                    int done = Interlocked.Increment(ref finished);
+                    if (progress != null)
+                        progress(done * 100 / blocks.Count);
+                    return r;
+                },
+                delegate(Render r) { });
+
+            Written = written;
+            Unchanged = unchanged;
+            Empty = empty;
+            sections.Save(Path.Combine(dir, ManifestName), settings);
+            File.WriteAllText(Path.Combine(dir, InfoName), String.Format(
+                "{{\"name\": \"{0}\", \"width\": {1}, \"height\": {2}, \"tileSize\": {3}, \"minZoom\": {4}, \"maxZoom\": {5}}}\n",
+                world.name.Replace("\\", "\\\\").Replace("\"", "\\\""), world.tilesWide, world.tilesHigh,
+                TileSize, MinLevel, MaxLevel));
+        }
+
+        private void drawBlock(string dir, World world, Block b, Render r,
+            SectionHashes sections, bool[] changed, bool[] changedTextured,
+            out int written, out int unchanged, out int empty)
+        {
+            written = unchanged = empty = 0;
+            int scale = 1 << b.level;
+            int span = TileSize / scale; //world tiles per pyramid tile
+            bool texture = UseTextures && scale > 2;
+            int margin = texture ? Overscan : 0;
+            bool[] dirty = texture ? changedTextured : changed;
+
+            //work out which tiles in the block need drawing before drawing any
+            List<int> redraw = new List<int>();
+            List<string> names = new List<string>();
+            for (int ty = 0; ty < MetaTiles; ty++)
+                for (int tx = 0; tx < MetaTiles; tx++)
+                {
+                    int px = b.x * MetaTiles + tx, py = b.y * MetaTiles + ty;
+                    int left = px * span, top = py * span;
+                    names.Add(String.Format("{0}/{1}/{2}", b.level, px, py));
+                    if (left >= world.tilesWide || top >= world.tilesHigh)
+                        continue;
+                    string path = tilePath(dir, names[names.Count - 1]);
+                    bool exists = File.Exists(path);
+                    bool stale = sections.Any(left - margin, top - margin, span + margin * 2, span + margin * 2,
+                        delegate(int i) { return dirty[i]; });
+                    if (!stale && exists)
+                    {
+                        unchanged++;
+                        continue;
+                    }
+                    if (isBlank(world, sections, left, top, span))
+                    {
+                        //it may have had something on it last time
+                        if (exists)
+                            File.Delete(path);
+                        if (stale)
+                            empty++;
+                        else
+                            unchanged++;
+                        continue;
+                    }
+                    redraw.Add(ty * MetaTiles + tx);
+                }
+            if (redraw.Count == 0)
+                return;
+
+            int pad = margin * scale;
+            int size = TileSize * MetaTiles + pad * 2;
+            byte[] pixels = new byte[size * size * 4];
+            r.DrawRegion(size, size, b.x * MetaTiles * span - margin, b.y * MetaTiles * span - margin,
+                scale, pixels, Light, texture, Houses, Wires, FogOfWar, world.tiles);
+
+            foreach (int i in redraw)
+            {
+                int tx = i % MetaTiles, ty = i / MetaTiles;
+                int px = b.x * MetaTiles + tx, py = b.y * MetaTiles + ty;
+                //tiles on the right and bottom edges stop at the world edge
+                int w = Math.Min(TileSize, world.tilesWide * scale - px * TileSize);
+                int h = Math.Min(TileSize, world.tilesHigh * scale - py * TileSize);
+                string path = tilePath(dir, names[i]);
+                Directory.CreateDirectory(Path.GetDirectoryName(path));
+                using (FileStream stream = new FileStream(path, FileMode.Create))
+                using (PngWriter png = new PngWriter(stream, w, h, Compression))
+                {
+                    int offset = ((pad + ty * TileSize) * size + pad + tx * TileSize) * 4;
+                    png.WriteRows(pixels, offset, size * 4, h);
+                    png.Close();
+                }
+                written++;
+            }
+        }
+
+        /// <summary>
+        /// Whether the world tiles under a pyramid tile are all air, or all
+        /// unexplored with fog of war on.
+        /// </summary>
+        private bool isBlank(World world, SectionHashes sections, int left, int top, int span)
+        {
+            //most of the sky and the unexplored parts are whole sections
+            if (!sections.Any(left, top, span, span, delegate(int i)
+                {
+                    return !sections.air[i] && !(FogOfWar && sections.unseen[i]);
+                }))
+                return true;
+            int x1 = Math.Min(left + span, world.tilesWide), y1 = Math.Min(top + span, world.tilesHigh);
+            bool air = true, unseen = true;
+            for (int x = left; x < x1; x++)
+                for (int y = top; y < y1; y++)
+                {
+                    Tile tile = world.tiles[x, y];
+                    if (tile.isActive || tile.wall != 0 || tile.liquid != 0)
+                        air = false;
+                    if (tile.seen)
+                        unseen = false;
+                    if (!air && !(FogOfWar && unseen))
+                        return false;
+                }
+            return true;
+        }
+
+        private static string tilePath(string dir, string name)
+        {
+            return Path.Combine(dir, name.Replace('/', Path.DirectorySeparatorChar) + ".png");
+        }
+    }
+}
@@ -0,0 +1,219 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Reads and writes tiles the way servers send them in 0x0a rows and 0x14
+    /// squares.  Rows are decoded straight into the map; the first tile of a
+    /// run is read once and the rest of the run is copied from it whole.
+    /// </summary>
+    class TileRowCodec
+    {
+        //whether a tile type sends its frame, by type
+        bool[] hasExtra = new bool[256];
+
+        public TileRowCodec(TileInfos tileInfos)
+        {
+            for (int i = 0; i < hasExtra.Length && i < tileInfos.Count; i++)
+                hasExtra[i] = tileInfos[i] != null && tileInfos[i].hasExtra;
+        }
+
+        /// <summary>
+        /// Decodes the 0x0a payload at offset into world's tiles, returns the
+        /// offset past it.  startx, y and width get the part of the row it covered.
+        /// </summary>
+        public int DecodeRow(byte[] data, int offset, World world, out int startx, out int y, out int width)
+        {
+            width = int16(data, offset);
+            startx = int32(data, offset + 2);
+            y = int32(data, offset + 6);
+            offset += 10;
+            if (y < 0 || y >= world.tilesHigh || startx < 0 || width < 0 || startx + width > world.tilesWide)
+                throw new Exception(String.Format("Bad tile row: {0} tiles at {1},{2}", width, startx, y));
+
+            Tile[,] tiles = world.tiles;
+            int end = startx + width;
+            for (int x = startx; x < end; x++)
+            {
+                Tile tile = tiles[x, y];
+                offset = ReadTile(data, offset, tile);
+                int rle = int16(data, offset);
+                offset += 2;
+                if (rle < 0 || x + rle >= end)
+                    throw new Exception(String.Format("Bad tile run: {0} tiles at {1},{2}", rle, x, y));
+                for (int r = x + 1; r <= x + rle; r++)
+                    tiles[r, y].CopyFrom(tile);
+                x += rle;
+            }
+            return offset;
+        }
+
+        /// <summary>
+        /// Reads one tile at offset, returns the offset past it.
+        /// </summary>
+        public int ReadTile(byte[] data, int offset, Tile tile)
+        {
+            byte flags = data[offset++];
+            byte flags2 = data[offset++];
+            tile.isActive = (flags & 1) == 1;
+            tile.hasRedWire = (flags & 16) == 16;
+            tile.half = (flags & 32) == 32;
+            tile.actuator = (flags & 64) == 64;
+            tile.inactive = (flags & 128) == 128;
+            tile.hasGreenWire = (flags2 & 1) == 1;
+            tile.hasBlueWire = (flags2 & 2) == 2;
+            tile.slope = (byte)((flags2 & 0x30) >> 4);
+            tile.color = (flags2 & 4) == 4 ? data[offset++] : (byte)0;
+            tile.wallColor = (flags2 & 8) == 8 ? data[offset++] : (byte)0;
+            if (tile.isActive)
+            {
+                tile.type = data[offset++];
+                if (hasExtra[tile.type])
+                {
+                    tile.u = int16(data, offset);
+                    tile.v = int16(data, offset + 2);
+                    offset += 4;
+                }
+                else
+                {
+                    tile.u = -1;
+                    tile.v = -1;
+                }
+            }
+            tile.wall = (flags & 4) == 4 ? data[offset++] : (byte)0;
+            tile.wallu = -1;
+            tile.wallv = -1;
+            if ((flags & 8) == 8)
+            {
+                tile.liquid = data[offset++];
+                tile.isLava = data[offset] == 1;
+                tile.isHoney = data[offset] == 2;
+                offset++;
+            }
+            else
+                tile.liquid = 0;
+            return offset;
+        }
+
+        /// <summary>
+        /// Writes the 0x0a payload for width tiles of row y from startx, runs
+        /// of equal tiles sent once.
+        /// </summary>
+        public void WriteRow(BinaryWriter w, Tile[,] tiles, int startx, int y, int width)
+        {
+            w.Write((Int16)width);
+            w.Write(startx);
+            w.Write(y);
+            for (int x = startx; x < startx + width; x++)
+            {
+                Tile tile = tiles[x, y];
+                int rle = 0;
+                while (x + rle + 1 < startx + width && rle < Int16.MaxValue &&
+                    sameOnWire(tile, tiles[x + rle + 1, y]))
+                    rle++;
+                byte flags = 0, flags2 = 0;
+                if (tile.isActive) flags |= 1;
+                if (tile.wall > 0) flags |= 4;
+                if (tile.liquid > 0) flags |= 8;
+                if (tile.hasRedWire) flags |= 16;
+                if (tile.half) flags |= 32;
+                if (tile.actuator) flags |= 64;
+                if (tile.inactive) flags |= 128;
+                if (tile.hasGreenWire) flags2 |= 1;
+                if (tile.hasBlueWire) flags2 |= 2;
+                if (tile.color > 0) flags2 |= 4;
+                if (tile.wallColor > 0) flags2 |= 8;
+                flags2 |= (byte)((tile.slope & 3) << 4);
+                w.Write(flags);
+                w.Write(flags2);
+                if (tile.color > 0)
+                    w.Write(tile.color);
+                if (tile.wallColor > 0)
+                    w.Write(tile.wallColor);
+                if (tile.isActive)
+                {
+                    w.Write((byte)tile.type);
+                    if (hasExtra[tile.type & 0xff])
+                    {
+                        w.Write(tile.u);
+                        w.Write(tile.v);
+                    }
+                }
+                if (tile.wall > 0)
+                    w.Write(tile.wall);
+                if (tile.liquid > 0)
+                {
+                    w.Write(tile.liquid);
+                    w.Write((byte)(tile.isLava ? 1 : tile.isHoney ? 2 : 0));
+                }
+                w.Write((Int16)rle);
+                x += rle;
+            }
+        }
+
+        /// <summary>
+        /// Whether two tiles are sent the same, so can share a run
+        /// </summary>
+        private bool sameOnWire(Tile a, Tile b)
+        {
+            if (a.isActive != b.isActive || a.wall != b.wall || a.liquid != b.liquid ||
+                a.hasRedWire != b.hasRedWire || a.hasGreenWire != b.hasGreenWire ||
+                a.hasBlueWire != b.hasBlueWire || a.half != b.half || a.actuator != b.actuator ||
+                a.inactive != b.inactive || a.slope != b.slope || a.color != b.color ||
+                a.wallColor != b.wallColor)
+                return false;
+            if (a.liquid > 0 && (a.isLava != b.isLava || a.isHoney != b.isHoney))
+                return false;
+            if (a.isActive)
+            {
+                if (a.type != b.type)
+                    return false;
+                if (hasExtra[a.type & 0xff] && (a.u != b.u || a.v != b.v))
+                    return false;
+            }
+            return true;
+        }
+
+        private static Int16 int16(byte[] data, int offset)
+        {
+            return (Int16)(data[offset] | (data[offset + 1] << 8));
+        }
+
+        private static Int32 int32(byte[] data, int offset)
+        {
+            return data[offset] | (data[offset + 1] << 8) | (data[offset + 2] << 16) | (data[offset + 3] << 24);
+        }
+    }
+}
@@ -0,0 +1,430 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Xml;
+
+namespace Terrafirma
+{
+    public class TileInfo
+    {
+        public string name;
+        public UInt32 color;
+        public bool hasExtra;
+        public double light;
+        public double lightR, lightG, lightB;
+        public bool transparent, solid;
+        public bool isStone, isGrass;
+		public bool canMerge;
+        public Int16 blend;
+        public int u, v, minu, maxu, minv, maxv;
+        public bool isHilighting;
+        public List<TileInfo> variants;
+    }
+    class TileInfos
+    {
+        public TileInfos(XmlNodeList nodes)
+        {
+            info = new TileInfo[nodes.Count];
+            for (int i = 0; i < nodes.Count; i++)
+            {
+                int id = Convert.ToInt32(nodes[i].Attributes["num"].Value);
+                info[id] = new TileInfo();
+                loadInfo(info[id], nodes[i]);
+            }
+        }
+        public int Count
+        {
+            get { return info.Length; }
+        }
+        public TileInfo this[int id] //no variantions
+        {
+            get { return info[id]; }
+        }
+        public TileInfo this[int id, Int16 u, Int16 v]
+        {
+            get { return find(info[id], u, v); }
+        }
+        public ArrayList Items()
+        {
+            ArrayList items = new ArrayList();
+            for (int i = 0; i < info.Length; i++)
+                items.Add(info[i]);
+            return items;
+        }
+
+        private TileInfo find(TileInfo info, Int16 u, Int16 v)
+        {
+            foreach (TileInfo vars in info.variants)
+            {
+                // must match *all* restrictions... and we take the first match we find.
+                if ((vars.u < 0 || vars.u == u) &&
+                    (vars.v < 0 || vars.v == v) &&
+                    (vars.minu < 0 || vars.minu <= u) &&
+                    (vars.minv < 0 || vars.minv <= v) &&
+                    (vars.maxu < 0 || vars.maxu > u) &&
+                    (vars.maxv < 0 || vars.maxv > v))
+                    return find(vars, u, v); //check for sub-variants
+            }
+            // if we get here, there are no variants that match
+            return info;
+        }
+        private double parseDouble(string value)
+        {
+            return Double.Parse(value, System.Globalization.CultureInfo.InvariantCulture);
+        }
+        private Int16 parseInt(string value)
+        {
+            return Int16.Parse(value, System.Globalization.CultureInfo.InvariantCulture);
+        }
+        private UInt32 parseColor(string color)
+        {
+            UInt32 c = 0;
+            for (int j = 0; j < color.Length; j++)
+            {
+                c <<= 4;
+                if (color[j] >= '0' && color[j] <= '9')
+                    c |= (byte)(color[j] - '0');
+                else if (color[j] >= 'A' && color[j] <= 'F')
+                    c |= (byte)(10 + color[j] - 'A');
+                else if (color[j] >= 'a' && color[j] <= 'f')
+                    c |= (byte)(10 + color[j] - 'a');
+            }
+            return c;
+        }
+        private void loadInfo(TileInfo info, XmlNode node)
+        {
+            info.name = node.Attributes["name"].Value;
+            info.color = parseColor(node.Attributes["color"].Value);
+            info.hasExtra = node.Attributes["hasExtra"] != null;
+            info.light = (node.Attributes["light"] == null) ? 0.0 : parseDouble(node.Attributes["light"].Value);
+            info.lightR = (node.Attributes["lightr"] == null) ? 0.0 : parseDouble(node.Attributes["lightr"].Value);
+            info.lightG = (node.Attributes["lightg"] == null) ? 0.0 : parseDouble(node.Attributes["lightg"].Value);
+            info.lightB = (node.Attributes["lightb"] == null) ? 0.0 : parseDouble(node.Attributes["lightb"].Value);
+            info.transparent = node.Attributes["letLight"] != null;
+            info.solid = node.Attributes["solid"] != null;
+            info.isStone = node.Attributes["isStone"] != null;
+            info.isGrass = node.Attributes["isGrass"] != null;
+			info.canMerge = node.Attributes["merge"] != null;
+            if (node.Attributes["blend"] != null)
+                info.blend = parseInt(node.Attributes["blend"].Value);
+            else
+                info.blend = -1;
+            info.variants = new List<TileInfo>();
+            if (node.HasChildNodes)
+                for (int i = 0; i < node.ChildNodes.Count; i++)
+                    info.variants.Add(newVariant(info, node.ChildNodes[i]));
+        }
+        private TileInfo newVariant(TileInfo parent, XmlNode node)
+        {
+            TileInfo info = new TileInfo();
+            info.name = (node.Attributes["name"] == null) ? parent.name : node.Attributes["name"].Value;
+            info.color = (node.Attributes["color"] == null) ? parent.color : parseColor(node.Attributes["color"].Value);
+            info.transparent = (node.Attributes["letLight"] == null) ? parent.transparent : true;
+            info.solid = (node.Attributes["solid"] == null) ? parent.solid : true;
+            info.light = (node.Attributes["light"] == null) ? parent.light : parseDouble(node.Attributes["light"].Value);
+            info.lightR = (node.Attributes["lightr"] == null) ? parent.lightR : parseDouble(node.Attributes["lightr"].Value);
+            info.lightG = (node.Attributes["lightg"] == null) ? parent.lightG : parseDouble(node.Attributes["lightg"].Value);
+            info.lightB = (node.Attributes["lightb"] == null) ? parent.lightB : parseDouble(node.Attributes["lightb"].Value);
+            info.u = (node.Attributes["u"] == null) ? -1 : parseInt(node.Attributes["u"].Value);
+            info.v = (node.Attributes["v"] == null) ? -1 : parseInt(node.Attributes["v"].Value);
+            info.minu = (node.Attributes["minu"] == null) ? -1 : parseInt(node.Attributes["minu"].Value);
+            info.maxu = (node.Attributes["maxu"] == null) ? -1 : parseInt(node.Attributes["maxu"].Value);
+            info.minv = (node.Attributes["minv"] == null) ? -1 : parseInt(node.Attributes["minv"].Value);
+            info.maxv = (node.Attributes["maxv"] == null) ? -1 : parseInt(node.Attributes["maxv"].Value);
+            info.variants = new List<TileInfo>();
+            if (node.HasChildNodes)
+                for (int i = 0; i < node.ChildNodes.Count; i++)
+                    info.variants.Add(newVariant(info, node.ChildNodes[i]));
+            return info;
+        }
+
+        private TileInfo[] info;
+    };
+    struct WallInfo
+    {
+        public string name;
+        public UInt32 color;
+		public Int16 blend;
+    }
+    class Tile
+    {
+        private UInt32 lite;
+        public Int16 u, v, wallu, wallv;
+        private UInt16 flags;
+        public UInt16 type;
+        public byte wall;
+        public byte liquid;
+
+        public byte color;
+        public byte wallColor;
+        public byte slope;
+
+
+        public bool isActive
+        {
+            get
+            {
+                return (flags & 0x0001) == 0x0001;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0001;
+                else
+                    flags &= 0xfffe;
+            }
+        }
+        public bool isLava
+        {
+            get
+            {
+                return (flags & 0x0002) == 0x0002;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0002;
+                else
+                    flags &= 0xfffd;
+            }
+        }
+        public bool isHoney
+        {
+            get
+            {
+                return (flags & 0x0004) == 0x0004;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0004;
+                else
+                    flags &= 0xfffb;
+            }
+        }
+        public bool seen
+        {
+            get
+            {
+                return (flags & 0x0008) == 0x0008;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0008;
+                else
+                    flags &= 0xfff7;
+            }
+        }
+
+        public bool hasRedWire
+        {
+            get
+            {
+                return (flags & 0x0010) == 0x0010;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0010;
+                else
+                    flags &= 0xffef;
+            }
+        }
+        public bool hasBlueWire
+        {
+            get
+            {
+                return (flags & 0x0020) == 0x0020;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0020;
+                else
+                    flags &= 0xffdf;
+            }
+        }
+        public bool hasGreenWire
+        {
+            get
+            {
+                return (flags & 0x0040) == 0x0040;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0040;
+                else
+                    flags &= 0xffbf;
+            }
+        }
+        public bool half
+        {
+            get
+            {
+                return (flags & 0x0080) == 0x0080;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0080;
+                else
+                    flags &= 0xff7f;
+            }
+        }
+        public bool actuator
+        {
+            get
+            {
+                return (flags & 0x0100) == 0x0100;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0100;
+                else
+                    flags &= 0xfeff;
+            }
+        }
+        public bool inactive
+        {
+            get
+            {
+                return (flags & 0x0200) == 0x0200;
+            }
+            set
+            {
+                if (value)
+                    flags |= 0x0200;
+                else
+                    flags &= 0xfdff;
+            }
+        }
+
+        public double light
+        {
+            get
+            {
+                return getRGBA(0);
+            }
+            set
+            {
+                setRGBA(0, value);
+            }
+        }
+        public double lightR
+        {
+            get
+            {
+                return getRGBA(24);
+            }
+            set
+            {
+                setRGBA(24, value);
+            }
+        }
+        public double lightG
+        {
+            get
+            {
+                return getRGBA(16);
+            }
+            set
+            {
+                setRGBA(16, value);
+            }
+        }
+        public double lightB
+        {
+            get
+            {
+                return getRGBA(8);
+            }
+            set
+            {
+                setRGBA(8, value);
+            }
+        }
+        private void setRGBA(int shift, double v)
+        {
+            int l = (int)Math.Round(v * 255.0);
+            if (l > 255) l = 255;
+            else if (l < 0) l = 0;
+            lite &= ~(UInt32)(0xff << shift);
+            lite |= (UInt32)(l << shift);
+        }
+        private double getRGBA(int shift)
+        {
+            int r = (int)(lite >> shift) & 0xff;
+            return (double)r / 255.0;
+        }
+
+        /// <summary>
+        /// Mixes everything that changes how the tile draws into a running
+        /// FNV-1a hash, a field at a time.
+        /// </summary>
+        public UInt64 Hash(UInt64 h)
+        {
+            const UInt64 prime = 1099511628211;
+            h = (h ^ type) * prime;
+            h = (h ^ flags) * prime;
+            h = (h ^ (UInt16)u) * prime;
+            h = (h ^ (UInt16)v) * prime;
+            h = (h ^ (UInt16)wallu) * prime;
+            h = (h ^ (UInt16)wallv) * prime;
+            h = (h ^ (UInt32)(wall | (liquid << 8) | (color << 16) | (wallColor << 24))) * prime;
+            h = (h ^ slope) * prime;
+            h = (h ^ lite) * prime;
+            return h;
+        }
+
+        /// <summary>
+        /// Copies everything but the light and whether the player has seen
+        /// it, for filling runs of the same tile.
+        /// </summary>
+        public void CopyFrom(Tile other)
+        {
+            u = other.u;
+            v = other.v;
+            wallu = other.wallu;
+            wallv = other.wallv;
+            flags = (UInt16)((flags & 0x0008) | (other.flags & 0xfff7));
+            type = other.type;
+            wall = other.wall;
+            liquid = other.liquid;
+            color = other.color;
+            wallColor = other.wallColor;
+            slope = other.slope;
+        }
+    }
+}
@@ -0,0 +1,1081 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+
+namespace Terrafirma
+{
+    struct ChestItem
+    {
+        public int stack;
+        public string name;
+        public string prefix;
+    }
+    struct Chest
+    {
+        public Int32 x { get; set; }
+        public Int32 y { get; set; }
+        public String name { get; set; }
+        public ChestItem[] items;
+    }
+    struct Sign
+    {
+        public string text;
+        public Int32 x, y;
+    }
+    class NPC
+    {
+        public string title;
+        public string name;
+        public float x, y;
+        public bool isHomeless;
+        public Int32 homeX, homeY;
+        public int sprite;
+        public int num;
+        public int slot;
+        public int order;
+    }
+    struct FriendlyNPC
+    {
+        public FriendlyNPC(string title, int id, int num, int order)
+        {
+            this.title = title;
+            this.id = id;
+            this.num = num;
+            this.order = order;
+        }
+        public string title;
+        public int id; //sprite
+        public int num; // number for npc heads
+        public int order; //order in name list
+    };
+
+    /// <summary>
+    /// Receives status text while a world is loaded or lit.  Called from
+    /// the loading thread.
+    /// </summary>
+    interface ILoadProgress
+    {
+        void Status(string text);
+    }
+
+    /// <summary>
+    /// A loaded world and its loaders.  Has no UI dependencies so it can
+    /// be used by the viewer and the command line renderer alike.
+    /// </summary>
+    class World
+    {
+        public const int MapVersion = 94;
+        public const int MaxTile = 254;
+        public const int MaxWall = 125;
+        public const int Widest = 8400;
+        public const int Highest = 2400;
+        //tiles light spreads before it fades out, at 0.04 a tile
+        public const int LightReach = 25;
+
+        public string name;
+        public Tile[,] tiles;
+        public Int32 tilesWide = 0, tilesHigh = 0;
+        public Int32 spawnX, spawnY;
+        public Int32 groundLevel, rockLevel;
+        public Int32 worldID = 0;
+        public List<Chest> chests = new List<Chest>();
+        public List<Sign> signs = new List<Sign>();
+        public List<NPC> npcs = new List<NPC>();
+
+        public byte moonType;
+        public Int32[] treeX = new Int32[3];
+        public Int32[] treeStyle = new Int32[4];
+        public Int32[] caveBackX = new Int32[3];
+        public Int32[] caveBackStyle = new Int32[4];
+        public Int32 iceBackStyle, jungleBackStyle, hellBackStyle;
+        public bool crimson;
+        public bool killedQueenBee, killedMechBoss1, killedMechBoss2, killedMechBoss3, killedMechBossAny, killedPirates;
+        public bool isRaining;
+        public Int32 rainTime;
+        public float maxRain;
+        public Int32 oreTier1, oreTier2, oreTier3;
+
+        public double gameTime;
+        public bool dayNight, bloodMoon, eclipse;
+        public int moonPhase;
+        public Int32 dungeonX, dungeonY;
+        public bool killedBoss1, killedBoss2, killedBoss3, killedGoblins, killedClown, killedFrost;
+        public bool killedPlantBoss, killedGolemBoss;
+        public bool savedTinkerer, savedWizard, savedMechanic;
+        public bool smashedOrb, meteorSpawned;
+        public byte shadowOrbCount;
+        public Int32 altarsSmashed;
+        public bool hardMode;
+        public Int32 goblinsDelay, goblinsSize, goblinsType;
+        public double goblinsX;
+        public byte[] styles = {   0, //tree
+                                   0, //corruption
+                                   0, //jungle
+                                   0, //snow
+                                   0, //hallow
+                                   0, //crimson
+                                   0, //desert
+                                   0 }; //ocean
+
+        public static readonly FriendlyNPC[] friendlyNPCs ={
+                                        new FriendlyNPC("Merchant", 17, 2, 0),
+                                        new FriendlyNPC("Nurse", 18, 3, 1),
+                                        new FriendlyNPC("Arms Dealer", 19, 6, 2),
+                                        new FriendlyNPC("Dryad", 20, 5, 3),
+                                        new FriendlyNPC("Guide", 22, 1, 4),
+                                        new FriendlyNPC("Old Man",37, 0, -1),
+                                        new FriendlyNPC("Demolitionist", 38, 4, 6),
+                                        new FriendlyNPC("Clothier", 54, 7, 5),
+                                        new FriendlyNPC("Goblin Tinkerer", 107, 9, 7),
+                                        new FriendlyNPC("Wizard", 108, 10, 8),
+                                        new FriendlyNPC("Mechanic", 124, 8, 9),
+                                        new FriendlyNPC("Santa Claus", 142, 11, -1),
+										new FriendlyNPC("Truffle", 160, 12, 10),
+										new FriendlyNPC("Steampunker", 178, 13, 11),
+										new FriendlyNPC("Dye Trader", 207, 14, 12),
+										new FriendlyNPC("Party Girl", 208, 15, 13),
+										new FriendlyNPC("Cyborg", 209, 16, 14),
+										new FriendlyNPC("Painter", 227, 17, 15),
+										new FriendlyNPC("Witch Doctor", 228, 18, 16),
+										new FriendlyNPC("Pirate", 229, 19, 17),
+                                        new FriendlyNPC("Stylist", 353, 20, 18)
+                                   };
+
+        WorldInfo info;
+
+        public World(WorldInfo info)
+            : this(info, Widest, Highest)
+        {
+        }
+
+        /// <summary>
+        /// A world whose grid starts at wide x high.  ResizeMap grows it to fit
+        /// a bigger world, so a grid of 0 x 0 only ever holds the world in it.
+        /// </summary>
+        public World(WorldInfo info, int wide, int high)
+        {
+            this.info = info;
+            tiles = new Tile[wide, high];
+        }
+
+        /// <summary>
+        /// Where terraria saves its worlds
+        /// </summary>
+        public static string WorldsFolder()
+        {
+            string terrariapath = Environment.GetFolderPath(Environment.SpecialFolder.MyDocuments);
+            terrariapath = Path.Combine(terrariapath, "My Games");
+            terrariapath = Path.Combine(terrariapath, "Terraria");
+            return Path.Combine(terrariapath, "Worlds");
+        }
+
+        /// <summary>
+        /// Loads a .wld file.  Returns false and fills in invalid if the map
+        /// had bad tiles or walls, it may not display properly.
+        /// </summary>
+        public bool Load(string path, ILoadProgress progress, out string invalid)
+        {
+            bool foundInvalid = false;
+            invalid = "";
+            using (BinaryReader b = new BinaryReader(File.Open(path, FileMode.Open, FileAccess.Read, FileShare.ReadWrite)))
+            {
+                int version = b.ReadInt32(); //now we care about the version
+                if (version > MapVersion)
+                    throw new Exception("Unsupported map version: " + version);
+                if (version > 87) //new map format
+                    foundInvalid = LoadNewMap(b, version, progress, out invalid);
+                else
+                    foundInvalid = LoadOldMap(b, version, progress, out invalid);
+            }
+            return !foundInvalid;
+        }
+
+        private bool LoadNewMap(BinaryReader b, int version, ILoadProgress progress, out string invalid)
+        {
+            Int16 numSections = b.ReadInt16();
+            int[] sections = new int[numSections];
+            for (int i = 0; i < numSections; i++)
+                sections[i] = b.ReadInt32();
+            Int16 numTiles = b.ReadInt16();
+            byte mask = 0x80;
+            byte bits = 0;
+            bool[] extra = new bool[numTiles];
+            for (int i = 0; i < numTiles; i++)
+            {
+                if (mask == 0x80)
+                {
+                    bits = b.ReadByte();
+                    mask = 1;
+                }
+                else
+                    mask <<= 1;
+                extra[i] = (bits & mask) == mask;
+            }
+            b.BaseStream.Position = sections[0]; //skip any unknown data in world file header
+            LoadHeader(b, version, progress);
+            b.BaseStream.Position = sections[1]; //skip to tiles
+            if (!LoadTiles(b, version, extra, progress, out invalid))
+                return true;
+            b.BaseStream.Position = sections[2]; //skip to chests
+            LoadChests(b, version);
+            b.BaseStream.Position = sections[3]; //skip to signs
+            LoadSigns(b);
+            b.BaseStream.Position = sections[4]; //skip to npcs
+            LoadNPCs(b, version, progress);
+            return false;
+        }
+
+        private bool LoadOldMap(BinaryReader b, int version, ILoadProgress progress, out string invalid)
+        {
+            LoadHeader(b, version, progress);
+            if (!LoadOldTiles(b, version, progress, out invalid))
+                return true;
+            LoadOldChests(b, version);
+            LoadOldSigns(b);
+            LoadNPCs(b, version, progress);
+            return false;
+        }
+
+        private void LoadHeader(BinaryReader b, int version, ILoadProgress progress)
+        {
+            name = b.ReadString();
+            worldID = b.ReadInt32();
+            b.BaseStream.Seek(16, SeekOrigin.Current); //skip bounds
+            tilesHigh = b.ReadInt32();
+            tilesWide = b.ReadInt32();
+            moonType = 0;
+            if (version >= 63)
+                moonType = b.ReadByte();
+            treeX[0] = treeX[1] = treeX[2] = 0;
+            treeStyle[0] = treeStyle[1] = treeStyle[2] = treeStyle[3] = 0;
+            if (version >= 44)
+            {
+                treeX[0] = b.ReadInt32();
+                treeX[1] = b.ReadInt32();
+                treeX[2] = b.ReadInt32();
+                treeStyle[0] = b.ReadInt32();
+                treeStyle[1] = b.ReadInt32();
+                treeStyle[2] = b.ReadInt32();
+                treeStyle[3] = b.ReadInt32();
+            }
+            caveBackX[0] = caveBackX[1] = caveBackX[2] = 0;
+            caveBackStyle[0] = caveBackStyle[1] = caveBackStyle[2] = caveBackStyle[3] = 0;
+            iceBackStyle = jungleBackStyle = hellBackStyle = 0;
+            if (version >= 60)
+            {
+                caveBackX[0] = b.ReadInt32();
+                caveBackX[1] = b.ReadInt32();
+                caveBackX[2] = b.ReadInt32();
+                caveBackStyle[0] = b.ReadInt32();
+                caveBackStyle[1] = b.ReadInt32();
+                caveBackStyle[2] = b.ReadInt32();
+                caveBackStyle[3] = b.ReadInt32();
+                iceBackStyle = b.ReadInt32();
+                if (version >= 61)
+                {
+                    jungleBackStyle = b.ReadInt32();
+                    hellBackStyle = b.ReadInt32();
+                }
+            }
+            spawnX = b.ReadInt32();
+            spawnY = b.ReadInt32();
+            groundLevel = (int)b.ReadDouble();
+            rockLevel = (int)b.ReadDouble();
+            gameTime = b.ReadDouble();
+            dayNight = b.ReadBoolean();
+            moonPhase = b.ReadInt32();
+            bloodMoon = b.ReadBoolean();
+            eclipse = false;
+            if (version >= 70)
+                eclipse = b.ReadBoolean();
+            dungeonX = b.ReadInt32();
+            dungeonY = b.ReadInt32();
+            crimson = false;
+            if (version >= 56)
+                crimson = b.ReadBoolean();
+            killedBoss1 = b.ReadBoolean();
+            killedBoss2 = b.ReadBoolean();
+            killedBoss3 = b.ReadBoolean();
+            killedQueenBee = false;
+            if (version >= 66)
+                killedQueenBee = b.ReadBoolean();
+            killedMechBoss1 = killedMechBoss2 = killedMechBoss3 = killedMechBossAny = false;
+            if (version >= 44)
+            {
+                killedMechBoss1 = b.ReadBoolean();
+                killedMechBoss2 = b.ReadBoolean();
+                killedMechBoss3 = b.ReadBoolean();
+                killedMechBossAny = b.ReadBoolean();
+            }
+            killedPlantBoss = killedGolemBoss = false;
+            if (version >= 64)
+            {
+                killedPlantBoss = b.ReadBoolean();
+                killedGolemBoss = b.ReadBoolean();
+            }
+            savedTinkerer = savedWizard = savedMechanic = killedGoblins = killedClown = killedFrost = killedPirates = false;
+            if (version >= 29)
+            {
+                savedTinkerer = b.ReadBoolean();
+                savedWizard = b.ReadBoolean();
+                if (version >= 34)
+                    savedMechanic = b.ReadBoolean();
+                killedGoblins = b.ReadBoolean();
+                if (version >= 32)
+                    killedClown = b.ReadBoolean();
+                if (version >= 37)
+                    killedFrost = b.ReadBoolean();
+                if (version >= 56)
+                    killedPirates = b.ReadBoolean();
+            }
+            smashedOrb = b.ReadBoolean();
+            meteorSpawned = b.ReadBoolean();
+            shadowOrbCount = b.ReadByte();
+            altarsSmashed = 0;
+            hardMode = false;
+            if (version >= 23)
+            {
+                altarsSmashed = b.ReadInt32();
+                hardMode = b.ReadBoolean();
+            }
+            goblinsDelay = b.ReadInt32();
+            goblinsSize = b.ReadInt32();
+            goblinsType = b.ReadInt32();
+            goblinsX = b.ReadDouble();
+
+            isRaining = false;
+            rainTime = 0;
+            maxRain = 0.0F;
+            oreTier1 = 107;
+            oreTier2 = 108;
+            oreTier3 = 111;
+            if (version >= 23 && altarsSmashed == 0)
+                oreTier1 = oreTier2 = oreTier3 = -1;
+            if (version >= 53)
+            {
+                isRaining = b.ReadBoolean();
+                rainTime = b.ReadInt32();
+                maxRain = b.ReadSingle();
+                if (version >= 54)
+                {
+                    oreTier1 = b.ReadInt32();
+                    oreTier2 = b.ReadInt32();
+                    oreTier3 = b.ReadInt32();
+                }
+            }
+            if (version >= 55)
+            {
+                int numstyles = 3;
+                if (version >= 60)
+                    numstyles = 8;
+                for (int i = 0; i < numstyles; i++)
+                    styles[i] = b.ReadByte();
+                //skip clouds
+                if (version >= 60)
+                {
+                    b.BaseStream.Seek(4, SeekOrigin.Current);
+                    if (version >= 62) //skip wind
+                        b.BaseStream.Seek(6, SeekOrigin.Current);
+                }
+            }
+
+            ResizeMap(progress);
+        }
+
+        private bool LoadOldTiles(BinaryReader b, int version, ILoadProgress progress, out string invalid)
+        {
+            invalid = "";
+            for (int x = 0; x < tilesWide; x++)
+            {
+                progress.Status(((int)((float)x * 100.0 / (float)tilesWide)) + "% - Reading tiles");
+                for (int y = 0; y < tilesHigh; y++)
+                {
+                    tiles[x, y].isActive = b.ReadBoolean();
+                    if (tiles[x, y].isActive)
+                    {
+                        if (version <= 77)
+                            tiles[x, y].type = b.ReadByte();
+                        else
+                            tiles[x, y].type = b.ReadUInt16();
+                        if (tiles[x, y].type > MaxTile) // something screwy in the map
+                        {
+                            tiles[x, y].isActive = false;
+                            invalid = String.Format("{0} is not a valid tile type", tiles[x, y].type);
+                            return false;
+                        }
+                        else if (info.tileInfos[tiles[x, y].type].hasExtra || (version < 72 && tiles[x, y].type == 170))
+                        {
+                            // torches and platforms didn't have extra in older versions.
+                            if ((version < 28 && tiles[x, y].type == 4) ||
+                                (version < 40 && tiles[x, y].type == 19))
+                            {
+                                tiles[x, y].u = -1;
+                                tiles[x, y].v = -1;
+                            }
+                            else
+                            {
+                                tiles[x, y].u = b.ReadInt16();
+                                tiles[x, y].v = b.ReadInt16();
+                                if (tiles[x, y].type == 144) //timer
+                                    tiles[x, y].v = 0;
+                            }
+                        }
+                        else
+                        {
+                            tiles[x, y].u = -1;
+                            tiles[x, y].v = -1;
+                        }
+
+                        if (version >= 48 && b.ReadBoolean())
+                        {
+                            tiles[x, y].color = b.ReadByte();
+                        }
+                    }
+                    if (version <= 25)
+                        b.ReadBoolean(); //skip obsolete hasLight
+                    if (b.ReadBoolean())
+                    {
+                        tiles[x, y].wall = b.ReadByte();
+                        if (tiles[x, y].wall > MaxWall)  // bad wall
+                        {
+                            invalid = String.Format("{0} is not a valid wall type", tiles[x, y].wall);
+                            tiles[x, y].wall = 0;
+                            return false;
+                        }
+                        if (version >= 48 && b.ReadBoolean())
+                            tiles[x, y].wallColor = b.ReadByte();
+                        tiles[x, y].wallu = -1;
+                        tiles[x, y].wallv = -1;
+                    }
+                    else
+                        tiles[x, y].wall = 0;
+                    if (b.ReadBoolean())
+                    {
+                        tiles[x, y].liquid = b.ReadByte();
+                        tiles[x, y].isLava = b.ReadBoolean();
+                        if (version >= 51)
+                            tiles[x, y].isHoney = b.ReadBoolean();
+                    }
+                    else
+                        tiles[x, y].liquid = 0;
+                    tiles[x, y].hasRedWire = false;
+                    tiles[x, y].hasGreenWire = false;
+                    tiles[x, y].hasBlueWire = false;
+                    tiles[x, y].half = false;
+                    tiles[x, y].actuator = false;
+                    tiles[x, y].inactive = false;
+                    tiles[x, y].slope = 0;
+                    if (version >= 33)
+                    {
+                        tiles[x, y].hasRedWire = b.ReadBoolean();
+                        if (version >= 43)
+                        {
+                            tiles[x, y].hasGreenWire = b.ReadBoolean();
+                            tiles[x, y].hasBlueWire = b.ReadBoolean();
+                        }
+                        if (version >= 41)
+                        {
+                            tiles[x, y].half = b.ReadBoolean();
+                            if (version >= 49)
+                                tiles[x, y].slope = b.ReadByte();
+                            if (!info.tileInfos[tiles[x, y].type].solid)
+                            {
+                                tiles[x, y].half = false;
+                                tiles[x, y].slope = 0;
+                            }
+                            if (version >= 42)
+                            {
+                                tiles[x, y].actuator = b.ReadBoolean();
+                                tiles[x, y].inactive = b.ReadBoolean();
+                            }
+                        }
+                    }
+                    if (version >= 25) //RLE
+                    {
+                        int rle = b.ReadInt16();
+                        for (int r = y + 1; r < y + 1 + rle; r++)
+                        {
+                            tiles[x, r].isActive = tiles[x, y].isActive;
+                            tiles[x, r].type = tiles[x, y].type;
+                            tiles[x, r].u = tiles[x, y].u;
+                            tiles[x, r].v = tiles[x, y].v;
+                            tiles[x, r].wall = tiles[x, y].wall;
+                            tiles[x, r].wallu = -1;
+                            tiles[x, r].wallv = -1;
+                            tiles[x, r].liquid = tiles[x, y].liquid;
+                            tiles[x, r].isLava = tiles[x, y].isLava;
+                            tiles[x, r].isHoney = tiles[x, y].isHoney;
+                            tiles[x, r].hasRedWire = tiles[x, y].hasRedWire;
+                            tiles[x, r].hasGreenWire = tiles[x, y].hasGreenWire;
+                            tiles[x, r].hasBlueWire = tiles[x, y].hasBlueWire;
+                            tiles[x, r].half = tiles[x, y].half;
+                            tiles[x, r].slope = tiles[x, y].slope;
+                            tiles[x, r].actuator = tiles[x, y].actuator;
+                            tiles[x, r].inactive = tiles[x, y].inactive;
+                            tiles[x, r].color = tiles[x, y].color;
+                            tiles[x, r].wallColor = tiles[x, y].wallColor;
+                        }
+                        y += rle;
+                    }
+                }
+            }
+            return true;
+        }
+
+        private bool LoadTiles(BinaryReader b, int version, bool[] extra, ILoadProgress progress, out string invalid)
+        {
+            invalid = "";
+            for (int x = 0; x < tilesWide; x++)
+            {
+                progress.Status(((int)((float)x * 100.0 / (float)tilesWide)) + "% - Reading tiles");
+                for (int y = 0; y < tilesHigh; y++)
+                {
+                    byte flags1 = b.ReadByte();
+                    byte flags2 = 0;
+                    byte flags3 = 0;
+                    if ((flags1 & 1) == 1) //has flags2
+                    {
+                        flags2 = b.ReadByte();
+                        if ((flags2 & 1) == 1) //has flags3
+                            flags3 = b.ReadByte();
+                    }
+                    tiles[x, y].isActive = (flags1 & 2) == 2;
+                    if (tiles[x, y].isActive)
+                    {
+                        tiles[x, y].type = b.ReadByte();
+                        if ((flags1 & 0x20) == 0x20) //2-byte type
+                            tiles[x, y].type |= (UInt16)(b.ReadByte() << 8);
+
+                        if (extra[tiles[x, y].type])
+                        {
+                            tiles[x, y].u = b.ReadInt16();
+                            tiles[x, y].v = b.ReadInt16();
+                        }
+                        else
+                        {
+                            tiles[x, y].u = -1;
+                            tiles[x, y].v = -1;
+                        }
+                        if ((flags3 & 0x8) == 0x8)
+                            tiles[x, y].color = b.ReadByte();
+                    }
+                    if ((flags1 & 4) == 4) //wall
+                    {
+                        tiles[x, y].wall = b.ReadByte();
+                        if ((flags3 & 0x10) == 0x10)
+                            tiles[x, y].wallColor = b.ReadByte();
+                        tiles[x, y].wallu = -1;
+                        tiles[x, y].wallv = -1;
+                    }
+                    else
+                        tiles[x, y].wall = 0;
+                    if ((flags1 & 0x18) != 0)
+                    {
+                        tiles[x, y].liquid = b.ReadByte();
+                        tiles[x, y].isLava = (flags1 & 0x18) == 0x10;
+                        tiles[x, y].isHoney = (flags1 & 0x18) == 0x18;
+                    }
+                    else
+                        tiles[x, y].liquid = 0;
+                    tiles[x, y].hasRedWire = (flags2 & 2) == 2;
+                    tiles[x, y].hasGreenWire = (flags2 & 4) == 4;
+                    tiles[x, y].hasBlueWire = (flags2 & 8) == 8;
+                    int slope = (flags2 >> 4) & 7;
+                    tiles[x, y].half = slope == 1;
+                    tiles[x, y].slope = (byte)(slope > 1 ? slope - 1 : 0);
+                    if (!info.tileInfos[tiles[x, y].type].solid)
+                    {
+                        tiles[x, y].half = false;
+                        tiles[x, y].slope = 0;
+                    }
+                    tiles[x, y].actuator = (flags3 & 2) == 2;
+                    tiles[x, y].inactive = (flags3 & 4) == 4;
+
+                    int rle = 0;
+                    switch (flags1 >> 6)
+                    {
+                        case 1: // 1 byte
+                            rle = b.ReadByte();
+                            break;
+                        case 2: // 2 bytes
+                            rle = b.ReadInt16();
+                            break;
+                    }
+                    for (int r = y + 1; r < y + 1 + rle; r++)
+                    {
+                        tiles[x, r].isActive = tiles[x, y].isActive;
+                        tiles[x, r].type = tiles[x, y].type;
+                        tiles[x, r].u = tiles[x, y].u;
+                        tiles[x, r].v = tiles[x, y].v;
+                        tiles[x, r].wall = tiles[x, y].wall;
+                        tiles[x, r].wallu = -1;
+                        tiles[x, r].wallv = -1;
+                        tiles[x, r].liquid = tiles[x, y].liquid;
+                        tiles[x, r].isLava = tiles[x, y].isLava;
+                        tiles[x, r].isHoney = tiles[x, y].isHoney;
+                        tiles[x, r].hasRedWire = tiles[x, y].hasRedWire;
+                        tiles[x, r].hasGreenWire = tiles[x, y].hasGreenWire;
+                        tiles[x, r].hasBlueWire = tiles[x, y].hasBlueWire;
+                        tiles[x, r].half = tiles[x, y].half;
+                        tiles[x, r].slope = tiles[x, y].slope;
+                        tiles[x, r].actuator = tiles[x, y].actuator;
+                        tiles[x, r].inactive = tiles[x, y].inactive;
+                        tiles[x, r].color = tiles[x, y].color;
+                        tiles[x, r].wallColor = tiles[x, y].wallColor;
+                    }
+                    y += rle;
+                }
+            }
+            return true;
+        }
+
+        private void LoadOldChests(BinaryReader b, int version)
+        {
+            int itemsPerChest = 40;
+            if (version < 58)
+                itemsPerChest = 20;
+            chests.Clear();
+            for (int i = 0; i < 1000; i++)
+            {
+                if (b.ReadBoolean())
+                {
+                    Chest chest = new Chest();
+                    chest.items = new ChestItem[itemsPerChest];
+                    chest.x = b.ReadInt32();
+                    chest.y = b.ReadInt32();
+                    if (version >= 85)
+                        chest.name = b.ReadString();
+                    for (int ii = 0; ii < itemsPerChest; ii++)
+                    {
+                        if (version < 59)
+                            chest.items[ii].stack = b.ReadByte();
+                        else
+                            chest.items[ii].stack = b.ReadInt16();
+                        if (chest.items[ii].stack > 0)
+                        {
+                            string name = "Unknown";
+                            if (version >= 38) //item names not stored
+                            {
+                                Int32 itemid = b.ReadInt32();
+                                if (itemid < 0)
+                                {
+                                    itemid = -itemid;
+                                    if (itemid < info.itemNames2.Length)
+                                        name = info.itemNames2[itemid];
+                                }
+                                else if (itemid < info.itemNames.Length)
+                                    name = info.itemNames[itemid];
+                            }
+                            else
+                                name = b.ReadString();
+                            string prefix = "";
+                            if (version >= 36) //item info.prefixes
+                            {
+                                int pfx = b.ReadByte();
+                                if (pfx < info.prefixes.Length)
+                                    prefix = info.prefixes[pfx];
+                            }
+                            chest.items[ii].name = name;
+                            chest.items[ii].prefix = prefix;
+                        }
+                    }
+                    chests.Add(chest);
+                }
+            }
+        }
+        private void LoadChests(BinaryReader b, int version)
+        {
+            int numChests = b.ReadInt16();
+            int itemsPerChest = b.ReadInt16();
+            chests.Clear();
+            for (int i = 0; i < numChests; i++)
+            {
+                Chest chest = new Chest();
+                chest.items = new ChestItem[itemsPerChest];
+                chest.x = b.ReadInt32();
+                chest.y = b.ReadInt32();
+                chest.name = b.ReadString();
+                for (int ii = 0; ii < itemsPerChest; ii++)
+                {
+                    chest.items[ii].stack = b.ReadInt16();
+                    if (chest.items[ii].stack > 0)
+                    {
+                        string name = "Unknown";
+                        Int32 itemid = b.ReadInt32();
+                        if (itemid < 0)
+                        {
+                            itemid = -itemid;
+                            if (itemid < info.itemNames2.Length)
+                                name = info.itemNames2[itemid];
+                        }
+                        else if (itemid < info.itemNames.Length)
+                            name = info.itemNames[itemid];
+                        string prefix = "";
+
+                        int pfx = b.ReadByte();
+                        if (pfx < info.prefixes.Length)
+                            prefix = info.prefixes[pfx];
+
+                        chest.items[ii].name = name;
+                        chest.items[ii].prefix = prefix;
+                    }
+                }
+                chests.Add(chest);
+            }
+        }
+
+        private void LoadOldSigns(BinaryReader b)
+        {
+            signs.Clear();
+            for (int i = 0; i < 1000; i++)
+            {
+                if (b.ReadBoolean())
+                {
+                    Sign sign = new Sign();
+                    sign.text = b.ReadString();
+                    sign.x = b.ReadInt32();
+                    sign.y = b.ReadInt32();
+                    signs.Add(sign);
+                }
+            }
+        }
+        private void LoadSigns(BinaryReader b)
+        {
+            int numSigns = b.ReadInt16();
+            signs.Clear();
+            for (int i = 0; i < numSigns; i++)
+            {
+                Sign sign = new Sign();
+                sign.text = b.ReadString();
+                sign.x = b.ReadInt32();
+                sign.y = b.ReadInt32();
+                signs.Add(sign);
+            }
+        }
+
+        private void LoadNPCs(BinaryReader b, int version, ILoadProgress progress)
+        {
+            npcs.Clear();
+            progress.Status("Loading NPCs...");
+            while (b.ReadBoolean())
+            {
+                NPC npc = new NPC();
+                npc.title = b.ReadString();
+                npc.name = "";
+                if (version >= 83)
+                    npc.name = b.ReadString();
+                npc.x = b.ReadSingle();
+                npc.y = b.ReadSingle();
+                npc.isHomeless = b.ReadBoolean();
+                npc.homeX = b.ReadInt32();
+                npc.homeY = b.ReadInt32();
+
+                npc.order = -1;
+                npc.num = 0;
+                npc.sprite = 0;
+                for (int i = 0; i < friendlyNPCs.Length; i++)
+                    if (friendlyNPCs[i].title == npc.title)
+                    {
+                        npc.sprite = friendlyNPCs[i].id;
+                        npc.num = friendlyNPCs[i].num;
+                        npc.order = friendlyNPCs[i].order;
+                    }
+
+                npcs.Add(npc);
+            }
+            if (version >= 31 && version <= 83) //read npcs
+            {
+                int numNames = 9;
+                if (version >= 34)
+                    numNames++;
+                if (version >= 65)
+                    numNames += 8;
+                if (version >= 79)
+                    numNames++;
+                for (int i = 0; i < numNames; i++)
+                {
+                    string name = b.ReadString();
+                    for (int j = 0; j < npcs.Count; j++)
+                    {
+                        if (npcs[j].order == i)
+                            npcs[j].name = name;
+                    }
+                }
+            }
+        }
+
+        /// <summary>
+        /// Loads the fog of war from the player's map of this world.  Returns
+        /// false if there's no player or they've never visited it.
+        /// </summary>
+        public bool LoadFogOfWar(string player)
+        {
+            for (int x = 0; x < tilesWide; x++)
+                for (int y = 0; y < tilesHigh; y++)
+                    tiles[x, y].seen = false;
+            if (player == null)
+                return false;
+            string path = Path.Combine(player.Substring(0, player.Length - 4), string.Concat(worldID, ".map"));
+            if (!File.Exists(path))
+                return false;
+            using (BinaryReader b = new BinaryReader(File.Open(path, FileMode.Open, FileAccess.Read, FileShare.ReadWrite)))
+            {
+                int version = b.ReadInt32();
+                if (version > MapVersion) //new map format
+                    throw new Exception("Unsupported fog of war version: " + version);
+                string title = b.ReadString();
+                b.BaseStream.Seek(4, SeekOrigin.Current); //skip worldid
+                Int32 mapTilesHigh = b.ReadInt32();
+                Int32 mapTilesWide = b.ReadInt32();
+                if (version <= 91)
+                {
+                    for (int x = 0; x < mapTilesWide; x++)
+                    {
+                        for (int y = 0; y < mapTilesHigh; y++)
+                        {
+                            if (b.ReadBoolean())
+                            {
+                                if (y < tilesHigh && x < tilesWide)
+                                    tiles[x, y].seen = true;
+                                UInt16 type = (version <= 77) ? b.ReadByte() : b.ReadUInt16();
+                                byte light = b.ReadByte();
+                                byte misc = b.ReadByte();
+                                byte misc2 = 0;
+                                if (version >= 50) misc2 = b.ReadByte();
+                                int rle = b.ReadInt16();
+                                if (light == 255)
+                                {
+                                    for (int r = y + 1; r < y + 1 + rle; r++)
+                                    {
+                                        if (r < tilesHigh && x < tilesWide)
+                                            tiles[x, r].seen = true;
+                                    }
+                                }
+                                else
+                                {
+                                    for (int r = y + 1; r < y + 1 + rle; r++)
+                                    {
+                                        light = b.ReadByte();
+                                        if (r < tilesHigh && x < tilesWide)
+                                            tiles[x, r].seen = true;
+                                    }
+                                }
+                                y += rle;
+                            }
+                            else
+                                y += b.ReadInt16(); //skip
+                        }
+                    }
+                }
+                else //version 2
+                {
+                    //disabled
+                    for (int y = 0; y < mapTilesHigh; y++)
+                        for (int x = 0; x < mapTilesWide; x++)
+                            tiles[x, y].seen = true;
+                }
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// allocates tiles for the current size and frees the rest
+        /// </summary>
+        public void ResizeMap(ILoadProgress progress)
+        {
+            if (tilesWide > tiles.GetLength(0) || tilesHigh > tiles.GetLength(1))
+                tiles = new Tile[Math.Max(tilesWide, tiles.GetLength(0)), Math.Max(tilesHigh, tiles.GetLength(1))];
+            int gridWide = tiles.GetLength(0), gridHigh = tiles.GetLength(1);
+            for (int y = 0; y < tilesHigh; y++)
+            {
+                progress.Status(((int)((float)y * 100.0 / (float)tilesHigh)) + "% - Allocating tiles");
+                for (int x = 0; x < tilesWide; x++)
+                {
+                    if (tiles[x, y] == null)
+                        tiles[x, y] = new Tile();
+                }
+            }
+            if (tilesWide < gridWide || tilesHigh < gridHigh) //free unused tiles
+            {
+                for (int y = 0; y < gridHigh; y++)
+                {
+                    int start = tilesWide;
+                    if (y >= tilesHigh)
+                        start = 0;
+                    for (int x = start; x < gridWide; x++)
+                        tiles[x, y] = null;
+                }
+            }
+        }
+
+        public void CalculateLight(ILoadProgress progress)
+        {
+            lightArea(0, 0, tilesWide - 1, tilesHigh - 1, progress);
+        }
+
+        /// <summary>
+        /// Relights around tiles x0,y0 to x1,y1 after they changed.  Light
+        /// fades out within LightReach tiles, so only that far around the change
+        /// can differ.  Light from further out comes in through the tiles just
+        /// beyond, which the change can't have reached.
+        /// </summary>
+        public void CalculateLight(int x0, int y0, int x1, int y1)
+        {
+            lightArea(Math.Max(0, x0 - LightReach), Math.Max(0, y0 - LightReach),
+                Math.Min(tilesWide - 1, x1 + LightReach), Math.Min(tilesHigh - 1, y1 + LightReach), null);
+        }
+
+        /// <summary>
+        /// Lights tiles x0,y0 to x1,y1 from scratch, with light spreading in
+        /// from the tiles around them as they are.  progress may be null.
+        /// </summary>
+        private void lightArea(int x0, int y0, int x1, int y1, ILoadProgress progress)
+        {
+            int high = y1 - y0 + 1;
+            if (x1 < x0 || high <= 0)
+                return;
+            // turn off all light
+            for (int y = y0; y <= y1; y++)
+            {
+                for (int x = x0; x <= x1; x++)
+                {
+                    Tile tile = tiles[x, y];
+                    tile.light = 0.0;
+                    tile.lightR = 0.0;
+                    tile.lightG = 0.0;
+                    tile.lightB = 0.0;
+                }
+            }
+            // light up light sources
+            for (int y = y0; y <= y1; y++)
+            {
+                if (progress != null)
+                    progress.Status(((int)((float)(y - y0) * 100.0 / (float)high)) + "% - Lighting tiles");
+                for (int x = x0; x <= x1; x++)
+                {
+                    Tile tile = tiles[x, y];
+                    TileInfo inf = info.tileInfos[tile.type, tile.u, tile.v];
+                    if ((!tile.isActive || inf.transparent) &&
+                        (tile.wall == 0 || tile.wall == 21) && tile.liquid < 255 && y < groundLevel) //sunlight
+                    {
+                        tile.light = 1.0;
+                        tile.lightR = 1.0;
+                        tile.lightG = 1.0;
+                        tile.lightB = 1.0;
+                    }
+                    if (tile.liquid > 0 && tile.isLava) //lava
+                    {
+                        tile.light = Math.Max(tile.light, (tile.liquid / 255) * 0.38 + 0.1275);
+                        // colored lava light's brightness is not affected by its level
+                        tile.lightR = Math.Max(tile.lightR, 0.66);
+                        tile.lightG = Math.Max(tile.lightG, 0.39);
+                        tile.lightB = Math.Max(tile.lightB, 0.13);
+                    }
+                    tile.light = Math.Max(tile.light, inf.light);
+                    tile.lightR = Math.Max(tile.lightR, inf.lightR);
+                    tile.lightG = Math.Max(tile.lightG, inf.lightG);
+                    tile.lightB = Math.Max(tile.lightB, inf.lightB);
+                }
+            }
+            // spread light
+            for (int y = y0; y <= y1; y++)
+            {
+                if (progress != null)
+                    progress.Status(((int)((float)(y - y0) * 50.0 / (float)high)) + "% - Spreading light");
+                for (int x = x0; x <= x1; x++)
+                {
+                    double delta = 0.04;
+                    Tile tile = tiles[x, y];
+                    TileInfo inf = info.tileInfos[tile.type, tile.u, tile.v];
+                    if (tile.isActive && !inf.transparent) delta = 0.16;
+                    if (y > 0)
+                    {
+                        if (tiles[x, y - 1].light - delta > tile.light)
+                            tile.light = tiles[x, y - 1].light - delta;
+                        if (tiles[x, y - 1].lightR - delta > tile.lightR)
+                            tile.lightR = tiles[x, y - 1].lightR - delta;
+                        if (tiles[x, y - 1].lightG - delta > tile.lightG)
+                            tile.lightG = tiles[x, y - 1].lightG - delta;
+                        if (tiles[x, y - 1].lightB - delta > tile.lightB)
+                            tile.lightB = tiles[x, y - 1].lightB - delta;
+                    }
+                    if (x > 0)
+                    {
+                        if (tiles[x - 1, y].light - delta > tile.light)
+                            tile.light = tiles[x - 1, y].light - delta;
+                        if (tiles[x - 1, y].lightR - delta > tile.lightR)
+                            tile.lightR = tiles[x - 1, y].lightR - delta;
+                        if (tiles[x - 1, y].lightG - delta > tile.lightG)
+                            tile.lightG = tiles[x - 1, y].lightG - delta;
+                        if (tiles[x - 1, y].lightB - delta > tile.lightB)
+                            tile.lightB = tiles[x - 1, y].lightB - delta;
+                    }
+                }
+            }
+            // spread light backwards
+            for (int y = y1; y >= y0; y--)
+            {
+                if (progress != null)
+                    progress.Status(((int)((float)(y1 + 1 - y) * 50.0 / (float)high) + 50) + "% - Spreading light");
+                for (int x = x1; x >= x0; x--)
+                {
+                    double delta = 0.04;
+                    Tile tile = tiles[x, y];
+                    TileInfo inf = info.tileInfos[tile.type, tile.u, tile.v];
+                    if (tile.isActive && !inf.transparent) delta = 0.16;
+                    if (y < tilesHigh - 1)
+                    {
+                        if (tiles[x, y + 1].light - delta > tile.light)
+                            tile.light = tiles[x, y + 1].light - delta;
+                        if (tiles[x, y + 1].lightR - delta > tile.lightR)
+                            tile.lightR = tiles[x, y + 1].lightR - delta;
+                        if (tiles[x, y + 1].lightG - delta > tile.lightG)
+                            tile.lightG = tiles[x, y + 1].lightG - delta;
+                        if (tiles[x, y + 1].lightB - delta > tile.lightB)
+                            tile.lightB = tiles[x, y + 1].lightB - delta;
+                    }
+                    if (x < tilesWide - 1)
+                    {
+                        if (tiles[x + 1, y].light - delta > tile.light)
+                            tile.light = tiles[x + 1, y].light - delta;
+                        if (tiles[x + 1, y].lightR - delta > tile.lightR)
+                            tile.lightR = tiles[x + 1, y].lightR - delta;
+                        if (tiles[x + 1, y].lightG - delta > tile.lightG)
+                            tile.lightG = tiles[x + 1, y].lightG - delta;
+                        if (tiles[x + 1, y].lightB - delta > tile.lightB)
+                            tile.lightB = tiles[x + 1, y].lightB - delta;
+                    }
+                }
+            }
+        }
+    }
+}
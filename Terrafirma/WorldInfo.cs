@@ -0,0 +1,153 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Xml;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Everything we know about tiles, walls and items, parsed from tiles.xml
+    /// </summary>
+    class WorldInfo
+    {
+        public TileInfos tileInfos;
+        public WallInfo[] wallInfo;
+        public UInt32 skyColor, earthColor, rockColor, hellColor, lavaColor, waterColor, honeyColor;
+        public string[] prefixes;
+        public string[] itemNames2;
+        public string[] itemNames;
+
+        public WorldInfo(XmlDocument xml)
+        {
+            tileInfos = new TileInfos(xml.GetElementsByTagName("tile"));
+            XmlNodeList wallList = xml.GetElementsByTagName("wall");
+            wallInfo = new WallInfo[wallList.Count + 1];
+            for (int i = 0; i < wallList.Count; i++)
+            {
+                int id = Convert.ToInt32(wallList[i].Attributes["num"].Value);
+                wallInfo[id].name = wallList[i].Attributes["name"].Value;
+                wallInfo[id].color = parseColor(wallList[i].Attributes["color"].Value);
+                if (wallList[i].Attributes["blend"] != null)
+                    wallInfo[id].blend = Convert.ToInt16(wallList[i].Attributes["blend"].Value);
+                else
+                    wallInfo[id].blend = (Int16)id;
+            }
+            XmlNodeList globalList = xml.GetElementsByTagName("global");
+            for (int i = 0; i < globalList.Count; i++)
+            {
+                string kind = globalList[i].Attributes["id"].Value;
+                UInt32 color = parseColor(globalList[i].Attributes["color"].Value);
+                switch (kind)
+                {
+                    case "sky":
+                        skyColor = color;
+                        break;
+                    case "earth":
+                        earthColor = color;
+                        break;
+                    case "rock":
+                        rockColor = color;
+                        break;
+                    case "hell":
+                        hellColor = color;
+                        break;
+                    case "water":
+                        waterColor = color;
+                        break;
+                    case "lava":
+                        lavaColor = color;
+                        break;
+                    case "honey":
+                        honeyColor = color;
+                        break;
+                }
+            }
+            XmlNodeList prefixList = xml.GetElementsByTagName("prefix");
+            prefixes = new string[prefixList.Count + 1];
+            for (int i = 0; i < prefixList.Count; i++)
+            {
+                int id = Convert.ToInt32(prefixList[i].Attributes["num"].Value);
+                prefixes[id] = prefixList[i].Attributes["name"].Value;
+            }
+            XmlNodeList itemList = xml.GetElementsByTagName("item");
+            //find min/max
+            Int32 minItemId = 0, maxItemId = 0;
+            for (int i = 0; i < itemList.Count; i++)
+            {
+                Int32 id = Convert.ToInt32(itemList[i].Attributes["num"].Value);
+                if (id < minItemId)
+                    minItemId = id;
+                if (id > maxItemId)
+                    maxItemId = id;
+            }
+            itemNames2 = new string[(-minItemId) + 1];
+            itemNames = new string[maxItemId + 1];
+            for (int i = 0; i < itemList.Count; i++)
+            {
+                int id = Convert.ToInt32(itemList[i].Attributes["num"].Value);
+                if (id < 0)
+                    itemNames2[-id] = itemList[i].Attributes["name"].Value;
+                else
+                    itemNames[id] = itemList[i].Attributes["name"].Value;
+            }
+        }
+
+        /// <summary>
+        /// Parses the tiles.xml embedded in this assembly
+        /// </summary>
+        public static WorldInfo Load()
+        {
+            XmlDocument xml = new XmlDocument();
+            using (Stream stream = typeof(WorldInfo).Assembly.GetManifestResourceStream("Terrafirma.tiles.xml"))
+            {
+                xml.Load(stream);
+            }
+            return new WorldInfo(xml);
+        }
+
+        private UInt32 parseColor(string color)
+        {
+            UInt32 c = 0;
+            for (int j = 0; j < color.Length; j++)
+            {
+                c <<= 4;
+                if (color[j] >= '0' && color[j] <= '9')
+                    c |= (byte)(color[j] - '0');
+                else if (color[j] >= 'A' && color[j] <= 'F')
+                    c |= (byte)(10 + color[j] - 'A');
+                else if (color[j] >= 'a' && color[j] <= 'f')
+                    c |= (byte)(10 + color[j] - 'a');
+            }
+            return c;
+        }
+    }
+}
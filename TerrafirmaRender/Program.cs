@@ -0,0 +1,492 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Renders a whole world to a png without any UI.
+    /// usage: terrafirma-render world.wld -o out.png [--zoom N] [--light none|light|color] [--textures [dir]] [--memory MB] [--compression N] [--indexed]
+    ///        terrafirma-render world.wld --tiles dir [--levels MIN-MAX] [--full] [--light ...] [--textures [dir]] [--compression N]
+    ///        terrafirma-render [worlds, folders or *.wld ...] --batch dir [--jobs N] [--zoom N] [--light ...] [--textures [dir]] [--indexed]
+    ///        terrafirma-render world.wld --serve PORT [--latency MS] [--bandwidth KB] [--password PW]
+    ///        terrafirma-render --connect HOST:PORT [--connect ...] --dashboard dir [--interval S] [--password PW] [--zoom N] ...
+    /// </summary>
+    class Program : ILoadProgress
+    {
+        string lastStatus = null;
+
+        static int Main(string[] args)
+        {
+            string outPath = null, tilesPath = null, batchPath = null, dashboardPath = null, textureDir = null;
+            List<string> worldPaths = new List<string>();
+            double zoom = 1.0;
+            int light = 0;
+            bool useTextures = false;
+            long memory = 0;
+            int minLevel = 0, maxLevel = 4;
+            bool full = false;
+            bool indexed = false;
+            int compression = PngWriter.DefaultLevel;
+            int jobs = 2;
+            int port = -1, latency = 0;
+            long bandwidth = 0;
+            string password = null;
+            List<string> servers = new List<string>();
+            int interval = 60;
+            try
+            {
+                for (int i = 0; i < args.Length; i++)
+                {
+                    switch (args[i])
+                    {
+                        case "-o":
+                        case "--output":
+                            outPath = nextArg(args, ref i);
+                            break;
+                        case "--tiles":
+                            tilesPath = nextArg(args, ref i);
+                            break;
+                        case "--batch":
+                            batchPath = nextArg(args, ref i);
+                            break;
+                        case "--jobs":
+                            jobs = Int32.Parse(nextArg(args, ref i));
+                            if (jobs < 1)
+                                throw new Exception("Jobs must be at least 1");
+                            break;
+                        case "--serve":
+                            port = Int32.Parse(nextArg(args, ref i));
+                            if (port < 0 || port > 65535)
+                                throw new Exception("Port must be between 0 and 65535");
+                            break;
+                        case "--latency":
+                            latency = Int32.Parse(nextArg(args, ref i));
+                            break;
+                        case "--bandwidth":
+                            bandwidth = Int64.Parse(nextArg(args, ref i)) * 1024;
+                            break;
+                        case "--password":
+                            password = nextArg(args, ref i);
+                            break;
+                        case "--dashboard":
+                            dashboardPath = nextArg(args, ref i);
+                            break;
+                        case "--connect":
+                            servers.Add(nextArg(args, ref i));
+                            break;
+                        case "--interval":
+                            interval = Int32.Parse(nextArg(args, ref i));
+                            if (interval < 1)
+                                throw new Exception("Interval must be at least 1 second");
+                            break;
+                        case "--levels":
+                            string[] levels = nextArg(args, ref i).Split('-');
+                            minLevel = Int32.Parse(levels[0]);
+                            maxLevel = Int32.Parse(levels[levels.Length - 1]);
+                            if (minLevel < 0 || maxLevel > 4 || minLevel > maxLevel)
+                                throw new Exception("Levels must be between 0 (1x) and 4 (16x)");
+                            break;
+                        case "--compression":
+                            compression = Int32.Parse(nextArg(args, ref i));
+                            if (compression < 0 || compression > 9)
+                                throw new Exception("Compression must be between 0 and 9");
+                            break;
+                        case "--full":
+                            full = true;
+                            break;
+                        case "--indexed":
+                            indexed = true;
+                            break;
+                        case "--zoom":
+                            zoom = Double.Parse(nextArg(args, ref i), System.Globalization.CultureInfo.InvariantCulture);
+                            if (zoom < 1.0 || zoom > 16.0)
+                                throw new Exception("Zoom must be between 1 and 16");
+                            break;
+                        case "--light":
+                            string mode = nextArg(args, ref i);
+                            if (mode == "none")
+                                light = 0;
+                            else if (mode == "light")
+                                light = 1;
+                            else if (mode == "color")
+                                light = 2;
+                            else
+                                throw new Exception(String.Format("Unknown lighting mode: {0}", mode));
+                            break;
+                        case "--memory":
+                            memory = Int64.Parse(nextArg(args, ref i));
+                            break;
+                        case "--textures":
+                            useTextures = true;
+                            //the install dir is optional
+                            if (i + 1 < args.Length && Directory.Exists(args[i + 1]))
+                                textureDir = args[++i];
+                            break;
+                        default:
+                            if (args[i].StartsWith("-"))
+                                throw new Exception(String.Format("Unexpected argument: {0}", args[i]));
+                            worldPaths.Add(args[i]);
+                            break;
+                    }
+                }
+                int outputs = (outPath != null ? 1 : 0) + (tilesPath != null ? 1 : 0) + (batchPath != null ? 1 : 0) +
+                    (port >= 0 ? 1 : 0) + (dashboardPath != null ? 1 : 0);
+                if (outputs != 1 || (batchPath == null && dashboardPath == null && worldPaths.Count != 1) ||
+                    (dashboardPath != null && (servers.Count == 0 || worldPaths.Count != 0)))
+                {
+                    usage();
+                    return 2;
+                }
+                if (indexed && (useTextures || light != 0 || tilesPath != null))
+                    throw new Exception("--indexed is only for flat images without lighting");
+                Program program = new Program();
+                string worldPath = worldPaths.FirstOrDefault();
+                if (dashboardPath != null)
+                    program.dashboard(servers, dashboardPath, interval, password, zoom, light, useTextures,
+                        textureDir, memory, compression);
+                else if (port >= 0)
+                    program.serve(worldPath, port, latency, bandwidth, password);
+                else if (batchPath != null)
+                    program.renderBatch(worldPaths, batchPath, jobs, zoom, light, useTextures, textureDir, memory,
+                        compression, indexed);
+                else if (tilesPath != null)
+                    program.renderTiles(worldPath, tilesPath, minLevel, maxLevel, full, light, useTextures, textureDir,
+                        compression);
+                else
+                    program.render(worldPath, outPath, zoom, light, useTextures, textureDir, memory, compression,
+                        indexed);
+            }
+            catch (Exception e)
+            {
+                Console.Error.WriteLine();
+                Console.Error.WriteLine("Error: {0}", e.Message);
+                return 1;
+            }
+            return 0;
+        }
+
+        static string nextArg(string[] args, ref int i)
+        {
+            if (i + 1 >= args.Length)
+                throw new Exception(String.Format("{0} needs a value", args[i]));
+            return args[++i];
+        }
+
+        static void usage()
+        {
+            Console.Error.WriteLine("usage: terrafirma-render world.wld -o out.png [options]");
+            Console.Error.WriteLine("       terrafirma-render world.wld --tiles dir [options]");
+            Console.Error.WriteLine("       terrafirma-render [worlds ...] --batch dir [options]");
+            Console.Error.WriteLine("       terrafirma-render world.wld --serve PORT [options]");
+            Console.Error.WriteLine("       terrafirma-render --connect HOST:PORT [--connect ...] --dashboard dir [options]");
+            Console.Error.WriteLine("  --zoom N                   pixels per tile, 1 to 16 (default 1)");
+            Console.Error.WriteLine("  --light none|light|color   lighting mode (default none)");
+            Console.Error.WriteLine("  --textures [dir]           draw with textures from the terraria install in dir");
+            Console.Error.WriteLine("  --memory MB                memory to render with (default 256), any image size fits");
+            Console.Error.WriteLine("  --compression N            png compression 0 to 9 (default 6), 0 and 1 are fast previews");
+            Console.Error.WriteLine("  --indexed                  write a palette png, a byte per pixel (flat, unlit maps only)");
+            Console.Error.WriteLine("  --tiles dir                write a dir/z/x/y.png tile pyramid instead of one image");
+            Console.Error.WriteLine("  --levels MIN-MAX           pyramid levels, 0 (1x) to 4 (16x) (default 0-4)");
+            Console.Error.WriteLine("  --full                     redraw every tile, not just the ones that changed");
+            Console.Error.WriteLine("  --batch dir                write dir/name.png for each world, folder or *.wld given,");
+            Console.Error.WriteLine("                             or for every world terraria has saved");
+            Console.Error.WriteLine("  --jobs N                   worlds loaded at once in a batch (default 2)");
+            Console.Error.WriteLine("  --serve PORT               serve the world to the viewer on localhost:PORT");
+            Console.Error.WriteLine("  --latency MS               delay every reply from the server");
+            Console.Error.WriteLine("  --bandwidth KB             limit the server to KB per second to each client");
+            Console.Error.WriteLine("  --password PW              make clients log in to the server with PW,");
+            Console.Error.WriteLine("                             or log in to the dashboard's servers with it");
+            Console.Error.WriteLine("  --dashboard dir            keep dir/HOST-PORT.png up to date for each server connected to");
+            Console.Error.WriteLine("  --connect HOST:PORT        a server for the dashboard to map and follow");
+            Console.Error.WriteLine("  --interval S               seconds between dashboard renders of changed maps (default 60)");
+        }
+
+        void render(string worldPath, string outPath, double zoom, int light, bool useTextures, string textureDir,
+            long memory, int compression, bool indexed)
+        {
+            WorldInfo info = WorldInfo.Load();
+            World world = new World(info);
+            Render render = new Render(info.tileInfos, info.wallInfo, info.skyColor, info.earthColor, info.rockColor,
+                info.hellColor, info.waterColor, info.lavaColor, info.honeyColor);
+
+            if (useTextures)
+            {
+                //textures are only drawn when zoomed past 2x, same as the viewer,
+                //and always a whole number of pixels per tile
+                zoom = Math.Floor(zoom);
+                if (zoom <= 2.0)
+                    throw new Exception("Textures need a zoom of 3 or more");
+                render.Textures = textureDir != null ? new Textures(textureDir) : new Textures();
+                if (!render.Textures.Valid)
+                    throw new Exception("Couldn't find the terraria textures, pass the install folder to --textures");
+            }
+
+            string invalid;
+            if (!world.Load(worldPath, this, out invalid))
+                Console.Error.WriteLine("\nFound problems with the map: {0}\nIt may not render properly.", invalid);
+            render.SetWorld(world.tilesWide, world.tilesHigh, world.groundLevel, world.rockLevel, world.styles,
+                world.treeX, world.treeStyle, world.caveBackX, world.caveBackStyle, world.jungleBackStyle,
+                world.hellBackStyle, world.npcs, world.worldID);
+            if (light != 0)
+                world.CalculateLight(this);
+
+            int width = (int)(world.tilesWide * zoom);
+            int height = (int)(world.tilesHigh * zoom);
+            MapExporter exporter = new MapExporter(render);
+            exporter.Light = light;
+            exporter.UseTextures = useTextures;
+            exporter.Compression = compression;
+            exporter.Indexed = indexed;
+            if (memory > 0)
+                exporter.MemoryBudget = memory * 1024L * 1024L;
+            using (FileStream stream = new FileStream(outPath, FileMode.Create))
+            {
+                exporter.Export(stream, world.tiles, width, height, 0.0, 0.0, zoom, delegate(int percent)
+                {
+                    Status(String.Format("{0}% - Rendering {1}x{2}", percent, width, height));
+                });
+            }
+            if (indexed)
+                Status(String.Format("Done, {0} colors", exporter.Palette.Count));
+            else
+                Status("Done");
+            Console.Error.WriteLine();
+        }
+
+        void renderTiles(string worldPath, string dir, int minLevel, int maxLevel, bool full,
+            int light, bool useTextures, string textureDir, int compression)
+        {
+            WorldInfo info = WorldInfo.Load();
+            World world = new World(info);
+            Render render = new Render(info.tileInfos, info.wallInfo, info.skyColor, info.earthColor, info.rockColor,
+                info.hellColor, info.waterColor, info.lavaColor, info.honeyColor);
+            if (useTextures)
+            {
+                //only the levels past 2x get textures
+                render.Textures = textureDir != null ? new Textures(textureDir) : new Textures();
+                if (!render.Textures.Valid)
+                    throw new Exception("Couldn't find the terraria textures, pass the install folder to --textures");
+            }
+
+            string invalid;
+            if (!world.Load(worldPath, this, out invalid))
+                Console.Error.WriteLine("\nFound problems with the map: {0}\nIt may not render properly.", invalid);
+            render.SetWorld(world.tilesWide, world.tilesHigh, world.groundLevel, world.rockLevel, world.styles,
+                world.treeX, world.treeStyle, world.caveBackX, world.caveBackStyle, world.jungleBackStyle,
+                world.hellBackStyle, world.npcs, world.worldID);
+            if (light != 0)
+                world.CalculateLight(this);
+
+            TilePyramid pyramid = new TilePyramid(render);
+            pyramid.MinLevel = minLevel;
+            pyramid.MaxLevel = maxLevel;
+            pyramid.Light = light;
+            pyramid.UseTextures = useTextures;
+            pyramid.Compression = compression;
+            pyramid.Incremental = !full;
+            pyramid.Export(dir, world, delegate(int percent)
+            {
+                Status(String.Format("{0}% - Rendering tiles", percent));
+            });
+            Status(String.Format("Done, {0} written, {1} unchanged, {2} empty",
+                pyramid.Written, pyramid.Unchanged, pyramid.Empty));
+            Console.Error.WriteLine();
+        }
+
+        void renderBatch(List<string> worldPaths, string dir, int jobs, double zoom, int light,
+            bool useTextures, string textureDir, long memory, int compression, bool indexed)
+        {
+            if (worldPaths.Count == 0)
+                worldPaths.Add(World.WorldsFolder());
+            List<string> paths = BatchExporter.FindWorlds(worldPaths);
+            if (paths.Count == 0)
+                throw new Exception("No worlds to render");
+
+            //tiles.xml and the textures are read once for every world
+            WorldInfo info = WorldInfo.Load();
+            Textures textures = null;
+            if (useTextures)
+            {
+                zoom = Math.Floor(zoom);
+                if (zoom <= 2.0)
+                    throw new Exception("Textures need a zoom of 3 or more");
+                textures = textureDir != null ? new Textures(textureDir) : new Textures();
+                if (!textures.Valid)
+                    throw new Exception("Couldn't find the terraria textures, pass the install folder to --textures");
+            }
+
+            BatchExporter batch = new BatchExporter(info, textures);
+            batch.Jobs = jobs;
+            batch.Zoom = zoom;
+            batch.Light = light;
+            batch.UseTextures = useTextures;
+            batch.Indexed = indexed;
+            batch.Compression = compression;
+            if (memory > 0)
+                batch.MemoryBudget = memory * 1024L * 1024L;
+
+            System.Diagnostics.Stopwatch watch = System.Diagnostics.Stopwatch.StartNew();
+            int count = 0, failed = 0;
+            batch.Export(paths, dir, delegate(BatchExporter.Result result)
+            {
+                count++;
+                if (result.Error != null)
+                {
+                    failed++;
+                    Console.Error.WriteLine("[{0}/{1}] {2}: {3}", count, paths.Count,
+                        Path.GetFileName(result.Path), result.Error);
+                    return;
+                }
+                Console.Error.WriteLine("[{0}/{1}] {2}: load {3:0.0}s, light {4:0.0}s, render {5:0.0}s",
+                    count, paths.Count, Path.GetFileName(result.Path), result.Load.TotalSeconds,
+                    result.Light.TotalSeconds, result.Render.TotalSeconds);
+                if (result.Problems != null)
+                    Console.Error.WriteLine("    Found problems with the map: {0}", result.Problems);
+            });
+            double minutes = watch.Elapsed.TotalMinutes;
+            Console.Error.WriteLine("{0} worlds in {1:0.0}s, {2:0.0} worlds/minute{3}", count - failed,
+                watch.Elapsed.TotalSeconds, minutes > 0 ? (count - failed) / minutes : 0,
+                failed > 0 ? String.Format(", {0} failed", failed) : "");
+            if (failed > 0)
+                throw new Exception(String.Format("{0} of {1} worlds failed", failed, count));
+        }
+
+        void serve(string worldPath, int port, int latency, long bandwidth, string password)
+        {
+            WorldInfo info = WorldInfo.Load();
+            World world = new World(info);
+            string invalid;
+            if (!world.Load(worldPath, this, out invalid))
+                Console.Error.WriteLine("\nFound problems with the map: {0}\nIt may not serve properly.", invalid);
+            Console.Error.WriteLine();
+
+            LocalServer server = new LocalServer(world, info);
+            server.Latency = latency;
+            server.Bandwidth = bandwidth;
+            server.Password = password;
+            server.Log = delegate(string text)
+            {
+                lock (this)
+                    Console.Error.WriteLine(text);
+            };
+            server.Start(port);
+            Console.Error.WriteLine("Serving {0} on localhost:{1}, ctrl-c to stop", world.name, server.Port);
+            Thread.Sleep(Timeout.Infinite);
+        }
+
+        void dashboard(List<string> servers, string dir, int interval, string password, double zoom, int light,
+            bool useTextures, string textureDir, long memory, int compression)
+        {
+            WorldInfo info = WorldInfo.Load();
+            Textures textures = null;
+            if (useTextures)
+            {
+                zoom = Math.Floor(zoom);
+                if (zoom <= 2.0)
+                    throw new Exception("Textures need a zoom of 3 or more");
+                textures = textureDir != null ? new Textures(textureDir) : new Textures();
+                if (!textures.Valid)
+                    throw new Exception("Couldn't find the terraria textures, pass the install folder to --textures");
+            }
+            Directory.CreateDirectory(dir);
+
+            using (MapDashboard dash = new MapDashboard(info, textures))
+            {
+                dash.UseTextures = useTextures;
+                dash.Compression = compression;
+                if (memory > 0)
+                    dash.MemoryBudget = memory * 1024L * 1024L;
+                dash.Log = delegate(MapSession session, string text)
+                {
+                    lock (this)
+                        Console.Error.WriteLine("{0}:{1}: {2}", session.Host, session.Port, text);
+                };
+                foreach (string server in servers)
+                {
+                    int colon = server.LastIndexOf(':');
+                    int port;
+                    if (colon <= 0 || !Int32.TryParse(server.Substring(colon + 1), out port) || port < 1 || port > 65535)
+                        throw new Exception(String.Format("Servers are HOST:PORT, not {0}", server));
+                    dash.Add(server.Substring(0, colon), port, password);
+                }
+
+                //only maps that changed since they were last written are drawn again
+                Dictionary<MapSession, int> written = new Dictionary<MapSession, int>();
+                while (true)
+                {
+                    Thread.Sleep(interval * 1000);
+                    foreach (MapSession session in dash.Sessions)
+                    {
+                        int changes = session.Changes;
+                        int last;
+                        if (!session.MapComplete || (written.TryGetValue(session, out last) && last == changes))
+                            continue;
+                        string path = Path.Combine(dir, String.Format("{0}-{1}.png", session.Host, session.Port));
+                        string temp = path + ".tmp";
+                        try
+                        {
+                            System.Diagnostics.Stopwatch watch = System.Diagnostics.Stopwatch.StartNew();
+                            using (FileStream stream = new FileStream(temp, FileMode.Create))
+                                dash.Export(session, stream, zoom, light);
+                            //readers never see half an image, or no image at all
+                            if (File.Exists(path))
+                                File.Replace(temp, path, null);
+                            else
+                                File.Move(temp, path);
+                            written[session] = changes;
+                            dash.Log(session, String.Format("Wrote {0} in {1:0.0}s", path, watch.Elapsed.TotalSeconds));
+                        }
+                        catch (Exception e)
+                        {
+                            dash.Log(session, String.Format("Couldn't write {0}: {1}", path, e.Message));
+                        }
+                    }
+                }
+            }
+        }
+
+        public void Status(string text)
+        {
+            //loaders report every row, only print when something changed.
+            //the exporter reports from its writer thread.
+            lock (this)
+            {
+                if (text == lastStatus)
+                    return;
+                lastStatus = text;
+                Console.Error.Write("\r{0,-40}", text);
+            }
+        }
+    }
+}
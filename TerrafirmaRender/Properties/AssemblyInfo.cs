@@ -0,0 +1,23 @@
+﻿using System.Reflection;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+
+// General Information about an assembly is controlled through the following 
+// set of attributes. Change these attribute values to modify the information
+// associated with an assembly.
+[assembly: AssemblyTitle("terrafirma-render")]
+[assembly: AssemblyDescription("Command line map renderer for Terraria")]
+[assembly: AssemblyConfiguration("")]
+[assembly: AssemblyCompany("Seancode")]
+[assembly: AssemblyProduct("Terrafirma")]
+[assembly: AssemblyCopyright("Copyright © 2014, Sean Kasun")]
+[assembly: AssemblyTrademark("")]
+[assembly: AssemblyCulture("")]
+
+// Setting ComVisible to false makes the types in this assembly not visible 
+// to COM components.  If you need to access a type in this assembly from 
+// COM, set the ComVisible attribute to true on that type.
+[assembly: ComVisible(false)]
+
+[assembly: AssemblyVersion("2.2.2.0")]
+[assembly: AssemblyFileVersion("2.2.2.0")]
@@ -0,0 +1,271 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Net;
+using System.Net.Sockets;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Maps a LocalServer that answers slowly, through a proxy that watches
+    /// which sections the session asks for and which it has been sent.
+    /// </summary>
+    static class MapSessionTests
+    {
+        public static void Add(List<KeyValuePair<string, Action>> tests)
+        {
+            tests.Add(new KeyValuePair<string, Action>("MapSession.Latency", latency));
+            tests.Add(new KeyValuePair<string, Action>("MapSession.DroppedRequests", droppedRequests));
+        }
+
+        /// <summary>
+        /// Passes bytes both ways between a client and a server, noting the
+        /// sections requested (0x0d) and those the client has been told are
+        /// done (0x0b).  0x0b is noted before it's passed on, so the requests
+        /// counted as unanswered are never more than the client has out.
+        /// </summary>
+        class Proxy
+        {
+            public List<int> Requests = new List<int>();
+            public int MostInFlight;
+            public Exception Error;
+
+            int sectionsWide;
+            HashSet<int> done = new HashSet<int>();
+            TcpListener listener;
+            Socket client, server;
+            Thread up, down;
+
+            public Proxy(int sectionsWide, int serverPort)
+            {
+                this.sectionsWide = sectionsWide;
+                listener = new TcpListener(IPAddress.Loopback, 0);
+                listener.Start();
+                Port = ((IPEndPoint)listener.LocalEndpoint).Port;
+                Thread accept = new Thread(delegate()
+                {
+                    try
+                    {
+                        client = listener.AcceptSocket();
+                        listener.Stop();
+                        server = new Socket(AddressFamily.InterNetwork, SocketType.Stream, ProtocolType.Tcp);
+                        server.Connect(IPAddress.Loopback, serverPort);
+                        up = pump(client, server, request);
+                        down = pump(server, client, reply);
+                    }
+                    catch (Exception e)
+                    {
+                        Error = e;
+                    }
+                });
+                accept.IsBackground = true;
+                accept.Start();
+            }
+
+            public int Port { get; private set; }
+
+            private Thread pump(Socket from, Socket to, Action<byte[], int> seen)
+            {
+                Thread thread = new Thread(delegate()
+                {
+                    using (MessageBuffer buffer = new MessageBuffer())
+                    {
+                        try
+                        {
+                            int n;
+                            while ((n = from.Receive(buffer.Data, buffer.ReceiveOffset, buffer.ReceiveCount,
+                                SocketFlags.None)) > 0)
+                            {
+                                int offset = buffer.ReceiveOffset;
+                                buffer.Received(n);
+                                byte[] data = buffer.Data;
+                                int start, len;
+                                //Next may move what's pending, so look before passing it on
+                                while (buffer.Next(out start, out len))
+                                    seen(buffer.Data, start);
+                                to.Send(data, offset, n, SocketFlags.None);
+                            }
+                            to.Shutdown(SocketShutdown.Send);
+                        }
+                        catch (SocketException)
+                        {
+                            //one side hung up
+                        }
+                        catch (Exception e)
+                        {
+                            Error = e;
+                        }
+                    }
+                });
+                thread.IsBackground = true;
+                thread.Start();
+                return thread;
+            }
+
+            private void request(byte[] data, int start)
+            {
+                if (data[start] != 0x0d)
+                    return;
+                int x = (int)(BitConverter.ToSingle(data, start + 4) / 16);
+                int y = (int)(BitConverter.ToSingle(data, start + 8) / 16);
+                int section = (y / SectionScheduler.SectionHeight) * sectionsWide + x / SectionScheduler.SectionWidth;
+                lock (this)
+                {
+                    Requests.Add(section);
+                    int inFlight = Requests.Count(s => !done.Contains(s));
+                    MostInFlight = Math.Max(MostInFlight, inFlight);
+                }
+            }
+
+            private void reply(byte[] data, int start)
+            {
+                if (data[start] != 0x0b)
+                    return;
+                int x0 = BitConverter.ToInt32(data, start + 1);
+                int y0 = BitConverter.ToInt32(data, start + 5);
+                int x1 = BitConverter.ToInt16(data, start + 9);
+                int y1 = BitConverter.ToInt16(data, start + 11);
+                lock (this)
+                {
+                    for (int y = y0; y <= y1; y++)
+                        for (int x = x0; x <= x1; x++)
+                            done.Add(y * sectionsWide + x);
+                }
+            }
+
+            public void Close()
+            {
+                listener.Stop();
+                if (client != null)
+                    client.Close();
+                if (server != null)
+                    server.Close();
+                if (up != null)
+                    up.Join();
+                if (down != null)
+                    down.Join();
+            }
+        }
+
+        const int Wide = 1600, High = 750;
+        const int SectionsWide = Wide / SectionScheduler.SectionWidth;
+        const int SectionsHigh = High / SectionScheduler.SectionHeight;
+
+        /// <summary>
+        /// Maps world from local through a proxy, checking every tile arrives,
+        /// and returns the proxy to see what was asked for
+        /// </summary>
+        private static Proxy map(World world, LocalServer local, TimeSpan timeout)
+        {
+            local.Start(0);
+            Proxy proxy = new Proxy(SectionsWide, local.Port);
+            MapSession session = new MapSession(new World(TestWorld.Info, 0, 0), TestWorld.Info);
+            session.UseCache = false;
+            session.RequestTimeout = timeout;
+            ManualResetEvent finished = new ManualResetEvent(false);
+            string failure = null;
+            session.Complete = delegate()
+            {
+                finished.Set();
+            };
+            session.Failed = delegate(string why)
+            {
+                failure = why;
+                finished.Set();
+            };
+            session.Lost = delegate(Exception error)
+            {
+                failure = "connection lost";
+                finished.Set();
+            };
+            session.Connect("127.0.0.1", proxy.Port);
+            bool done = finished.WaitOne(30000);
+            session.Close();
+            proxy.Close();
+            Check.That(done, "the map didn't finish");
+            Check.That(failure == null, "the session failed: {0}", failure);
+            Check.That(proxy.Error == null, "the proxy failed: {0}", proxy.Error);
+
+            for (int y = 0; y < High; y++)
+                for (int x = 0; x < Wide; x++)
+                    TestWorld.CheckTile(world, session.World, x, y);
+            return proxy;
+        }
+
+        //every section arrives, asked for nearest first, never more at once than the window
+        private static void latency()
+        {
+            World world = TestWorld.Make(Wide, High, 1);
+            using (LocalServer local = new LocalServer(world, TestWorld.Info))
+            {
+                local.Latency = 20;
+                Proxy proxy = map(world, local, SectionScheduler.DefaultTimeout);
+
+                //nearest the spawn first, measured as the scheduler does
+                int cx = world.spawnX / SectionScheduler.SectionWidth;
+                int cy = world.spawnY / SectionScheduler.SectionHeight;
+                long last = 0;
+                foreach (int section in proxy.Requests)
+                {
+                    long dx = (section % SectionsWide - cx) * SectionScheduler.SectionWidth;
+                    long dy = (section / SectionsWide - cy) * SectionScheduler.SectionHeight;
+                    long dist = dx * dx + dy * dy;
+                    Check.That(dist >= last, "section {0} was asked for after farther ones", section);
+                    last = dist;
+                }
+                Check.That(proxy.Requests.Count == proxy.Requests.Distinct().Count(), "a section was asked for twice");
+                Check.That(proxy.MostInFlight <= SectionScheduler.DefaultWindow, "{0} requests in flight, the window is {1}",
+                    proxy.MostInFlight, SectionScheduler.DefaultWindow);
+                Check.That(proxy.MostInFlight > 1, "requests weren't pipelined");
+                Console.WriteLine("  {0} of {1} sections requested, at most {2} in flight", proxy.Requests.Count,
+                    SectionsWide * SectionsHigh, proxy.MostInFlight);
+            }
+        }
+
+        //a server that ignores some requests and answers only the last of a
+        //burst still gets mapped, by asking again
+        private static void droppedRequests()
+        {
+            World world = TestWorld.Make(Wide, High, 2);
+            using (LocalServer local = new LocalServer(world, TestWorld.Info))
+            {
+                local.Latency = 20;
+                local.DropEvery = 3;
+                local.Coalesce = true;
+                Proxy proxy = map(world, local, TimeSpan.FromMilliseconds(300));
+                int again = proxy.Requests.Count - proxy.Requests.Distinct().Count();
+                Check.That(again > 0, "nothing was asked for again");
+                Console.WriteLine("  {0} requests, {1} of them again", proxy.Requests.Count, again);
+            }
+        }
+    }
+}
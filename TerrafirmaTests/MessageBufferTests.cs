@@ -0,0 +1,228 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Linq;
+using System.Text;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Feeds streams of messages through MessageBuffer.Next the way the
+    /// socket does, cut up every which way.
+    /// </summary>
+    static class MessageBufferTests
+    {
+        public static void Add(List<KeyValuePair<string, Action>> tests)
+        {
+            tests.Add(new KeyValuePair<string, Action>("MessageBuffer.SplitLengths", splitLengths));
+            tests.Add(new KeyValuePair<string, Action>("MessageBuffer.Oversize", oversize));
+            tests.Add(new KeyValuePair<string, Action>("MessageBuffer.Compaction", compaction));
+            tests.Add(new KeyValuePair<string, Action>("MessageBuffer.Throughput", throughput));
+        }
+
+        /// <summary>
+        /// A stream of messages of the given lengths, counting the id.  Each
+        /// message's bytes say which message it is, so they can be checked.
+        /// </summary>
+        public static byte[] Stream(IList<int> lengths)
+        {
+            long total = lengths.Sum(l => (long)l + 4);
+            byte[] stream = new byte[total];
+            int pos = 0;
+            for (int i = 0; i < lengths.Count; i++)
+            {
+                BitConverter.GetBytes(lengths[i]).CopyTo(stream, pos);
+                pos += 4;
+                for (int j = 0; j < lengths[i]; j++)
+                    stream[pos++] = (byte)(i * 31 + j);
+            }
+            return stream;
+        }
+
+        /// <summary>
+        /// Throws unless data at start is message i of a Stream
+        /// </summary>
+        public static void CheckMessage(IList<int> lengths, int i, byte[] data, int start, int len)
+        {
+            Check.That(i < lengths.Count, "got message {0}, only {1} were sent", i, lengths.Count);
+            Check.Equal(lengths[i], len, String.Format("length of message {0}", i));
+            for (int j = 0; j < len; j++)
+                if (data[start + j] != (byte)(i * 31 + j))
+                    throw new Exception(String.Format("message {0} is wrong at byte {1}", i, j));
+        }
+
+        /// <summary>
+        /// Receives stream into buffer, at most chunk() bytes at a time, handing
+        /// each message to got.
+        /// </summary>
+        public static void Feed(MessageBuffer buffer, byte[] stream, Func<int> chunk, Action<byte[], int, int> got)
+        {
+            int pos = 0;
+            int start, len;
+            while (pos < stream.Length)
+            {
+                Check.That(buffer.ReceiveCount > 0, "no room to receive at byte {0}", pos);
+                int n = Math.Min(Math.Min(chunk(), buffer.ReceiveCount), stream.Length - pos);
+                Buffer.BlockCopy(stream, pos, buffer.Data, buffer.ReceiveOffset, n);
+                buffer.Received(n);
+                pos += n;
+                while (buffer.Next(out start, out len))
+                    got(buffer.Data, start, len);
+            }
+        }
+
+        private static void feedAndCheck(List<int> lengths, Func<int> chunk)
+        {
+            byte[] stream = Stream(lengths);
+            using (MessageBuffer buffer = new MessageBuffer())
+            {
+                int count = 0;
+                Feed(buffer, stream, chunk, delegate(byte[] data, int start, int len)
+                {
+                    CheckMessage(lengths, count++, data, start, len);
+                });
+                Check.Equal(lengths.Count, count, "messages");
+                Check.Equal(0, buffer.Pending, "bytes left over");
+            }
+        }
+
+        //every way of splitting a length prefix, and receives bigger than messages
+        private static void splitLengths()
+        {
+            Random rand = new Random(1);
+            List<int> lengths = new List<int>();
+            for (int i = 0; i < 2000; i++)
+                lengths.Add(rand.Next(1, 5000));
+            foreach (int size in new int[] { 1, 2, 3, 4, 5, 7, 13, 4096, 16 * 1024, 64 * 1024, Int32.MaxValue })
+                feedAndCheck(lengths, () => size);
+            feedAndCheck(lengths, () => rand.Next(1, 100000));
+        }
+
+        //messages bigger than the buffer grow it, and bad lengths are caught
+        private static void oversize()
+        {
+            List<int> lengths = new List<int>();
+            foreach (int big in new int[] { 300 * 1024, 1024 * 1024, 3 * MessageBuffer.DefaultSize })
+            {
+                lengths.Add(big);
+                for (int i = 0; i < 5; i++)
+                    lengths.Add(10 + i);
+            }
+            feedAndCheck(lengths, () => 64 * 1024);
+            feedAndCheck(lengths, () => 1000);
+
+            foreach (int bad in new int[] { 0, -1, 16 * 1024 * 1024 + 1 })
+            {
+                using (MessageBuffer buffer = new MessageBuffer())
+                {
+                    BitConverter.GetBytes(bad).CopyTo(buffer.Data, 0);
+                    buffer.Received(4);
+                    int start, len;
+                    Check.Throws(() => buffer.Next(out start, out len), String.Format("length {0}", bad));
+                }
+            }
+        }
+
+        //a partial message moves to the front only once it has to
+        private static void compaction()
+        {
+            int start, len;
+            //a message filling all but 10 bytes, then the start of a 5000 byte one
+            List<int> lengths = new List<int> { MessageBuffer.DefaultSize - 14, 5000 };
+            byte[] stream = Stream(lengths);
+            using (MessageBuffer buffer = new MessageBuffer())
+            {
+                byte[] data = buffer.Data;
+                Check.Equal(MessageBuffer.DefaultSize, data.Length, "buffer size");
+                Buffer.BlockCopy(stream, 0, data, 0, data.Length);
+                buffer.Received(data.Length);
+                Check.That(buffer.Next(out start, out len), "first message not found");
+                CheckMessage(lengths, 0, buffer.Data, start, len);
+                Check.That(!buffer.Next(out start, out len), "second message found early");
+                Check.That(buffer.Data == data, "buffer grew instead of compacting");
+                Check.Equal(10, buffer.Pending, "pending after compaction");
+                Check.Equal(10, buffer.ReceiveOffset, "receive offset after compaction");
+
+                int rest = stream.Length - data.Length;
+                Buffer.BlockCopy(stream, data.Length, buffer.Data, buffer.ReceiveOffset, rest);
+                buffer.Received(rest);
+                Check.That(buffer.Next(out start, out len), "second message not found");
+                CheckMessage(lengths, 1, buffer.Data, start, len);
+                Check.That(!buffer.Next(out start, out len), "a third message");
+                Check.Equal(0, buffer.ReceiveOffset, "receive offset once empty");
+            }
+
+            //with plenty of room left, the partial message stays put
+            lengths = new List<int> { 100, 5000 };
+            stream = Stream(lengths);
+            using (MessageBuffer buffer = new MessageBuffer())
+            {
+                Buffer.BlockCopy(stream, 0, buffer.Data, 0, 114);
+                buffer.Received(114);
+                Check.That(buffer.Next(out start, out len), "first message not found");
+                Check.That(!buffer.Next(out start, out len), "second message found early");
+                Check.Equal(114, buffer.ReceiveOffset, "receive offset with room to spare");
+            }
+        }
+
+        //a mix like a server's while mapping: mostly small messages, and
+        //tile sections of a few kilobytes, received 64K at a time
+        private static void throughput()
+        {
+            Random rand = new Random(2);
+            List<int> lengths = new List<int>();
+            long total = 0;
+            while (total < 32 * 1024 * 1024)
+            {
+                int len = rand.Next(10) == 0 ? rand.Next(2000, 20000) : rand.Next(10, 60);
+                lengths.Add(len);
+                total += len + 4;
+            }
+            byte[] stream = Stream(lengths);
+            const int Passes = 8;
+            long messages = 0;
+            int sum = 0;
+            using (MessageBuffer buffer = new MessageBuffer())
+            {
+                Stopwatch watch = Stopwatch.StartNew();
+                for (int pass = 0; pass < Passes; pass++)
+                    Feed(buffer, stream, () => 64 * 1024, delegate(byte[] data, int start, int len)
+                    {
+                        messages++;
+                        sum += data[start];
+                    });
+                double seconds = watch.Elapsed.TotalSeconds;
+                Check.Equal((long)lengths.Count * Passes, messages, "messages");
+                Console.WriteLine("  {0:0} MB/s, {1:0.0}M messages/s", stream.Length * (double)Passes / (1024 * 1024) / seconds,
+                    messages / 1e6 / seconds);
+            }
+        }
+    }
+}
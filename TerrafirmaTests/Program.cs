@@ -0,0 +1,76 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Linq;
+using System.Text;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Runs the tests, and the benchmarks with them, printing what they
+    /// measure.  Pass names to run just the tests starting with them.  Exits
+    /// with 1 if any test fails.
+    ///   dotnet run -c Release --project TerrafirmaTests [names ...]
+    /// </summary>
+    static class Program
+    {
+        static int Main(string[] args)
+        {
+            List<KeyValuePair<string, Action>> tests = new List<KeyValuePair<string, Action>>();
+            MessageBufferTests.Add(tests);
+            ServerConnectionTests.Add(tests);
+            MapSessionTests.Add(tests);
+            RenderTests.Add(tests);
+            TileRowCodecTests.Add(tests);
+
+            int passed = 0, failed = 0;
+            foreach (KeyValuePair<string, Action> test in tests)
+            {
+                if (args.Length > 0 && !args.Any(a => test.Key.StartsWith(a, StringComparison.OrdinalIgnoreCase)))
+                    continue;
+                Stopwatch watch = Stopwatch.StartNew();
+                try
+                {
+                    test.Value();
+                    passed++;
+                    Console.WriteLine("pass {0} ({1:0.00}s)", test.Key, watch.Elapsed.TotalSeconds);
+                }
+                catch (Exception e)
+                {
+                    failed++;
+                    Console.WriteLine("FAIL {0}: {1}", test.Key, e.Message);
+                    Console.WriteLine(e.StackTrace);
+                }
+            }
+            Console.WriteLine("{0} passed, {1} failed", passed, failed);
+            return failed > 0 ? 1 : 0;
+        }
+    }
+}
@@ -0,0 +1,349 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Linq;
+using System.Text;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Renders a fixed world and compares hashes of the result with ones
+    /// recorded from a known good build.  When a change to rendering is
+    /// meant to change the output, check the new images and update these.
+    /// </summary>
+    static class RenderTests
+    {
+        //frames resolved for TestWorld.Make(600, 400, 7)
+        const ulong FramesHash = 0x5299e7b70cccc9e6UL;
+        //flat renders of it at zoom 1 and 3, unlit
+        const ulong FlatHash = 0x50451ec57ffe9272UL;
+        const ulong ZoomedHash = 0xd5783e3afcae0c22UL;
+
+        public static void Add(List<KeyValuePair<string, Action>> tests)
+        {
+            tests.Add(new KeyValuePair<string, Action>("Render.FramesGolden", framesGolden));
+            tests.Add(new KeyValuePair<string, Action>("Render.FlatGolden", flatGolden));
+            tests.Add(new KeyValuePair<string, Action>("Render.Lighting2Speed", lighting2Speed));
+            tests.Add(new KeyValuePair<string, Action>("Render.EdgeViewports", edgeViewports));
+            tests.Add(new KeyValuePair<string, Action>("Render.ExportSpeed", exportSpeed));
+        }
+
+        private static Render newRender(World world)
+        {
+            WorldInfo info = TestWorld.Info;
+            Render render = new Render(info.tileInfos, info.wallInfo, info.skyColor, info.earthColor, info.rockColor,
+                info.hellColor, info.waterColor, info.lavaColor, info.honeyColor);
+            render.SetWorld(world.tilesWide, world.tilesHigh, world.groundLevel, world.rockLevel,
+                world.styles, world.treeX, world.treeStyle, world.caveBackX, world.caveBackStyle,
+                world.jungleBackStyle, world.hellBackStyle, world.npcs, world.worldID);
+            return render;
+        }
+
+        //the variants frameSet picks don't depend on the order or threads
+        //tiles are fixed on, only on where they are and the world
+        private static void framesGolden()
+        {
+            World world = TestWorld.Make(600, 400, 7);
+            newRender(world).ResolveFrames(world.tiles, null);
+            Hash hash = new Hash();
+            for (int y = 0; y < world.tilesHigh; y++)
+                for (int x = 0; x < world.tilesWide; x++)
+                {
+                    Tile tile = world.tiles[x, y];
+                    hash.Add(tile.u);
+                    hash.Add(tile.v);
+                    hash.Add(tile.wallu);
+                    hash.Add(tile.wallv);
+                }
+            checkHash(FramesHash, hash.Value, "resolved frames");
+        }
+
+        private static void flatGolden()
+        {
+            World world = TestWorld.Make(600, 400, 7);
+            Render render = newRender(world);
+            render.ResolveFrames(world.tiles, null);
+            checkHash(FlatHash, renderHash(render, world, 1.0), "flat render");
+            checkHash(ZoomedHash, renderHash(render, world, 3.0), "flat render at zoom 3");
+        }
+
+        private static ulong renderHash(Render render, World world, double zoom)
+        {
+            int width = (int)(world.tilesWide * zoom), height = (int)(world.tilesHigh * zoom);
+            byte[] pixels = new byte[width * height * 4];
+            render.DrawRegion(width, height, 0.0, 0.0, zoom, pixels, 0, false, false, false, false, world.tiles);
+            Hash hash = new Hash();
+            foreach (byte b in pixels)
+                hash.Add(b);
+            return hash.Value;
+        }
+
+        //a color lit textured draw at 16x, blitting through the light table
+        //and then through the per texel multiplies it replaced
+        private static void lighting2Speed()
+        {
+            World world = TestWorld.Make(600, 400, 7);
+            Render render = texturedRender(world);
+            const int Width = 1920, Height = 1080;
+            byte[] table = new byte[Width * Height * 4], multiply = new byte[Width * Height * 4];
+
+            //taking turns, so both have had the jit's attention by the end
+            Render.RowKernel[] kernels = { Render.opaqueRow, Render.maskedRow, Render.blendedRow, Render.alphaRow };
+            double tableTime = double.MaxValue, multiplyTime = double.MaxValue;
+            for (int round = 0; round < 4; round++)
+            {
+                tableTime = Math.Min(tableTime, timeDraw(render, world, Width, Height, 16.0, 2, table));
+                try
+                {
+                    Render.opaqueRow = multiplyOpaqueRow;
+                    Render.maskedRow = multiplyMaskedRow;
+                    Render.blendedRow = multiplyBlendedRow;
+                    Render.alphaRow = multiplyAlphaRow;
+                    multiplyTime = Math.Min(multiplyTime, timeDraw(render, world, Width, Height, 16.0, 2, multiply));
+                }
+                finally
+                {
+                    Render.opaqueRow = kernels[0];
+                    Render.maskedRow = kernels[1];
+                    Render.blendedRow = kernels[2];
+                    Render.alphaRow = kernels[3];
+                }
+            }
+
+            int worst = 0;
+            for (int i = 0; i < table.Length; i++)
+                worst = Math.Max(worst, Math.Abs(table[i] - multiply[i]));
+            Check.That(worst <= 2, "the light table is off by {0} from multiplying", worst);
+            Console.WriteLine("  {0}x{1} at 16x: table {2:0.0} ms, multiply {3:0.0} ms, {4:0.00}x as fast, off by at most {5}",
+                Width, Height, tableTime, multiplyTime, multiplyTime / tableTime, worst);
+        }
+
+        private static Render texturedRender(World world)
+        {
+            world.CalculateLight(new TestWorld.Quiet());
+            Render render = newRender(world);
+            render.ResolveFrames(world.tiles, null);
+            render.Textures = TestTextures.Make();
+            return render;
+        }
+
+        //views hanging off each side and corner of the map only draw inside
+        //the framebuffer, and leave what's well off the map alone.  the view
+        //in the middle is timed against them.
+        private static void edgeViewports()
+        {
+            World world = TestWorld.Make(600, 400, 7);
+            Render render = texturedRender(world);
+            const int Width = 640, Height = 480, GuardRows = 16;
+            const byte Untouched = 0x5a;
+            //walls reach 8 texels past their tile, call it two tiles
+            const int Reach = 2;
+            //rows past the framebuffer, which nothing should write
+            byte[] pixels = new byte[Width * (Height + GuardRows) * 4];
+
+            foreach (double zoom in new double[] { 4.0, 16.0 })
+            {
+                double wide = Width / zoom, high = Height / zoom;
+                //hanging half off the left, top, right or bottom, or in the middle
+                double[] xs = { -wide / 2 - 0.5, (world.tilesWide - wide) / 2, world.tilesWide - wide / 2 + 0.5 };
+                double[] ys = { -high / 2 - 0.5, (world.tilesHigh - high) / 2, world.tilesHigh - high / 2 + 0.5 };
+                double edgeTime = 0.0, middleTime = 0.0;
+                for (int i = 0; i < 3; i++)
+                    for (int j = 0; j < 3; j++)
+                    {
+                        double startx = xs[i], starty = ys[j], best = double.MaxValue;
+                        for (int run = 0; run < 3; run++)
+                        {
+                            for (int b = 0; b < pixels.Length; b++)
+                                pixels[b] = Untouched;
+                            Stopwatch watch = Stopwatch.StartNew();
+                            render.DrawRegion(Width, Height, startx, starty, zoom, pixels, 2, true, false, true, false,
+                                world.tiles);
+                            best = Math.Min(best, watch.Elapsed.TotalMilliseconds);
+                        }
+                        if (i == 1 && j == 1)
+                            middleTime = best;
+                        else
+                            edgeTime += best / 8;
+
+                        for (int b = Width * Height * 4; b < pixels.Length; b++)
+                            Check.That(pixels[b] == Untouched, "a view at {0},{1} drew past the framebuffer at zoom {2}",
+                                startx, starty, zoom);
+                        //the map's edges, in pixels
+                        double left = (-Reach - startx) * zoom, right = (world.tilesWide + Reach - startx) * zoom;
+                        double top = (-Reach - starty) * zoom, bottom = (world.tilesHigh + Reach - starty) * zoom;
+                        for (int y = 0; y < Height; y++)
+                            for (int x = 0; x < Width; x++)
+                                if (x < left || x >= right || y < top || y >= bottom)
+                                    Check.That(pixels[(y * Width + x) * 4] == Untouched,
+                                        "a view at {0},{1} drew at {2},{3}, off the map, at zoom {4}",
+                                        startx, starty, x, y, zoom);
+                    }
+                Console.WriteLine("  {0}x{1} at {2}x: {3:0.0} ms in the middle, {4:0.0} ms on an edge",
+                    Width, Height, zoom, middleTime, edgeTime);
+            }
+        }
+
+        //a whole map exported with textures and color light
+        private static void exportSpeed()
+        {
+            World world = TestWorld.Make(600, 400, 7);
+            Render render = texturedRender(world);
+            const double Zoom = 4.0;
+            int width = (int)(world.tilesWide * Zoom), height = (int)(world.tilesHigh * Zoom);
+            MapExporter exporter = new MapExporter(render);
+            exporter.UseTextures = true;
+            exporter.Light = 2;
+            exporter.Wires = true;
+            exporter.Compression = 1;
+            double best = double.MaxValue;
+            for (int run = 0; run < 3; run++)
+            {
+                Stopwatch watch = Stopwatch.StartNew();
+                exporter.Export(Stream.Null, world.tiles, width, height, 0.0, 0.0, Zoom, null);
+                best = Math.Min(best, watch.Elapsed.TotalMilliseconds);
+            }
+            Console.WriteLine("  {0}x{1} at {2}x: {3:0} ms, {4:0.0}M pixels/s", width, height, Zoom, best,
+                (double)width * height / best / 1000.0);
+        }
+
+        //the best of a few draws of the surface around the spawn, in milliseconds
+        private static double timeDraw(Render render, World world, int width, int height, double zoom, int light,
+            byte[] pixels)
+        {
+            double startx = world.spawnX - width / zoom / 2, starty = world.groundLevel - height / zoom / 2;
+            double best = double.MaxValue;
+            for (int run = 0; run < 4; run++)
+            {
+                Array.Clear(pixels, 0, pixels.Length);
+                Stopwatch watch = Stopwatch.StartNew();
+                render.DrawRegion(width, height, startx, starty, zoom, pixels, light, true, false, true, false,
+                    world.tiles);
+                //the first loads the textures
+                if (run > 0)
+                    best = Math.Min(best, watch.Elapsed.TotalMilliseconds);
+            }
+            return best;
+        }
+
+        //the blits as they were before the light table, a double multiply per channel
+        static void multiplyOpaqueRow(byte[] data, int t, int[] cols, int x0, int x1,
+            byte[] pixels, int b, int lr, int lg, int lb, int alpha)
+        {
+            double lightR = (lr >> 8) / 255.0, lightG = (lg >> 8) / 255.0, lightB = (lb >> 8) / 255.0;
+            for (int x = x0; x < x1; x++, b += 4)
+            {
+                int tx = t + cols[x];
+                pixels[b] = (byte)(data[tx] * lightB);
+                pixels[b + 1] = (byte)(data[tx + 1] * lightG);
+                pixels[b + 2] = (byte)(data[tx + 2] * lightR);
+                pixels[b + 3] = 0xff;
+            }
+        }
+
+        static void multiplyMaskedRow(byte[] data, int t, int[] cols, int x0, int x1,
+            byte[] pixels, int b, int lr, int lg, int lb, int alpha)
+        {
+            double lightR = (lr >> 8) / 255.0, lightG = (lg >> 8) / 255.0, lightB = (lb >> 8) / 255.0;
+            for (int x = x0; x < x1; x++, b += 4)
+            {
+                int tx = t + cols[x];
+                if (data[tx + 3] == 0)
+                    continue;
+                pixels[b] = (byte)(data[tx] * lightB);
+                pixels[b + 1] = (byte)(data[tx + 1] * lightG);
+                pixels[b + 2] = (byte)(data[tx + 2] * lightR);
+                pixels[b + 3] = 0xff;
+            }
+        }
+
+        static void multiplyBlendedRow(byte[] data, int t, int[] cols, int x0, int x1,
+            byte[] pixels, int b, int lr, int lg, int lb, int alpha)
+        {
+            double lightR = (lr >> 8) / 255.0, lightG = (lg >> 8) / 255.0, lightB = (lb >> 8) / 255.0;
+            for (int x = x0; x < x1; x++, b += 4)
+            {
+                int tx = t + cols[x];
+                int a = data[tx + 3];
+                if (a == 0)
+                    continue;
+                pixels[b] = blend(pixels[b], (byte)(data[tx] * lightB), a);
+                pixels[b + 1] = blend(pixels[b + 1], (byte)(data[tx + 1] * lightG), a);
+                pixels[b + 2] = blend(pixels[b + 2], (byte)(data[tx + 2] * lightR), a);
+                pixels[b + 3] = 0xff;
+            }
+        }
+
+        static void multiplyAlphaRow(byte[] data, int t, int[] cols, int x0, int x1,
+            byte[] pixels, int b, int lr, int lg, int lb, int alpha)
+        {
+            double lightR = (lr >> 8) / 255.0, lightG = (lg >> 8) / 255.0, lightB = (lb >> 8) / 255.0;
+            for (int x = x0; x < x1; x++, b += 4)
+            {
+                int tx = t + cols[x];
+                if (data[tx + 3] == 0)
+                    continue;
+                pixels[b] = blend(pixels[b], (byte)(data[tx] * lightB), alpha);
+                pixels[b + 1] = blend(pixels[b + 1], (byte)(data[tx + 1] * lightG), alpha);
+                pixels[b + 2] = blend(pixels[b + 2], (byte)(data[tx + 2] * lightR), alpha);
+                pixels[b + 3] = 0xff;
+            }
+        }
+
+        static byte blend(byte from, byte c, int alpha)
+        {
+            return (byte)((c * alpha + from * (255 - alpha)) / 255);
+        }
+
+        private static void checkHash(ulong expected, ulong actual, string what)
+        {
+            Console.WriteLine("  {0}: {1:x16}", what, actual);
+            Check.That(expected == actual, "{0} changed: expected {1:x16}, got {2:x16}", what, expected, actual);
+        }
+
+        //fnv-1a, 64 bit
+        class Hash
+        {
+            public ulong Value = 0xcbf29ce484222325UL;
+
+            public void Add(byte b)
+            {
+                Value = (Value ^ b) * 0x100000001b3UL;
+            }
+
+            public void Add(Int16 v)
+            {
+                Add((byte)v);
+                Add((byte)(v >> 8));
+            }
+        }
+    }
+}
@@ -0,0 +1,201 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Net;
+using System.Net.Sockets;
+using System.Threading;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Checks that neither direction of a ServerConnection allocates once
+    /// it's warmed up, and that a handler may close it mid replay.
+    /// </summary>
+    static class ServerConnectionTests
+    {
+        public static void Add(List<KeyValuePair<string, Action>> tests)
+        {
+            tests.Add(new KeyValuePair<string, Action>("ServerConnection.FeedAllocations", feedAllocations));
+            tests.Add(new KeyValuePair<string, Action>("ServerConnection.SendAllocations", sendAllocations));
+            tests.Add(new KeyValuePair<string, Action>("ServerConnection.CloseWhileFeeding", closeWhileFeeding));
+        }
+
+        private static void feedAllocations()
+        {
+            Random rand = new Random(3);
+            List<int> lengths = new List<int>();
+            for (int i = 0; i < 1000; i++)
+                lengths.Add(rand.Next(1, 3000));
+            byte[] stream = MessageBufferTests.Stream(lengths);
+            const int Chunk = 1500;
+
+            ServerConnection conn = new ServerConnection();
+            long messages = 0;
+            conn.Received = delegate(byte[] data, int start, int len)
+            {
+                messages++;
+            };
+            for (int pass = 0; pass < 3; pass++)
+                feed(conn, stream, Chunk);
+
+            const int Passes = 20;
+            messages = 0;
+            long before = GC.GetAllocatedBytesForCurrentThread();
+            for (int pass = 0; pass < Passes; pass++)
+                feed(conn, stream, Chunk);
+            long allocated = GC.GetAllocatedBytesForCurrentThread() - before;
+            Check.Equal((long)lengths.Count * Passes, messages, "messages");
+            Console.WriteLine("  {0:0.000} bytes per message received", allocated / (double)messages);
+            Check.Equal(0L, allocated, "bytes allocated feeding");
+            conn.Close();
+        }
+
+        private static void feed(ServerConnection conn, byte[] stream, int chunk)
+        {
+            for (int pos = 0; pos < stream.Length; pos += chunk)
+                conn.Feed(stream, pos, Math.Min(chunk, stream.Length - pos));
+        }
+
+        private static void sendAllocations()
+        {
+            TcpListener listener = new TcpListener(IPAddress.Loopback, 0);
+            listener.Start();
+            int port = ((IPEndPoint)listener.LocalEndpoint).Port;
+            ServerConnection conn = new ServerConnection();
+            ManualResetEvent connected = new ManualResetEvent(false);
+            Exception error = null;
+            conn.Connected = delegate(Exception e)
+            {
+                error = e;
+                connected.Set();
+            };
+            conn.Received = delegate(byte[] data, int start, int len) { };
+            conn.Connect("127.0.0.1", port);
+            Socket server = listener.AcceptSocket();
+            listener.Stop();
+            Check.That(connected.WaitOne(5000), "didn't connect");
+            Check.That(error == null, "couldn't connect: {0}", error);
+
+            //the other end just counts what arrives
+            long arrived = 0;
+            Thread reader = new Thread(delegate()
+            {
+                byte[] buffer = new byte[64 * 1024];
+                int n;
+                try
+                {
+                    while ((n = server.Receive(buffer)) > 0)
+                        Interlocked.Add(ref arrived, n);
+                }
+                catch (SocketException)
+                {
+                    //reset when we hang up
+                }
+            });
+            reader.IsBackground = true;
+            reader.Start();
+
+            long expected = 0;
+            //fill the pool, and grow the queue, past anything sending in
+            //batches will need
+            byte[][] held = new byte[256][];
+            for (int i = 0; i < held.Length; i++)
+                held[i] = conn.NewMessage();
+            foreach (byte[] message in held)
+                expected += send(conn, message);
+            for (int i = 0; i < 100; i++)
+                expected += sendBatch(conn, ref arrived, expected);
+
+            const int Batches = 1000;
+            long before = GC.GetAllocatedBytesForCurrentThread();
+            for (int i = 0; i < Batches; i++)
+                expected += sendBatch(conn, ref arrived, expected);
+            long allocated = GC.GetAllocatedBytesForCurrentThread() - before;
+            Console.WriteLine("  {0:0.000} bytes per message sent", allocated / (double)(Batches * BatchSize));
+            Check.Equal(0L, allocated, "bytes allocated sending");
+
+            conn.Close();
+            reader.Join();
+            server.Close();
+        }
+
+        const int BatchSize = 100;
+
+        //sends a batch, and waits for it all to arrive so the queue stays short
+        private static long sendBatch(ServerConnection conn, ref long arrived, long sent)
+        {
+            long bytes = 0;
+            for (int i = 0; i < BatchSize; i++)
+                bytes += send(conn, conn.NewMessage());
+            SpinWait spin = new SpinWait();
+            while (Interlocked.Read(ref arrived) < sent + bytes)
+            {
+                Check.That(conn.IsConnected, "connection lost");
+                spin.SpinOnce();
+            }
+            return bytes;
+        }
+
+        //a tile request, the kind of message sent most, returning its size
+        private static int send(ServerConnection conn, byte[] message)
+        {
+            int pos = ServerConnection.PayloadStart;
+            ServerConnection.PutInt32(message, ref pos, 1200);
+            ServerConnection.PutInt32(message, ref pos, 300);
+            ServerConnection.PutSingle(message, ref pos, 1.5f);
+            ServerConnection.PutText(message, ref pos, "section");
+            conn.Send(message, 0x08, pos);
+            return pos;
+        }
+
+        //a handler closing the connection ends the replay there
+        private static void closeWhileFeeding()
+        {
+            ServerConnection conn = new ServerConnection();
+            int seen = 0;
+            bool closed = false;
+            conn.Closed = delegate(Exception e)
+            {
+                closed = true;
+            };
+            conn.Received = delegate(byte[] data, int start, int len)
+            {
+                seen++;
+                conn.Close();
+            };
+            byte[] stream = MessageBufferTests.Stream(new int[] { 5, 6, 7 });
+            conn.Feed(stream, 0, stream.Length);
+            conn.Feed(stream, 0, stream.Length);
+            Check.Equal(1, seen, "messages handled");
+            Check.That(closed, "Closed wasn't called");
+        }
+    }
+}
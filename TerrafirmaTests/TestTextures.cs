@@ -0,0 +1,113 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Linq;
+using System.Text;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Stands in for a terraria install: writes small uncompressed xnb
+    /// textures of noise to a temporary folder, enough to draw a TestWorld.
+    /// Tiles and wires have transparent gutters between frames, and torches
+    /// and some backgrounds are translucent, so every blit kernel gets used.
+    /// </summary>
+    static class TestTextures
+    {
+        static string folder;
+
+        public static Textures Make()
+        {
+            if (folder == null)
+            {
+                string path = Path.Combine(Path.GetTempPath(), "terrafirma-tests-textures");
+                Directory.CreateDirectory(path);
+                for (int i = 0; i < 256; i++)
+                    write(path, String.Format("Background_{0}", i), 128, 256, i % 4 == 0 ? Kind.Translucent : Kind.Opaque);
+                foreach (int i in new int[] { 0, 1, 2, 7 })
+                    write(path, String.Format("Tiles_{0}", i), 288, 270, Kind.Gutters);
+                write(path, "Tiles_4", 66, 1024, Kind.Translucent);
+                write(path, "Wall_2", 468, 180, Kind.Opaque);
+                write(path, "Wall_Outline", 32, 32, Kind.Gutters);
+                for (int i = 0; i < 12; i++)
+                    write(path, String.Format("Liquid_{0}", i), 16, 16, Kind.Opaque);
+                write(path, "Wires", 288, 72, Kind.Gutters);
+                folder = path;
+            }
+            return new Textures(folder);
+        }
+
+        enum Kind { Opaque, Gutters, Translucent };
+
+        //an xnb holding one Color texture, as XNA writes it uncompressed
+        static void write(string path, string name, int width, int height, Kind kind)
+        {
+            using (BinaryWriter w = new BinaryWriter(File.Create(Path.Combine(path, name + ".xnb"))))
+            {
+                w.Write(Encoding.ASCII.GetBytes("XNBw"));
+                w.Write((UInt16)5);
+                w.Write((Int32)0); //length, filled in below
+                w.Write((byte)1); //one reader
+                w.Write("Microsoft.Xna.Framework.Content.Texture2DReader");
+                w.Write((Int32)0);
+                w.Write((byte)0); //no shared resources
+                w.Write((byte)1); //the first reader
+                w.Write((Int32)0); //Color
+                w.Write(width);
+                w.Write(height);
+                w.Write((Int32)1); //levels
+                w.Write(width * height * 4);
+                //string hashes change from run to run, so seed from the characters
+                uint state = 1;
+                foreach (char c in name)
+                    state = state * 31 + c;
+                for (int y = 0; y < height; y++)
+                    for (int x = 0; x < width; x++)
+                    {
+                        state ^= state << 13;
+                        state ^= state >> 17;
+                        state ^= state << 5;
+                        byte alpha = 255;
+                        if (kind == Kind.Gutters && (x % 18 >= 16 || y % 18 >= 16))
+                            alpha = 0;
+                        else if (kind == Kind.Translucent && (x + y) % 3 == 0)
+                            alpha = (byte)(state >> 24);
+                        w.Write((byte)state);
+                        w.Write((byte)(state >> 8));
+                        w.Write((byte)(state >> 16));
+                        w.Write(alpha);
+                    }
+                w.Seek(6, SeekOrigin.Begin);
+                w.Write((Int32)w.BaseStream.Length);
+            }
+        }
+    }
+}
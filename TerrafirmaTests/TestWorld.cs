@@ -0,0 +1,151 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Makes small worlds for the tests, the same every time for a given
+    /// seed: dirt and stone under a grass surface, with caves of water and
+    /// lava, walls, ore, torches, wires and paint.  Frames are left to be
+    /// resolved, as in a world just loaded.
+    /// </summary>
+    static class TestWorld
+    {
+        static WorldInfo info;
+
+        public class Quiet : ILoadProgress
+        {
+            public void Status(string text)
+            {
+            }
+        }
+
+        public static WorldInfo Info
+        {
+            get
+            {
+                if (info == null)
+                    info = WorldInfo.Load();
+                return info;
+            }
+        }
+
+        public static World Make(int wide, int high, uint seed)
+        {
+            World world = new World(Info, wide, high);
+            world.name = "Test";
+            world.worldID = (int)seed;
+            world.tilesWide = wide;
+            world.tilesHigh = high;
+            world.ResizeMap(new Quiet());
+            world.groundLevel = high / 4;
+            world.rockLevel = high / 2;
+            world.spawnX = wide / 2;
+            world.spawnY = world.groundLevel;
+
+            uint state = seed * 2654435761u + 1;
+            int surface = world.groundLevel - 10;
+            for (int x = 0; x < wide; x++)
+            {
+                //the surface wanders up and down a tile at a time
+                int r = (int)(next(ref state) % 3) - 1;
+                surface = Math.Max(5, Math.Min(world.groundLevel + 10, surface + r));
+                for (int y = 0; y < high; y++)
+                {
+                    Tile tile = world.tiles[x, y];
+                    tile.u = tile.v = tile.wallu = tile.wallv = -1;
+                    uint n = next(ref state);
+                    if (y == surface - 1 && n % 40 == 0)
+                    {
+                        tile.isActive = true;
+                        tile.type = 4; //torch
+                        tile.u = 0;
+                        tile.v = 0;
+                        continue;
+                    }
+                    if (y < surface)
+                        continue;
+                    bool cave = y > world.groundLevel && ((x / 7 + y / 5) * 2654435761u >> 28) == 0;
+                    if (y > surface)
+                        tile.wall = 2;
+                    if (cave)
+                    {
+                        tile.liquid = (byte)(n % 4 == 0 ? 0 : 255);
+                        tile.isLava = y > world.rockLevel;
+                        continue;
+                    }
+                    tile.isActive = true;
+                    if (y == surface)
+                        tile.type = 2; //grass
+                    else if (n % 50 == 0)
+                        tile.type = 7; //copper
+                    else
+                        tile.type = (UInt16)(y > world.rockLevel ? 1 : 0);
+                    if (n % 97 == 0)
+                        tile.hasRedWire = true;
+                    if (n % 89 == 0)
+                        tile.color = (byte)(n % 27 + 1);
+                    if (n % 83 == 0)
+                        tile.slope = (byte)(n % 4);
+                }
+            }
+            return world;
+        }
+
+        //xorshift, so worlds don't depend on System.Random's implementation
+        static uint next(ref uint state)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+
+        /// <summary>
+        /// Throws unless tile x,y is the same in both worlds, as far as the
+        /// server sends it.  Frames only count for tiles that keep them.
+        /// </summary>
+        public static void CheckTile(World expected, World actual, int x, int y)
+        {
+            Tile a = expected.tiles[x, y], b = actual.tiles[x, y];
+            bool same = a.isActive == b.isActive && a.wall == b.wall && a.liquid == b.liquid &&
+                a.isLava == b.isLava && a.isHoney == b.isHoney && a.hasRedWire == b.hasRedWire &&
+                a.hasGreenWire == b.hasGreenWire && a.hasBlueWire == b.hasBlueWire && a.half == b.half &&
+                a.actuator == b.actuator && a.inactive == b.inactive && a.color == b.color &&
+                a.wallColor == b.wallColor && a.slope == b.slope;
+            if (same && a.isActive)
+                same = a.type == b.type && (!Info.tileInfos[a.type].hasExtra || (a.u == b.u && a.v == b.v));
+            if (!same)
+                throw new Exception(String.Format("tile {0},{1} differs", x, y));
+        }
+    }
+}
@@ -0,0 +1,160 @@
+﻿/*
+Copyright (c) 2014, Sean Kasun
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Linq;
+using System.Text;
+
+namespace Terrafirma
+{
+    /// <summary>
+    /// Writes rows with TileRowCodec.WriteRow and reads them back with
+    /// DecodeRow, and times decoding 0x0a payloads of several widths.
+    /// </summary>
+    static class TileRowCodecTests
+    {
+        public static void Add(List<KeyValuePair<string, Action>> tests)
+        {
+            tests.Add(new KeyValuePair<string, Action>("TileRowCodec.RoundTrip", roundTrip));
+            tests.Add(new KeyValuePair<string, Action>("TileRowCodec.BadRows", badRows));
+            tests.Add(new KeyValuePair<string, Action>("TileRowCodec.DecodeSpeed", decodeSpeed));
+        }
+
+        /// <summary>
+        /// A test world with every flag the wire carries set somewhere
+        /// </summary>
+        private static World source(int wide, int high)
+        {
+            World world = TestWorld.Make(wide, high, 11);
+            for (int y = 0; y < high; y++)
+                for (int x = 0; x < wide; x++)
+                {
+                    Tile tile = world.tiles[x, y];
+                    int n = (x * 7 + y * 13) % 101;
+                    tile.hasGreenWire = n == 1;
+                    tile.hasBlueWire = n == 2;
+                    tile.half = n == 3 && tile.isActive;
+                    tile.actuator = n == 4;
+                    tile.inactive = n == 5 && tile.isActive;
+                    if (n == 6 && tile.wall > 0)
+                        tile.wallColor = 3;
+                    if (n == 7 && tile.liquid > 0 && !tile.isLava)
+                        tile.isHoney = true;
+                }
+            return world;
+        }
+
+        private static byte[] encode(TileRowCodec codec, World world, int startx, int y, int width)
+        {
+            using (MemoryStream stream = new MemoryStream())
+            using (BinaryWriter w = new BinaryWriter(stream))
+            {
+                codec.WriteRow(w, world.tiles, startx, y, width);
+                w.Flush();
+                return stream.ToArray();
+            }
+        }
+
+        //whole rows, section rows, single tiles and odd pieces all come back
+        //as they were, over a world that had other tiles in it
+        private static void roundTrip()
+        {
+            const int Wide = 600, High = 300;
+            World from = source(Wide, High);
+            World to = TestWorld.Make(Wide, High, 12);
+            TileRowCodec codec = new TileRowCodec(TestWorld.Info.tileInfos);
+            foreach (int[] piece in new int[][] { new int[] { 0, Wide }, new int[] { 200, 200 },
+                new int[] { 599, 1 }, new int[] { 13, 37 } })
+            {
+                int sx = piece[0], sw = piece[1];
+                for (int y = 0; y < High; y++)
+                {
+                    byte[] data = encode(codec, from, sx, y, sw);
+                    int startx, row, width;
+                    int end = codec.DecodeRow(data, 0, to, out startx, out row, out width);
+                    Check.Equal(data.Length, end, "end of the row");
+                    Check.Equal(sx, startx, "startx");
+                    Check.Equal(y, row, "y");
+                    Check.Equal(sw, width, "width");
+                    for (int x = sx; x < sx + sw; x++)
+                        TestWorld.CheckTile(from, to, x, y);
+                }
+            }
+        }
+
+        //rows and runs that don't fit the world are refused
+        private static void badRows()
+        {
+            World world = source(100, 50);
+            TileRowCodec codec = new TileRowCodec(TestWorld.Info.tileInfos);
+            int startx, y, width;
+            byte[] data = encode(codec, world, 0, 10, 100);
+            World small = TestWorld.Make(50, 50, 1);
+            Check.Throws(() => codec.DecodeRow(data, 0, small, out startx, out y, out width), "row past the edge");
+            //make the last run claim one tile more than is left
+            int rle = BitConverter.ToInt16(data, data.Length - 2);
+            BitConverter.GetBytes((Int16)(rle + 1)).CopyTo(data, data.Length - 2);
+            Check.Throws(() => codec.DecodeRow(data, 0, world, out startx, out y, out width), "run past the row");
+        }
+
+        //a section's rows, and rows a quarter, half and all of a large world wide
+        private static void decodeSpeed()
+        {
+            const int Wide = World.Widest, High = 150;
+            World from = source(Wide, High);
+            World to = TestWorld.Make(Wide, High, 12);
+            TileRowCodec codec = new TileRowCodec(TestWorld.Info.tileInfos);
+            foreach (int width in new int[] { SectionScheduler.SectionWidth, Wide / 4, Wide / 2, Wide })
+            {
+                List<byte[]> rows = new List<byte[]>();
+                long bytes = 0;
+                for (int y = 0; y < High; y++)
+                    for (int x = 0; x + width <= Wide; x += width)
+                    {
+                        byte[] data = encode(codec, from, x, y, width);
+                        rows.Add(data);
+                        bytes += data.Length;
+                    }
+                int startx, row, w;
+                foreach (byte[] data in rows) //warm up
+                    codec.DecodeRow(data, 0, to, out startx, out row, out w);
+                const int Passes = 10;
+                Stopwatch watch = Stopwatch.StartNew();
+                for (int pass = 0; pass < Passes; pass++)
+                    foreach (byte[] data in rows)
+                        codec.DecodeRow(data, 0, to, out startx, out row, out w);
+                double seconds = watch.Elapsed.TotalSeconds;
+                Console.WriteLine("  {0,4} wide: {1,6:0.0}M tiles/s, {2,5:0} MB/s, {3:0.00} bytes a tile", width,
+                    (double)Wide * High * Passes / 1e6 / seconds, bytes * (double)Passes / (1024 * 1024) / seconds,
+                    bytes / ((double)Wide * High));
+            }
+        }
+    }
+}